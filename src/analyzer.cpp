@@ -0,0 +1,378 @@
+#include "analyzer.h"
+#include "syntax.h"
+#include "datatypes/types.h"
+#include "datatypes/closure.h"
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+
+namespace {
+    class Analyzer {
+        // global environment of the form, global closures can be inlined into it
+        Environment &env_;
+        // closures whose bodies are being inlined, they are not inlined into themselves again
+        std::vector<const Closure *> inlining_;
+
+        // loop whose body is being analyzed
+        struct Loop {
+            // slot declared for the name, calls that resolve to it jump back to the start of the body
+            size_t name_slot;
+            std::vector<size_t> slots;
+            std::shared_ptr<LoopTarget> target;
+        };
+        // a deque, so that the loop a call found stays put while a named let in its arguments pushes another
+        std::deque<Loop> loops_;
+
+        NodePtr analyze_sequence(const ListPtr &exprs, size_t start, const ScopePtr &scope) {
+            std::vector<NodePtr> body;
+            for (size_t i = start; i < exprs->size(); ++i) {
+                body.push_back(analyze(exprs->get_value(i), scope));
+            }
+            if (body.size() == 1) {
+                return body[0];
+            }
+            return std::make_shared<SequenceNode>(std::move(body));
+        }
+
+        NodePtr analyze_symbol(SymbolId name, const ScopePtr &scope) {
+            auto address = scope == nullptr ? std::nullopt : scope->resolve(name);
+            if (!address.has_value()) {
+                return std::make_shared<GlobalNode>(name);
+            }
+            if (address->boxed) {
+                return std::make_shared<BoxedLocalNode>(name, *address);
+            }
+            return std::make_shared<LocalNode>(name, *address);
+        }
+
+        static NodePtr local_set(const LexicalAddress &address, const NodePtr &value) {
+            if (address.boxed) {
+                return std::make_shared<BoxedSetNode>(address, value);
+            }
+            return std::make_shared<LocalSetNode>(address, value);
+        }
+
+        // the body continues after the slots are boxed
+        static NodePtr with_boxes(std::vector<size_t> slots, NodePtr body) {
+            if (slots.empty()) {
+                return body;
+            }
+            return std::make_shared<BoxNode>(std::move(slots), std::move(body));
+        }
+
+        NodePtr analyze_define(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto name = variable_id(list_ast->get_value(1), "define");
+            if (scope == nullptr) {
+                return std::make_shared<DefineNode>(name, analyze(list_ast->get_value(2), scope));
+            }
+            // the value can refer to the variable only from a lambda, which is called after the define
+            auto index = scope->declare(name, true);
+            auto value = analyze(list_ast->get_value(2), scope);
+            scope->bind(name);
+            return local_set(LexicalAddress{0, index, scope->is_boxed(name)}, value);
+        }
+
+        NodePtr analyze_set(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto name = variable_id(list_ast->get_value(1), "set!");
+            auto value = analyze(list_ast->get_value(2), scope);
+            auto address = scope == nullptr ? std::nullopt : scope->resolve(name);
+            if (address.has_value()) {
+                return local_set(*address, value);
+            }
+            return std::make_shared<SetNode>(name, value);
+        }
+
+        NodePtr analyze_if(const ListPtr &list_ast, const ScopePtr &scope) {
+            if (list_ast->size() < 3 || list_ast->size() > 4) {
+                throw std::runtime_error("if: expected a test, a consequent and an optional alternate");
+            }
+            auto test = analyze(list_ast->get_value(1), scope);
+            auto consequent = analyze(list_ast->get_value(2), scope);
+            // the result of the expression is unspecified if there is no alternate
+            auto alternate = list_ast->size() == 4 ? analyze(list_ast->get_value(3), scope)
+                                                   : std::make_shared<ConstantNode>(std::make_shared<NilValue>());
+            return std::make_shared<IfNode>(test, consequent, alternate);
+        }
+
+        NodePtr analyze_cond(const ListPtr &list_ast, const ScopePtr &scope) {
+            std::vector<CondNode::Clause> clauses;
+            for (size_t i = 1; i < list_ast->size(); ++i) {
+                auto clause = std::static_pointer_cast<ListValue>(list_ast->get_value(i));
+                auto test = analyze(car<Value>(clause), scope);
+                NodePtr body = clause->size() > 1 ? analyze_sequence(clause, 1, scope) : nullptr;
+                clauses.push_back({test, body});
+            }
+            return std::make_shared<CondNode>(std::move(clauses));
+        }
+
+        NodePtr analyze_case(const ListPtr &list_ast, const ScopePtr &scope) {
+            CaseTable table(list_ast);
+            auto key = analyze(list_ast->get_value(1), scope);
+            std::vector<NodePtr> bodies;
+            for (size_t i = 2; i < list_ast->size(); ++i) {
+                bodies.push_back(analyze_sequence(std::static_pointer_cast<ListValue>(list_ast->get_value(i)), 1, scope));
+            }
+            return std::make_shared<CaseNode>(key, std::move(table), std::move(bodies));
+        }
+
+        NodePtr analyze_let(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto bindings_list = car<ListValue>(cdr(list_ast));
+            auto let_scope = make_let_scope(scope);
+            VariableUse use(list_ast, 1), inits_use(bindings_list, 0);
+            // all the variables are declared first, so that lambdas in the bindings can refer to each other (letrec)
+            std::vector<SymbolId> names;
+            for (size_t i = 0; i < bindings_list->size(); ++i) {
+                names.push_back(variable_id(car<Value>(bindings_list->get_value(i)), "let"));
+                let_scope->declare(names.back(), true, is_boxed_let_variable(names.back(), use, inits_use));
+            }
+            auto boxes = let_scope->boxed_slots();
+            std::vector<std::pair<size_t, NodePtr> > bindings;
+            for (size_t i = 0; i < bindings_list->size(); ++i) {
+                auto binding = std::static_pointer_cast<ListValue>(bindings_list->get_value(i));
+                auto init = analyze(binding->get_value(1), let_scope);
+                // earlier bindings are visible in later ones (let*)
+                let_scope->bind(names[i]);
+                bindings.emplace_back(let_scope->resolve(names[i])->index, init);
+            }
+            declare_internal_defines(let_scope, list_ast, 2, use);
+            auto body = with_boxes(let_scope->boxed_slots(boxes), analyze_sequence(list_ast, 2, let_scope));
+            size_t frame_size = scope == nullptr ? let_scope->frame_size() : 0;
+            return std::make_shared<LetNode>(frame_size, std::move(bindings), std::move(boxes), body);
+        }
+
+        NodePtr analyze_receive(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto variables = receive_variables(list_ast);
+            auto expression = analyze(list_ast->get_value(2), scope);
+            auto receive_scope = make_let_scope(scope);
+            VariableUse use(list_ast, 3);
+            std::vector<size_t> slots;
+            for (auto name: variables) {
+                slots.push_back(receive_scope->declare(name, false, use.is_captured(name) && use.is_assigned(name)));
+            }
+            declare_internal_defines(receive_scope, list_ast, 3, use);
+            auto body = with_boxes(receive_scope->boxed_slots(), analyze_sequence(list_ast, 3, receive_scope));
+            size_t frame_size = scope == nullptr ? receive_scope->frame_size() : 0;
+            return std::make_shared<ReceiveNode>(frame_size, expression, std::move(slots), body);
+        }
+
+        NodePtr analyze_guard(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto handler = guard_handler(list_ast);
+            auto body = analyze_sequence(list_ast, 2, scope);
+            return std::make_shared<GuardNode>(body, std::static_pointer_cast<const ReceiveNode>(
+                    analyze_receive(handler, scope)));
+        }
+
+        NodePtr analyze_named_let(const ListPtr &list_ast, const ScopePtr &scope) {
+            if (!is_loop(list_ast)) {
+                return analyze(named_let_to_call(list_ast), scope);
+            }
+            auto bindings_list = std::static_pointer_cast<ListValue>(list_ast->get_value(2));
+            // the initial values are evaluated outside of the loop
+            std::vector<NodePtr> inits;
+            for (size_t i = 0; i < bindings_list->size(); ++i) {
+                inits.push_back(analyze(std::static_pointer_cast<ListValue>(bindings_list->get_value(i))->get_value(1),
+                                        scope));
+            }
+            auto loop_scope = make_let_scope(scope);
+            Loop loop{loop_scope->declare(variable_id(list_ast->get_value(1), "let")), {},
+                      std::make_shared<LoopTarget>()};
+            std::vector<std::pair<size_t, NodePtr> > bindings;
+            for (size_t i = 0; i < bindings_list->size(); ++i) {
+                loop.slots.push_back(loop_scope->declare(variable_id(car<Value>(bindings_list->get_value(i)), "let")));
+                bindings.emplace_back(loop.slots.back(), inits[i]);
+            }
+            declare_internal_defines(loop_scope, list_ast, 3);
+            loops_.push_back(loop);
+            auto body = analyze_sequence(list_ast, 3, loop_scope);
+            loops_.pop_back();
+            loop.target->body = body.get();
+            size_t frame_size = scope == nullptr ? loop_scope->frame_size() : 0;
+            return std::make_shared<LoopNode>(frame_size, std::move(bindings), body);
+        }
+
+        // the loop whose name the call calls, nullptr for other calls
+        const Loop *called_loop(const ListPtr &list_ast, const ScopePtr &scope) {
+            if (scope == nullptr || list_ast->get_value(0)->get_type() != ValueType::Symbol) {
+                return nullptr;
+            }
+            auto address = scope->resolve(car<SymbolValue>(list_ast)->get_id());
+            if (!address.has_value() || address->depth != 0) {
+                return nullptr;
+            }
+            for (auto it = loops_.rbegin(); it != loops_.rend(); ++it) {
+                if (it->name_slot == address->index) {
+                    return &*it;
+                }
+            }
+            return nullptr;
+        }
+
+        NodePtr analyze_lambda(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto binds = car<ListValue>(cdr(list_ast));
+            auto lambda_scope = make_lambda_scope(scope);
+            VariableUse use(list_ast, 2);
+            // the arguments are stored in the first slots of the frame
+            for (size_t i = 0; i < binds->size(); ++i) {
+                auto name = variable_id(binds->get_value(i), "lambda");
+                lambda_scope->declare(name, false, use.is_captured(name) && use.is_assigned(name));
+            }
+            declare_internal_defines(lambda_scope, list_ast, 2, use);
+            auto body = analyze_sequence(list_ast, 2, lambda_scope);
+            return std::make_shared<LambdaNode>(list_ast, lambda_scope->frame_size(), lambda_scope->captures(),
+                                                scope == nullptr ? 0 : scope->closure_depth(),
+                                                with_boxes(lambda_scope->boxed_slots(), body));
+        }
+
+        // closure that a call of the global variable can be inlined as, nullptr if it cannot
+        std::shared_ptr<Closure> inline_candidate(const ListPtr &list_ast, const ScopePtr &scope) {
+            // the parameters of the inlined body need slots in the frame of the caller
+            if (scope == nullptr || list_ast->get_value(0)->get_type() != ValueType::Symbol) {
+                return nullptr;
+            }
+            auto name = car<SymbolValue>(list_ast)->get_id();
+            if (scope->resolve(name).has_value()) {
+                return nullptr;
+            }
+            auto cell = env_.find_cell(name);
+            if (cell == nullptr || (*cell)->get_type() != ValueType::Closure) {
+                return nullptr;
+            }
+            auto closure = std::static_pointer_cast<Closure>(*cell);
+            // only closures made at the top level have no free variables other than globals
+            if (closure->get_source() == nullptr || closure->get_env().get() != &env_ ||
+                closure->get_formal_params()->size() != list_ast->size() - 1 ||
+                std::find(inlining_.begin(), inlining_.end(), closure.get()) != inlining_.end()) {
+                return nullptr;
+            }
+            size_t size = 0;
+            if (!is_inlinable(closure->get_source(), 2, name, size)) {
+                return nullptr;
+            }
+            return closure;
+        }
+
+        // the body is small, does not refer to the closure itself and makes no closures, whose frames would be shared
+        static bool is_inlinable(const ListPtr &list, size_t start, SymbolId self, size_t &size) {
+            for (size_t i = start; i < list->size(); ++i) {
+                auto value = list->get_value(i);
+                if (++size > INLINE_SIZE_LIMIT) {
+                    return false;
+                }
+                if (value->get_type() == ValueType::Symbol) {
+                    auto id = std::static_pointer_cast<SymbolValue>(value)->get_id();
+                    if (id == self || id == static_cast<SymbolId>(SpecialForm::Lambda)) {
+                        return false;
+                    }
+                } else if (value->get_type() == ValueType::List &&
+                           !is_inlinable(std::static_pointer_cast<ListValue>(value), 0, self, size)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        NodePtr analyze_call(const ListPtr &list_ast, const ScopePtr &scope) {
+            if (auto loop = called_loop(list_ast, scope)) {
+                std::vector<std::pair<size_t, NodePtr> > arguments;
+                for (size_t i = 1; i < list_ast->size(); ++i) {
+                    arguments.emplace_back(loop->slots[i - 1], analyze(list_ast->get_value(i), scope));
+                }
+                return std::make_shared<RecurNode>(std::move(arguments), loop->target);
+            }
+            auto op = analyze(list_ast->get_value(0), scope);
+            std::vector<NodePtr> operands;
+            for (size_t i = 1; i < list_ast->size(); ++i) {
+                operands.push_back(analyze(list_ast->get_value(i), scope));
+            }
+            auto closure = inline_candidate(list_ast, scope);
+            auto call = std::make_shared<CallNode>(op, std::move(operands));
+            if (closure == nullptr) {
+                return call;
+            }
+            // the body is analyzed as if it was a let binding the parameters to the arguments, but it must not
+            // see the local variables of the caller
+            auto source = closure->get_source();
+            auto params = closure->get_formal_params();
+            auto inline_scope = make_inline_scope(scope);
+            std::vector<std::pair<size_t, NodePtr> > arguments;
+            for (size_t i = 0; i < params->size(); ++i) {
+                auto index = inline_scope->declare(variable_id(params->get_value(i), "lambda"));
+                arguments.emplace_back(index, call->get_operands()[i]);
+            }
+            inlining_.push_back(closure.get());
+            declare_internal_defines(inline_scope, source, 2);
+            auto body = analyze_sequence(source, 2, inline_scope);
+            inlining_.pop_back();
+            return std::make_shared<InlineNode>(call, closure, std::move(arguments), body);
+        }
+
+    public:
+        explicit Analyzer(Environment &env) : env_(env) {
+        }
+
+        NodePtr analyze(const ValuePtr &ast, const ScopePtr &scope) {
+            if (ast->get_type() == ValueType::Symbol) {
+                return analyze_symbol(std::static_pointer_cast<SymbolValue>(ast)->get_id(), scope);
+            }
+            if (ast->get_type() != ValueType::List) {
+                return std::make_shared<ConstantNode>(ast);
+            }
+            auto list_ast = std::static_pointer_cast<ListValue>(ast);
+            // if it's an empty list return unchanged
+            if (list_ast->size() == 0) {
+                return std::make_shared<ConstantNode>(ast);
+            }
+
+            if (car<Value>(list_ast)->get_type() == ValueType::Symbol) {
+                auto symbol = car<SymbolValue>(list_ast);
+                auto symbol_name = symbol->get_symbol_name();
+                switch (static_cast<SpecialForm>(symbol->get_id())) {
+                    case SpecialForm::Define:
+                        // NOTE: function defines not supported
+                        check_arity(symbol_name, 3, list_ast->size());
+                        return analyze_define(list_ast, scope);
+                    case SpecialForm::LetStar:
+                    case SpecialForm::Letrec:
+                    case SpecialForm::Let:
+                        if (is_named_let(list_ast)) {
+                            return analyze_named_let(list_ast, scope);
+                        }
+                        return analyze_let(list_ast, scope);
+                    case SpecialForm::Do:
+                        return analyze_named_let(do_to_named_let(list_ast), scope);
+                    case SpecialForm::Case:
+                        return analyze_case(list_ast, scope);
+                    case SpecialForm::Receive:
+                        return analyze_receive(list_ast, scope);
+                    case SpecialForm::Guard:
+                        return analyze_guard(list_ast, scope);
+                    case SpecialForm::Quote:
+                        check_arity(symbol_name, 2, list_ast->size());
+                        return std::make_shared<ConstantNode>(list_ast->get_value(1));
+                    case SpecialForm::Lambda:
+                        return analyze_lambda(list_ast, scope);
+                    case SpecialForm::Begin:
+                        return analyze_sequence(list_ast, 1, scope);
+                    case SpecialForm::Set:
+                        check_arity(symbol_name, 3, list_ast->size());
+                        return analyze_set(list_ast, scope);
+                    case SpecialForm::If:
+                        return analyze_if(list_ast, scope);
+                    case SpecialForm::Cond:
+                        return analyze_cond(list_ast, scope);
+                    default:
+                        break;
+                }
+            }
+
+            // otherwise the first element is a function and we need to apply it
+            return analyze_call(list_ast, scope);
+        }
+    };
+}
+
+NodePtr analyze(const ValuePtr &ast, const EnvironmentPtr &env) {
+    return Analyzer(*env).analyze(ast, nullptr);
+}
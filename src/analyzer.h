@@ -0,0 +1,403 @@
+#ifndef SCHEME_ANALYZER_H
+#define SCHEME_ANALYZER_H
+
+#include "util.h"
+#include "scope.h"
+#include "syntax.h"
+#include <string>
+#include <vector>
+
+// State of the trampoline in run(). A node whose last step is a tail expression does not evaluate it,
+// it stores the next node (and environment) here and returns nullptr, so that run() continues with it
+// without growing the C++ stack.
+struct TailCall {
+    const Node *node;
+    EnvironmentPtr env;
+    // keeps the body of a tail called closure alive while it is executed
+    NodePtr owner;
+};
+
+// A form that was already analyzed: all special form dispatch was done once in analyze(),
+// executing the node only does the work that depends on the runtime environment.
+class Node {
+public:
+    virtual ~Node() = default;
+
+    // returns the value of the node, or nullptr if the evaluation continues with tail.node in tail.env
+    virtual ValuePtr execute(TailCall &tail) const = 0;
+};
+
+class ConstantNode : public Node {
+    ValuePtr value_;
+public:
+    explicit ConstantNode(ValuePtr value) : value_(std::move(value)) {
+    }
+
+    [[nodiscard]] const ValuePtr &get_value() const {
+        return value_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+class GlobalNode : public Node {
+    SymbolId name_;
+    mutable GlobalCache cache_;
+public:
+    explicit GlobalNode(SymbolId name) : name_(name) {
+    }
+
+    [[nodiscard]] SymbolId get_name() const {
+        return name_;
+    }
+
+    // value of the variable, found through the inline cache
+    const ValuePtr &lookup(Environment &env) const {
+        return cache_.lookup(env, name_);
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// variable resolved to a slot of a frame during analysis
+class LocalNode : public Node {
+    SymbolId name_;
+    LexicalAddress address_;
+public:
+    LocalNode(SymbolId name, LexicalAddress address) : name_(name), address_(address) {
+    }
+
+    [[nodiscard]] const LexicalAddress &get_address() const {
+        return address_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// variable that lives in a box (see scope.h)
+class BoxedLocalNode : public Node {
+    SymbolId name_;
+    LexicalAddress address_;
+public:
+    BoxedLocalNode(SymbolId name, LexicalAddress address) : name_(name), address_(address) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+class DefineNode : public Node {
+    SymbolId name_;
+    NodePtr value_;
+public:
+    DefineNode(SymbolId name, NodePtr value) : name_(name), value_(std::move(value)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+class SetNode : public Node {
+    SymbolId name_;
+    NodePtr value_;
+public:
+    SetNode(SymbolId name, NodePtr value) : name_(name), value_(std::move(value)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// set! of a local variable, or define inside of a lambda or let
+class LocalSetNode : public Node {
+    LexicalAddress address_;
+    NodePtr value_;
+public:
+    LocalSetNode(LexicalAddress address, NodePtr value) : address_(address), value_(std::move(value)) {
+    }
+
+    [[nodiscard]] const LexicalAddress &get_address() const {
+        return address_;
+    }
+
+    [[nodiscard]] const NodePtr &get_value() const {
+        return value_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// set! or define of a boxed variable
+class BoxedSetNode : public Node {
+    LexicalAddress address_;
+    NodePtr value_;
+public:
+    BoxedSetNode(LexicalAddress address, NodePtr value) : address_(address), value_(std::move(value)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// puts the values of slots of the current frame (the arguments of a call, or nothing for internal defines)
+// into new boxes and continues with the body
+class BoxNode : public Node {
+    std::vector<size_t> slots_;
+    NodePtr body_;
+public:
+    BoxNode(std::vector<size_t> slots, NodePtr body) : slots_(std::move(slots)), body_(std::move(body)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+class IfNode : public Node {
+    NodePtr test_;
+    NodePtr consequent_;
+    NodePtr alternate_;
+public:
+    IfNode(NodePtr test, NodePtr consequent, NodePtr alternate) : test_(std::move(test)),
+                                                                  consequent_(std::move(consequent)),
+                                                                  alternate_(std::move(alternate)) {
+    }
+
+    [[nodiscard]] const NodePtr &get_test() const {
+        return test_;
+    }
+
+    [[nodiscard]] const NodePtr &get_consequent() const {
+        return consequent_;
+    }
+
+    [[nodiscard]] const NodePtr &get_alternate() const {
+        return alternate_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// sequence of expressions, the value of the last one is the result (begin, bodies of lambda and let)
+class SequenceNode : public Node {
+    std::vector<NodePtr> body_;
+public:
+    explicit SequenceNode(std::vector<NodePtr> body) : body_(std::move(body)) {
+    }
+
+    [[nodiscard]] const std::vector<NodePtr> &get_body() const {
+        return body_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+class CondNode : public Node {
+public:
+    struct Clause {
+        NodePtr test;
+        // nullptr if the clause has no expressions
+        NodePtr body;
+    };
+
+    explicit CondNode(std::vector<Clause> clauses) : clauses_(std::move(clauses)) {
+    }
+
+    [[nodiscard]] const std::vector<Clause> &get_clauses() const {
+        return clauses_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+
+private:
+    std::vector<Clause> clauses_;
+};
+
+class CaseNode : public Node {
+    NodePtr key_;
+    CaseTable table_;
+    // expressions of each clause
+    std::vector<NodePtr> bodies_;
+public:
+    CaseNode(NodePtr key, CaseTable table, std::vector<NodePtr> bodies)
+            : key_(std::move(key)), table_(std::move(table)), bodies_(std::move(bodies)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// let, let* and letrec all behave like let*
+class LetNode : public Node {
+    // 0 if the variables are slots of the current frame
+    size_t frame_size_;
+    // slot and initial value of each variable
+    std::vector<std::pair<size_t, NodePtr> > bindings_;
+    // slots of the boxed variables, their boxes are made before any initial value is evaluated
+    std::vector<size_t> boxes_;
+    NodePtr body_;
+public:
+    LetNode(size_t frame_size, std::vector<std::pair<size_t, NodePtr> > bindings, std::vector<size_t> boxes,
+            NodePtr body) : frame_size_(frame_size), bindings_(std::move(bindings)), boxes_(std::move(boxes)),
+                            body_(std::move(body)) {
+    }
+
+    [[nodiscard]] size_t get_frame_size() const {
+        return frame_size_;
+    }
+
+    [[nodiscard]] const std::vector<std::pair<size_t, NodePtr> > &get_bindings() const {
+        return bindings_;
+    }
+
+    [[nodiscard]] const NodePtr &get_body() const {
+        return body_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// receive: the values of the expression are stored into the slots of the variables (see values.h)
+class ReceiveNode : public Node {
+    // 0 if the variables are slots of the current frame
+    size_t frame_size_;
+    NodePtr expression_;
+    std::vector<size_t> slots_;
+    NodePtr body_;
+public:
+    ReceiveNode(size_t frame_size, NodePtr expression, std::vector<size_t> slots, NodePtr body)
+            : frame_size_(frame_size), expression_(std::move(expression)), slots_(std::move(slots)),
+              body_(std::move(body)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+
+    // stores the values into the slots and continues with the body
+    ValuePtr receive(std::vector<ValuePtr> &values, TailCall &tail) const;
+};
+
+// guard: the body runs with the guard on the handler stack, a condition raised to it is received by the handler
+// (see exceptions.h)
+class GuardNode : public Node {
+    NodePtr body_;
+    std::shared_ptr<const ReceiveNode> handler_;
+public:
+    GuardNode(NodePtr body, std::shared_ptr<const ReceiveNode> handler)
+            : body_(std::move(body)), handler_(std::move(handler)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// start of the body of a loop, known once the body (with the calls that jump to it) is analyzed
+struct LoopTarget {
+    const Node *body = nullptr;
+};
+
+// named let (or do) that runs as a loop (see is_loop in syntax.h)
+class LoopNode : public Node {
+    // 0 if the variables are slots of the current frame
+    size_t frame_size_;
+    // slot and initial value of each variable, the initial values are evaluated outside of the loop
+    std::vector<std::pair<size_t, NodePtr> > bindings_;
+    NodePtr body_;
+public:
+    LoopNode(size_t frame_size, std::vector<std::pair<size_t, NodePtr> > bindings, NodePtr body)
+            : frame_size_(frame_size), bindings_(std::move(bindings)), body_(std::move(body)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// call of the name of a loop: the arguments are stored into the slots of the variables and the body runs again
+class RecurNode : public Node {
+    std::vector<std::pair<size_t, NodePtr> > arguments_;
+    std::shared_ptr<const LoopTarget> target_;
+public:
+    RecurNode(std::vector<std::pair<size_t, NodePtr> > arguments, std::shared_ptr<const LoopTarget> target)
+            : arguments_(std::move(arguments)), target_(std::move(target)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+class LambdaNode : public Node {
+    // the lambda form, closures keep it to be inlined
+    ListPtr source_;
+    std::shared_ptr<ListValue> formal_params_;
+    size_t frame_size_;
+    // variables the closure copies into its frame, one per slot (see scope.h)
+    std::vector<LexicalAddress> captures_;
+    // frames out to the environment of the enclosing closure, which the frame of the closure leads to
+    size_t closure_depth_;
+    NodePtr body_;
+public:
+    LambdaNode(ListPtr source, size_t frame_size, std::vector<LexicalAddress> captures, size_t closure_depth,
+               NodePtr body) : source_(std::move(source)), formal_params_(car<ListValue>(cdr(source_))),
+                               frame_size_(frame_size), captures_(std::move(captures)), closure_depth_(closure_depth),
+                               body_(std::move(body)) {
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+class CallNode : public Node {
+    NodePtr operator_;
+    // operator_ if it is a global variable (the common case of calling a builtin or a top level function),
+    // it is then read through its cache without going through run()
+    const GlobalNode *global_operator_;
+    std::vector<NodePtr> operands_;
+public:
+    CallNode(NodePtr op, std::vector<NodePtr> operands) : operator_(std::move(op)), operands_(std::move(operands)) {
+        global_operator_ = dynamic_cast<const GlobalNode *>(operator_.get());
+    }
+
+    [[nodiscard]] const NodePtr &get_operator() const {
+        return operator_;
+    }
+
+    [[nodiscard]] const GlobalNode *get_global_operator() const {
+        return global_operator_;
+    }
+
+    [[nodiscard]] const std::vector<NodePtr> &get_operands() const {
+        return operands_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// Call of a small global closure with its body analyzed right into the caller: the arguments are stored into slots
+// of the frame of the caller and the body continues in it, no frame is made. It is used only as long as the global
+// variable holds the same closure, otherwise the call is done as usual.
+class InlineNode : public Node {
+    std::shared_ptr<const CallNode> call_;
+    ValuePtr closure_;
+    // slot of each parameter and its argument
+    std::vector<std::pair<size_t, NodePtr> > arguments_;
+    NodePtr body_;
+public:
+    InlineNode(std::shared_ptr<const CallNode> call, ValuePtr closure, std::vector<std::pair<size_t, NodePtr> > arguments,
+               NodePtr body) : call_(std::move(call)), closure_(std::move(closure)), arguments_(std::move(arguments)),
+                               body_(std::move(body)) {
+    }
+
+    [[nodiscard]] const std::shared_ptr<const CallNode> &get_call() const {
+        return call_;
+    }
+
+    [[nodiscard]] const ValuePtr &get_closure() const {
+        return closure_;
+    }
+
+    [[nodiscard]] const std::vector<std::pair<size_t, NodePtr> > &get_arguments() const {
+        return arguments_;
+    }
+
+    [[nodiscard]] const NodePtr &get_body() const {
+        return body_;
+    }
+
+    ValuePtr execute(TailCall &tail) const override;
+};
+
+// closures whose bodies have at most this many atoms and lists can be inlined
+constexpr size_t INLINE_SIZE_LIMIT = 24;
+
+// walks the form once and returns the tree of nodes that evaluates it in the global environment env
+NodePtr analyze(const ValuePtr &ast, const EnvironmentPtr &env);
+
+#endif //SCHEME_ANALYZER_H
@@ -0,0 +1,116 @@
+#ifndef SCHEME_BYTECODE_H
+#define SCHEME_BYTECODE_H
+
+#include "util.h"
+#include "scope.h"
+#include "syntax.h"
+#include "datatypes/types.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Instructions of the stack virtual machine. Every instruction is a single byte opcode followed by its operands,
+// indices and argument counts are 16 bit, jump targets are 32 bit absolute offsets into the code.
+enum class OpCode : std::uint8_t {
+    Constant,       // index: push constants[index]
+    GetGlobal,      // index: push the value of the global variable names[index]
+    DefineGlobal,   // index: bind names[index] to the top of the stack in the global environment
+    SetGlobal,      // index: update an existing global binding of names[index] to the top of the stack
+    GetLocal,       // depth index: push a slot of the frame depth frames out
+    SetLocal,       // depth index: store the top of the stack into a slot (set! and define of locals)
+    GetBoxed,       // depth index: push the value in the box of a slot
+    SetBoxed,       // depth index: store the top of the stack into the box of a slot
+    MakeBox,        // index: put the value of a slot of the current frame into a new box
+    Pop,            // discard the top of the stack
+    Jump,           // target
+    JumpIfFalse,    // target: pop the test, jump if it is not a true value
+    Case,           // index: pop the key, jump to the target of the clause case_tables[index] selects
+    MakeClosure,    // index: push a closure of prototypes[index] with its captures from the current environment
+    Call,           // argc: call the function below the arguments, push the result
+    TailCall,       // argc: like Call, but reuses the current frame
+    Return,         // return the top of the stack from the current function
+    Values,         // count: pop a result, push the count values it stands for (see values.h)
+    PushGuard,      // target: enter a guard, a condition raised to it is pushed and continues at target
+    PopGuard,       // leave the guard entered last (see exceptions.h)
+    EnterFrame,     // size: make a new frame inside the current environment (let at the top level)
+    LeaveFrame,     // return to the outer environment
+};
+
+struct Prototype;
+
+// clauses of a case and where their code starts, the last target is the code for a key no clause selects
+struct CaseDispatch {
+    CaseTable table;
+    std::vector<std::uint32_t> targets;
+};
+
+struct Chunk {
+    std::vector<std::uint8_t> code;
+    std::vector<ValuePtr> constants;
+    std::vector<SymbolId> names;
+    // inline cache of each name, filled by the vm
+    mutable std::vector<GlobalCache> global_caches;
+    std::vector<std::shared_ptr<const Prototype> > prototypes;
+    std::vector<CaseDispatch> case_tables;
+
+    void emit(OpCode op) {
+        code.push_back(static_cast<std::uint8_t>(op));
+    }
+
+    void emit(OpCode op, std::uint16_t operand) {
+        emit(op);
+        code.push_back(operand & 0xff);
+        code.push_back(operand >> 8);
+    }
+
+    void emit(OpCode op, std::uint16_t first, std::uint16_t second) {
+        emit(op, first);
+        code.push_back(second & 0xff);
+        code.push_back(second >> 8);
+    }
+
+    // overwrites a 16 bit operand that was not known when it was emitted
+    void patch_u16(size_t position, std::uint16_t operand) {
+        code[position] = operand & 0xff;
+        code[position + 1] = operand >> 8;
+    }
+
+    // emits a jump with a placeholder target, returns the position of the target for patch_jump
+    size_t emit_jump(OpCode op) {
+        emit(op);
+        for (int i = 0; i < 4; ++i) {
+            code.push_back(0);
+        }
+        return code.size() - 4;
+    }
+
+    // emits a jump to a target that is already known (the start of a loop)
+    void emit_jump_to(OpCode op, size_t target) {
+        emit(op);
+        for (int i = 0; i < 4; ++i) {
+            code.push_back((target >> (8 * i)) & 0xff);
+        }
+    }
+
+    // points the jump at the current end of the code
+    void patch_jump(size_t position) {
+        auto target = static_cast<std::uint32_t>(code.size());
+        for (int i = 0; i < 4; ++i) {
+            code[position + i] = (target >> (8 * i)) & 0xff;
+        }
+    }
+};
+
+// compiled lambda (or top level form, which has no parameters)
+struct Prototype {
+    std::shared_ptr<ListValue> formal_params;
+    size_t frame_size = 0;
+    // variables the closures copy into their frames and where their frames lead to (see LambdaNode)
+    std::vector<LexicalAddress> captures;
+    size_t closure_depth = 0;
+    Chunk chunk;
+};
+
+using PrototypePtr = std::shared_ptr<const Prototype>;
+
+#endif //SCHEME_BYTECODE_H
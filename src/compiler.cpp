@@ -0,0 +1,430 @@
+#include "compiler.h"
+#include "scope.h"
+#include "syntax.h"
+#include "datatypes/types.h"
+#include <deque>
+#include <limits>
+#include <string>
+
+namespace {
+
+    class Compiler {
+        Chunk &chunk_;
+
+        // loop whose body is being compiled
+        struct Loop {
+            // slot declared for the name, calls that resolve to it jump back to start
+            size_t name_slot;
+            std::vector<size_t> slots;
+            size_t start;
+        };
+        // a deque, so that the loop a call found stays put while a named let in its arguments pushes another
+        std::deque<Loop> loops_;
+
+        std::uint16_t add_index(size_t index) {
+            if (index > std::numeric_limits<std::uint16_t>::max()) {
+                throw std::runtime_error("compile error: too many constants in one function");
+            }
+            return static_cast<std::uint16_t>(index);
+        }
+
+        std::uint16_t add_constant(const ValuePtr &value) {
+            chunk_.constants.push_back(value);
+            return add_index(chunk_.constants.size() - 1);
+        }
+
+        std::uint16_t add_name(SymbolId name) {
+            for (size_t i = 0; i < chunk_.names.size(); ++i) {
+                if (chunk_.names[i] == name) {
+                    return add_index(i);
+                }
+            }
+            chunk_.names.push_back(name);
+            chunk_.global_caches.emplace_back();
+            return add_index(chunk_.names.size() - 1);
+        }
+
+        void emit_set_local(const LexicalAddress &address) {
+            chunk_.emit(address.boxed ? OpCode::SetBoxed : OpCode::SetLocal, add_index(address.depth),
+                        add_index(address.index));
+        }
+
+        void emit_boxes(const std::vector<size_t> &slots) {
+            for (auto index: slots) {
+                chunk_.emit(OpCode::MakeBox, add_index(index));
+            }
+        }
+
+        void compile_sequence(const ListPtr &exprs, size_t start, const ScopePtr &scope, bool tail) {
+            if (start >= exprs->size()) {
+                chunk_.emit(OpCode::Constant, add_constant(std::make_shared<NilValue>()));
+                return;
+            }
+            for (size_t i = start; i < exprs->size() - 1; ++i) {
+                compile_form(exprs->get_value(i), scope, false);
+                chunk_.emit(OpCode::Pop);
+            }
+            compile_form(exprs->get_value(exprs->size() - 1), scope, tail);
+        }
+
+        void compile_symbol(SymbolId name, const ScopePtr &scope) {
+            auto address = scope == nullptr ? std::nullopt : scope->resolve(name);
+            if (address.has_value()) {
+                chunk_.emit(address->boxed ? OpCode::GetBoxed : OpCode::GetLocal, add_index(address->depth),
+                            add_index(address->index));
+            } else {
+                chunk_.emit(OpCode::GetGlobal, add_name(name));
+            }
+        }
+
+        void compile_define(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto name = variable_id(list_ast->get_value(1), "define");
+            if (scope == nullptr) {
+                compile_form(list_ast->get_value(2), scope, false);
+                chunk_.emit(OpCode::DefineGlobal, add_name(name));
+                return;
+            }
+            auto index = scope->declare(name, true);
+            compile_form(list_ast->get_value(2), scope, false);
+            scope->bind(name);
+            emit_set_local({0, index, scope->is_boxed(name)});
+        }
+
+        void compile_set(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto name = variable_id(list_ast->get_value(1), "set!");
+            compile_form(list_ast->get_value(2), scope, false);
+            auto address = scope == nullptr ? std::nullopt : scope->resolve(name);
+            if (address.has_value()) {
+                emit_set_local(*address);
+            } else {
+                chunk_.emit(OpCode::SetGlobal, add_name(name));
+            }
+        }
+
+        void compile_if(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            if (list_ast->size() < 3 || list_ast->size() > 4) {
+                throw std::runtime_error("if: expected a test, a consequent and an optional alternate");
+            }
+            compile_form(list_ast->get_value(1), scope, false);
+            auto to_alternate = chunk_.emit_jump(OpCode::JumpIfFalse);
+            compile_form(list_ast->get_value(2), scope, tail);
+            auto to_end = chunk_.emit_jump(OpCode::Jump);
+            chunk_.patch_jump(to_alternate);
+            if (list_ast->size() == 4) {
+                compile_form(list_ast->get_value(3), scope, tail);
+            } else {
+                chunk_.emit(OpCode::Constant, add_constant(std::make_shared<NilValue>()));
+            }
+            chunk_.patch_jump(to_end);
+        }
+
+        void compile_cond(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            std::vector<size_t> to_end;
+            for (size_t i = 1; i < list_ast->size(); ++i) {
+                auto clause = std::static_pointer_cast<ListValue>(list_ast->get_value(i));
+                compile_form(car<Value>(clause), scope, false);
+                auto to_next = chunk_.emit_jump(OpCode::JumpIfFalse);
+                if (clause->size() == 1) {
+                    chunk_.emit(OpCode::Constant, add_constant(std::make_shared<BoolValue>(true)));
+                } else {
+                    compile_sequence(clause, 1, scope, tail);
+                }
+                to_end.push_back(chunk_.emit_jump(OpCode::Jump));
+                chunk_.patch_jump(to_next);
+            }
+            // result of the entire cond expression is unspecified
+            chunk_.emit(OpCode::Constant, add_constant(std::make_shared<NilValue>()));
+            for (auto position: to_end) {
+                chunk_.patch_jump(position);
+            }
+        }
+
+        void compile_case(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            CaseTable table(list_ast);
+            compile_form(list_ast->get_value(1), scope, false);
+            chunk_.case_tables.push_back({std::move(table), {}});
+            auto index = add_index(chunk_.case_tables.size() - 1);
+            chunk_.emit(OpCode::Case, index);
+            std::vector<std::uint32_t> targets;
+            std::vector<size_t> to_end;
+            for (size_t i = 2; i < list_ast->size(); ++i) {
+                targets.push_back(static_cast<std::uint32_t>(chunk_.code.size()));
+                compile_sequence(std::static_pointer_cast<ListValue>(list_ast->get_value(i)), 1, scope, tail);
+                to_end.push_back(chunk_.emit_jump(OpCode::Jump));
+            }
+            // result of a case that no clause selects is unspecified
+            targets.push_back(static_cast<std::uint32_t>(chunk_.code.size()));
+            chunk_.emit(OpCode::Constant, add_constant(std::make_shared<NilValue>()));
+            for (auto position: to_end) {
+                chunk_.patch_jump(position);
+            }
+            chunk_.case_tables[index].targets = std::move(targets);
+        }
+
+        void compile_let(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            auto bindings_list = car<ListValue>(cdr(list_ast));
+            auto let_scope = make_let_scope(scope);
+            // only a let at the top level has its own frame, its size is known after the body is compiled
+            bool new_frame = scope == nullptr;
+            size_t frame_size_position = 0;
+            if (new_frame) {
+                chunk_.emit(OpCode::EnterFrame, 0);
+                frame_size_position = chunk_.code.size() - 2;
+            }
+            VariableUse use(list_ast, 1), inits_use(bindings_list, 0);
+            std::vector<SymbolId> names;
+            for (size_t i = 0; i < bindings_list->size(); ++i) {
+                names.push_back(variable_id(car<Value>(bindings_list->get_value(i)), "let"));
+                let_scope->declare(names.back(), true, is_boxed_let_variable(names.back(), use, inits_use));
+            }
+            auto boxes = let_scope->boxed_slots();
+            emit_boxes(boxes);
+            for (size_t i = 0; i < bindings_list->size(); ++i) {
+                auto binding = std::static_pointer_cast<ListValue>(bindings_list->get_value(i));
+                compile_form(binding->get_value(1), let_scope, false);
+                let_scope->bind(names[i]);
+                emit_set_local(*let_scope->resolve(names[i]));
+                chunk_.emit(OpCode::Pop);
+            }
+            declare_internal_defines(let_scope, list_ast, 2, use);
+            emit_boxes(let_scope->boxed_slots(boxes));
+            compile_sequence(list_ast, 2, let_scope, tail);
+            if (new_frame) {
+                chunk_.patch_u16(frame_size_position, add_index(let_scope->frame_size()));
+                // a tail call has already replaced the environment, otherwise we have to restore it
+                if (!tail) {
+                    chunk_.emit(OpCode::LeaveFrame);
+                }
+            }
+        }
+
+        void compile_receive(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            receive_variables(list_ast);
+            compile_form(list_ast->get_value(2), scope, false);
+            compile_received(list_ast, scope, tail);
+        }
+
+        // the variables of the receive form take the values on top of the stack and the body runs
+        void compile_received(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            auto variables = receive_variables(list_ast);
+            auto receive_scope = make_let_scope(scope);
+            bool new_frame = scope == nullptr;
+            size_t frame_size_position = 0;
+            if (new_frame) {
+                chunk_.emit(OpCode::EnterFrame, 0);
+                frame_size_position = chunk_.code.size() - 2;
+            }
+            chunk_.emit(OpCode::Values, add_index(variables.size()));
+            VariableUse use(list_ast, 3);
+            std::vector<size_t> slots;
+            for (auto name: variables) {
+                slots.push_back(receive_scope->declare(name, false, use.is_captured(name) && use.is_assigned(name)));
+            }
+            emit_store_slots(slots);
+            declare_internal_defines(receive_scope, list_ast, 3, use);
+            emit_boxes(receive_scope->boxed_slots());
+            compile_sequence(list_ast, 3, receive_scope, tail);
+            if (new_frame) {
+                chunk_.patch_u16(frame_size_position, add_index(receive_scope->frame_size()));
+                if (!tail) {
+                    chunk_.emit(OpCode::LeaveFrame);
+                }
+            }
+        }
+
+        void compile_guard(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            auto handler = guard_handler(list_ast);
+            auto to_handler = chunk_.emit_jump(OpCode::PushGuard);
+            // the guard is left when the body returns, so the body is not in tail position
+            compile_sequence(list_ast, 2, scope, false);
+            chunk_.emit(OpCode::PopGuard);
+            auto to_end = chunk_.emit_jump(OpCode::Jump);
+            // a condition raised to the guard is pushed and the handler receives it
+            chunk_.patch_jump(to_handler);
+            compile_received(handler, scope, tail);
+            chunk_.patch_jump(to_end);
+        }
+
+        void compile_named_let(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            if (!is_loop(list_ast)) {
+                compile_form(named_let_to_call(list_ast), scope, tail);
+                return;
+            }
+            auto bindings_list = std::static_pointer_cast<ListValue>(list_ast->get_value(2));
+            // the initial values are evaluated outside of the loop
+            for (size_t i = 0; i < bindings_list->size(); ++i) {
+                compile_form(std::static_pointer_cast<ListValue>(bindings_list->get_value(i))->get_value(1), scope,
+                             false);
+            }
+            auto loop_scope = make_let_scope(scope);
+            bool new_frame = scope == nullptr;
+            size_t frame_size_position = 0;
+            if (new_frame) {
+                chunk_.emit(OpCode::EnterFrame, 0);
+                frame_size_position = chunk_.code.size() - 2;
+            }
+            Loop loop{loop_scope->declare(variable_id(list_ast->get_value(1), "let")), {}, 0};
+            for (size_t i = 0; i < bindings_list->size(); ++i) {
+                loop.slots.push_back(loop_scope->declare(variable_id(car<Value>(bindings_list->get_value(i)), "let")));
+            }
+            emit_store_slots(loop.slots);
+            declare_internal_defines(loop_scope, list_ast, 3);
+            loop.start = chunk_.code.size();
+            loops_.push_back(loop);
+            compile_sequence(list_ast, 3, loop_scope, tail);
+            loops_.pop_back();
+            if (new_frame) {
+                chunk_.patch_u16(frame_size_position, add_index(loop_scope->frame_size()));
+                if (!tail) {
+                    chunk_.emit(OpCode::LeaveFrame);
+                }
+            }
+        }
+
+        // pops the values on top of the stack into the slots of the current frame
+        void emit_store_slots(const std::vector<size_t> &slots) {
+            for (size_t i = slots.size(); i-- > 0;) {
+                emit_set_local({0, slots[i]});
+                chunk_.emit(OpCode::Pop);
+            }
+        }
+
+        // the loop whose name the call calls, nullptr for other calls
+        const Loop *called_loop(const ListPtr &list_ast, const ScopePtr &scope) {
+            if (scope == nullptr || list_ast->get_value(0)->get_type() != ValueType::Symbol) {
+                return nullptr;
+            }
+            auto address = scope->resolve(car<SymbolValue>(list_ast)->get_id());
+            if (!address.has_value() || address->depth != 0) {
+                return nullptr;
+            }
+            for (auto it = loops_.rbegin(); it != loops_.rend(); ++it) {
+                if (it->name_slot == address->index) {
+                    return &*it;
+                }
+            }
+            return nullptr;
+        }
+
+        void compile_lambda(const ListPtr &list_ast, const ScopePtr &scope) {
+            auto prototype = std::make_shared<Prototype>();
+            prototype->formal_params = car<ListValue>(cdr(list_ast));
+            auto lambda_scope = make_lambda_scope(scope);
+            VariableUse use(list_ast, 2);
+            // the arguments are stored in the first slots of the frame
+            for (size_t i = 0; i < prototype->formal_params->size(); ++i) {
+                auto name = variable_id(prototype->formal_params->get_value(i), "lambda");
+                lambda_scope->declare(name, false, use.is_captured(name) && use.is_assigned(name));
+            }
+            declare_internal_defines(lambda_scope, list_ast, 2, use);
+            Compiler(prototype->chunk).compile_body(list_ast, 2, lambda_scope);
+            prototype->frame_size = lambda_scope->frame_size();
+            prototype->captures = lambda_scope->captures();
+            prototype->closure_depth = scope == nullptr ? 0 : scope->closure_depth();
+            chunk_.prototypes.push_back(prototype);
+            chunk_.emit(OpCode::MakeClosure, add_index(chunk_.prototypes.size() - 1));
+        }
+
+        void compile_call(const ListPtr &list_ast, const ScopePtr &scope, bool tail) {
+            if (auto loop = called_loop(list_ast, scope)) {
+                for (size_t i = 1; i < list_ast->size(); ++i) {
+                    compile_form(list_ast->get_value(i), scope, false);
+                }
+                emit_store_slots(loop->slots);
+                chunk_.emit_jump_to(OpCode::Jump, loop->start);
+                return;
+            }
+            for (size_t i = 0; i < list_ast->size(); ++i) {
+                compile_form(list_ast->get_value(i), scope, false);
+            }
+            chunk_.emit(tail ? OpCode::TailCall : OpCode::Call, add_index(list_ast->size() - 1));
+        }
+
+    public:
+        explicit Compiler(Chunk &chunk) : chunk_(chunk) {
+        }
+
+        void compile_body(const ListPtr &exprs, size_t start, const ScopePtr &scope) {
+            emit_boxes(scope->boxed_slots());
+            compile_sequence(exprs, start, scope, true);
+            chunk_.emit(OpCode::Return);
+        }
+
+        void compile_form(const ValuePtr &ast, const ScopePtr &scope, bool tail) {
+            if (ast->get_type() == ValueType::Symbol) {
+                compile_symbol(std::static_pointer_cast<SymbolValue>(ast)->get_id(), scope);
+                return;
+            }
+            auto list_ast = std::static_pointer_cast<ListValue>(ast);
+            // atoms and the empty list evaluate to themselves
+            if (ast->get_type() != ValueType::List || list_ast->size() == 0) {
+                chunk_.emit(OpCode::Constant, add_constant(ast));
+                return;
+            }
+
+            if (car<Value>(list_ast)->get_type() == ValueType::Symbol) {
+                auto symbol = car<SymbolValue>(list_ast);
+                auto symbol_name = symbol->get_symbol_name();
+                switch (static_cast<SpecialForm>(symbol->get_id())) {
+                    case SpecialForm::Define:
+                        check_arity(symbol_name, 3, list_ast->size());
+                        compile_define(list_ast, scope);
+                        return;
+                    case SpecialForm::LetStar:
+                    case SpecialForm::Letrec:
+                    case SpecialForm::Let:
+                        if (is_named_let(list_ast)) {
+                            compile_named_let(list_ast, scope, tail);
+                            return;
+                        }
+                        compile_let(list_ast, scope, tail);
+                        return;
+                    case SpecialForm::Do:
+                        compile_named_let(do_to_named_let(list_ast), scope, tail);
+                        return;
+                    case SpecialForm::Case:
+                        compile_case(list_ast, scope, tail);
+                        return;
+                    case SpecialForm::Receive:
+                        compile_receive(list_ast, scope, tail);
+                        return;
+                    case SpecialForm::Guard:
+                        compile_guard(list_ast, scope, tail);
+                        return;
+                    case SpecialForm::Quote:
+                        check_arity(symbol_name, 2, list_ast->size());
+                        chunk_.emit(OpCode::Constant, add_constant(list_ast->get_value(1)));
+                        return;
+                    case SpecialForm::Lambda:
+                        compile_lambda(list_ast, scope);
+                        return;
+                    case SpecialForm::Begin:
+                        compile_sequence(list_ast, 1, scope, tail);
+                        return;
+                    case SpecialForm::Set:
+                        check_arity(symbol_name, 3, list_ast->size());
+                        compile_set(list_ast, scope);
+                        return;
+                    case SpecialForm::If:
+                        compile_if(list_ast, scope, tail);
+                        return;
+                    case SpecialForm::Cond:
+                        compile_cond(list_ast, scope, tail);
+                        return;
+                    default:
+                        break;
+                }
+            }
+            compile_call(list_ast, scope, tail);
+        }
+    };
+}
+
+PrototypePtr compile(const ValuePtr &ast) {
+    auto prototype = std::make_shared<Prototype>();
+    prototype->formal_params = std::make_shared<ListValue>();
+    Compiler compiler(prototype->chunk);
+    compiler.compile_form(ast, nullptr, true);
+    prototype->chunk.emit(OpCode::Return);
+    return prototype;
+}
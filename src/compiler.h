@@ -0,0 +1,9 @@
+#ifndef SCHEME_COMPILER_H
+#define SCHEME_COMPILER_H
+
+#include "bytecode.h"
+
+// compiles a top level form into a prototype without parameters, which the vm can execute
+PrototypePtr compile(const ValuePtr &ast);
+
+#endif //SCHEME_COMPILER_H
@@ -0,0 +1,59 @@
+#include "continuation.h"
+#include "evaluator.h"
+#include "datatypes/closure.h"
+
+namespace {
+    // a call of the continuation from eval or a builtin, the vm handles calls of continuations itself
+    FunctionSharedPointer escape_function(const ContinuationStatePtr &state) {
+        return [state](size_t argc, std::vector<ValuePtr> &argv) -> ValuePtr {
+            if (!state->live) {
+                throw std::runtime_error("continuation: call/cc already returned, only the vm can re-enter it");
+            }
+            throw ContinuationInvoked{state, argc == 0 ? std::make_shared<NilValue>() : argv[0]};
+        };
+    }
+}
+
+ContinuationValue::ContinuationValue(ContinuationStatePtr state)
+        : FunctionValue(escape_function(state), Primitive::Continuation), state_(std::move(state)) {
+}
+
+std::shared_ptr<ContinuationValue> make_continuation(const ContinuationStatePtr &state) {
+    auto continuation = std::make_shared<ContinuationValue>(state);
+    state->continuation = continuation;
+    return continuation;
+}
+
+ValuePtr call_with_current_continuation(size_t argc, std::vector<ValuePtr> &argv) {
+//    (call-with-current-continuation procedure) procedure
+//    Procedure must be a procedure of one argument. The procedure call-with-current-continuation packages up
+//    the current continuation as an "escape procedure" and passes it as an argument to procedure.
+//    The escape procedure is a Scheme procedure of one argument that, if it is later passed a value,
+//    will ignore whatever continuation is in effect at that later time and will give the value instead
+//    to the continuation that was in effect when the escape procedure was created.
+    std::string name = "call/cc";
+    check_arity(name, 1, argc);
+    auto state = std::make_shared<ContinuationState>();
+    std::vector<ValuePtr> args{make_continuation(state)};
+    ValuePtr result;
+    try {
+        if (argv[0]->get_type() == ValueType::Function) {
+            result = apply_fn(static_cast<const FunctionValue &>(*argv[0]), args);
+        } else if (argv[0]->get_type() == ValueType::Closure) {
+            result = std::static_pointer_cast<Closure>(argv[0])->call(args);
+        } else {
+            throw std::runtime_error("call/cc: " + argv[0]->to_string() + " is not a function");
+        }
+    } catch (ContinuationInvoked &jump) {
+        state->live = false;
+        if (jump.state != state) {
+            throw;
+        }
+        return jump.value;
+    } catch (...) {
+        state->live = false;
+        throw;
+    }
+    state->live = false;
+    return result;
+}
@@ -0,0 +1,65 @@
+#ifndef SCHEME_CONTINUATION_H
+#define SCHEME_CONTINUATION_H
+
+#include "util.h"
+#include "vm.h"
+#include <memory>
+#include <vector>
+
+// First class continuations of call-with-current-continuation (call/cc).
+//
+// Capturing a continuation copies nothing. While the call of call/cc has not returned (its extent), the continuation
+// is escape only: calling it unwinds to the call of call/cc, which then returns the value. In the vm this is a jump,
+// the call frames above the frame that called call/cc are dropped. In eval, and from builtins such as map, the call
+// of the continuation throws ContinuationInvoked, which call/cc catches.
+//
+// A continuation that is still referenced when the call of call/cc returns may be re-entered later. Only then the
+// vm copies the frames of the callers into a snapshot, and calling the continuation replaces the calls of the current
+// vm activation with copies of them. Continuations are delimited by vm activations: re-entering one continues the
+// snapshot up to the top level form (or builtin call) that captured it and returns from the current one.
+// eval only supports escaping continuations.
+struct ContinuationState {
+    // the call of call/cc has not returned, the continuation can escape to it
+    bool live = true;
+    // vm that called call/cc with a closure of the vm, frame is the index of the call frame of the caller in it,
+    // base the first stack slot of the receiver (nullptr for call/cc done by the builtin function)
+    const VM *vm = nullptr;
+    size_t frame = 0;
+    size_t base = 0;
+    // the continuation, expired if it cannot be called anymore
+    std::weak_ptr<Value> continuation;
+    // copy of the callers made when the continuation outlived the call of call/cc,
+    // the top registers are those of the caller of call/cc
+    std::shared_ptr<const CallStack> snapshot;
+};
+
+using ContinuationStatePtr = std::shared_ptr<ContinuationState>;
+
+class ContinuationValue : public FunctionValue {
+    ContinuationStatePtr state_;
+public:
+    explicit ContinuationValue(ContinuationStatePtr state);
+
+    [[nodiscard]] const ContinuationStatePtr &get_state() const {
+        return state_;
+    }
+
+    [[nodiscard]] std::string to_string() const override {
+        return "#<continuation>";
+    }
+};
+
+// thrown by a call of a live continuation that cannot jump to its call/cc directly
+struct ContinuationInvoked {
+    ContinuationStatePtr state;
+    ValuePtr value;
+};
+
+// makes a continuation whose state records where it returns to
+std::shared_ptr<ContinuationValue> make_continuation(const ContinuationStatePtr &state);
+
+// the builtin call/cc: calls the receiver with an escape only continuation and returns what it returns,
+// or the value the continuation was called with
+ValuePtr call_with_current_continuation(size_t argc, std::vector<ValuePtr> &argv);
+
+#endif //SCHEME_CONTINUATION_H
@@ -5,22 +5,58 @@
 #include "types.h"
 #include "environment.h"
 #include "../util.h"
+#include "../bytecode.h"
+#include "../scope.h"
+#include <atomic>
 #include <vector>
 #include <string>
 
+class NativeCode;
+
+class NumericCode;
+
 class Closure : public Value {
+    // the frame with the captures of the closure, or the environment of the enclosing closure if it has none
     EnvironmentPtr env_;
     std::shared_ptr<ListValue> formal_params_; // TODO make this normal list of strings of names
-    std::shared_ptr<Value> body_;
+    // number of slots in the frame of a call, the arguments come first
+    size_t frame_size_;
+    NodePtr body_;
+    // the lambda form of a closure made by eval
+    ListPtr source_;
+    // set instead of body_ if the closure was made by the vm
+    PrototypePtr prototype_;
+    // interpreted calls so far, a hot closure is compiled to native code (see jit.h)
+    std::atomic<size_t> calls_{0};
+    std::shared_ptr<const NativeCode> native_;
+    // body specialized to unboxed numbers (see numeric.h)
+    std::shared_ptr<const NumericCode> numeric_;
+    // set once native_ (or numeric_) holds what the compilation made, nullptr if it failed. The closure may be
+    // called by several threads (see loader.h), only one compiles and the others see its result once it is set.
+    std::atomic<bool> native_done_{false};
+    std::atomic<bool> numeric_done_{false};
 
 public:
-    Closure(const EnvironmentPtr &env, std::shared_ptr<ListValue> formal_params,
-            std::shared_ptr<Value> body) : Value(ValueType::Closure), env_(env), formal_params_(formal_params),
-                                           body_(body) {
+    Closure(const EnvironmentPtr &env, std::shared_ptr<ListValue> formal_params, size_t frame_size, NodePtr body,
+            ListPtr source) : Value(ValueType::Closure), env_(env), formal_params_(std::move(formal_params)),
+                              frame_size_(frame_size), body_(std::move(body)), source_(std::move(source)) {
+    };
+
+    Closure(const EnvironmentPtr &env, const PrototypePtr &prototype) : Value(ValueType::Closure), env_(env),
+                                                                       formal_params_(prototype->formal_params),
+                                                                       frame_size_(prototype->frame_size),
+                                                                       prototype_(prototype) {
     };
 
     ValuePtr call(const std::vector<ValuePtr> &args);
 
+    // calls the native code (or the numeric specialization) of the closure, made once the closure is hot,
+    // nullptr if the call has to be interpreted
+    ValuePtr call_native(const std::vector<ValuePtr> &args);
+
+    // environment in which the body is evaluated, the arguments are bound to the formal parameters
+    EnvironmentPtr make_frame(const std::vector<ValuePtr> &args) const;
+
     ValueType get_type() const {
         return ValueType::Closure;
     }
@@ -29,10 +65,22 @@ public:
         return "#<Closure>";
     }
 
-    ValuePtr get_body() const {
+    NodePtr get_body() const {
         return body_;
     }
 
+    size_t get_frame_size() const {
+        return frame_size_;
+    }
+
+    ListPtr get_source() const {
+        return source_;
+    }
+
+    PrototypePtr get_prototype() const {
+        return prototype_;
+    }
+
     EnvironmentPtr get_env() const {
         return env_;
     }
@@ -42,5 +90,8 @@ public:
     }
 };
 
+// environment of a closure made in frame: a new frame with a copy of each capture (an address relative to frame),
+// whose outer environment is depth frames out of frame, or that environment itself if there are no captures
+EnvironmentPtr make_closure_env(const EnvironmentPtr &frame, size_t depth, const std::vector<LexicalAddress> &captures);
 
 #endif //SCHEME_CLOSURE_H
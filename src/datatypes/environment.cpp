@@ -1,4 +1,10 @@
 #include "../evaluator.h"
+#include "../continuation.h"
+#include "../threads.h"
+#include "../values.h"
+#include "../exceptions.h"
+#include "../eval_cache.h"
+#include "../streams.h"
 #include "closure.h"
 #include "types.h"
 #include "environment.h"
@@ -6,44 +12,122 @@
 #include <utility>
 
 
-void Environment::set(const std::string &key, const ValuePtr &value) {
-    data[key] = value;
+// 0 is never current, so an empty GlobalCache is always stale
+std::atomic<std::uint64_t> Environment::binding_epoch_{1};
+
+namespace {
+    // memory of local frames that were freed, a call takes the block that the last finished call released,
+    // so the frames of a running program are a stack of the same few blocks
+    struct FreeFrames {
+        // deeper recursion than this allocates and frees the frames one by one
+        static constexpr size_t CAPACITY = 1024;
+        std::vector<void *> blocks;
+
+        ~FreeFrames() {
+            for (auto *block: blocks) {
+                ::operator delete(block);
+            }
+        }
+    };
+
+    thread_local FreeFrames free_frames;
+
+    // allocator of allocate_shared for local frames, it only ever allocates single blocks of one size
+    // (the frame together with its reference counts)
+    template<typename T>
+    struct FrameAllocator {
+        using value_type = T;
+
+        FrameAllocator() = default;
+
+        template<typename U>
+        explicit FrameAllocator(const FrameAllocator<U> &) {
+        }
+
+        T *allocate(size_t n) {
+            if (n == 1 && !free_frames.blocks.empty()) {
+                auto *block = free_frames.blocks.back();
+                free_frames.blocks.pop_back();
+                return static_cast<T *>(block);
+            }
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *block, size_t n) {
+            if (n == 1 && free_frames.blocks.size() < FreeFrames::CAPACITY) {
+                free_frames.blocks.push_back(block);
+            } else {
+                ::operator delete(block);
+            }
+        }
+
+        template<typename U>
+        bool operator==(const FrameAllocator<U> &) const {
+            return true;
+        }
+    };
 }
 
-void Environment::update_existing(const std::string &key, const ValuePtr &value) {
-    if (data.find(key) != data.end()) {
-        data[key] = value;
-    } else if (outer != nullptr) {
-        outer->update_existing(key, value);
+EnvironmentPtr Environment::make_local_frame(EnvironmentPtr outer, size_t frame_size) {
+    return std::allocate_shared<Environment>(FrameAllocator<Environment>(), std::move(outer), frame_size);
+}
+
+void Environment::set(SymbolId key, const ValuePtr &value) {
+    auto [position, inserted] = data.try_emplace(key, value);
+    if (inserted) {
+        ++binding_epoch_;
     } else {
-        throw std::runtime_error("Symbol " + key + " not found");
+        position->second = value;
     }
 }
 
-Environment::Environment(EnvironmentPtr outer, const std::shared_ptr<ListValue> &binds,
-                         const std::shared_ptr<ListValue> &exprs)
-        : Value(ValueType::Environment), outer(std::move(std::move(outer))) {
-    for (size_t i = 0; i < binds->size(); i++) {
-        auto bind = binds->get_value(i);
-        auto expr = exprs->get_value(i);
-        set(bind->to_string(), expr);
+void Environment::set(const std::string &key, const ValuePtr &value) {
+    set(SymbolValue::intern(key)->get_id(), value);
+}
+
+void Environment::update_existing(SymbolId key, const ValuePtr &value) {
+    for (Environment *env = this; env != nullptr; env = env->outer.get()) {
+        auto found = env->data.find(key);
+        if (found != env->data.end()) {
+            found->second = value;
+            return;
+        }
     }
+    throw std::runtime_error("Symbol " + SymbolValue::from_id(key)->to_string() + " not found");
 }
 
-ValuePtr Environment::get(const std::string &key) const {
-    if (data.find(key) != data.end()) {
-        return data.at(key);
+void Environment::update_existing(const std::string &key, const ValuePtr &value) {
+    update_existing(SymbolValue::intern(key)->get_id(), value);
+}
+
+ValuePtr Environment::get(SymbolId key) const {
+    for (const Environment *env = this; env != nullptr; env = env->outer.get()) {
+        auto found = env->data.find(key);
+        if (found != env->data.end()) {
+            return found->second;
+        }
     }
-    if (outer != nullptr) {
-        return outer->get(key);
+    throw std::runtime_error("Symbol " + SymbolValue::from_id(key)->to_string() + " not found");
+}
+
+ValuePtr *Environment::find_cell(SymbolId key) {
+    for (Environment *env = this; env != nullptr; env = env->outer.get()) {
+        auto found = env->data.find(key);
+        if (found != env->data.end()) {
+            return &found->second;
+        }
     }
-    throw std::runtime_error("Symbol " + key + " not found");
+    return nullptr;
+}
+
+ValuePtr Environment::get(const std::string &key) const {
+    return get(SymbolValue::intern(key)->get_id());
 }
 
 //    find: takes a symbol key and if the current environment contains that key then return the environment.
 //    If no key is found and outer is not nil then call find (recurse) on the outer environment.
 EnvironmentPtr Environment::find(const std::string &key) {
-    if (data.find(key) != data.end()) {
+    if (data.find(SymbolValue::intern(key)->get_id()) != data.end()) {
         return std::make_shared<Environment>(*this);
     }
     if (outer != nullptr) {
@@ -60,8 +144,10 @@ EnvironmentPtr Environment::get_outer() const {
 BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
     auto make_arithmetic_function = [](auto operation) {
         return [operation](size_t argc, std::vector<ValuePtr> &argv) {
-            if (!check_signature(argv, {ValueType::Integer, ValueType::Integer}) && !check_signature(argv, {ValueType::Float, ValueType::Float}) && !check_signature(argv, {ValueType::Integer, ValueType::Float}) && !check_signature(argv, {ValueType::Float, ValueType::Integer}))
-            {
+            auto is_number = [](const ValuePtr &value) {
+                return value->get_type() == ValueType::Integer || value->get_type() == ValueType::Float;
+            };
+            if (argv.size() != 2 || !is_number(argv[0]) || !is_number(argv[1])) {
                 throw std::runtime_error("Invalid argument types, this is only a numeric operator.");
             }
 
@@ -69,17 +155,25 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
                 double result = operation(argv[0]->to_double(), argv[1]->to_double());
                 return std::static_pointer_cast<Value>(std::make_shared<FloatValue>(result));
             } else {
-                int result = operation(std::static_pointer_cast<IntegerValue>(argv[0])->get_value(),
+                std::int64_t result = operation(std::static_pointer_cast<IntegerValue>(argv[0])->get_value(),
                                        std::static_pointer_cast<IntegerValue>(argv[1])->get_value());
                 return std::static_pointer_cast<Value>(std::make_shared<IntegerValue>(result));
             }
         };
     };
 
-    set("+", std::make_shared<FunctionValue>(make_arithmetic_function(std::plus<>{})));
-    set("-", std::make_shared<FunctionValue>(make_arithmetic_function(std::minus<>{})));
-    set("*", std::make_shared<FunctionValue>(make_arithmetic_function(std::multiplies<>{})));
-    set("/", std::make_shared<FunctionValue>(make_arithmetic_function(std::divides<>{})));
+    set("+", std::make_shared<FunctionValue>(make_arithmetic_function(std::plus<>{}), Primitive::Add));
+    set("-", std::make_shared<FunctionValue>(make_arithmetic_function(std::minus<>{}), Primitive::Subtract));
+    set("*", std::make_shared<FunctionValue>(make_arithmetic_function(std::multiplies<>{}), Primitive::Multiply));
+    auto divides = [](auto a, auto b) {
+        if constexpr (std::is_integral_v<decltype(b)>) {
+            if (b == 0) {
+                throw std::runtime_error("Division by zero");
+            }
+        }
+        return a / b;
+    };
+    set("/", std::make_shared<FunctionValue>(make_arithmetic_function(divides), Primitive::Divide));
 
 
     set("true", std::make_shared<BoolValue>(true));
@@ -132,11 +226,16 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
         };
     };
 
-    set("=", std::make_shared<FunctionValue>(make_comparison_function(std::equal_to<double>())));
-    set(">", std::make_shared<FunctionValue>(make_comparison_function(std::greater<double>())));
-    set("<", std::make_shared<FunctionValue>(make_comparison_function(std::less<double>())));
-    set(">=", std::make_shared<FunctionValue>(make_comparison_function(std::greater_equal<double>())));
-    set("<=", std::make_shared<FunctionValue>(make_comparison_function(std::less_equal<double>())));
+    set("=", std::make_shared<FunctionValue>(make_comparison_function(std::equal_to<double>()),
+                                             Primitive::Equal));
+    set(">", std::make_shared<FunctionValue>(make_comparison_function(std::greater<double>()),
+                                             Primitive::Greater));
+    set("<", std::make_shared<FunctionValue>(make_comparison_function(std::less<double>()),
+                                             Primitive::Less));
+    set(">=", std::make_shared<FunctionValue>(make_comparison_function(std::greater_equal<double>()),
+                                             Primitive::GreaterEqual));
+    set("<=", std::make_shared<FunctionValue>(make_comparison_function(std::less_equal<double>()),
+                                             Primitive::LessEqual));
 
 // abs
     auto abs_function_pointer = [](size_t argc, std::vector<ValuePtr> &argv) {
@@ -149,6 +248,9 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
     auto quotient_function_pointer = [](size_t argc, std::vector<ValuePtr> &argv) {
         auto a = std::static_pointer_cast<IntegerValue>(argv[0]);
         auto b = std::static_pointer_cast<IntegerValue>(argv[1]);
+        if (b->get_value() == 0) {
+            throw std::runtime_error("Division by zero");
+        }
         return std::static_pointer_cast<Value>(std::make_shared<IntegerValue>(a->get_value() / b->get_value()));
     };
     set("quotient", std::make_shared<FunctionValue>(quotient_function_pointer));
@@ -157,6 +259,9 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
     auto remainder_function_pointer = [](size_t argc, std::vector<ValuePtr> &argv) {
         auto a = std::static_pointer_cast<IntegerValue>(argv[0]);
         auto b = std::static_pointer_cast<IntegerValue>(argv[1]);
+        if (b->get_value() == 0) {
+            throw std::runtime_error("Division by zero");
+        }
         return std::static_pointer_cast<Value>(std::make_shared<IntegerValue>(a->get_value() % b->get_value()));
     };
     set("remainder", std::make_shared<FunctionValue>(remainder_function_pointer));
@@ -247,7 +352,7 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
         }
         return std::static_pointer_cast<Value>(list);
     };
-    set("cons", std::make_shared<FunctionValue>(cons_function_pointer));
+    set("cons", std::make_shared<FunctionValue>(cons_function_pointer, Primitive::Cons));
 
 // concat
     auto concat_function_pointer = [](size_t argc, std::vector<ValuePtr> &argv) {
@@ -276,7 +381,7 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
     set("zero?", std::make_shared<FunctionValue>([number_comparison_function, zero_comparison](auto &&PH1, auto &&PH2) {
         return number_comparison_function(zero_comparison, std::forward<decltype(PH1)>(PH1),
                                           std::forward<decltype(PH2)>(PH2));
-    }));
+    }, Primitive::IsZero));
 
     auto positive_comparison = [](double n) {
         return n > 0;
@@ -337,7 +442,7 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
         }// return ! is true
         return std::static_pointer_cast<Value>(std::make_shared<BoolValue>(!argv[0]->is_true()));
     };
-    set("not", std::make_shared<FunctionValue>(not_function_pointer));
+    set("not", std::make_shared<FunctionValue>(not_function_pointer, Primitive::Not));
 
 // pair? (or more like list?)
     auto pair_queston_function_pointer = [](size_t argc, std::vector<ValuePtr> &argv) {
@@ -349,14 +454,14 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
     auto car_function_pointer = [](size_t argc, const std::vector<ValuePtr> &argv) {
         return car<Value>(argv[0]);
     };
-    set("car", std::make_shared<FunctionValue>(car_function_pointer));
+    set("car", std::make_shared<FunctionValue>(car_function_pointer, Primitive::Car));
 
 
 // cdr
     auto cdr_function_pointer = [](size_t argc, const std::vector<ValuePtr> &argv) {
         return std::static_pointer_cast<Value>(cdr(argv[0]));
     };
-    set("cdr", std::make_shared<FunctionValue>(cdr_function_pointer));
+    set("cdr", std::make_shared<FunctionValue>(cdr_function_pointer, Primitive::Cdr));
 
 // set-car!
     auto set_car_bang_function_pointer = [](size_t argc, std::vector<ValuePtr> &argv) {
@@ -387,7 +492,7 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
                 std::make_shared<BoolValue>(argv[0]->get_type() == ValueType::List && argv[0]->to_string() == "()"));
     };
 
-    set("null?", std::make_shared<FunctionValue>(null_question_function_pointer));
+    set("null?", std::make_shared<FunctionValue>(null_question_function_pointer, Primitive::IsNull));
 
 // length
     set("length", std::make_shared<FunctionValue>(count_function_pointer));
@@ -399,7 +504,7 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
 //string->symbol
     auto string_to_symbol_function_pointer = [](size_t argc, std::vector<ValuePtr> &argv) {
         auto string = std::static_pointer_cast<StringValue>(argv[0]);
-        return std::static_pointer_cast<Value>(std::make_shared<SymbolValue>(string->get_value()));
+        return std::static_pointer_cast<Value>(SymbolValue::intern(string->get_value()));
     };
     set("string->symbol", std::make_shared<FunctionValue>(string_to_symbol_function_pointer));
 
@@ -547,7 +652,7 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
             for (int i = 0; i < list->size(); i++) {
                 std::vector<ValuePtr> args;
                 args.push_back(list->get_value(i));
-                newlist->add_value(apply_fn(func, args));
+                newlist->add_value(apply_fn(*func, args));
             }
             return std::static_pointer_cast<Value>(newlist);
         }
@@ -572,7 +677,7 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
             for (int i = 0; i < list->size(); i++) {
                 std::vector<ValuePtr> args;
                 args.push_back(list->get_value(i));
-                apply_fn(func, args);
+                apply_fn(*func, args);
             }
             return std::static_pointer_cast<Value>(std::make_shared<NilValue>());
         }
@@ -586,6 +691,48 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
     };
     set("for-each", std::make_shared<FunctionValue>(for_each_function_pointer));
 
+// filter, fold and streams
+    set("filter", std::make_shared<FunctionValue>(filter_function));
+    set("fold", std::make_shared<FunctionValue>(fold_function));
+    set("list->stream", stream_procedure(StreamOperation::FromList));
+    set("stream-map", stream_procedure(StreamOperation::Map));
+    set("stream-filter", stream_procedure(StreamOperation::Filter));
+    set("stream->list", stream_procedure(StreamOperation::ToList));
+    set("stream-fold", stream_procedure(StreamOperation::Fold));
+    set("stream-for-each", stream_procedure(StreamOperation::ForEach));
+    set("stream?", std::make_shared<FunctionValue>(stream_question_function));
+
+// call-with-current-continuation, call/cc
+    auto call_cc = std::make_shared<FunctionValue>(call_with_current_continuation, Primitive::CallCC);
+    set("call-with-current-continuation", call_cc);
+    set("call/cc", call_cc);
+
+// multiple values
+    set("values", std::make_shared<FunctionValue>(values_function));
+    set("call-with-values", std::make_shared<FunctionValue>(call_with_values_function));
+
+// eval and read
+    set("eval", std::make_shared<FunctionValue>(eval_function));
+    set("interaction-environment", std::make_shared<FunctionValue>(interaction_environment_function));
+    set("read", std::make_shared<FunctionValue>(read_function));
+
+// exceptions
+    set("raise", raise_procedure());
+    set("raise-continuable", std::make_shared<FunctionValue>(raise_continuable_function, Primitive::RaiseContinuable));
+    set("with-exception-handler", std::make_shared<FunctionValue>(with_exception_handler_function));
+    set("error", std::make_shared<FunctionValue>(error_function, Primitive::Error));
+    set("error-object?", std::make_shared<FunctionValue>(error_object_question_function));
+    set("error-object-message", std::make_shared<FunctionValue>(error_object_message_function));
+    set("error-object-irritants", std::make_shared<FunctionValue>(error_object_irritants_function));
+
+// green threads and channels
+    set("spawn", std::make_shared<FunctionValue>(spawn_function, Primitive::Spawn));
+    set("yield", std::make_shared<FunctionValue>(yield_function, Primitive::Yield));
+    set("join", std::make_shared<FunctionValue>(join_function, Primitive::Join));
+    set("make-channel", std::make_shared<FunctionValue>(make_channel_function));
+    set("channel-send", std::make_shared<FunctionValue>(channel_send_function));
+    set("channel-receive", std::make_shared<FunctionValue>(channel_receive_function, Primitive::Receive));
+
 
 //    Two structured mutable objects are operationally equivalent
 //    if they have operationally equivalent values in corresponding positions,
@@ -612,8 +759,8 @@ BaseEnvironment::BaseEnvironment() : Environment(nullptr) {
 
         if (argv[0]->get_type() == ValueType::Symbol) {
             return std::static_pointer_cast<Value>(std::make_shared<BoolValue>(
-                    std::static_pointer_cast<SymbolValue>(argv[0])->to_string() ==
-                    std::static_pointer_cast<SymbolValue>(argv[1])->to_string()));
+                    std::static_pointer_cast<SymbolValue>(argv[0])->get_id() ==
+                    std::static_pointer_cast<SymbolValue>(argv[1])->get_id()));
         }
         if (argv[0]->get_type() == ValueType::Nil) {
             return std::static_pointer_cast<Value>(std::make_shared<BoolValue>(true));
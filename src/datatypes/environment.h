@@ -6,11 +6,18 @@
 #include <string>
 #include <sstream>
 #include <fstream>
-#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
 #include <iostream>
 
 class Environment : public Value {
 public:
+    void set(SymbolId key, const std::shared_ptr<Value> &value);
+
     void set(const std::string &key, const std::shared_ptr<Value> &value);
 
     Environment() : Value(ValueType::Environment), outer(nullptr) {
@@ -19,29 +26,112 @@ public:
     explicit Environment(std::shared_ptr<Environment> outer) : Value(ValueType::Environment), outer(outer) {
     }
 
-    Environment(std::shared_ptr<Environment> outer, const std::shared_ptr<ListValue> &binds,
-                const std::shared_ptr<ListValue> &exprs);
+    // frame with slots for the local variables of a lambda (or a top level let), see scope.h
+    Environment(std::shared_ptr<Environment> outer, size_t frame_size) : Value(ValueType::Environment),
+                                                                         outer(std::move(outer)) {
+        if (frame_size > INLINE_SLOTS) {
+            overflow_slots.resize(frame_size - INLINE_SLOTS);
+        }
+    }
+
+    // frame of a call or of the captures of a closure (see scope.h), it comes from a pool of this thread that recycles
+    // the memory of the frames that were freed
+    static std::shared_ptr<Environment> make_local_frame(std::shared_ptr<Environment> outer, size_t frame_size);
+
+    std::shared_ptr<Value> &slot(size_t index) {
+        return index < INLINE_SLOTS ? inline_slots[index] : overflow_slots[index - INLINE_SLOTS];
+    }
+
+    // slot of a frame depth frames out of this one
+    std::shared_ptr<Value> &slot(size_t depth, size_t index) {
+        Environment *frame = this;
+        for (size_t i = 0; i < depth; ++i) {
+            frame = frame->outer.get();
+        }
+        return frame->slot(index);
+    }
 
 
+    std::shared_ptr<Value> get(SymbolId key) const;
+
+    // cell of the nearest binding of the key, nullptr if it is not bound
+    std::shared_ptr<Value> *find_cell(SymbolId key);
+
     std::shared_ptr<Value> get(const std::string &key) const;
 
     std::shared_ptr<Environment> find(const std::string &key);
 
     std::shared_ptr<Environment> get_outer() const;
 
+    void update_existing(SymbolId key, const std::shared_ptr<Value> &value);
+
     void update_existing(const std::string &key, const std::shared_ptr<Value> &value);
 
+    // names that forms defined or set! in this global environment, the optimizer does not fold calls of them (see
+    // optimizer.h), nullptr for the frames of lambdas and lets
+    virtual std::unordered_set<SymbolId> *assigned_names() {
+        return nullptr;
+    }
+
+    // changes whenever a new binding is added to any environment, a binding found before may be shadowed by it
+    static std::uint64_t binding_epoch() {
+        return binding_epoch_.load(std::memory_order_acquire);
+    }
+
 protected:
-    std::map<std::string, std::shared_ptr<Value> > data;
+    static std::atomic<std::uint64_t> binding_epoch_;
+
+    // frames of small lambdas keep their slots inline, so making one is a single allocation
+    static constexpr size_t INLINE_SLOTS = 4;
+
+    std::unordered_map<SymbolId, std::shared_ptr<Value> > data;
     std::shared_ptr<Environment> outer;
+    std::array<std::shared_ptr<Value>, INLINE_SLOTS> inline_slots;
+    std::vector<std::shared_ptr<Value> > overflow_slots;
 
 
 };
 
-class BaseEnvironment : public Environment {
+// Inline cache of a global variable reference. The cell of a binding never moves (nodes of an unordered_map are
+// stable and bindings are never removed) and set! or a repeated define only change its value, so the cached cell
+// stays valid until a new binding is added somewhere. The cache assumes that the reference is always looked up
+// from environments of the same global environment, which holds for nodes and bytecode made by one eval call.
+// Threads that load a file (see loader.h) share the caches of its code: the cell is published before the epoch,
+// and every thread that fills a cache in the same epoch finds the same cell.
+class GlobalCache {
+    std::atomic<std::shared_ptr<Value> *> cell_{nullptr};
+    std::atomic<std::uint64_t> epoch_{0};
+public:
+    GlobalCache() = default;
+
+    // caches are only copied while the code that holds them is built
+    GlobalCache(const GlobalCache &other) : cell_(other.cell_.load(std::memory_order_relaxed)),
+                                            epoch_(other.epoch_.load(std::memory_order_relaxed)) {
+    }
 
+    const std::shared_ptr<Value> &lookup(Environment &env, SymbolId key) {
+        auto epoch = Environment::binding_epoch();
+        if (epoch_.load(std::memory_order_acquire) != epoch) {
+            auto *cell = env.find_cell(key);
+            if (cell == nullptr) {
+                throw std::runtime_error("Symbol " + SymbolValue::from_id(key)->to_string() + " not found");
+            }
+            cell_.store(cell, std::memory_order_relaxed);
+            epoch_.store(epoch, std::memory_order_release);
+            return *cell;
+        }
+        return *cell_.load(std::memory_order_relaxed);
+    }
+};
+
+class BaseEnvironment : public Environment {
+    std::unordered_set<SymbolId> assigned_names_;
 public:
     BaseEnvironment();
+
+    std::unordered_set<SymbolId> *assigned_names() override {
+        return &assigned_names_;
+    }
 };
 
 #endif //SCHEME_ENVIRONMENT_H
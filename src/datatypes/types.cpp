@@ -1,4 +1,7 @@
 #include "types.h"
+#include <deque>
+#include <mutex>
+#include <unordered_map>
 
 void ListValue::add_value(const std::shared_ptr<Value> &value) {
     values.push_back(value);
@@ -38,19 +41,117 @@ IntegerValue::IntegerValue(std::int64_t value) : NumberValue(ValueType::Integer)
 }
 
 
+namespace {
+    class SymbolTable {
+        // every spelling that was interned, so that reading the same spelling again is a single lookup
+        std::unordered_map<std::string, std::shared_ptr<SymbolValue> > by_spelling;
+        // the symbols by id, together with the name their value points to
+        std::deque<std::pair<std::string, std::shared_ptr<SymbolValue> > > by_id;
+        // string->symbol and read intern while the threads that load a file run (see loader.h)
+        mutable std::mutex mutex;
+
+    public:
+        SymbolTable() {
+            for (const auto *name: {"define", "let*", "letrec", "let", "quote", "lambda", "begin", "set!", "if",
+                                    "cond", "do", "define-syntax", "case", "receive", "guard"}) {
+                intern(name);
+            }
+        }
+
+        std::shared_ptr<SymbolValue> intern(const std::string &spelling) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = by_spelling.find(spelling);
+            if (found != by_spelling.end()) {
+                return found->second;
+            }
+            std::string name = spelling;
+            for (auto &c: name) {
+                c = static_cast<char>(std::tolower(c));
+            }
+            auto existing = name == spelling ? by_spelling.end() : by_spelling.find(name);
+            if (existing != by_spelling.end()) {
+                by_spelling.emplace(spelling, existing->second);
+                return existing->second;
+            }
+            auto &entry = by_id.emplace_back(name, nullptr);
+            entry.second = std::make_shared<SymbolValue>(static_cast<SymbolId>(by_id.size() - 1), &entry.first);
+            by_spelling.emplace(name, entry.second);
+            if (name != spelling) {
+                by_spelling.emplace(spelling, entry.second);
+            }
+            return entry.second;
+        }
+
+        std::shared_ptr<SymbolValue> from_id(SymbolId id) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return by_id.at(id).second;
+        }
+    };
+
+    SymbolTable &symbol_table() {
+        static SymbolTable table;
+        return table;
+    }
+}
+
+std::shared_ptr<SymbolValue> SymbolValue::intern(const std::string &name) {
+    return symbol_table().intern(name);
+}
+
+std::shared_ptr<SymbolValue> SymbolValue::from_id(SymbolId id) {
+    return symbol_table().from_id(id);
+}
+
 std::string SymbolValue::to_string() const {
-    return value;
+    return *value;
+}
+
+ListValue::~ListValue() {
+    // nested lists that only this list refers to are destroyed one after another instead of recursively,
+    // a list nested a million times deep would overflow the C++ stack otherwise
+    std::vector<std::shared_ptr<Value> > pending;
+    auto release = [&pending](std::vector<std::shared_ptr<Value> > &values) {
+        for (auto &value: values) {
+            if (value != nullptr && value->get_type() == ValueType::List && value.use_count() == 1) {
+                pending.push_back(std::move(value));
+            }
+        }
+    };
+    release(values);
+    while (!pending.empty()) {
+        auto list = std::move(pending.back());
+        pending.pop_back();
+        // list has no nested lists left when it is destroyed at the end of the iteration
+        release(static_cast<ListValue &>(*list).values);
+    }
 }
 
 std::string ListValue::to_string() const {
+    // nested lists are printed with an explicit stack of the lists being printed, so that a deeply nested list
+    // does not overflow the C++ stack
     std::string result = "(";
-    for (auto &value: values) {
-        result += value->to_string() + " ";
-    }
-    if (result.size() > 1) {
-        result.pop_back();
+    std::vector<std::pair<const ListValue *, size_t> > pending{{this, 0}};
+    while (!pending.empty()) {
+        auto &[list, index] = pending.back();
+        if (index == list->values.size()) {
+            if (result.back() == ' ') {
+                result.pop_back();
+            }
+            result += ")";
+            pending.pop_back();
+            if (!pending.empty()) {
+                result += " ";
+            }
+            continue;
+        }
+        const auto &value = list->values[index++];
+        if (value->get_type() == ValueType::List) {
+            result += "(";
+            pending.emplace_back(static_cast<const ListValue *>(value.get()), 0);
+        } else {
+            result += value->to_string() + " ";
+        }
     }
-    result += ")";
     return result;
 }
 
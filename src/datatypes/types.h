@@ -9,7 +9,7 @@
 #define SCHEME_TYPES_H
 
 enum class ValueType {
-    List, String, Bool, Integer, Float, Function, Symbol, Nil, Closure, Environment
+    List, String, Bool, Integer, Float, Function, Symbol, Nil, Closure, Environment, Thread, Channel, Macro, Box, Values, Error, Stream
 };
 
 
@@ -60,6 +60,8 @@ public:
                                                                       values(std::move(values)) {
     }
 
+    ~ListValue() override;
+
     [[nodiscard]] std::string to_string() const override;
 
     void add_value(const std::shared_ptr<Value> &value);
@@ -80,13 +82,37 @@ public:
 
 };
 
+using SymbolId = std::uint32_t;
+
+// Symbols the evaluator dispatches on. They are interned before any other symbol, in this order,
+// so their ids are known at compile time and special forms can be found with a switch.
+enum class SpecialForm : SymbolId {
+    Define, LetStar, Letrec, Let, Quote, Lambda, Begin, Set, If, Cond, Do, DefineSyntax, Case, Receive, Guard,
+    // number of special forms, not a symbol
+    Count
+};
+
+// Symbols are interned: there is only one SymbolValue for each name (case insensitive), so symbols can be
+// compared by their id and environments can be keyed by it.
 class SymbolValue : public Value {
-    std::string value;
+    SymbolId id;
+    // lower case name, owned by the symbol table
+    const std::string *value;
 public:
-    explicit SymbolValue(std::string value) : Value(ValueType::Symbol), value(std::move(value)) {
-        for (auto &c: this->value) {
-            c = std::tolower(c);
-        }
+    SymbolValue(SymbolId id, const std::string *value) : Value(ValueType::Symbol), id(id), value(value) {
+    }
+
+    // returns the symbol with the name, creating it on first use
+    static std::shared_ptr<SymbolValue> intern(const std::string &name);
+
+    static std::shared_ptr<SymbolValue> from_id(SymbolId id);
+
+    [[nodiscard]] SymbolId get_id() const {
+        return id;
+    }
+
+    [[nodiscard]] const std::string &get_symbol_name() const {
+        return *value;
     }
 
     [[nodiscard]] std::string to_string() const override;
@@ -103,19 +129,34 @@ protected:
 using FunctionSharedPointer = std::function<std::shared_ptr<Value>(size_t, std::vector<std::shared_ptr<Value> > &)>;
 // with
 
+// Builtins that the evaluators can apply without calling the function, see primitives.h.
+// The builtins from CallCC on have no fast path, the vm handles them itself (see continuation.h, threads.h and
+// exceptions.h).
+enum class Primitive : std::uint8_t {
+    None, Add, Subtract, Multiply, Divide, Equal, Less, Greater, LessEqual, GreaterEqual,
+    Car, Cdr, Cons, IsNull, Not, IsZero, CallCC, Continuation, Spawn, Yield, Join, Receive, Raise, RaiseContinuable,
+    Error
+};
+
 class FunctionValue : public Value {
 public:
-    explicit FunctionValue(FunctionSharedPointer function) : Value(ValueType::Function), function(std::move(function)) {
+    explicit FunctionValue(FunctionSharedPointer function, Primitive primitive = Primitive::None)
+            : Value(ValueType::Function), function(std::move(function)), primitive(primitive) {
     }
 
-    [[nodiscard]] FunctionSharedPointer get_function() const {
+    [[nodiscard]] const FunctionSharedPointer &get_function() const {
         return function;
     }
 
+    [[nodiscard]] Primitive get_primitive() const {
+        return primitive;
+    }
+
     [[nodiscard]] std::string to_string() const override;
 
 private:
     FunctionSharedPointer function{nullptr};
+    Primitive primitive;
 
 };
 
@@ -189,6 +230,15 @@ public:
 };
 
 
+// Cell of a local variable that closures share because it is assigned after they copied it (see scope.h).
+// Only frames and closure environments hold boxes, programs never see one.
+class BoxValue : public Value {
+public:
+    std::shared_ptr<Value> value;
+
+    explicit BoxValue(std::shared_ptr<Value> value) : Value(ValueType::Box), value(std::move(value)) {
+    }
+};
 
 // class Complex : public Number {}; # TODO
 // class Rational : public Number {};
@@ -0,0 +1,234 @@
+#include "eval_cache.h"
+#include "analyzer.h"
+#include "compiler.h"
+#include "evaluator.h"
+#include "macros.h"
+#include "optimizer.h"
+#include "reader.h"
+#include "vm.h"
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+namespace {
+    size_t combine(size_t seed, size_t value) {
+        return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+    }
+
+    // the list a (quote list) form quotes, nullptr for other forms
+    const Value *quoted_list(const ListValue &list) {
+        if (list.size() == 2 && list.get_value(0)->get_type() == ValueType::Symbol &&
+            static_cast<const SymbolValue &>(*list.get_value(0)).get_id() == static_cast<SymbolId>(SpecialForm::Quote) &&
+            list.get_value(1)->get_type() == ValueType::List) {
+            return list.get_value(1).get();
+        }
+        return nullptr;
+    }
+
+    struct Context {
+        EnvironmentPtr env;
+        bool vm = false;
+    };
+
+    thread_local Context context;
+
+    // a form evaluated before in an environment, with what either engine made of it
+    struct CachedForm {
+        std::weak_ptr<Environment> env;
+        ValuePtr form;
+        NodePtr node;
+        PrototypePtr prototype;
+    };
+
+    // forms by the hash of their structure and environment
+    thread_local std::unordered_map<size_t, std::vector<CachedForm> > cache;
+    thread_local size_t cached_forms = 0;
+
+    CachedForm &cached_form(const ValuePtr &form, const EnvironmentPtr &env) {
+        auto hash = combine(hash_form(*form, QuotedLists::Identical), std::hash<const Environment *>{}(env.get()));
+        auto &forms = cache[hash];
+        for (auto &cached: forms) {
+            if (cached.env.lock() == env && same_form(cached.form, form, QuotedLists::Identical)) {
+                return cached;
+            }
+        }
+        if (cached_forms >= EVAL_CACHE_CAPACITY) {
+            cache.clear();
+            cached_forms = 0;
+            return cached_form(form, env);
+        }
+        ++cached_forms;
+        forms.push_back({env, copy_form(form, QuotedLists::Identical), nullptr, nullptr});
+        return forms.back();
+    }
+}
+
+size_t hash_form(const Value &form, QuotedLists quoted) {
+    auto type = static_cast<size_t>(form.get_type());
+    switch (form.get_type()) {
+        case ValueType::Symbol:
+            return combine(type, static_cast<const SymbolValue &>(form).get_id());
+        case ValueType::Integer:
+            return combine(type, std::hash<std::int64_t>{}(static_cast<const IntegerValue &>(form).get_value()));
+        case ValueType::Float:
+            return combine(type, std::bit_cast<std::uint64_t>(static_cast<const FloatValue &>(form).get_value()));
+        case ValueType::String:
+            return combine(type, std::hash<std::string>{}(static_cast<const StringValue &>(form).get_value()));
+        case ValueType::Bool:
+            return combine(type, form.is_true());
+        case ValueType::Nil:
+            return type;
+        case ValueType::List: {
+            const auto &list = static_cast<const ListValue &>(form);
+            size_t hash = combine(type, list.size());
+            const auto *data = quoted_list(list);
+            if (data != nullptr && quoted == QuotedLists::Identical) {
+                return combine(hash, std::hash<const Value *>{}(data));
+            }
+            for (size_t i = 0; i < list.size(); ++i) {
+                hash = combine(hash, hash_form(*list.get_value(i), quoted));
+            }
+            return hash;
+        }
+        default:
+            // procedures and other objects put into generated code are the same only if they are identical
+            return combine(type, std::hash<const Value *>{}(&form));
+    }
+}
+
+bool same_form(const ValuePtr &a, const ValuePtr &b, QuotedLists quoted) {
+    if (a == b) {
+        return true;
+    }
+    if (a->get_type() != b->get_type()) {
+        return false;
+    }
+    switch (a->get_type()) {
+        case ValueType::Symbol:
+            return static_cast<const SymbolValue &>(*a).get_id() == static_cast<const SymbolValue &>(*b).get_id();
+        case ValueType::Integer:
+            return static_cast<const IntegerValue &>(*a).get_value() ==
+                   static_cast<const IntegerValue &>(*b).get_value();
+        case ValueType::Float:
+            // the bits, so that 0.0 and -0.0 are different forms and a NaN is the same form as itself
+            return std::bit_cast<std::uint64_t>(static_cast<const FloatValue &>(*a).get_value()) ==
+                   std::bit_cast<std::uint64_t>(static_cast<const FloatValue &>(*b).get_value());
+        case ValueType::String:
+            return static_cast<const StringValue &>(*a).get_value() ==
+                   static_cast<const StringValue &>(*b).get_value();
+        case ValueType::Bool:
+            return a->is_true() == b->is_true();
+        case ValueType::Nil:
+            return true;
+        case ValueType::List: {
+            const auto &first = static_cast<const ListValue &>(*a);
+            const auto &second = static_cast<const ListValue &>(*b);
+            if (first.size() != second.size()) {
+                return false;
+            }
+            const auto *first_data = quoted_list(first);
+            const auto *second_data = quoted_list(second);
+            if (quoted == QuotedLists::Identical && (first_data != nullptr || second_data != nullptr)) {
+                return first_data == second_data;
+            }
+            for (size_t i = 0; i < first.size(); ++i) {
+                if (!same_form(first.get_value(i), second.get_value(i), quoted)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+ValuePtr copy_form(const ValuePtr &form, QuotedLists quoted) {
+    if (form->get_type() != ValueType::List) {
+        return form;
+    }
+    const auto &list = static_cast<const ListValue &>(*form);
+    if (quoted == QuotedLists::Identical && quoted_list(list) != nullptr) {
+        return form;
+    }
+    std::vector<ValuePtr> values;
+    values.reserve(list.size());
+    for (size_t i = 0; i < list.size(); ++i) {
+        values.push_back(copy_form(list.get_value(i), quoted));
+    }
+    return std::make_shared<ListValue>(std::move(values));
+}
+
+EvalContext::EvalContext(const EnvironmentPtr &env, bool vm)
+        : outer_env_(std::move(context.env)), outer_vm_(context.vm) {
+    context.env = env;
+    context.vm = vm;
+}
+
+EvalContext::~EvalContext() {
+    context.env = std::move(outer_env_);
+    context.vm = outer_vm_;
+}
+
+size_t eval_cache_size() {
+    return cached_forms;
+}
+
+ValuePtr eval_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (eval expr-or-def environment-specifier) procedure
+//    If expr-or-def is an expression, it is evaluated in the specified environment and its values are returned.
+//    If it is a definition, the specified identifier(s) are defined in the specified environment.
+    if (argc == 0 || argc > 2) {
+        throw std::runtime_error("eval: expected an expression and an optional environment");
+    }
+    auto env = context.env;
+    if (argc == 2) {
+        if (argv[1]->get_type() != ValueType::Environment) {
+            throw std::runtime_error("eval: " + argv[1]->to_string() + " is not an environment");
+        }
+        env = std::static_pointer_cast<Environment>(argv[1]);
+    }
+    if (env == nullptr) {
+        throw std::runtime_error("eval: no environment to evaluate in");
+    }
+    auto &cached = cached_form(argv[0], env);
+    // the cached code may be replaced while it runs (the cache is cleared by an eval inside of it)
+    if (context.vm) {
+        if (cached.prototype == nullptr) {
+            cached.prototype = compile(optimize(expand_macros(argv[0], env), env));
+        }
+        auto prototype = cached.prototype;
+        VM vm;
+        return vm.execute(prototype, env);
+    }
+    if (cached.node == nullptr) {
+        cached.node = analyze(optimize(expand_macros(argv[0], env), env), env);
+    }
+    auto node = cached.node;
+    return run(node.get(), env);
+}
+
+ValuePtr interaction_environment_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (interaction-environment) procedure
+//    This procedure returns a specifier for a mutable environment that contains an implementation-defined set of
+//    bindings, typically a superset of those exported by (scheme base).
+    std::string name = "interaction-environment";
+    check_arity(name, 0, argc);
+    if (context.env == nullptr) {
+        throw std::runtime_error("interaction-environment: no top level form is being evaluated");
+    }
+    return context.env;
+}
+
+ValuePtr read_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (read string)
+//    Returns the first datum of the string, the way the reader reads programs (R7RS reads from a port instead).
+    std::string name = "read";
+    check_arity(name, 1, argc);
+    if (argv[0]->get_type() != ValueType::String) {
+        throw std::runtime_error("read: " + argv[0]->to_string() + " is not a string");
+    }
+    return read_string(static_cast<const StringValue &>(*argv[0]).get_value());
+}
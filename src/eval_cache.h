@@ -0,0 +1,62 @@
+#ifndef SCHEME_EVAL_CACHE_H
+#define SCHEME_EVAL_CACHE_H
+
+#include "util.h"
+#include <vector>
+
+// Evaluating data as code: (eval expression [environment]), (interaction-environment) and (read string).
+//
+// eval evaluates the expression as a top level form of the global environment of the form that calls it (or of the
+// environment given), with the engine that runs that form. Programs that generate their expressions tend to evaluate
+// the same few shapes over and over, so the form is not expanded, optimized and analyzed (or compiled) again each
+// time: the result is cached under a structural hash of the expression and the environment, and an expression equal
+// to one evaluated before (the same list structure, symbols and constants) runs the cached nodes or prototype.
+// A quoted list is data the code returns, so it only matches the identical list. The cache keeps a copy of the code
+// of the expression, changing the list afterwards does not change what is cached.
+// Like a lambda, a cached form keeps what macro expansion and constant folding made of it when it was first
+// evaluated. The cache belongs to the thread and is cleared when it holds EVAL_CACHE_CAPACITY forms.
+
+constexpr size_t EVAL_CACHE_CAPACITY = 4096;
+
+// the global environment and the engine the eval builtin uses while a top level form runs,
+// eval and vm_eval make one for their form and the outer one is restored when they return
+class EvalContext {
+    EnvironmentPtr outer_env_;
+    bool outer_vm_;
+public:
+    EvalContext(const EnvironmentPtr &env, bool vm);
+
+    ~EvalContext();
+
+    EvalContext(const EvalContext &) = delete;
+
+    EvalContext &operator=(const EvalContext &) = delete;
+};
+
+// how forms compare the lists they quote: the code the eval cache keeps returns the quoted list itself, so it needs the
+// identical list, while the watcher compares the text of the program
+enum class QuotedLists {
+    Identical, Equal
+};
+
+// hash of the structure of a form, forms that are the same (see same_form) have the same hash
+size_t hash_form(const Value &form, QuotedLists quoted);
+
+// the forms are the same list structure with the same symbols and constants (floats by their bits), other objects in
+// them are identical
+bool same_form(const ValuePtr &a, const ValuePtr &b, QuotedLists quoted);
+
+// the form with its lists copied, so changing the lists of the form does not change the copy, quoted lists are
+// shared if they are compared by identity
+ValuePtr copy_form(const ValuePtr &form, QuotedLists quoted);
+
+// number of forms in the cache of the thread
+size_t eval_cache_size();
+
+ValuePtr eval_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr interaction_environment_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr read_function(size_t argc, std::vector<ValuePtr> &argv);
+
+#endif //SCHEME_EVAL_CACHE_H
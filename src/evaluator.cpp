@@ -1,88 +1,197 @@
 #include "util.h"
 #include "evaluator.h"
+#include "analyzer.h"
+#include "vm.h"
+#include "primitives.h"
+#include "jit.h"
+#include "numeric.h"
+#include "optimizer.h"
+#include "macros.h"
+#include "values.h"
+#include "exceptions.h"
+#include "eval_cache.h"
 #include "datatypes/closure.h"
 #include "datatypes/environment.h"
 #include "printer.h"
+#include <array>
 #include <string>
 #include <iostream>
-
-
-ValuePtr apply_fn(const std::shared_ptr<FunctionValue> &fn, std::vector<std::shared_ptr<Value> > args) {
-    return fn->get_function()(args.size(), args);
+#include <cstdint>
+#include <mutex>
+
+namespace {
+    // C++ stack position of the last call whose compiled code gave up because the recursion got too deep. The calls
+    // below it (the stack grows down) are nested in the interpreted call that replaced it: in compiled code they would
+    // only get as deep again and give up too, which would make deep recursion quadratic, so they are interpreted.
+    thread_local std::uintptr_t too_deep_at = 0;
 }
 
-ValuePtr Closure::call(const std::vector<ValuePtr> &args) {
-    // Create a new environment with the captured environment as the outer environment
-    EnvironmentPtr new_env = std::make_shared<Environment>(env_);
+ValuePtr apply_fn(const FunctionValue &fn, std::vector<ValuePtr> &args) {
+    return fn.get_function()(args.size(), args);
+}
 
-    // Bind the arguments to the formal parameters in the new environment
-    for (size_t i = 0; i < formal_params_->size(); ++i) {
-        new_env->set(formal_params_->get_value(i)->to_string(), args[i]);
+ValuePtr call_procedure(const ValuePtr &procedure, std::vector<ValuePtr> &args, const std::string &caller) {
+    if (procedure->get_type() == ValueType::Function) {
+        return apply_fn(static_cast<const FunctionValue &>(*procedure), args);
     }
-
-    // Evaluate the body of the Closure with the new environment
-    // evaluate all bodies and return the last one
-    // for each expression in body
-    auto body_list = std::static_pointer_cast<ListValue>(body_);
-    for (int i = 0; i < body_list->size() - 1; ++i) {
-        eval(body_list->get_value(i), new_env);
+    if (procedure->get_type() == ValueType::Closure) {
+        return std::static_pointer_cast<Closure>(procedure)->call(args);
     }
-    return eval(body_list->get_value(body_list->size() - 1), new_env);
+    throw std::runtime_error(caller + ": " + procedure->to_string() + " is not a function");
 }
 
-std::shared_ptr<Value> eval_ast(const ValuePtr &value, const EnvironmentPtr &env) {
-    if (value->get_type() == ValueType::List) {
-        auto list = std::static_pointer_cast<ListValue>(value);
-        auto list_with_evaluated_content = std::make_shared<ListValue>();
-        for (size_t i = 0; i < list->size(); ++i) {
-            list_with_evaluated_content->add_value(eval(list->get_value(i), env));
-        }
-        return list_with_evaluated_content;
-    } else if (value->get_type() == ValueType::Symbol) {
-        return env->get(std::static_pointer_cast<SymbolValue>(value)->to_string());
+EnvironmentPtr Closure::make_frame(const std::vector<ValuePtr> &args) const {
+    if (formal_params_->size() != args.size()) {
+        std::string name = "lambda";
+        check_arity(name, formal_params_->size(), args.size());
+    }
+    // Create a new frame with the captured environment as the outer environment, closures made by the call copy
+    // what they use out of it, so nothing refers to it after the call returns
+    EnvironmentPtr new_env = Environment::make_local_frame(env_, frame_size_);
 
-    } else {
-        return value;
+    // Bind the arguments to the formal parameters, they are the first slots of the frame
+    for (size_t i = 0; i < args.size(); ++i) {
+        new_env->slot(i) = args[i];
     }
+    return new_env;
 }
 
+EnvironmentPtr make_closure_env(const EnvironmentPtr &frame, size_t depth, const std::vector<LexicalAddress> &captures) {
+    auto outer = frame;
+    for (size_t i = 0; i < depth; ++i) {
+        outer = outer->get_outer();
+    }
+    if (captures.empty()) {
+        return outer;
+    }
+    auto env = Environment::make_local_frame(std::move(outer), captures.size());
+    for (size_t i = 0; i < captures.size(); ++i) {
+        // a boxed variable is shared with the box, others are copied
+        env->slot(i) = frame->slot(captures[i].depth, captures[i].index);
+    }
+    return env;
+}
 
-std::pair<bool, ValuePtr> eval_list(ValuePtr &ast, EnvironmentPtr &env) {
-    auto resolved_list = std::static_pointer_cast<ListValue>(eval_ast(ast, env));
-    auto first = car<Value>(resolved_list);
-    if (first->get_type() == ValueType::Function) {
-        auto function = car<FunctionValue>(resolved_list);
-        auto args = std::vector<ValuePtr>();
+ValuePtr Closure::call(const std::vector<ValuePtr> &args) {
+    if (prototype_ != nullptr) {
+        VM vm;
+        return vm.call(*this, args);
+    }
+    if (auto result = call_native(args)) {
+        return result;
+    }
+    // Evaluate the body of the Closure with the new environment
+    return run(body_.get(), make_frame(args));
+}
 
-        for (size_t i = 1; i < resolved_list->size(); ++i) {
-            args.push_back(resolved_list->get_value(i));
+ValuePtr Closure::call_native(const std::vector<ValuePtr> &args) {
+    if (body_ == nullptr || !jit_enabled() || (calls_.load(std::memory_order_relaxed) < JIT_THRESHOLD &&
+                                               calls_.fetch_add(1, std::memory_order_relaxed) + 1 < JIT_THRESHOLD)) {
+        return nullptr;
+    }
+    auto position = reinterpret_cast<std::uintptr_t>(__builtin_frame_address(0));
+    if (too_deep_at != 0) {
+        if (position < too_deep_at) {
+            return nullptr;
+        }
+        too_deep_at = 0;
+    }
+    // the compilers run one at a time
+    static std::mutex compiling;
+    // integer code is compiled to machine code, what it cannot run may still be specialized to unboxed numbers
+    if (!native_done_.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(compiling);
+        if (!native_done_.load(std::memory_order_relaxed)) {
+            native_ = compile_native(*this);
+            native_done_.store(true, std::memory_order_release);
+        }
+    }
+    bool too_deep = false;
+    if (native_ != nullptr) {
+        if (auto result = run_native(*native_, *this, args, too_deep)) {
+            return result;
+        }
+        if (too_deep) {
+            too_deep_at = position;
+            return nullptr;
         }
-        return std::make_pair(true, apply_fn(function, args));
+    }
+    if (!numeric_done_.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(compiling);
+        if (!numeric_done_.load(std::memory_order_relaxed)) {
+            numeric_ = specialize_numeric(*this, args);
+            numeric_done_.store(true, std::memory_order_release);
+        }
+    }
+    if (numeric_ == nullptr) {
+        return nullptr;
+    }
+    auto result = run_numeric(*numeric_, *this, args, too_deep);
+    if (too_deep) {
+        too_deep_at = position;
+    }
+    return result;
+}
 
-    } else if (first->get_type() == ValueType::Closure) {
+ValuePtr ConstantNode::execute(TailCall &tail) const {
+    return value_;
+}
 
+ValuePtr GlobalNode::execute(TailCall &tail) const {
+    return lookup(*tail.env);
+}
 
-        auto closure = car<Closure>(resolved_list);
-        auto args = cdr(resolved_list);
+ValuePtr LocalNode::execute(TailCall &tail) const {
+    const auto &value = tail.env->slot(address_.depth, address_.index);
+    // internal define that was not executed yet
+    if (value == nullptr) {
+        throw std::runtime_error("Symbol " + SymbolValue::from_id(name_)->to_string() + " not found");
+    }
+    return value;
+}
 
-        env = std::make_shared<Environment>(closure->get_env(), closure->get_formal_params(), args);
-        auto body_list = std::static_pointer_cast<ListValue>(closure->get_body());
-        for (int i = 0; i < body_list->size() - 1; ++i) {
-            eval(body_list->get_value(i), env);
-        }
-        // last expression in body
-        ast = body_list->get_value(body_list->size() - 1);
-        return std::make_pair(false, nullptr);
+ValuePtr LocalSetNode::execute(TailCall &tail) const {
+    auto value = run(value_.get(), tail.env);
+    tail.env->slot(address_.depth, address_.index) = value;
+    return value;
+}
 
-    } else {
-        throw std::runtime_error(
-                "eval error: " + car<Value>(resolved_list)->to_string() + " is not a function");
+ValuePtr BoxedLocalNode::execute(TailCall &tail) const {
+    const auto &value = static_cast<BoxValue &>(*tail.env->slot(address_.depth, address_.index)).value;
+    if (value == nullptr) {
+        throw std::runtime_error("Symbol " + SymbolValue::from_id(name_)->to_string() + " not found");
+    }
+    return value;
+}
 
+ValuePtr BoxedSetNode::execute(TailCall &tail) const {
+    auto value = run(value_.get(), tail.env);
+    static_cast<BoxValue &>(*tail.env->slot(address_.depth, address_.index)).value = value;
+    return value;
+}
+
+ValuePtr BoxNode::execute(TailCall &tail) const {
+    for (auto index: slots_) {
+        auto &slot = tail.env->slot(index);
+        slot = std::make_shared<BoxValue>(std::move(slot));
     }
+    tail.node = body_.get();
+    return nullptr;
+}
+
+ValuePtr DefineNode::execute(TailCall &tail) const {
+    auto result = run(value_.get(), tail.env);
+    tail.env->set(name_, result);
+    return result;
 }
 
+ValuePtr SetNode::execute(TailCall &tail) const {
+    auto value = run(value_.get(), tail.env);
+    tail.env->update_existing(name_, value);
+    return value;
+}
 
-void eval_if(ValuePtr &ast, const EnvironmentPtr &env, const std::shared_ptr<ListValue> &list_ast) {
+ValuePtr IfNode::execute(TailCall &tail) const {
 //                (if 〈test〉 〈consequent〉 〈alternate〉) syntax
 //                        (if 〈test〉 〈consequent〉) syntax
 //                Syntax: 〈Test〉, 〈consequent〉, and 〈alternate〉 may be arbitrary expressions.
@@ -92,17 +201,30 @@ void eval_if(ValuePtr &ast, const EnvironmentPtr &env, const std::shared_ptr<Lis
 //                value(s) is(are) returned. If 〈test〉 yields a false value and
 //                no 〈alternate〉 is specified, then the result of the expression
 //                is unspecified.
-    auto test = eval(car<Value>(cdr(list_ast)), env);
-    if (test->is_true()) {
-        ast = car<Value>(cdr(cdr(list_ast)));
+    if (run(test_.get(), tail.env)->is_true()) {
+        tail.node = consequent_.get();
     } else {
-        ast = car<Value>(cdr(cdr(cdr(list_ast))));
+        tail.node = alternate_.get();
     }
+    return nullptr;
 }
 
+ValuePtr SequenceNode::execute(TailCall &tail) const {
+//                (begin 〈expression1〉 〈expression2〉 . . . ) library syntax
+//                The 〈expression〉s are evaluated sequentially from left to
+//                right, and the value(s) of the last 〈expression〉 is(are) returned.
+//                This expression type is used to sequence side effects such as input and output.
+    if (body_.empty()) {
+        return std::make_shared<NilValue>();
+    }
+    for (size_t i = 0; i < body_.size() - 1; ++i) {
+        run(body_[i].get(), tail.env);
+    }
+    tail.node = body_.back().get();
+    return nullptr;
+}
 
-std::pair<bool, ValuePtr> eval_cond(ValuePtr &ast, const EnvironmentPtr &env, const std::shared_ptr<ListValue> &list_ast) {
-// returns a pair of bool and ValuePtr
+ValuePtr CondNode::execute(TailCall &tail) const {
 //   Each 〈clause〉 should be of the form
 //   (〈test〉 〈expression〉 . . . )
 //   where 〈test〉 is any expression. The last 〈clause〉 may be
@@ -115,139 +237,217 @@ std::pair<bool, ValuePtr> eval_cond(ValuePtr &ast, const EnvironmentPtr &env, co
 //   〈expression〉s in its 〈clause〉 are evaluated in order, and the
 //   result of the last 〈expression〉 in the 〈clause〉 is returned
 //   as the result of the entire cond expression.
-    auto clauses = cdr(list_ast);
-    bool tco = false;
-    for (int i = 0; i < clauses->size(); ++i) {
-        auto clause = std::static_pointer_cast<ListValue>(clauses->get_value(i));
-        auto test = car<Value>(clause);
-        // evaluate test
-        if (eval(test, env)->is_true()) {
-            if (clause->size() == 1) { return std::make_pair(false, std::make_shared<BoolValue>(true)); }
-            auto exprs = cdr(clause);
-            for (int j = 0; j < exprs->size() - 1; ++j) {
-                eval(exprs->get_value(j), env);
-
-            }
-            ast = exprs->get_value(exprs->size() - 1);
-            tco = true;
-            break;
+    for (const auto &clause: clauses_) {
+        if (run(clause.test.get(), tail.env)->is_true()) {
+            if (clause.body == nullptr) { return std::make_shared<BoolValue>(true); }
+            tail.node = clause.body.get();
+            return nullptr;
         }
-
     }
-    return std::make_pair(tco, nullptr);
+    return std::make_shared<NilValue>(); // result of the entire cond expression is unspecified
+}
 
+ValuePtr CaseNode::execute(TailCall &tail) const {
+//    A case expression is evaluated as follows. 〈Key〉 is evaluated and its result is compared against each 〈datum〉.
+//    If the result of evaluating 〈key〉 is equivalent (in the sense of eqv?) to a 〈datum〉, then the expressions in the
+//    corresponding 〈clause〉 are evaluated from left to right and the result of the last expression in the 〈clause〉
+//    is returned as the result of the case expression. If the result of evaluating 〈key〉 is different from every
+//    〈datum〉, then if there is an else clause its expressions are evaluated and the result of the last is the result
+//    of the case expression; otherwise the result of the case expression is unspecified.
+    auto clause = table_.select(*run(key_.get(), tail.env));
+    if (clause == bodies_.size()) {
+        return std::make_shared<NilValue>();
+    }
+    tail.node = bodies_[clause].get();
+    return nullptr;
 }
 
-void eval_let(ValuePtr &ast, EnvironmentPtr &env, const std::shared_ptr<ListValue> &list_ast) {
+ValuePtr LetNode::execute(TailCall &tail) const {
     //   create a new environment using the current environment as the outer value and then use the first parameter as a list_ast of new bindings in the "let*" environment.
     //   Take the second element of the binding list_ast, call EVAL using the new "let*" environment as the evaluation environment,
     //   then call set on the "let*" environment using the first binding list_ast element as the key and the evaluated second element as the value. This is repeated for each odd/even pair in the binding list_ast. Note in particular, the bindings earlier in the list_ast can be referred to by later bindings. Finally, the second parameter (third element) of the original let* form is evaluated using the new "let*" environment and the result is returned as the result of the let* (the new let environment is discarded upon completion).
-    auto outer = env;
-    auto new_env = std::make_shared<Environment>(outer);
-    auto bindings_list = car<ListValue>(cdr(list_ast));
-    auto body = cdr(cdr(list_ast));
-    //iterate each binding
-    for (int i = 0; i < bindings_list->size(); ++i) {
-        auto name = car<SymbolValue>(bindings_list->get_value(i));
-        auto second_param = cdr(bindings_list->get_value(i))->get_value(0);
-        auto value = eval(second_param, new_env);
-        new_env->set(name->to_string(), value);
+    //   Inside of a lambda the variables are slots of its frame, so only a let at the top level makes a new frame.
+    if (frame_size_ > 0) {
+        tail.env = std::make_shared<Environment>(tail.env, frame_size_);
+    }
+    for (auto index: boxes_) {
+        tail.env->slot(index) = std::make_shared<BoxValue>(nullptr);
+    }
+    for (const auto &[index, init]: bindings_) {
+        auto value = run(init.get(), tail.env);
+        auto &slot = tail.env->slot(index);
+        // a boxed variable keeps its box, which closures made by the initial values may share already
+        if (slot != nullptr && slot->get_type() == ValueType::Box) {
+            static_cast<BoxValue &>(*slot).value = std::move(value);
+        } else {
+            slot = std::move(value);
+        }
+    }
+    tail.node = body_.get();
+    return nullptr;
+}
+
+ValuePtr ReceiveNode::execute(TailCall &tail) const {
+    return receive(received_values(run(expression_.get(), tail.env), slots_.size()), tail);
+}
+
+ValuePtr ReceiveNode::receive(std::vector<ValuePtr> &values, TailCall &tail) const {
+    // at the top level the variables get a frame, inside of a lambda they are slots of its frame
+    if (frame_size_ > 0) {
+        tail.env = std::make_shared<Environment>(tail.env, frame_size_);
     }
-    // many expressions can follow the bindings
-    for (int i = 0; i < body->size() - 1; ++i) {
-        eval(body->get_value(i), new_env);
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        tail.env->slot(slots_[i]) = std::move(values[i]);
     }
-    ast = body->get_value(body->size() - 1);
-    env = new_env;
+    tail.node = body_.get();
+    return nullptr;
+}
 
+ValuePtr GuardNode::execute(TailCall &tail) const {
+    auto &handlers = handler_stack();
+    auto guard = handlers.size();
+    handlers.emplace_back();
+    ValuePtr condition;
+    try {
+        auto result = run(body_.get(), tail.env);
+        handlers.resize(guard);
+        return result;
+    } catch (ConditionRaised &raised) {
+        handlers.resize(guard);
+        if (raised.guard != guard) {
+            throw;
+        }
+        condition = std::move(raised.condition);
+    } catch (std::runtime_error &error) {
+        handlers.resize(guard);
+        condition = error_condition(error);
+    } catch (...) {
+        handlers.resize(guard);
+        throw;
+    }
+    std::vector<ValuePtr> values{std::move(condition)};
+    return handler_->receive(values, tail);
 }
 
-ValuePtr eval_lambda(const std::shared_ptr<ListValue> &list_ast, const EnvironmentPtr &env) {
+namespace {
+    // all the values are evaluated before any slot changes, a few of them without allocating
+    void assign_slots(const std::vector<std::pair<size_t, NodePtr> > &bindings, const EnvironmentPtr &from,
+                      Environment &to) {
+        constexpr size_t INLINE_VALUES = 8;
+        std::array<ValuePtr, INLINE_VALUES> inline_values;
+        std::vector<ValuePtr> more;
+        ValuePtr *values = inline_values.data();
+        if (bindings.size() > INLINE_VALUES) {
+            more.resize(bindings.size());
+            values = more.data();
+        }
+        for (size_t i = 0; i < bindings.size(); ++i) {
+            values[i] = run(bindings[i].second.get(), from);
+        }
+        for (size_t i = 0; i < bindings.size(); ++i) {
+            to.slot(bindings[i].first) = std::move(values[i]);
+        }
+    }
+}
+
+ValuePtr LoopNode::execute(TailCall &tail) const {
+    // at the top level the variables get a frame, inside of a lambda they are slots of its frame
+    auto env = frame_size_ > 0 ? std::make_shared<Environment>(tail.env, frame_size_) : tail.env;
+    assign_slots(bindings_, tail.env, *env);
+    tail.env = std::move(env);
+    tail.node = body_.get();
+    return nullptr;
+}
+
+ValuePtr RecurNode::execute(TailCall &tail) const {
+    assign_slots(arguments_, tail.env, *tail.env);
+    tail.node = target_->body;
+    return nullptr;
+}
+
+ValuePtr LambdaNode::execute(TailCall &tail) const {
 //                lambda: Return a new function Closure. The body of that Closure does the following:
 //                1. Create a new environment using env (closed over from outer scope) as the outer parameter,
 //                2. the first parameter (second list element of ast from the outer scope) as the binds parameter,
 //                3. and the parameters to the Closure as the exprs parameter.
 //                4. Call eval on the second parameter (third list element of ast from outer scope),
 //                5. using the new environment. Use the result as the return value of the Closure.
-    auto binds = car<ListValue>(cdr(list_ast));
-    auto exprs = cdr(cdr(list_ast));
-    auto closure = std::make_shared<Closure>(env, binds, exprs);
-    return closure;
+//                The closure copies the free variables it uses (see scope.h) instead of keeping env.
+    return std::make_shared<Closure>(make_closure_env(tail.env, closure_depth_, captures_), formal_params_,
+                                     frame_size_, body_, source_);
 }
 
+ValuePtr CallNode::execute(TailCall &tail) const {
+    auto first = global_operator_ != nullptr ? global_operator_->lookup(*tail.env) : run(operator_.get(), tail.env);
+    // core builtins are applied right on the operands, without the argument vector
+    if (first->get_type() == ValueType::Function) {
+        auto primitive = static_cast<const FunctionValue &>(*first).get_primitive();
+        if (primitive != Primitive::None && primitive_arity(primitive) == operands_.size()) {
+            ValuePtr operands[2];
+            for (size_t i = 0; i < operands_.size(); ++i) {
+                operands[i] = run(operands_[i].get(), tail.env);
+            }
+            auto result = apply_primitive(primitive, operands);
+            if (result != nullptr) {
+                return result;
+            }
+            std::vector<ValuePtr> args(operands, operands + operands_.size());
+            return apply_fn(static_cast<const FunctionValue &>(*first), args);
+        }
+    }
+
+    std::vector<ValuePtr> args;
+    args.reserve(operands_.size());
+    for (const auto &operand: operands_) {
+        args.push_back(run(operand.get(), tail.env));
+    }
 
-void eval_begin(ValuePtr &ast, const std::shared_ptr<ListValue> &list_ast, const EnvironmentPtr &env) {
-//                (begin 〈expression1〉 〈expression2〉 . . . ) library syntax
-//                The 〈expression〉s are evaluated sequentially from left to
-//                right, and the value(s) of the last 〈expression〉 is(are) returned.
-//                This expression type is used to sequence side effects such as input and output.
-    auto exprs = cdr(list_ast);
-    for (int i = 0; i < exprs->size() - 1; ++i) {
-        eval(exprs->get_value(i), env);
+    // closures and builtins behave differently, builtins are applied directly, closures have to be tail call optimized
+    if (first->get_type() == ValueType::Function) {
+        return apply_fn(static_cast<const FunctionValue &>(*first), args);
 
+    } else if (first->get_type() == ValueType::Closure) {
+        auto closure = std::static_pointer_cast<Closure>(first);
+        if (auto result = closure->call_native(args)) {
+            return result;
+        }
+        tail.env = closure->make_frame(args);
+        // the previous owner may own this node, release it only after we are done
+        auto previous_owner = std::move(tail.owner);
+        tail.owner = closure->get_body();
+        tail.node = tail.owner.get();
+        return nullptr;
+
+    } else {
+        throw std::runtime_error("eval error: " + first->to_string() + " is not a function");
     }
-    ast = exprs->get_value(exprs->size() - 1);
 }
 
-ValuePtr eval(const ValuePtr &ast_in, const EnvironmentPtr &env_in) {
-    auto ast = ast_in;
-    auto env = env_in;
-    while (true) {
-        if (ast->get_type() != ValueType::List)
-            return eval_ast(ast, env);
-            // if it's an empty list return unchanged
-        else if (std::static_pointer_cast<ListValue>(ast)->size() == 0)
-            return ast;
-        else {
-            auto list_ast = std::static_pointer_cast<ListValue>(ast);
-
-            if (car<Value>(list_ast)->get_type() == ValueType::Symbol) {
-                auto symbol = car<SymbolValue>(list_ast);
-                auto symbol_name = symbol->to_string();
-                if (symbol_name == "define") {
-                    // NOTE: function defines not supported
-                    check_arity(symbol_name, 3, list_ast->size());
-                    auto result = eval(list_ast->get_value(2), env);
-                    env->set(list_ast->get_value(1)->to_string(), result);
-                    return result;
-
-                } else if (symbol_name == "let*" || symbol_name == "letrec" || symbol_name == "let") {
-                    eval_let(ast, env, list_ast);
-                    continue; // tco
-
-                } else if (symbol_name == "quote") {
-                    check_arity(symbol_name, 2, list_ast->size());
-                    return list_ast->get_value(1);
-                } else if (symbol_name == "lambda") {
-                    return eval_lambda(list_ast, env);
-                } else if (symbol_name == "begin") {
-                    eval_begin(ast, list_ast, env);
-                    continue;
-                } else if (symbol_name == "set!") {
-                    auto what = car<SymbolValue>(cdr(list_ast));
-                    auto value = eval(car<Value>(cdr(cdr(list_ast))), env);
-                    env->update_existing(what->to_string(), value);
-                    return value;
-                } else if (symbol_name == "if") {
-                    eval_if(ast, env, list_ast);
-                    continue;
-                } else if (symbol_name == "cond") {
-                    std::pair<bool, ValuePtr> tco_and_result = eval_cond(ast, env, list_ast);
-                    if (tco_and_result.first) continue;
-                        // else if the the second is not nullptr then we need to return it
-                    else if (tco_and_result.second != nullptr) return tco_and_result.second;
-                    else return std::make_shared<NilValue>(); // result of the entire cond expression is unspecified
-                }
-
-            }
+ValuePtr InlineNode::execute(TailCall &tail) const {
+    if (call_->get_global_operator()->lookup(*tail.env) != closure_) {
+        tail.node = call_.get();
+        return nullptr;
+    }
+    for (const auto &[index, argument]: arguments_) {
+        tail.env->slot(index) = run(argument.get(), tail.env);
+    }
+    tail.node = body_.get();
+    return nullptr;
+}
 
-            // otherwise the first element is a function and we need to apply it,
-            // closures and builtins behave differently, builtins are applied directly, closures have to be tail call optimized
-            auto should_return_and_result = eval_list(ast, env);
-            if (should_return_and_result.first) {
-                return should_return_and_result.second;
-            }
-            // otherwise the loop continues as tco
+ValuePtr run(const Node *node, EnvironmentPtr env) {
+    TailCall tail{node, std::move(env), nullptr};
+    while (true) {
+        auto result = tail.node->execute(tail);
+        if (result != nullptr) {
+            return result;
         }
-    }  // end while loop
-}
\ No newline at end of file
+        // otherwise the loop continues as tco
+    }
+}
+
+ValuePtr eval(const ValuePtr &ast_in, const EnvironmentPtr &env_in) {
+    EvalContext context(env_in, false);
+    auto node = analyze(optimize(expand_macros(ast_in, env_in), env_in), env_in);
+    return run(node.get(), env_in);
+}
@@ -4,19 +4,13 @@
 
 #include "util.h"
 
-ValuePtr apply_fn(const std::shared_ptr<FunctionValue> &fn, std::vector<std::shared_ptr<Value> > args);
+ValuePtr apply_fn(const FunctionValue &fn, std::vector<ValuePtr> &args);
 
-std::shared_ptr<Value> eval_ast(const ValuePtr &value, const EnvironmentPtr &env);
+// calls a builtin or a closure of either engine from a builtin, caller names the builtin in the error for anything else
+ValuePtr call_procedure(const ValuePtr &procedure, std::vector<ValuePtr> &args, const std::string &caller);
 
-std::pair<bool, ValuePtr> eval_list(ValuePtr &ast, EnvironmentPtr &env);
-
-void eval_let(ValuePtr &ast, EnvironmentPtr &env, const std::shared_ptr<ListValue> &list_ast);
-
-std::pair<bool, ValuePtr> eval_cond(ValuePtr &ast, const EnvironmentPtr &env, const std::shared_ptr<ListValue> &list_ast);
-
-void eval_if(ValuePtr &ast, const EnvironmentPtr &env, const std::shared_ptr<ListValue> &list_ast);
-
-void eval_begin(ValuePtr &ast, const std::shared_ptr<ListValue> &list_ast, const EnvironmentPtr &env);
+// executes an analyzed node, tail calls are done in a loop instead of recursion
+ValuePtr run(const Node *node, EnvironmentPtr env);
 
 ValuePtr eval(const ValuePtr &ast_in, const EnvironmentPtr &env_in);
 
@@ -0,0 +1,177 @@
+#include "exceptions.h"
+#include "evaluator.h"
+#include "primitives.h"
+#include <string>
+
+namespace {
+    thread_local std::vector<Handler> handlers;
+
+    // the entries from index on are taken off the handler stack while their handler runs and put back afterwards,
+    // also when it is left by an exception
+    class OuterHandlers {
+        size_t index_;
+        std::vector<Handler> inner_;
+    public:
+        explicit OuterHandlers(size_t index)
+                : index_(index), inner_(std::make_move_iterator(handlers.begin() + static_cast<long>(index)),
+                                        std::make_move_iterator(handlers.end())) {
+            handlers.resize(index);
+        }
+
+        ~OuterHandlers() {
+            handlers.resize(index_);
+            handlers.insert(handlers.end(), std::make_move_iterator(inner_.begin()),
+                            std::make_move_iterator(inner_.end()));
+        }
+
+        OuterHandlers(const OuterHandlers &) = delete;
+
+        OuterHandlers &operator=(const OuterHandlers &) = delete;
+    };
+
+    std::string describe(const ErrorObject &error) {
+        std::string description = "error: " + error.message;
+        for (size_t i = 0; i < error.irritants->size(); ++i) {
+            description += " " + error.irritants->get_value(i)->to_string();
+        }
+        return description;
+    }
+
+    std::string uncaught_message(const ValuePtr &condition) {
+        if (condition->get_type() != ValueType::Error) {
+            return "raise: uncaught " + condition->to_string();
+        }
+        return describe(static_cast<const ErrorObject &>(*condition));
+    }
+
+    const ErrorObject &error_object(const std::string &name, const std::vector<ValuePtr> &argv) {
+        if (argv[0]->get_type() != ValueType::Error) {
+            throw std::runtime_error(name + ": " + argv[0]->to_string() + " is not an error object");
+        }
+        return static_cast<const ErrorObject &>(*argv[0]);
+    }
+}
+
+std::string ErrorObject::to_string() const {
+    return "#<" + describe(*this) + ">";
+}
+
+std::vector<Handler> &handler_stack() {
+    return handlers;
+}
+
+ValuePtr make_error_object(size_t argc, const std::vector<ValuePtr> &argv) {
+    if (argc == 0) {
+        throw std::runtime_error("error: expected a message");
+    }
+    auto message = argv[0]->get_type() == ValueType::String
+                   ? static_cast<const StringValue &>(*argv[0]).get_value()
+                   : argv[0]->to_string();
+    return std::make_shared<ErrorObject>(
+            message, std::make_shared<ListValue>(std::vector<ValuePtr>(argv.begin() + 1, argv.end())));
+}
+
+ValuePtr error_condition(const std::runtime_error &error) {
+    return std::make_shared<ErrorObject>(error.what(), std::make_shared<ListValue>());
+}
+
+ValuePtr raise_condition(const ValuePtr &condition, bool continuable) {
+    if (handlers.empty()) {
+        throw std::runtime_error(uncaught_message(condition));
+    }
+    auto index = handlers.size() - 1;
+    if (handlers[index].procedure == nullptr) {
+        throw ConditionRaised{index, condition};
+    }
+    auto procedure = handlers[index].procedure;
+    OuterHandlers outer(index);
+    std::vector<ValuePtr> args{condition};
+    auto result = call_procedure(procedure, args, "raise");
+    if (continuable) {
+        return result;
+    }
+    std::vector<ValuePtr> irritants{std::make_shared<StringValue>("handler returned from raise"), condition};
+    return raise_condition(make_error_object(irritants.size(), irritants), false);
+}
+
+const ValuePtr &raise_procedure() {
+    static const ValuePtr raise = std::make_shared<FunctionValue>(raise_function, Primitive::Raise);
+    return raise;
+}
+
+ValuePtr raise_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (raise obj) procedure
+//    Raises an exception by invoking the current exception handler on obj. The handler is called with the same
+//    dynamic environment as that of the call to raise, except that the current exception handler is the one that
+//    was installed when the handler being called was installed. If the handler returns, a secondary exception is
+//    raised in the same dynamic environment as the handler.
+    std::string name = "raise";
+    check_arity(name, 1, argc);
+    return raise_condition(argv[0], false);
+}
+
+ValuePtr raise_continuable_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (raise-continuable obj) procedure
+//    Raises an exception by invoking the current exception handler on obj. The handler is called with the same
+//    dynamic environment as the call to raise-continuable, except that the current exception handler is the one that
+//    was installed when the handler being called was installed. If the handler returns, the values it returns become
+//    the values returned by the call to raise-continuable.
+    std::string name = "raise-continuable";
+    check_arity(name, 1, argc);
+    return raise_condition(argv[0], true);
+}
+
+ValuePtr with_exception_handler_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (with-exception-handler handler thunk) procedure
+//    The handler argument should be a procedure that accepts one argument. The thunk argument should be a procedure
+//    that accepts zero arguments. The with-exception-handler procedure returns the results of invoking thunk.
+//    Handler is installed as the current exception handler in the dynamic environment used for the invocation of
+//    thunk.
+    std::string name = "with-exception-handler";
+    check_arity(name, 2, argc);
+    if (argv[0]->get_type() != ValueType::Function && argv[0]->get_type() != ValueType::Closure) {
+        throw std::runtime_error(name + ": " + argv[0]->to_string() + " is not a function");
+    }
+    auto depth = handlers.size();
+    handlers.push_back({argv[0], 0, {}});
+    std::vector<ValuePtr> args;
+    try {
+        auto result = call_procedure(argv[1], args, name);
+        handlers.resize(depth);
+        return result;
+    } catch (...) {
+        handlers.resize(depth);
+        throw;
+    }
+}
+
+ValuePtr error_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (error message obj ...) procedure
+//    Raises an exception as if by calling raise on a newly allocated implementation-defined object which encapsulates
+//    the information provided by message, as well as any objs, known as the irritants.
+    return raise_condition(make_error_object(argc, argv), false);
+}
+
+ValuePtr error_object_question_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (error-object? obj) procedure
+//    Returns #t if obj is an object created by error or one of an implementation-defined set of objects.
+    std::string name = "error-object?";
+    check_arity(name, 1, argc);
+    return bool_value(argv[0]->get_type() == ValueType::Error);
+}
+
+ValuePtr error_object_message_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (error-object-message error-object) procedure
+//    Returns the message encapsulated by error-object.
+    std::string name = "error-object-message";
+    check_arity(name, 1, argc);
+    return std::make_shared<StringValue>(error_object(name, argv).message);
+}
+
+ValuePtr error_object_irritants_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (error-object-irritants error-object) procedure
+//    Returns a list of the irritants encapsulated by error-object.
+    std::string name = "error-object-irritants";
+    check_arity(name, 1, argc);
+    return error_object(name, argv).irritants;
+}
@@ -0,0 +1,82 @@
+#ifndef SCHEME_EXCEPTIONS_H
+#define SCHEME_EXCEPTIONS_H
+
+#include "util.h"
+#include "vm.h"
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Exceptions: (raise obj), (raise-continuable obj), (with-exception-handler handler thunk), (error message obj ...),
+// error-object?, error-object-message, error-object-irritants and the special form (guard (variable clause ...) body).
+//
+// The handlers in effect are kept on the handler stack of the thread, innermost last: with-exception-handler pushes
+// its handler while the thunk runs and a guard pushes an entry while its body runs. raise only looks at the innermost
+// entry. A handler procedure is called where raise was called, with the outer handlers in effect, so nothing is
+// unwound: raise-continuable returns what the handler returns, raise raises a secondary error to the outer handlers.
+// A guard is escaped to instead. In the vm a guard of the activation that raises is reached by a jump, like the
+// escape of a continuation: the calls made since the guard was entered are dropped and its clauses continue with the
+// condition. Only a guard of eval, or one outside of the builtin call that raises, is reached by throwing
+// ConditionRaised. The clauses are those of cond with the variable bound to the condition, if none applies the guard
+// raises the condition again (with raise from the guard, where R7RS uses raise-continuable from the raise).
+//
+// Errors of the interpreter itself (the std::runtime_errors of builtins and evaluators) still unwind the C++ stack
+// and do not call handler procedures, a guard they reach gets an error object with their message.
+
+// an entry of the handler stack
+struct Handler {
+    // procedure of with-exception-handler, nullptr for a guard
+    ValuePtr procedure;
+    // activation of the vm that entered the guard, 0 for a guard of eval and for procedures
+    size_t activation = 0;
+    GuardFrame guard;
+};
+
+// the handler stack of the thread, a green thread keeps the guards of its own calls (see CallStack in vm.h)
+std::vector<Handler> &handler_stack();
+
+// thrown by a raise to a guard it cannot jump to, the guard at index guard of the handler stack catches it
+struct ConditionRaised {
+    size_t guard;
+    ValuePtr condition;
+};
+
+class ErrorObject : public Value {
+public:
+    ErrorObject(std::string message, ListPtr irritants)
+            : Value(ValueType::Error), message(std::move(message)), irritants(std::move(irritants)) {
+    }
+
+    [[nodiscard]] std::string to_string() const override;
+
+    const std::string message;
+    const ListPtr irritants;
+};
+
+// the error object of (error message obj ...)
+ValuePtr make_error_object(size_t argc, const std::vector<ValuePtr> &argv);
+
+// the error object a guard gets for an error of the interpreter
+ValuePtr error_condition(const std::runtime_error &error);
+
+// raises the condition to the innermost handler, returns what the handler returns if the raise is continuable
+ValuePtr raise_condition(const ValuePtr &condition, bool continuable);
+
+// the raise builtin, guards raise the conditions their clauses do not handle with it
+const ValuePtr &raise_procedure();
+
+ValuePtr raise_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr raise_continuable_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr with_exception_handler_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr error_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr error_object_question_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr error_object_message_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr error_object_irritants_function(size_t argc, std::vector<ValuePtr> &argv);
+
+#endif //SCHEME_EXCEPTIONS_H
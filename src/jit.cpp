@@ -0,0 +1,470 @@
+#include "jit.h"
+#include "analyzer.h"
+#include "primitives.h"
+#include "datatypes/closure.h"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define SCHEME_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+namespace {
+    bool enabled = true;
+
+    // state shared by all native frames of one run_native
+    struct NativeContext {
+        std::int64_t depth;
+        // set when the recursion got too deep, the frames then return one by one without finishing their work
+        std::int64_t bailed;
+    };
+
+    using NativeEntry = std::int64_t (*)(const std::int64_t *args, NativeContext *context);
+
+    // native frames are small, this keeps them well within the C++ stack
+    constexpr std::int32_t NATIVE_DEPTH_LIMIT = 10000;
+
+    // the arguments are converted on the C++ stack
+    constexpr size_t MAX_NATIVE_ARITY = 8;
+}
+
+class NativeCode {
+public:
+    // global variable the code depends on and the value it had when the code was compiled
+    struct Guard {
+        const GlobalNode *node;
+        // nullptr for the compiled closure itself, which cannot own itself
+        ValuePtr expected;
+    };
+
+    NativeCode(void *memory, size_t size, size_t arity, std::vector<Guard> guards)
+            : memory_(memory), size_(size), arity_(arity), guards_(std::move(guards)) {
+    }
+
+    NativeCode(const NativeCode &) = delete;
+
+    NativeCode &operator=(const NativeCode &) = delete;
+
+    ~NativeCode() {
+#ifdef SCHEME_JIT_X86_64
+        munmap(memory_, size_);
+#endif
+    }
+
+    [[nodiscard]] NativeEntry get_entry() const {
+        return reinterpret_cast<NativeEntry>(memory_);
+    }
+
+    [[nodiscard]] size_t get_arity() const {
+        return arity_;
+    }
+
+    [[nodiscard]] const std::vector<Guard> &get_guards() const {
+        return guards_;
+    }
+
+private:
+    void *memory_;
+    size_t size_;
+    size_t arity_;
+    std::vector<Guard> guards_;
+};
+
+void set_jit_enabled(bool value) {
+    enabled = value;
+}
+
+bool jit_enabled() {
+    return enabled;
+}
+
+#ifdef SCHEME_JIT_X86_64
+
+namespace {
+    class Assembler {
+        std::vector<std::uint8_t> code_;
+
+    public:
+        void emit(std::initializer_list<std::uint8_t> bytes) {
+            code_.insert(code_.end(), bytes);
+        }
+
+        void emit_u32(std::uint32_t value) {
+            for (int i = 0; i < 4; ++i) {
+                code_.push_back((value >> (8 * i)) & 0xff);
+            }
+        }
+
+        void emit_u64(std::uint64_t value) {
+            for (int i = 0; i < 8; ++i) {
+                code_.push_back((value >> (8 * i)) & 0xff);
+            }
+        }
+
+        // emits the placeholder of a 32 bit relative target, returns its position for patch
+        size_t emit_target() {
+            emit_u32(0);
+            return code_.size() - 4;
+        }
+
+        // relative targets count from the end of the instruction, which ends with the target
+        void patch(size_t position, size_t target) {
+            auto offset = static_cast<std::uint32_t>(static_cast<std::int64_t>(target) -
+                                                     static_cast<std::int64_t>(position + 4));
+            for (int i = 0; i < 4; ++i) {
+                code_[position + i] = (offset >> (8 * i)) & 0xff;
+            }
+        }
+
+        [[nodiscard]] size_t position() const {
+            return code_.size();
+        }
+
+        [[nodiscard]] const std::vector<std::uint8_t> &code() const {
+            return code_;
+        }
+    };
+
+    // Register use: the value of every expression ends up in rax, rcx is a scratch register and rbx points to the
+    // NativeContext. The arguments are pushed by the caller, so parameter i is at [rbp + 16 + 8 * i].
+    class NativeCompiler {
+        const Closure &closure_;
+        size_t arity_;
+        Assembler as_;
+        std::vector<NativeCode::Guard> guards_;
+        // start of the body after the depth check, self tail calls jump here
+        size_t loop_ = 0;
+        std::vector<size_t> to_body_;
+        std::vector<size_t> to_epilogue_;
+        std::vector<size_t> to_unwind_;
+
+        // value of a global variable at compile time, the code is guarded against its change
+        const Value *global_value(const Node *node, bool is_self) {
+            auto global = dynamic_cast<const GlobalNode *>(node);
+            if (global == nullptr) {
+                return nullptr;
+            }
+            auto cell = closure_.get_env()->find_cell(global->get_name());
+            if (cell == nullptr) {
+                return nullptr;
+            }
+            guards_.push_back({global, is_self ? nullptr : *cell});
+            return cell->get();
+        }
+
+        bool is_self_call(const CallNode &call) {
+            auto global = dynamic_cast<const GlobalNode *>(call.get_operator().get());
+            if (global == nullptr) {
+                return false;
+            }
+            auto cell = closure_.get_env()->find_cell(global->get_name());
+            if (cell == nullptr || cell->get() != &closure_) {
+                return false;
+            }
+            return global_value(global, true) != nullptr;
+        }
+
+        Primitive call_primitive(const CallNode &call) {
+            auto value = global_value(call.get_operator().get(), false);
+            if (value == nullptr || value->get_type() != ValueType::Function) {
+                return Primitive::None;
+            }
+            auto primitive = static_cast<const FunctionValue *>(value)->get_primitive();
+            return call.get_operands().size() == primitive_arity(primitive) ? primitive : Primitive::None;
+        }
+
+        std::int32_t parameter_offset(size_t index) const {
+            return static_cast<std::int32_t>(16 + 8 * index);
+        }
+
+        // leaves the first operand in rax and the second one in rcx
+        bool operands(const CallNode &call) {
+            if (!expression(call.get_operands()[0].get(), false)) {
+                return false;
+            }
+            as_.emit({0x50});                           // push rax
+            if (!expression(call.get_operands()[1].get(), false)) {
+                return false;
+            }
+            as_.emit({0x48, 0x89, 0xc1});               // mov rcx, rax
+            as_.emit({0x58});                           // pop rax
+            return true;
+        }
+
+        // jumps to one of to_false if the test is false, falls through otherwise
+        bool test(const Node *node, std::vector<size_t> &to_false) {
+            auto call = dynamic_cast<const CallNode *>(node);
+            if (call == nullptr) {
+                return false;
+            }
+            std::uint8_t jump_if_false;
+            switch (call_primitive(*call)) {
+                case Primitive::IsZero:
+                    if (!expression(call->get_operands()[0].get(), false)) {
+                        return false;
+                    }
+                    as_.emit({0x48, 0x83, 0xf8, 0x00});     // cmp rax, 0
+                    jump_if_false = 0x85;                   // jne
+                    break;
+                case Primitive::Equal:
+                    jump_if_false = 0x85;                   // jne
+                    break;
+                case Primitive::Less:
+                    jump_if_false = 0x8d;                   // jge
+                    break;
+                case Primitive::Greater:
+                    jump_if_false = 0x8e;                   // jle
+                    break;
+                case Primitive::LessEqual:
+                    jump_if_false = 0x8f;                   // jg
+                    break;
+                case Primitive::GreaterEqual:
+                    jump_if_false = 0x8c;                   // jl
+                    break;
+                default:
+                    return false;
+            }
+            if (call->get_operands().size() == 2) {
+                if (!operands(*call)) {
+                    return false;
+                }
+                as_.emit({0x48, 0x39, 0xc8});               // cmp rax, rcx
+            }
+            as_.emit({0x0f, jump_if_false});
+            to_false.push_back(as_.emit_target());
+            return true;
+        }
+
+        bool self_call(const CallNode &call, bool tail) {
+            const auto &args = call.get_operands();
+            if (args.size() != arity_) {
+                return false;
+            }
+            if (tail) {
+                // the new arguments replace the parameters and the body starts over in the same frame
+                for (const auto &arg: args) {
+                    if (!expression(arg.get(), false)) {
+                        return false;
+                    }
+                    as_.emit({0x50});                       // push rax
+                }
+                for (size_t i = args.size(); i-- > 0;) {
+                    as_.emit({0x58});                       // pop rax
+                    as_.emit({0x48, 0x89, 0x85});           // mov [rbp + offset], rax
+                    as_.emit_u32(parameter_offset(i));
+                }
+                as_.emit({0xe9});                           // jmp loop
+                as_.patch(as_.emit_target(), loop_);
+                return true;
+            }
+            // the first argument is pushed last, so that it is at the lowest address
+            for (size_t i = args.size(); i-- > 0;) {
+                if (!expression(args[i].get(), false)) {
+                    return false;
+                }
+                as_.emit({0x50});                           // push rax
+            }
+            as_.emit({0xe8});                               // call body
+            to_body_.push_back(as_.emit_target());
+            if (!args.empty()) {
+                as_.emit({0x48, 0x81, 0xc4});               // add rsp, 8 * argc
+                as_.emit_u32(8 * args.size());
+            }
+            as_.emit({0x48, 0x83, 0x7b, 0x08, 0x00});       // cmp qword [rbx + 8], 0
+            as_.emit({0x0f, 0x85});                         // jne unwind
+            to_unwind_.push_back(as_.emit_target());
+            return true;
+        }
+
+        bool expression(const Node *node, bool tail) {
+            if (auto constant = dynamic_cast<const ConstantNode *>(node)) {
+                const auto &value = constant->get_value();
+                if (value->get_type() != ValueType::Integer) {
+                    return false;
+                }
+                as_.emit({0x48, 0xb8});                     // mov rax, imm64
+                as_.emit_u64(static_cast<const IntegerValue &>(*value).get_value());
+                return true;
+            }
+            if (auto local = dynamic_cast<const LocalNode *>(node)) {
+                const auto &address = local->get_address();
+                if (address.depth != 0 || address.index >= arity_) {
+                    return false;
+                }
+                as_.emit({0x48, 0x8b, 0x85});               // mov rax, [rbp + offset]
+                as_.emit_u32(parameter_offset(address.index));
+                return true;
+            }
+            if (auto if_node = dynamic_cast<const IfNode *>(node)) {
+                std::vector<size_t> to_alternate;
+                if (!test(if_node->get_test().get(), to_alternate) ||
+                    !expression(if_node->get_consequent().get(), tail)) {
+                    return false;
+                }
+                as_.emit({0xe9});                           // jmp end (or return)
+                auto to_end = as_.emit_target();
+                if (tail) {
+                    to_epilogue_.push_back(to_end);
+                }
+                for (auto position: to_alternate) {
+                    as_.patch(position, as_.position());
+                }
+                if (!expression(if_node->get_alternate().get(), tail)) {
+                    return false;
+                }
+                if (!tail) {
+                    as_.patch(to_end, as_.position());
+                }
+                return true;
+            }
+            auto call = dynamic_cast<const CallNode *>(node);
+            if (call == nullptr) {
+                return false;
+            }
+            if (is_self_call(*call)) {
+                return self_call(*call, tail);
+            }
+            auto primitive = call_primitive(*call);
+            if (primitive != Primitive::Add && primitive != Primitive::Subtract && primitive != Primitive::Multiply) {
+                return false;
+            }
+            if (!operands(*call)) {
+                return false;
+            }
+            switch (primitive) {
+                case Primitive::Add:
+                    as_.emit({0x48, 0x01, 0xc8});           // add rax, rcx
+                    break;
+                case Primitive::Subtract:
+                    as_.emit({0x48, 0x29, 0xc8});           // sub rax, rcx
+                    break;
+                default:
+                    as_.emit({0x48, 0x0f, 0xaf, 0xc1});     // imul rax, rcx
+                    break;
+            }
+            return true;
+        }
+
+    public:
+        explicit NativeCompiler(const Closure &closure) : closure_(closure),
+                                                          arity_(closure.get_formal_params()->size()) {
+        }
+
+        NativeCodePtr compile() {
+            if (arity_ > MAX_NATIVE_ARITY) {
+                return nullptr;
+            }
+            // entry(args, context), called from C++
+            as_.emit({0xf3, 0x0f, 0x1e, 0xfa});             // endbr64
+            as_.emit({0x55});                               // push rbp
+            as_.emit({0x48, 0x89, 0xe5});                   // mov rbp, rsp
+            as_.emit({0x53});                               // push rbx
+            as_.emit({0x48, 0x89, 0xf3});                   // mov rbx, rsi
+            for (size_t i = arity_; i-- > 0;) {
+                as_.emit({0xff, 0xb7});                     // push qword [rdi + 8 * i]
+                as_.emit_u32(8 * i);
+            }
+            as_.emit({0xe8});                               // call body
+            to_body_.push_back(as_.emit_target());
+            if (arity_ > 0) {
+                as_.emit({0x48, 0x81, 0xc4});               // add rsp, 8 * arity
+                as_.emit_u32(8 * arity_);
+            }
+            as_.emit({0x5b, 0x5d, 0xc3});                   // pop rbx, pop rbp, ret
+
+            // body
+            auto body = as_.position();
+            as_.emit({0x55});                               // push rbp
+            as_.emit({0x48, 0x89, 0xe5});                   // mov rbp, rsp
+            as_.emit({0x48, 0xff, 0x03});                   // inc qword [rbx]
+            as_.emit({0x48, 0x81, 0x3b});                   // cmp qword [rbx], limit
+            as_.emit_u32(NATIVE_DEPTH_LIMIT);
+            as_.emit({0x0f, 0x8f});                         // jg bail
+            auto to_bail = as_.emit_target();
+            loop_ = as_.position();
+            if (!expression(closure_.get_body().get(), true)) {
+                return nullptr;
+            }
+            auto epilogue = as_.position();
+            as_.emit({0x48, 0xff, 0x0b});                   // dec qword [rbx]
+            as_.emit({0x5d, 0xc3});                         // pop rbp, ret
+            as_.patch(to_bail, as_.position());
+            as_.emit({0x48, 0xc7, 0x43, 0x08});             // mov qword [rbx + 8], 1
+            as_.emit_u32(1);
+            auto unwind = as_.position();
+            as_.emit({0x48, 0x89, 0xec});                   // mov rsp, rbp
+            as_.emit({0x5d, 0xc3});                         // pop rbp, ret
+
+            for (auto position: to_body_) {
+                as_.patch(position, body);
+            }
+            for (auto position: to_epilogue_) {
+                as_.patch(position, epilogue);
+            }
+            for (auto position: to_unwind_) {
+                as_.patch(position, unwind);
+            }
+            return install();
+        }
+
+        // copies the code to executable memory
+        NativeCodePtr install() {
+            const auto &code = as_.code();
+            void *memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                return nullptr;
+            }
+            std::memcpy(memory, code.data(), code.size());
+            if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, code.size());
+                return nullptr;
+            }
+            return std::make_shared<NativeCode>(memory, code.size(), arity_, std::move(guards_));
+        }
+    };
+}
+
+NativeCodePtr compile_native(const Closure &closure) {
+    if (closure.get_body() == nullptr) {
+        return nullptr;
+    }
+    return NativeCompiler(closure).compile();
+}
+
+#else
+
+NativeCodePtr compile_native(const Closure &closure) {
+    return nullptr;
+}
+
+#endif
+
+ValuePtr run_native(const NativeCode &code, const Closure &closure, const std::vector<ValuePtr> &args,
+                    bool &too_deep) {
+    if (args.size() != code.get_arity()) {
+        return nullptr;
+    }
+    for (const auto &guard: code.get_guards()) {
+        const Value *expected = guard.expected == nullptr ? &closure : guard.expected.get();
+        if (guard.node->lookup(*closure.get_env()).get() != expected) {
+            return nullptr;
+        }
+    }
+    std::array<std::int64_t, MAX_NATIVE_ARITY> native_args{};
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i]->get_type() != ValueType::Integer) {
+            return nullptr;
+        }
+        native_args[i] = static_cast<const IntegerValue &>(*args[i]).get_value();
+    }
+    NativeContext context{0, 0};
+    auto result = code.get_entry()(native_args.data(), &context);
+    if (context.bailed != 0) {
+        too_deep = true;
+        return nullptr;
+    }
+    return std::make_shared<IntegerValue>(result);
+}
@@ -0,0 +1,41 @@
+#ifndef SCHEME_JIT_H
+#define SCHEME_JIT_H
+
+#include "util.h"
+#include <memory>
+#include <vector>
+
+// Template JIT for hot closures of the tree walking engine (Linux x86-64 only, elsewhere nothing is compiled).
+//
+// A closure is compiled after JIT_THRESHOLD calls if its body only does integer arithmetic on its parameters:
+// integer constants, parameters, + - *, comparisons and zero? as tests of if, and calls of the closure itself through
+// its global name. Every node kind has a fixed machine code template and the templates are stitched together into
+// executable memory. Such a body has no side effects, so whenever the native code cannot finish (an argument is not
+// an integer, a global it depends on was redefined, the recursion got too deep) the call is simply interpreted instead.
+// The calls nested in an interpreted call that got too deep are interpreted too (see Closure::call_native), so deep
+// recursion does not go as deep again in native code for every one of them.
+
+class Closure;
+
+class NativeCode;
+
+using NativeCodePtr = std::shared_ptr<const NativeCode>;
+
+// number of interpreted calls after which a closure is compiled
+constexpr size_t JIT_THRESHOLD = 100;
+
+// compiles the body of a closure made by eval, nullptr if it is not in the supported subset
+NativeCodePtr compile_native(const Closure &closure);
+
+// result of the compiled code of the closure, nullptr if the call has to be interpreted, too_deep is set if that is
+// because the recursion got too deep
+ValuePtr run_native(const NativeCode &code, const Closure &closure, const std::vector<ValuePtr> &args,
+                    bool &too_deep);
+
+// the jit is on by default, it can be turned off to compare with the interpreter (--no-jit),
+// which also turns off the numeric specialization (see numeric.h)
+void set_jit_enabled(bool enabled);
+
+bool jit_enabled();
+
+#endif //SCHEME_JIT_H
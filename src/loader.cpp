@@ -0,0 +1,395 @@
+#include "loader.h"
+#include "evaluator.h"
+#include "macros.h"
+#include "optimizer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+    size_t threads_setting = 0;
+    size_t sequential_ms = LOAD_SEQUENTIAL_MS;
+    size_t parallel_count = 0;
+
+    // builtins the threads may call, they have no effects outside of their arguments and the thread
+    constexpr const char *READING_BUILTINS[] = {
+            "+", "-", "*", "/", "=", ">", "<", ">=", "<=", "abs", "quotient", "remainder", "max", "min", "number?",
+            "real?", "integer?", "rational?", "boolean?", "list", "list?", "empty?", "count", "cons", "concat", "zero?",
+            "positive?", "negative?", "odd?", "even?", "exact?", "inexact?", "not", "pair?", "car", "cdr", "null?",
+            "length", "append", "string->symbol", "symbol?", "symbol->string", "string?", "string-length",
+            "string-ref", "string=?", "string<?", "string>?", "string<=?", "string>=?", "vector?", "make-vector",
+            "vector-length", "vector-ref", "vector->list", "list->vector", "procedure?", "map", "for-each", "filter",
+            "fold", "list->stream", "stream-map", "stream-filter", "stream->list", "stream-fold", "stream-for-each",
+            "stream?", "values", "call-with-values", "read", "raise", "raise-continuable", "with-exception-handler",
+            "error", "error-object?", "error-object-message", "error-object-irritants", "eqv?", "eq?", "equal?",
+            "memq", "memv", "member", "assq", "assv", "assoc"};
+    ListPtr make_list(std::initializer_list<ValuePtr> values) {
+        return std::make_shared<ListValue>(std::vector<ValuePtr>(values));
+    }
+
+    class Loader {
+        // a definition of the batch
+        struct Definition {
+            SymbolId name;
+            // (lambda () expression) made by the engine, the threads call it
+            ValuePtr thunk;
+            // 0 if it waits for no definition of the batch, otherwise one more than the level of those it waits for
+            size_t level;
+        };
+
+        // what evaluating an expression may do, found in its expansion and in the bodies of the procedures it calls
+        struct Effects {
+            // every name it uses, those of the procedures included
+            std::unordered_set<SymbolId> names;
+            // it may change something other forms see, or call code that is not known
+            bool unsafe = false;
+            // it calls set-car!, set-cdr! or vector-set!
+            bool mutates = false;
+            // it reads global lists or the value of a definition of the batch
+            bool reads_data = false;
+        };
+
+        enum class Access {
+            Reads, Mutates
+        };
+
+        EnvironmentPtr env_;
+        Engine engine_;
+        // the builtins the threads may call, by their values, so that another name for one is just as good
+        std::unordered_map<const Value *, Access> builtins_;
+        // names some set! of the program changes
+        std::unordered_set<SymbolId> assigned_;
+        // names some define of the program binds
+        std::unordered_set<SymbolId> defined_;
+        // lambdas of the definitions evaluated so far whose names no set! changes
+        std::unordered_map<SymbolId, ValuePtr> procedures_;
+        std::vector<Definition> batch_;
+        std::unordered_map<SymbolId, size_t> batch_names_;
+        // names the definitions of the batch use
+        std::unordered_set<SymbolId> batch_uses_;
+        ValuePtr result_;
+
+        void add_builtins(const char *const *begin, const char *const *end, Access access) {
+            for (const auto *name = begin; name != end; ++name) {
+                auto *cell = env_->find_cell(SymbolValue::intern(*name)->get_id());
+                if (cell != nullptr && *cell != nullptr && (*cell)->get_type() == ValueType::Function) {
+                    builtins_[cell->get()] = access;
+                }
+            }
+        }
+
+        // the names the program binds and assigns, the optimizer does not fold calls of them (like in a begin that
+        // is optimized as a whole)
+        void scan(const ValuePtr &ast) {
+            if (ast->get_type() != ValueType::List) {
+                return;
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            if (is_form(list, SpecialForm::Quote)) {
+                return;
+            }
+            if ((is_form(list, SpecialForm::Define) || is_form(list, SpecialForm::Set)) && list->size() > 1 &&
+                list->get_value(1)->get_type() == ValueType::Symbol) {
+                auto name = std::static_pointer_cast<SymbolValue>(list->get_value(1))->get_id();
+                (is_form(list, SpecialForm::Set) ? assigned_ : defined_).insert(name);
+                note_assigned(*env_, name);
+            }
+            for (size_t i = 0; i < list->size(); ++i) {
+                scan(list->get_value(i));
+            }
+        }
+
+        bool is_global(SymbolId name) const {
+            return env_->find_cell(name) != nullptr || defined_.count(name) != 0 || batch_names_.count(name) != 0;
+        }
+
+        void walk(const ValuePtr &ast, bool in_lambda, Effects &effects) {
+            if (ast->get_type() == ValueType::Symbol) {
+                use(std::static_pointer_cast<SymbolValue>(ast)->get_id(), effects);
+                return;
+            }
+            if (ast->get_type() != ValueType::List) {
+                return;
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            size_t start = 0;
+            if (list->size() > 0 && list->get_value(0)->get_type() == ValueType::Symbol &&
+                car<SymbolValue>(list)->get_id() < static_cast<SymbolId>(SpecialForm::Count)) {
+                // the names bound by let, do and the others are walked like uses, which only makes it stricter
+                start = 1;
+                switch (static_cast<SpecialForm>(car<SymbolValue>(list)->get_id())) {
+                    case SpecialForm::Quote:
+                        return;
+                    case SpecialForm::Lambda:
+                        for (size_t i = 2; i < list->size(); ++i) {
+                            walk(list->get_value(i), true, effects);
+                        }
+                        return;
+                    case SpecialForm::Set:
+                        if (list->size() > 1 && list->get_value(1)->get_type() == ValueType::Symbol &&
+                            is_global(std::static_pointer_cast<SymbolValue>(list->get_value(1))->get_id())) {
+                            effects.unsafe = true;
+                        }
+                        start = 2;
+                        break;
+                    case SpecialForm::Define:
+                        // only a define in a lambda body binds a local variable
+                        effects.unsafe = effects.unsafe || !in_lambda;
+                        start = 2;
+                        break;
+                    case SpecialForm::DefineSyntax:
+                        effects.unsafe = true;
+                        return;
+                    default:
+                        break;
+                }
+            }
+            for (size_t i = start; i < list->size(); ++i) {
+                walk(list->get_value(i), in_lambda, effects);
+            }
+        }
+
+        void use(SymbolId name, Effects &effects) {
+            if (!effects.names.insert(name).second) {
+                return;
+            }
+            if (batch_names_.count(name) != 0) {
+                effects.reads_data = true;
+                return;
+            }
+            auto procedure = procedures_.find(name);
+            if (procedure != procedures_.end()) {
+                walk(procedure->second, false, effects);
+                return;
+            }
+            auto *cell = env_->find_cell(name);
+            // a local variable, or a global that is not defined yet, which the threads do not find either
+            if (cell == nullptr || *cell == nullptr) {
+                return;
+            }
+            switch ((*cell)->get_type()) {
+                case ValueType::Function: {
+                    auto builtin = builtins_.find(cell->get());
+                    if (builtin == builtins_.end()) {
+                        effects.unsafe = true;
+                    } else if (builtin->second == Access::Mutates) {
+                        effects.mutates = true;
+                    }
+                    return;
+                }
+                case ValueType::List:
+                case ValueType::Stream:
+                    effects.reads_data = true;
+                    return;
+                case ValueType::Integer:
+                case ValueType::Float:
+                case ValueType::String:
+                case ValueType::Bool:
+                case ValueType::Nil:
+                case ValueType::Symbol:
+                case ValueType::Error:
+                    return;
+                default:
+                    // closures that are not known, macros, threads, channels and environments
+                    effects.unsafe = true;
+            }
+        }
+
+        // definitions of lambdas and constants are evaluated right away
+        static bool is_immediate(const ValuePtr &expression) {
+            if (expression->get_type() == ValueType::Symbol) {
+                return false;
+            }
+            if (expression->get_type() != ValueType::List) {
+                return true;
+            }
+            auto list = std::static_pointer_cast<ListValue>(expression);
+            return is_form(list, SpecialForm::Lambda) || is_form(list, SpecialForm::Quote);
+        }
+
+        // the name a form defines must not be bound before the batch is done if a definition of the batch uses it
+        void end_batch_before(SymbolId name) {
+            if (batch_names_.count(name) != 0 || batch_uses_.count(name) != 0) {
+                evaluate_batch();
+            }
+        }
+
+        void evaluate(const ValuePtr &form) {
+            result_ = engine_(form, env_);
+        }
+
+        void load(const ValuePtr &form) {
+            if (form->get_type() != ValueType::List) {
+                evaluate_batch();
+                evaluate(form);
+                return;
+            }
+            auto list = std::static_pointer_cast<ListValue>(form);
+            if (!is_form(list, SpecialForm::Define) || list->size() != 3 ||
+                list->get_value(1)->get_type() != ValueType::Symbol) {
+                evaluate_batch();
+                evaluate(form);
+                return;
+            }
+            auto name = std::static_pointer_cast<SymbolValue>(list->get_value(1))->get_id();
+            auto expression = std::static_pointer_cast<ListValue>(expand_macros(form, env_))->get_value(2);
+            if (is_immediate(expression)) {
+                end_batch_before(name);
+                evaluate(form);
+                if (expression->get_type() == ValueType::List && is_form(std::static_pointer_cast<ListValue>(expression),
+                                                                         SpecialForm::Lambda) &&
+                    assigned_.count(name) == 0) {
+                    procedures_[name] = expression;
+                } else {
+                    procedures_.erase(name);
+                }
+                return;
+            }
+            Effects effects;
+            walk(expression, false, effects);
+            if (effects.unsafe || (effects.mutates && effects.reads_data)) {
+                evaluate_batch();
+                evaluate(form);
+                procedures_.erase(name);
+                return;
+            }
+            end_batch_before(name);
+            size_t level = 0;
+            for (auto used: effects.names) {
+                auto found = batch_names_.find(used);
+                if (found != batch_names_.end()) {
+                    level = std::max(level, batch_[found->second].level + 1);
+                }
+            }
+            auto thunk = make_list({SymbolValue::from_id(static_cast<SymbolId>(SpecialForm::Lambda)),
+                                    std::make_shared<ListValue>(), list->get_value(2)});
+            batch_names_[name] = batch_.size();
+            batch_.push_back({name, engine_(thunk, env_), level});
+            batch_uses_.insert(effects.names.begin(), effects.names.end());
+        }
+
+        void evaluate_batch() {
+            auto batch = std::move(batch_);
+            batch_.clear();
+            batch_names_.clear();
+            batch_uses_.clear();
+            size_t levels = 0;
+            for (const auto &definition: batch) {
+                levels = std::max(levels, definition.level + 1);
+            }
+            for (size_t level = 0; level < levels; ++level) {
+                std::vector<const Definition *> definitions;
+                for (const auto &definition: batch) {
+                    if (definition.level == level) {
+                        definitions.push_back(&definition);
+                    }
+                }
+                evaluate_level(definitions);
+            }
+        }
+
+        void evaluate_level(const std::vector<const Definition *> &definitions) {
+            auto count = definitions.size();
+            std::vector<ValuePtr> values(count);
+            std::vector<std::exception_ptr> errors(count);
+            auto evaluate_definition = [&](size_t i) {
+                try {
+                    std::vector<ValuePtr> args;
+                    values[i] = call_procedure(definitions[i]->thunk, args, "define");
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            };
+            // this thread starts alone and only starts the others once the level takes long enough, see
+            // LOAD_SEQUENTIAL_MS
+            auto start = std::chrono::steady_clock::now();
+            size_t first = 0;
+            bool failed = false;
+            while (!failed && first < count &&
+                   (count - first == 1 ||
+                    std::chrono::steady_clock::now() - start < std::chrono::milliseconds(sequential_ms))) {
+                evaluate_definition(first);
+                failed = errors[first++] != nullptr;
+            }
+            if (!failed && first < count) {
+                std::atomic<size_t> next{first};
+                auto work = [&] {
+                    for (auto i = next++; i < count; i = next++) {
+                        evaluate_definition(i);
+                    }
+                };
+                std::vector<std::thread> threads;
+                for (size_t i = 1; i < std::min(count - first, load_threads()); ++i) {
+                    threads.emplace_back(work);
+                }
+                work();
+                for (auto &thread: threads) {
+                    thread.join();
+                }
+                parallel_count += count - first;
+            }
+            // the values are defined in the order of the file, up to the first error
+            for (size_t i = 0; i < count; ++i) {
+                if (errors[i] != nullptr) {
+                    std::rethrow_exception(errors[i]);
+                }
+                auto name = definitions[i]->name;
+                evaluate(make_list({SymbolValue::from_id(static_cast<SymbolId>(SpecialForm::Define)),
+                                    SymbolValue::from_id(name),
+                                    make_list({SymbolValue::from_id(static_cast<SymbolId>(SpecialForm::Quote)),
+                                               values[i]})}));
+                procedures_.erase(name);
+            }
+        }
+
+    public:
+        Loader(EnvironmentPtr env, Engine engine) : env_(std::move(env)), engine_(engine) {
+            add_builtins(std::begin(READING_BUILTINS), std::end(READING_BUILTINS), Access::Reads);
+            add_builtins(std::begin(MUTATING_BUILTINS), std::end(MUTATING_BUILTINS), Access::Mutates);
+        }
+
+        ValuePtr run(const ListPtr &program) {
+            scan(program);
+            for (size_t i = 1; i < program->size(); ++i) {
+                load(program->get_value(i));
+            }
+            evaluate_batch();
+            return result_;
+        }
+    };
+}
+
+bool is_form(const ListPtr &list, SpecialForm form) {
+    return list->size() > 0 && list->get_value(0)->get_type() == ValueType::Symbol &&
+           car<SymbolValue>(list)->get_id() == static_cast<SymbolId>(form);
+}
+
+ValuePtr load_program(const ValuePtr &program, const EnvironmentPtr &env, Engine engine) {
+    if (load_threads() == 1 || program->get_type() != ValueType::List ||
+        !is_form(std::static_pointer_cast<ListValue>(program), SpecialForm::Begin) ||
+        std::static_pointer_cast<ListValue>(program)->size() < 2) {
+        return engine(program, env);
+    }
+    return Loader(env, engine).run(std::static_pointer_cast<ListValue>(program));
+}
+
+void set_load_threads(size_t threads, size_t sequential) {
+    threads_setting = threads;
+    sequential_ms = sequential;
+}
+
+size_t load_threads() {
+    if (threads_setting != 0) {
+        return threads_setting;
+    }
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+size_t parallel_definitions() {
+    return parallel_count;
+}
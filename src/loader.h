@@ -0,0 +1,51 @@
+#ifndef SCHEME_LOADER_H
+#define SCHEME_LOADER_H
+
+#include "util.h"
+#include "native.h"
+
+// Loading a program file: the top level forms of its begin are evaluated one after another, except that the
+// initializers of independent definitions are evaluated at the same time on a pool of threads.
+//
+// A (define name expression) joins the batch of definitions being collected if evaluating the expression cannot be
+// seen by anything else: after macro expansion it, and the bodies of the procedures it may call (the lambdas of
+// earlier definitions of the file that no set! changes), only use builtins without side effects outside of the
+// objects they make, constants, local variables, and global data (which it may not mutate with set-car!, set-cdr!
+// or vector-set! then). Every other form first evaluates the batch, then is evaluated itself. Definitions of
+// lambdas and constants are evaluated right away, they take no time. A form that uses a name a definition of the
+// batch binds waits for it. A form that binds a name some definition of the batch uses ends the batch first, so that
+// the definition still sees the old binding.
+//
+// The batch is evaluated in levels: the definitions that wait for none of the batch, then those that wait for them,
+// and so on. The expressions of a level are compiled (or analyzed) before, by the thread that loads the file, and
+// evaluated by up to load_threads() threads (see LOAD_SEQUENTIAL_MS); their values are then defined in the order of the file. Only the code
+// of the expressions runs on the other threads, the global environment does not change while they run. If an
+// expression raises an error, the error of the first of them in the file is raised once its level is done.
+
+// builtins that change the list or vector they are given, the loader and the watcher (see watch.h) look for calls of
+// them
+inline constexpr const char *MUTATING_BUILTINS[] = {"set-car!", "set-cdr!", "vector-set!"};
+
+// the list is a use of the special form
+bool is_form(const ListPtr &list, SpecialForm form);
+
+// the program with its top level forms evaluated by the engine as described above, a program that is not a begin is
+// just evaluated
+ValuePtr load_program(const ValuePtr &program, const EnvironmentPtr &env, Engine engine);
+
+// A level is evaluated by the loading thread alone until it took this long, only the rest of its definitions are
+// shared with other threads. Once a process has started a thread, libstdc++ updates the reference counts of every
+// shared_ptr atomically for the rest of the run, which makes the interpreter slower: a file of quick definitions is
+// better off without threads.
+constexpr size_t LOAD_SEQUENTIAL_MS = 10;
+
+// number of threads a level is evaluated by, 0 (the default) means one per core, and with 1 the program is evaluated
+// by the engine as a whole (--threads=n), and the time a level runs on one thread before the others are started
+void set_load_threads(size_t threads, size_t sequential_ms = LOAD_SEQUENTIAL_MS);
+
+size_t load_threads();
+
+// number of definitions loaded so far that were evaluated together with others
+size_t parallel_definitions();
+
+#endif //SCHEME_LOADER_H
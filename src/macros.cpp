@@ -0,0 +1,610 @@
+#include "macros.h"
+#include "optimizer.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace {
+    // expansions of one use (its expansion being a use again) before the expander gives up
+    constexpr size_t MAX_EXPANSIONS = 10000;
+
+    SymbolId ellipsis() {
+        static const SymbolId id = SymbolValue::intern("...")->get_id();
+        return id;
+    }
+
+    SymbolId underscore() {
+        static const SymbolId id = SymbolValue::intern("_")->get_id();
+        return id;
+    }
+
+    SymbolId syntax_rules() {
+        static const SymbolId id = SymbolValue::intern("syntax-rules")->get_id();
+        return id;
+    }
+
+    bool is_symbol(const ValuePtr &value) {
+        return value->get_type() == ValueType::Symbol;
+    }
+
+    bool is_symbol(const ValuePtr &value, SymbolId id) {
+        return is_symbol(value) && std::static_pointer_cast<SymbolValue>(value)->get_id() == id;
+    }
+
+    SymbolId symbol_id(const ValuePtr &value) {
+        return std::static_pointer_cast<SymbolValue>(value)->get_id();
+    }
+
+    bool is_list(const ValuePtr &value) {
+        return value->get_type() == ValueType::List;
+    }
+
+    ListPtr as_list(const ValuePtr &value) {
+        return std::static_pointer_cast<ListValue>(value);
+    }
+
+    // the special form the list starts with, SpecialForm::Count if it does not start with one
+    SpecialForm special_form(const ListPtr &list) {
+        if (list->size() == 0 || !is_symbol(list->get_value(0)) ||
+            symbol_id(list->get_value(0)) >= static_cast<SymbolId>(SpecialForm::Count)) {
+            return SpecialForm::Count;
+        }
+        return static_cast<SpecialForm>(symbol_id(list->get_value(0)));
+    }
+
+    // index of the element followed by an ellipsis, the size of the list if there is none
+    size_t ellipsis_position(const ListPtr &list, size_t start) {
+        for (size_t i = start; i + 1 < list->size(); ++i) {
+            if (is_symbol(list->get_value(i + 1), ellipsis())) {
+                return i;
+            }
+        }
+        return list->size();
+    }
+
+    // what a pattern variable matched, a variable under an ellipsis matched one item for each repetition
+    struct Match {
+        ValuePtr value;
+        bool repeated = false;
+        std::vector<Match> items;
+    };
+
+    using Matches = std::unordered_map<SymbolId, Match>;
+
+    class Matcher {
+        const std::vector<SymbolId> &literals_;
+
+        [[nodiscard]] bool is_literal(SymbolId id) const {
+            return std::find(literals_.begin(), literals_.end(), id) != literals_.end();
+        }
+
+    public:
+        explicit Matcher(const std::vector<SymbolId> &literals) : literals_(literals) {
+        }
+
+        void variables(const ValuePtr &pattern, std::vector<SymbolId> &variables) const {
+            if (is_symbol(pattern)) {
+                auto id = symbol_id(pattern);
+                if (id != ellipsis() && id != underscore() && !is_literal(id)) {
+                    variables.push_back(id);
+                }
+            } else if (is_list(pattern)) {
+                auto list = as_list(pattern);
+                for (size_t i = 0; i < list->size(); ++i) {
+                    this->variables(list->get_value(i), variables);
+                }
+            }
+        }
+
+        bool match(const ValuePtr &pattern, const ValuePtr &form, Matches &matches) const {
+            if (is_symbol(pattern)) {
+                auto id = symbol_id(pattern);
+                if (id == underscore()) {
+                    return true;
+                }
+                if (is_literal(id)) {
+                    return is_symbol(form, id);
+                }
+                matches[id] = Match{form};
+                return true;
+            }
+            if (is_list(pattern)) {
+                return is_list(form) && match_list(as_list(pattern), as_list(form), 0, matches);
+            }
+            return pattern->get_type() == form->get_type() && pattern->to_string() == form->to_string();
+        }
+
+        // matches the elements of the lists from start on
+        bool match_list(const ListPtr &pattern, const ListPtr &form, size_t start, Matches &matches) const {
+            auto repeated = ellipsis_position(pattern, start);
+            if (repeated == pattern->size()) {
+                if (form->size() != pattern->size()) {
+                    return false;
+                }
+                for (size_t i = start; i < pattern->size(); ++i) {
+                    if (!match(pattern->get_value(i), form->get_value(i), matches)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            size_t after = pattern->size() - repeated - 2;
+            if (form->size() < repeated + after) {
+                return false;
+            }
+            for (size_t i = start; i < repeated; ++i) {
+                if (!match(pattern->get_value(i), form->get_value(i), matches)) {
+                    return false;
+                }
+            }
+            std::vector<SymbolId> repeated_variables;
+            variables(pattern->get_value(repeated), repeated_variables);
+            for (auto id: repeated_variables) {
+                matches[id] = Match{nullptr, true, {}};
+            }
+            size_t repeated_end = form->size() - after;
+            for (size_t i = repeated; i < repeated_end; ++i) {
+                Matches item;
+                if (!match(pattern->get_value(repeated), form->get_value(i), item)) {
+                    return false;
+                }
+                for (auto id: repeated_variables) {
+                    matches[id].items.push_back(std::move(item[id]));
+                }
+            }
+            for (size_t i = 0; i < after; ++i) {
+                if (!match(pattern->get_value(repeated + 2 + i), form->get_value(repeated_end + i), matches)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    // names the template binds with lambda, let, let*, letrec, a named let or do
+    void collect_binders(const ValuePtr &tmpl, std::vector<SymbolId> &binders) {
+        if (!is_list(tmpl)) {
+            return;
+        }
+        auto list = as_list(tmpl);
+        auto add = [&binders](const ValuePtr &name) {
+            if (is_symbol(name) && symbol_id(name) != ellipsis()) {
+                binders.push_back(symbol_id(name));
+            }
+        };
+        auto add_bindings = [&add](const ValuePtr &bindings) {
+            if (!is_list(bindings)) {
+                return;
+            }
+            for (size_t i = 0; i < as_list(bindings)->size(); ++i) {
+                auto binding = as_list(bindings)->get_value(i);
+                if (is_list(binding) && as_list(binding)->size() > 0) {
+                    add(car<Value>(binding));
+                }
+            }
+        };
+        switch (special_form(list)) {
+            case SpecialForm::Lambda:
+            case SpecialForm::Receive:
+                if (list->size() > 1 && is_list(list->get_value(1))) {
+                    for (size_t i = 0; i < as_list(list->get_value(1))->size(); ++i) {
+                        add(as_list(list->get_value(1))->get_value(i));
+                    }
+                }
+                break;
+            case SpecialForm::Let:
+            case SpecialForm::LetStar:
+            case SpecialForm::Letrec:
+                if (list->size() > 2 && is_symbol(list->get_value(1))) {
+                    add(list->get_value(1));
+                    add_bindings(list->get_value(2));
+                } else if (list->size() > 1) {
+                    add_bindings(list->get_value(1));
+                }
+                break;
+            case SpecialForm::Do:
+                if (list->size() > 1) {
+                    add_bindings(list->get_value(1));
+                }
+                break;
+            case SpecialForm::Guard:
+                if (list->size() > 1 && is_list(list->get_value(1)) && as_list(list->get_value(1))->size() > 0) {
+                    add(car<Value>(list->get_value(1)));
+                }
+                break;
+            default:
+                break;
+        }
+        for (size_t i = 0; i < list->size(); ++i) {
+            collect_binders(list->get_value(i), binders);
+        }
+    }
+
+    class Instantiator {
+        // the matches of the rule, then the items of the repetitions being instantiated
+        std::vector<const Matches *> matches_;
+        std::unordered_map<SymbolId, ValuePtr> renames_;
+
+        const Match *lookup(SymbolId id) const {
+            for (auto it = matches_.rbegin(); it != matches_.rend(); ++it) {
+                auto found = (*it)->find(id);
+                if (found != (*it)->end()) {
+                    return &found->second;
+                }
+            }
+            return nullptr;
+        }
+
+        void repeated_variables(const ValuePtr &tmpl, std::vector<SymbolId> &variables) const {
+            if (is_symbol(tmpl)) {
+                auto match = lookup(symbol_id(tmpl));
+                if (match != nullptr && match->repeated &&
+                    std::find(variables.begin(), variables.end(), symbol_id(tmpl)) == variables.end()) {
+                    variables.push_back(symbol_id(tmpl));
+                }
+            } else if (is_list(tmpl)) {
+                for (size_t i = 0; i < as_list(tmpl)->size(); ++i) {
+                    repeated_variables(as_list(tmpl)->get_value(i), variables);
+                }
+            }
+        }
+
+        // adds an instance of the subtemplate for each item its repeated pattern variables matched
+        void repeat(const ValuePtr &tmpl, const ListPtr &result) {
+            std::vector<SymbolId> variables;
+            repeated_variables(tmpl, variables);
+            if (variables.empty()) {
+                throw std::runtime_error("syntax-rules: no pattern variable of an ellipsis before ... in " +
+                                         tmpl->to_string());
+            }
+            auto count = lookup(variables[0])->items.size();
+            for (auto id: variables) {
+                if (lookup(id)->items.size() != count) {
+                    throw std::runtime_error("syntax-rules: pattern variables of " + tmpl->to_string() +
+                                             " matched different numbers of items");
+                }
+            }
+            for (size_t i = 0; i < count; ++i) {
+                Matches item;
+                for (auto id: variables) {
+                    item[id] = lookup(id)->items[i];
+                }
+                matches_.push_back(&item);
+                result->add_value(instantiate(tmpl));
+                matches_.pop_back();
+            }
+        }
+
+    public:
+        Instantiator(const Matches &matches, const ValuePtr &tmpl) : matches_{&matches} {
+            // a fresh name for every binder of every expansion
+            static size_t expansions = 0;
+            auto suffix = " " + std::to_string(++expansions);
+            std::vector<SymbolId> binders;
+            collect_binders(tmpl, binders);
+            for (auto id: binders) {
+                if (matches.find(id) == matches.end()) {
+                    renames_[id] = SymbolValue::intern(SymbolValue::from_id(id)->get_symbol_name() + suffix);
+                }
+            }
+        }
+
+        ValuePtr instantiate(const ValuePtr &tmpl) {
+            if (is_symbol(tmpl)) {
+                auto id = symbol_id(tmpl);
+                if (auto match = lookup(id)) {
+                    if (match->repeated) {
+                        throw std::runtime_error("syntax-rules: " + tmpl->to_string() +
+                                                 " matched under an ellipsis is used without ...");
+                    }
+                    return match->value;
+                }
+                auto renamed = renames_.find(id);
+                return renamed == renames_.end() ? tmpl : renamed->second;
+            }
+            if (!is_list(tmpl)) {
+                return tmpl;
+            }
+            auto list = as_list(tmpl);
+            auto result = std::make_shared<ListValue>();
+            for (size_t i = 0; i < list->size(); ++i) {
+                if (i + 1 < list->size() && is_symbol(list->get_value(i + 1), ellipsis())) {
+                    repeat(list->get_value(i), result);
+                    ++i;
+                } else {
+                    result->add_value(instantiate(list->get_value(i)));
+                }
+            }
+            return result;
+        }
+    };
+
+    // a list pattern has at most one ellipsis, which follows a subpattern
+    void check_pattern(const ValuePtr &pattern) {
+        if (!is_list(pattern)) {
+            return;
+        }
+        auto list = as_list(pattern);
+        size_t ellipses = 0;
+        for (size_t i = 0; i < list->size(); ++i) {
+            if (is_symbol(list->get_value(i), ellipsis())) {
+                if (i == 0 || ++ellipses > 1) {
+                    throw std::runtime_error("define-syntax: misplaced ... in the pattern " + pattern->to_string());
+                }
+            }
+            check_pattern(list->get_value(i));
+        }
+    }
+
+    class Expander {
+        Environment &env_;
+        // names bound by the enclosing lambdas, lets and dos
+        std::vector<SymbolId> locals_;
+        size_t depth_ = 0;
+
+        // names bound in a body, forgotten when the body was expanded
+        class Scope {
+            Expander &expander_;
+            size_t mark_;
+        public:
+            explicit Scope(Expander &expander) : expander_(expander), mark_(expander.locals_.size()) {
+                ++expander_.depth_;
+            }
+
+            ~Scope() {
+                --expander_.depth_;
+                expander_.locals_.resize(mark_);
+            }
+
+            void bind(const ValuePtr &name) {
+                if (is_symbol(name)) {
+                    expander_.locals_.push_back(symbol_id(name));
+                }
+            }
+
+            void bind_bindings(const ValuePtr &bindings) {
+                for (size_t i = 0; i < as_list(bindings)->size(); ++i) {
+                    auto binding = as_list(bindings)->get_value(i);
+                    if (is_list(binding) && as_list(binding)->size() > 0) {
+                        bind(car<Value>(binding));
+                    }
+                }
+            }
+
+            // internal defines of a body
+            void bind_defines(const ListPtr &body, size_t start) {
+                for (size_t i = start; i < body->size(); ++i) {
+                    auto form = body->get_value(i);
+                    if (is_list(form) && special_form(as_list(form)) == SpecialForm::Define &&
+                        as_list(form)->size() > 1) {
+                        bind(as_list(form)->get_value(1));
+                    }
+                }
+            }
+        };
+
+        // the macro the form uses, nullptr if it is not a macro use
+        const Macro *macro_of(const ListPtr &list) {
+            if (list->size() == 0 || !is_symbol(list->get_value(0))) {
+                return nullptr;
+            }
+            auto id = symbol_id(list->get_value(0));
+            if (id < static_cast<SymbolId>(SpecialForm::Count) ||
+                std::find(locals_.begin(), locals_.end(), id) != locals_.end()) {
+                return nullptr;
+            }
+            auto cell = env_.find_cell(id);
+            if (cell == nullptr || (*cell)->get_type() != ValueType::Macro) {
+                return nullptr;
+            }
+            return static_cast<const Macro *>(cell->get());
+        }
+
+        ListPtr expand_elements(const ListPtr &list, size_t start) {
+            auto result = std::make_shared<ListValue>();
+            for (size_t i = 0; i < list->size(); ++i) {
+                result->add_value(i < start ? list->get_value(i) : expand(list->get_value(i)));
+            }
+            return result;
+        }
+
+        // bindings of a let or a do, the names stay as they are
+        ListPtr expand_bindings(const ValuePtr &bindings) {
+            auto result = std::make_shared<ListValue>();
+            for (size_t i = 0; i < as_list(bindings)->size(); ++i) {
+                auto binding = as_list(bindings)->get_value(i);
+                result->add_value(is_list(binding) ? expand_elements(as_list(binding), 1) : binding);
+            }
+            return result;
+        }
+
+        ValuePtr define_syntax(const ListPtr &list) {
+            if (depth_ > 0) {
+                throw std::runtime_error("define-syntax: only allowed at the top level");
+            }
+            if (list->size() != 3 || !is_symbol(list->get_value(1))) {
+                throw std::runtime_error("define-syntax: expected a name and a syntax-rules form");
+            }
+            auto name = symbol_id(list->get_value(1));
+            if (name < static_cast<SymbolId>(SpecialForm::Count)) {
+                throw std::runtime_error("define-syntax: cannot redefine " + list->get_value(1)->to_string());
+            }
+            auto spec = list->get_value(2);
+            if (!is_list(spec) || as_list(spec)->size() < 2 || !is_symbol(as_list(spec)->get_value(0), syntax_rules()) ||
+                !is_list(as_list(spec)->get_value(1))) {
+                throw std::runtime_error("define-syntax: expected (syntax-rules (literal ...) (pattern template) ...)");
+            }
+            std::vector<SymbolId> literals;
+            auto literal_list = as_list(as_list(spec)->get_value(1));
+            for (size_t i = 0; i < literal_list->size(); ++i) {
+                if (!is_symbol(literal_list->get_value(i))) {
+                    throw std::runtime_error("define-syntax: literals have to be symbols");
+                }
+                literals.push_back(symbol_id(literal_list->get_value(i)));
+            }
+            std::vector<std::pair<ListPtr, ValuePtr> > rules;
+            for (size_t i = 2; i < as_list(spec)->size(); ++i) {
+                auto rule = as_list(spec)->get_value(i);
+                if (!is_list(rule) || as_list(rule)->size() != 2 || !is_list(car<Value>(rule)) ||
+                    car<ListValue>(rule)->size() == 0) {
+                    throw std::runtime_error("define-syntax: expected a (pattern template) rule but got " +
+                                             rule->to_string());
+                }
+                check_pattern(car<Value>(rule));
+                rules.emplace_back(car<ListValue>(rule), as_list(rule)->get_value(1));
+            }
+            env_.set(name, std::make_shared<Macro>(std::move(literals), std::move(rules)));
+            // a builtin of the same name is not one anymore
+            note_assigned(env_, name);
+            auto quoted = std::make_shared<ListValue>();
+            quoted->add_value(SymbolValue::from_id(static_cast<SymbolId>(SpecialForm::Quote)));
+            quoted->add_value(list->get_value(1));
+            return quoted;
+        }
+
+    public:
+        explicit Expander(Environment &env) : env_(env) {
+        }
+
+        ValuePtr expand(const ValuePtr &ast) {
+            if (!is_list(ast)) {
+                return ast;
+            }
+            auto list = as_list(ast);
+            for (size_t expansions = 0; auto macro = macro_of(list); ++expansions) {
+                if (expansions == MAX_EXPANSIONS) {
+                    throw std::runtime_error("macro expansion of " + list->get_value(0)->to_string() +
+                                             " does not terminate");
+                }
+                auto expanded = macro->expand(list);
+                if (!is_list(expanded)) {
+                    return expanded;
+                }
+                list = as_list(expanded);
+            }
+            switch (special_form(list)) {
+                case SpecialForm::Quote:
+                    return list;
+                case SpecialForm::DefineSyntax:
+                    return define_syntax(list);
+                case SpecialForm::Lambda: {
+                    if (list->size() < 2 || !is_list(list->get_value(1))) {
+                        return list;
+                    }
+                    Scope scope(*this);
+                    for (size_t i = 0; i < as_list(list->get_value(1))->size(); ++i) {
+                        scope.bind(as_list(list->get_value(1))->get_value(i));
+                    }
+                    scope.bind_defines(list, 2);
+                    return expand_elements(list, 2);
+                }
+                case SpecialForm::Let:
+                case SpecialForm::LetStar:
+                case SpecialForm::Letrec: {
+                    // the bindings of a named let come after its name
+                    size_t position = list->size() > 2 && is_symbol(list->get_value(1)) ? 2 : 1;
+                    if (list->size() <= position || !is_list(list->get_value(position))) {
+                        return list;
+                    }
+                    Scope scope(*this);
+                    if (position == 2) {
+                        scope.bind(list->get_value(1));
+                    }
+                    scope.bind_bindings(list->get_value(position));
+                    scope.bind_defines(list, position + 1);
+                    auto result = expand_elements(list, position + 1);
+                    result->set_value(position, expand_bindings(list->get_value(position)));
+                    return result;
+                }
+                case SpecialForm::Do: {
+                    if (list->size() < 3 || !is_list(list->get_value(1)) || !is_list(list->get_value(2))) {
+                        return list;
+                    }
+                    Scope scope(*this);
+                    scope.bind_bindings(list->get_value(1));
+                    auto result = expand_elements(list, 3);
+                    result->set_value(1, expand_bindings(list->get_value(1)));
+                    result->set_value(2, expand_elements(as_list(list->get_value(2)), 0));
+                    return result;
+                }
+                case SpecialForm::Receive: {
+                    // the expression is outside of the scope of the variables
+                    if (list->size() < 3 || !is_list(list->get_value(1))) {
+                        return list;
+                    }
+                    auto expression = expand(list->get_value(2));
+                    Scope scope(*this);
+                    for (size_t i = 0; i < as_list(list->get_value(1))->size(); ++i) {
+                        scope.bind(as_list(list->get_value(1))->get_value(i));
+                    }
+                    scope.bind_defines(list, 3);
+                    auto result = expand_elements(list, 3);
+                    result->set_value(2, expression);
+                    return result;
+                }
+                case SpecialForm::Guard: {
+                    // the body is outside of the scope of the variable, the clauses are those of cond
+                    if (list->size() < 2 || !is_list(list->get_value(1)) || as_list(list->get_value(1))->size() == 0) {
+                        return list;
+                    }
+                    auto result = expand_elements(list, 2);
+                    auto clauses = as_list(list->get_value(1));
+                    Scope scope(*this);
+                    scope.bind(clauses->get_value(0));
+                    auto expanded = std::make_shared<ListValue>();
+                    expanded->add_value(clauses->get_value(0));
+                    for (size_t i = 1; i < clauses->size(); ++i) {
+                        auto clause = clauses->get_value(i);
+                        expanded->add_value(is_list(clause) ? expand_elements(as_list(clause), 0) : clause);
+                    }
+                    result->set_value(1, expanded);
+                    return result;
+                }
+                case SpecialForm::Define:
+                case SpecialForm::Set:
+                    return expand_elements(list, 2);
+                case SpecialForm::Case: {
+                    // the datums of the clauses are not expanded
+                    auto result = expand_elements(list, list->size());
+                    if (list->size() > 1) {
+                        result->set_value(1, expand(list->get_value(1)));
+                    }
+                    for (size_t i = 2; i < list->size(); ++i) {
+                        if (is_list(list->get_value(i))) {
+                            result->set_value(i, expand_elements(as_list(list->get_value(i)), 1));
+                        }
+                    }
+                    return result;
+                }
+                case SpecialForm::Cond: {
+                    auto result = std::make_shared<ListValue>();
+                    result->add_value(list->get_value(0));
+                    for (size_t i = 1; i < list->size(); ++i) {
+                        auto clause = list->get_value(i);
+                        result->add_value(is_list(clause) ? expand_elements(as_list(clause), 0) : clause);
+                    }
+                    return result;
+                }
+                default:
+                    return expand_elements(list, 0);
+            }
+        }
+    };
+}
+
+ValuePtr Macro::expand(const ListPtr &use) const {
+    Matcher matcher(literals);
+    for (const auto &[pattern, tmpl]: rules) {
+        Matches matches;
+        if (matcher.match_list(pattern, use, 1, matches)) {
+            return Instantiator(matches, tmpl).instantiate(tmpl);
+        }
+    }
+    throw std::runtime_error("syntax-rules: no rule of " + use->get_value(0)->to_string() + " matches " +
+                             use->to_string());
+}
+
+ValuePtr expand_macros(const ValuePtr &ast, const EnvironmentPtr &env) {
+    return Expander(*env).expand(ast);
+}
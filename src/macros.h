@@ -0,0 +1,45 @@
+#ifndef SCHEME_MACROS_H
+#define SCHEME_MACROS_H
+
+#include "util.h"
+#include <utility>
+#include <vector>
+
+// Macros: (define-syntax name (syntax-rules (literal ...) (pattern template) ...)).
+//
+// Macros are expanded before a form is optimized and analyzed (or compiled): the expansion replaces the use in the
+// form, so the nodes of a closure body (or its bytecode) only contain the expanded code, and calling the closure
+// again never expands anything. A use costs nothing at run time compared to writing the expansion by hand.
+//
+// define-syntax binds the name in the global environment to a Macro as soon as the expander gets to it, so the forms
+// after it, later forms of the same begin included, can use the macro. It is only allowed at the top level and
+// evaluates to the name. A name bound by an enclosing lambda, let or do is a variable there and is not expanded.
+//
+// The first rule whose pattern matches the use is expanded (the keyword at the start of the pattern is ignored).
+// Patterns are lists of pattern variables, literals (which match the same symbol), _ (matches anything) and
+// constants; a subpattern followed by ... matches any number of elements, and the elements after it match the end
+// of the list. In the template a subtemplate followed by ... is repeated for each element its pattern variables
+// matched. Names that the template binds with lambda, let, let*, letrec, a named let or do are renamed on every
+// expansion, so they cannot capture names of the arguments; other names mean what they mean where the macro is used.
+class Macro : public Value {
+public:
+    Macro(std::vector<SymbolId> literals, std::vector<std::pair<ListPtr, ValuePtr> > rules)
+            : Value(ValueType::Macro), literals(std::move(literals)), rules(std::move(rules)) {
+    }
+
+    [[nodiscard]] std::string to_string() const override {
+        return "#<macro>";
+    }
+
+    std::vector<SymbolId> literals;
+    // pattern and template of each rule
+    std::vector<std::pair<ListPtr, ValuePtr> > rules;
+
+    // expansion of a use of the macro
+    [[nodiscard]] ValuePtr expand(const ListPtr &use) const;
+};
+
+// the form with every macro use expanded, define-syntax forms define their macros in env
+ValuePtr expand_macros(const ValuePtr &ast, const EnvironmentPtr &env);
+
+#endif //SCHEME_MACROS_H
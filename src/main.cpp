@@ -5,42 +5,96 @@
 #include "printer.h"
 #include "datatypes/environment.h"
 #include "evaluator.h"
+#include "vm.h"
+#include "jit.h"
+#include "native.h"
+#include "loader.h"
+#include "watch.h"
+#include <vector>
 
+// tree walking eval is the reference engine, the vm compiles forms to bytecode first, Engine is in native.h
 
-void rep(const EnvironmentPtr &env) {
+// compiled libraries loaded into the environment before the file or the repl runs
+std::vector<std::string> libraries;
+
+EnvironmentPtr make_environment(Engine engine) {
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    for (const auto &library: libraries) {
+        load_library(library, env, engine);
+    }
+    return env;
+}
+
+void rep(const EnvironmentPtr &env, Engine engine) {
     try {
-        print(*eval(read_stdin(), env));
+        print(*engine(read_stdin(), env));
     } catch (std::exception &e) {
         std::cout << e.what() << std::endl;
     }
 }
 
-void execute_file(const std::string &path) {
-    BaseEnvironment e;
-    EnvironmentPtr eptr = std::make_shared<BaseEnvironment>(e);
-    print(*eval(read_file(path), eptr));
+void execute_file(const std::string &path, Engine engine) {
+    EnvironmentPtr eptr = make_environment(engine);
+    print(*load_program(read_file(path), eptr, engine));
 }
 
 
-[[noreturn]] void repl() {
-    BaseEnvironment environment;
-    EnvironmentPtr environment_ptr = std::make_shared<BaseEnvironment>(environment);
+[[noreturn]] void repl(Engine engine) {
+    EnvironmentPtr environment_ptr = make_environment(engine);
     while (true) {
         std::cout << ">> ";
-        rep(environment_ptr);
+        rep(environment_ptr, engine);
     }
 
 }
 
 int main(int argc, char const *argv[]) {
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        execute_file((std::string &) argv[1]);
+    Engine engine = eval;
+    std::string path;
+    bool compile = false;
+    bool watch = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--engine=vm") {
+            engine = vm_eval;
+        } else if (arg == "--engine=tree") {
+            engine = eval;
+        } else if (arg == "--no-jit") {
+            set_jit_enabled(false);
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            set_load_threads(std::stoul(arg.substr(10)));
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--compile") {
+            compile = true;
+        } else if (arg.rfind("--load=", 0) == 0) {
+            libraries.push_back(arg.substr(7));
+        } else if (path.empty() && arg.rfind("--", 0) != 0) {
+            path = arg;
+        } else {
+            std::cout << "Usage: " << argv[0] << " [--engine=tree|vm] [--no-jit] [--threads=n] [--load=library.so]... [--watch] [file]" << std::endl;
+            std::cout << "       " << argv[0] << " --compile library.scm" << std::endl;
+            std::cout << "If no file is specified, the repl will be started" << std::endl;
+            return 1;
+        }
+    }
+
+    if (compile) {
+        if (path.empty()) {
+            std::cout << "--compile needs a file" << std::endl;
+            return 1;
+        }
+        std::cout << compile_library(path) << std::endl;
+    } else if (watch) {
+        if (path.empty()) {
+            std::cout << "--watch needs a file" << std::endl;
+            return 1;
+        }
+        watch_file(path, make_environment(engine), engine);
+    } else if (path.empty()) {
+        repl(engine);
     } else {
-        std::cout << "Usage: " << argv[0] << " [file]" << std::endl;
-        std::cout << "If no file is specified, the repl will be started" << std::endl;
-        return 1;
+        execute_file(path, engine);
     }
 
     return 0;
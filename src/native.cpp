@@ -0,0 +1,724 @@
+#include "native.h"
+#include "evaluator.h"
+#include "optimizer.h"
+#include "reader.h"
+#include "datatypes/closure.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <sstream>
+
+// the compiler and headers the generated code is built with, set by the build
+#ifndef SCHEME_CXX
+#define SCHEME_CXX "c++"
+#endif
+#ifndef SCHEME_INCLUDE_DIR
+#define SCHEME_INCLUDE_DIR "src"
+#endif
+
+namespace {
+    // the value as one word of a command of the shell
+    std::string shell_word(const std::string &value) {
+        std::string result = "'";
+        for (char c: value) {
+            // a quote ends the quoted part, is given by itself and starts a new one
+            if (c == '\'') {
+                result += "'\\''";
+            } else {
+                result += c;
+            }
+        }
+        return result + "'";
+    }
+
+    std::string cpp_string(const std::string &value) {
+        std::string result = "\"";
+        for (unsigned char c: value) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += static_cast<char>(c);
+            } else if (c < 0x20 || c >= 0x7f) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof escaped, "\\%03o", c);
+                result += escaped;
+            } else {
+                result += static_cast<char>(c);
+            }
+        }
+        return result + "\"";
+    }
+
+    bool is_symbol(const ValuePtr &value) {
+        return value->get_type() == ValueType::Symbol;
+    }
+
+    SymbolId symbol_id(const ValuePtr &value) {
+        return std::static_pointer_cast<SymbolValue>(value)->get_id();
+    }
+
+    // the special form the list starts with, SpecialForm::Count if it is a call (or not a list)
+    SpecialForm special_form(const ValuePtr &ast) {
+        if (ast->get_type() != ValueType::List) {
+            return SpecialForm::Count;
+        }
+        auto list = std::static_pointer_cast<ListValue>(ast);
+        if (list->size() == 0 || !is_symbol(list->get_value(0)) ||
+            symbol_id(list->get_value(0)) >= static_cast<SymbolId>(SpecialForm::Count)) {
+            return SpecialForm::Count;
+        }
+        return static_cast<SpecialForm>(symbol_id(list->get_value(0)));
+    }
+
+    bool translatable_sequence(const ListPtr &list, size_t start, bool &sets);
+
+    // the expression only uses the forms that are translated, sets is set if it has a set!
+    bool translatable(const ValuePtr &ast, bool &sets) {
+        if (ast->get_type() != ValueType::List) {
+            return true;
+        }
+        auto list = std::static_pointer_cast<ListValue>(ast);
+        switch (special_form(ast)) {
+            case SpecialForm::Quote:
+                return list->size() == 2;
+            case SpecialForm::If:
+                return list->size() >= 3 && list->size() <= 4 && translatable_sequence(list, 1, sets);
+            case SpecialForm::Cond:
+                for (size_t i = 1; i < list->size(); ++i) {
+                    auto clause = list->get_value(i);
+                    if (clause->get_type() != ValueType::List ||
+                        std::static_pointer_cast<ListValue>(clause)->size() == 0 ||
+                        !translatable_sequence(std::static_pointer_cast<ListValue>(clause), 0, sets)) {
+                        return false;
+                    }
+                }
+                return true;
+            case SpecialForm::Let:
+            case SpecialForm::LetStar:
+            case SpecialForm::Letrec: {
+                if (list->size() < 3 || list->get_value(1)->get_type() != ValueType::List) {
+                    return false;
+                }
+                auto bindings = std::static_pointer_cast<ListValue>(list->get_value(1));
+                for (size_t i = 0; i < bindings->size(); ++i) {
+                    auto binding = bindings->get_value(i);
+                    if (binding->get_type() != ValueType::List ||
+                        std::static_pointer_cast<ListValue>(binding)->size() != 2 ||
+                        !is_symbol(car<Value>(binding)) ||
+                        !translatable(std::static_pointer_cast<ListValue>(binding)->get_value(1), sets)) {
+                        return false;
+                    }
+                }
+                return translatable_sequence(list, 2, sets);
+            }
+            case SpecialForm::Begin:
+                return translatable_sequence(list, 1, sets);
+            case SpecialForm::Set:
+                sets = true;
+                return list->size() == 3 && is_symbol(list->get_value(1)) && translatable(list->get_value(2), sets);
+            case SpecialForm::Count:
+                return translatable_sequence(list, 0, sets);
+            default:
+                // define and lambda
+                return false;
+        }
+    }
+
+    bool translatable_sequence(const ListPtr &list, size_t start, bool &sets) {
+        for (size_t i = start; i < list->size(); ++i) {
+            if (!translatable(list->get_value(i), sets)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // (define name (lambda (params) body)) with a body that can be translated
+    bool is_translatable_define(const ValuePtr &ast) {
+        if (special_form(ast) != SpecialForm::Define) {
+            return false;
+        }
+        auto define = std::static_pointer_cast<ListValue>(ast);
+        if (define->size() != 3 || !is_symbol(define->get_value(1)) ||
+            special_form(define->get_value(2)) != SpecialForm::Lambda) {
+            return false;
+        }
+        auto lambda = std::static_pointer_cast<ListValue>(define->get_value(2));
+        if (lambda->size() < 3 || lambda->get_value(1)->get_type() != ValueType::List) {
+            return false;
+        }
+        auto params = std::static_pointer_cast<ListValue>(lambda->get_value(1));
+        for (size_t i = 0; i < params->size(); ++i) {
+            if (!is_symbol(params->get_value(i))) {
+                return false;
+            }
+        }
+        bool sets = false;
+        return translatable_sequence(lambda, 2, sets);
+    }
+
+    // the expression refers to one of the names (outside of quote)
+    bool mentions(const ValuePtr &ast, const std::vector<SymbolId> &names) {
+        if (is_symbol(ast)) {
+            return std::find(names.begin(), names.end(), symbol_id(ast)) != names.end();
+        }
+        if (ast->get_type() != ValueType::List || special_form(ast) == SpecialForm::Quote) {
+            return false;
+        }
+        auto list = std::static_pointer_cast<ListValue>(ast);
+        for (size_t i = 0; i < list->size(); ++i) {
+            if (mentions(list->get_value(i), names)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // C++ expression that makes the value, for constants and the forms evaluated when the library is loaded
+    std::string construct(const ValuePtr &value) {
+        switch (value->get_type()) {
+            case ValueType::Integer: {
+                auto integer = std::static_pointer_cast<IntegerValue>(value)->get_value();
+                if (integer == std::numeric_limits<std::int64_t>::min()) {
+                    return "std::make_shared<IntegerValue>(std::int64_t(-9223372036854775807) - 1)";
+                }
+                return "std::make_shared<IntegerValue>(std::int64_t(" + std::to_string(integer) + "))";
+            }
+            case ValueType::Float: {
+                auto number = std::static_pointer_cast<FloatValue>(value)->get_value();
+                // %.17g writes them as inf and nan, which are not C++
+                if (std::isnan(number)) {
+                    return "std::make_shared<FloatValue>(std::numeric_limits<double>::quiet_NaN())";
+                }
+                if (std::isinf(number)) {
+                    return std::string("std::make_shared<FloatValue>(") + (number < 0 ? "-" : "") +
+                           "std::numeric_limits<double>::infinity())";
+                }
+                char digits[32];
+                std::snprintf(digits, sizeof digits, "%.17g", number);
+                return "std::make_shared<FloatValue>(" + std::string(digits) + ")";
+            }
+            case ValueType::String:
+                return "std::make_shared<StringValue>(" +
+                       cpp_string(std::static_pointer_cast<StringValue>(value)->get_value()) + ")";
+            case ValueType::Bool:
+                return value->is_true() ? "std::make_shared<BoolValue>(true)" : "std::make_shared<BoolValue>(false)";
+            case ValueType::Nil:
+                return "std::make_shared<NilValue>()";
+            case ValueType::Symbol:
+                return "SymbolValue::intern(" +
+                       cpp_string(std::static_pointer_cast<SymbolValue>(value)->get_symbol_name()) + ")";
+            case ValueType::List: {
+                auto list = std::static_pointer_cast<ListValue>(value);
+                std::string result = "native_list({";
+                for (size_t i = 0; i < list->size(); ++i) {
+                    result += (i == 0 ? "" : ", ") + construct(list->get_value(i));
+                }
+                return result + "})";
+            }
+            default:
+                throw std::runtime_error("compile: cannot translate " + value->to_string());
+        }
+    }
+
+    // a top level define that is translated to a C++ function
+    struct Function {
+        std::string name;
+        ListPtr lambda;
+    };
+
+    class Translator {
+        std::vector<std::string> constants_;
+        // globals the functions refer to, each has a cache
+        std::vector<SymbolId> globals_;
+        std::vector<Function> functions_;
+        // statements of scheme_load after the library is set up
+        std::vector<std::string> forms_;
+        std::ostringstream definitions_;
+
+        // the function being translated
+        std::ostringstream body_;
+        size_t function_ = 0;
+        std::vector<std::string> params_;
+        // local variables in scope, innermost last
+        std::vector<std::pair<SymbolId, std::string> > locals_;
+        size_t variables_ = 0;
+        size_t depth_ = 2;
+        // a set! could change a local variable before it is used, so references copy it
+        bool copy_locals_ = false;
+        bool loops_ = false;
+
+        void line(const std::string &text) {
+            body_ << std::string(4 * depth_, ' ') << text << '\n';
+        }
+
+        std::string variable(const char *prefix) {
+            return prefix + std::to_string(variables_++);
+        }
+
+        static std::string index(size_t i) {
+            return "[" + std::to_string(i) + "]";
+        }
+
+        // temporaries are not used after they are passed on
+        static std::string owned(const std::string &expression) {
+            return expression[0] == 't' ? "std::move(" + expression + ")" : expression;
+        }
+
+        std::string constant(const ValuePtr &value) {
+            constants_.push_back(construct(value));
+            return "lib.constants" + index(constants_.size() - 1);
+        }
+
+        std::string nil() {
+            return constant(std::make_shared<NilValue>());
+        }
+
+        size_t global(SymbolId name) {
+            auto found = std::find(globals_.begin(), globals_.end(), name);
+            if (found != globals_.end()) {
+                return found - globals_.begin();
+            }
+            globals_.push_back(name);
+            return globals_.size() - 1;
+        }
+
+        std::optional<std::string> local(SymbolId name) {
+            for (auto it = locals_.rbegin(); it != locals_.rend(); ++it) {
+                if (it->first == name) {
+                    return it->second;
+                }
+            }
+            return std::nullopt;
+        }
+
+        // index of the function of the library the global variable names, if it is one
+        std::optional<size_t> library_function(const ValuePtr &op) {
+            if (!is_symbol(op) || local(symbol_id(op)).has_value()) {
+                return std::nullopt;
+            }
+            auto &name = std::static_pointer_cast<SymbolValue>(op)->get_symbol_name();
+            for (size_t i = functions_.size(); i > 0; --i) {
+                if (functions_[i - 1].name == name) {
+                    return i - 1;
+                }
+            }
+            return std::nullopt;
+        }
+
+        // emits the statements computing the expression, returns the C++ expression of its value
+        std::string value(const ValuePtr &ast) {
+            if (is_symbol(ast)) {
+                auto name = local(symbol_id(ast));
+                if (name.has_value() && !copy_locals_) {
+                    return *name;
+                }
+                auto t = variable("t");
+                line("ValuePtr " + t + " = " + (name.has_value() ? *name : lookup(symbol_id(ast))) + ";");
+                return t;
+            }
+            if (ast->get_type() != ValueType::List || std::static_pointer_cast<ListValue>(ast)->size() == 0) {
+                return constant(ast);
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            switch (special_form(ast)) {
+                case SpecialForm::Quote:
+                    return constant(list->get_value(1));
+                case SpecialForm::If: {
+                    auto t = variable("t");
+                    auto test = value(list->get_value(1));
+                    line("ValuePtr " + t + ";");
+                    line("if (" + test + "->is_true()) {");
+                    assign(t, list->get_value(2));
+                    line("} else {");
+                    if (list->size() == 4) {
+                        assign(t, list->get_value(3));
+                    } else {
+                        ++depth_;
+                        line(t + " = " + nil() + ";");
+                        --depth_;
+                    }
+                    line("}");
+                    return t;
+                }
+                case SpecialForm::Cond: {
+                    auto t = variable("t");
+                    line("ValuePtr " + t + ";");
+                    cond(list, 1, &t);
+                    return t;
+                }
+                case SpecialForm::Let:
+                case SpecialForm::LetStar:
+                case SpecialForm::Letrec: {
+                    auto t = variable("t");
+                    line("ValuePtr " + t + ";");
+                    line("{");
+                    ++depth_;
+                    auto scope = bind(list);
+                    line(t + " = " + owned(sequence(list, 2)) + ";");
+                    locals_.resize(scope);
+                    --depth_;
+                    line("}");
+                    return t;
+                }
+                case SpecialForm::Begin:
+                    return sequence(list, 1);
+                case SpecialForm::Set: {
+                    auto result = value(list->get_value(2));
+                    auto name = symbol_id(list->get_value(1));
+                    auto local_name = local(name);
+                    if (local_name.has_value()) {
+                        line(*local_name + " = " + result + ";");
+                    } else {
+                        line("lib.env->update_existing(lib.names" + index(global(name)) + ", " + result + ");");
+                    }
+                    return result;
+                }
+                default:
+                    return call(list, false);
+            }
+        }
+
+        std::string lookup(SymbolId name) {
+            auto i = index(global(name));
+            return "lib.caches" + i + ".lookup(*lib.env, lib.names" + i + ")";
+        }
+
+        // the value of the expression is stored in t, in a block
+        void assign(const std::string &t, const ValuePtr &ast) {
+            ++depth_;
+            line(t + " = " + owned(value(ast)) + ";");
+            --depth_;
+        }
+
+        std::string sequence(const ListPtr &list, size_t start) {
+            if (start == list->size()) {
+                return nil();
+            }
+            for (size_t i = start; i + 1 < list->size(); ++i) {
+                value(list->get_value(i));
+            }
+            return value(list->get_value(list->size() - 1));
+        }
+
+        // declares the variables of a let, returns the number of locals to restore after its body
+        size_t bind(const ListPtr &let) {
+            auto scope = locals_.size();
+            auto bindings = std::static_pointer_cast<ListValue>(let->get_value(1));
+            for (size_t i = 0; i < bindings->size(); ++i) {
+                auto binding = std::static_pointer_cast<ListValue>(bindings->get_value(i));
+                auto init = value(binding->get_value(1));
+                auto v = variable("v");
+                line("ValuePtr " + v + " = " + owned(init) + ";");
+                // earlier bindings are visible in later ones (let*)
+                locals_.emplace_back(symbol_id(binding->get_value(0)), v);
+            }
+            return scope;
+        }
+
+        // clauses from i on, the value is stored in *t, or returned if t is nullptr (tail position)
+        void cond(const ListPtr &list, size_t i, const std::string *t) {
+            if (i == list->size()) {
+                // result of the entire cond expression is unspecified
+                line(t == nullptr ? "return " + nil() + ";" : *t + " = " + nil() + ";");
+                return;
+            }
+            auto clause = std::static_pointer_cast<ListValue>(list->get_value(i));
+            auto test = value(clause->get_value(0));
+            line("if (" + test + "->is_true()) {");
+            ++depth_;
+            if (clause->size() == 1) {
+                line((t == nullptr ? "return" : *t + " =") + " std::make_shared<BoolValue>(true);");
+            } else if (t == nullptr) {
+                tail_sequence(clause, 1);
+            } else {
+                line(*t + " = " + owned(sequence(clause, 1)) + ";");
+            }
+            --depth_;
+            line("} else {");
+            ++depth_;
+            cond(list, i + 1, t);
+            --depth_;
+            line("}");
+        }
+
+        // emits the statements that return the value of the expression
+        void tail(const ValuePtr &ast) {
+            auto form = special_form(ast);
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            if (form == SpecialForm::If) {
+                auto test = value(list->get_value(1));
+                line("if (" + test + "->is_true()) {");
+                ++depth_;
+                tail(list->get_value(2));
+                --depth_;
+                line("} else {");
+                ++depth_;
+                if (list->size() == 4) {
+                    tail(list->get_value(3));
+                } else {
+                    line("return " + nil() + ";");
+                }
+                --depth_;
+                line("}");
+            } else if (form == SpecialForm::Cond) {
+                cond(list, 1, nullptr);
+            } else if (form == SpecialForm::Let || form == SpecialForm::LetStar || form == SpecialForm::Letrec) {
+                line("{");
+                ++depth_;
+                auto scope = bind(list);
+                tail_sequence(list, 2);
+                locals_.resize(scope);
+                --depth_;
+                line("}");
+            } else if (form == SpecialForm::Begin) {
+                tail_sequence(list, 1);
+            } else if (form == SpecialForm::Count && ast->get_type() == ValueType::List && list->size() > 0) {
+                call(list, true);
+            } else {
+                line("return " + value(ast) + ";");
+            }
+        }
+
+        void tail_sequence(const ListPtr &list, size_t start) {
+            if (start == list->size()) {
+                line("return " + nil() + ";");
+                return;
+            }
+            for (size_t i = start; i + 1 < list->size(); ++i) {
+                value(list->get_value(i));
+            }
+            tail(list->get_value(list->size() - 1));
+        }
+
+        // the operator is evaluated first, then the operands (as in eval), in tail position the call returns
+        std::string call(const ListPtr &list, bool is_tail) {
+            auto fn = value(list->get_value(0));
+            std::vector<std::string> args;
+            for (size_t i = 1; i < list->size(); ++i) {
+                args.push_back(value(list->get_value(i)));
+            }
+            auto argc = std::to_string(args.size());
+            std::string array = "nullptr";
+            if (!args.empty()) {
+                array = variable("a");
+                std::string values;
+                for (const auto &arg: args) {
+                    values += (values.empty() ? "" : ", ") + owned(arg);
+                }
+                line("ValuePtr " + array + "[] = {" + values + "};");
+            }
+            auto generic = "native_call(" + fn + ", " + array + ", " + argc + ")";
+            auto callee = library_function(list->get_value(0));
+            if (is_tail && callee == function_ && args.size() == params_.size()) {
+                // a tail call of the function itself is a jump back to its start, unless the global was redefined
+                loops_ = true;
+                line("if (" + fn + " == lib.functions" + index(function_) + ") {");
+                ++depth_;
+                for (size_t i = 0; i < params_.size(); ++i) {
+                    line(params_[i] + " = std::move(" + array + index(i) + ");");
+                }
+                line("goto start;");
+                --depth_;
+                line("}");
+                line("return " + generic + ";");
+                return "";
+            }
+            auto result = generic;
+            if (callee.has_value()) {
+                result = fn + " == lib.functions" + index(*callee) + " ? function_" + std::to_string(*callee) +
+                         "(lib, " + array + ", " + argc + ") : " + generic;
+            }
+            if (is_tail) {
+                line("return " + result + ";");
+                return "";
+            }
+            auto t = variable("t");
+            line("ValuePtr " + t + " = " + result + ";");
+            return t;
+        }
+
+        void translate_function(size_t i) {
+            const auto &lambda = functions_[i].lambda;
+            auto params = std::static_pointer_cast<ListValue>(lambda->get_value(1));
+            function_ = i;
+            params_.clear();
+            locals_.clear();
+            variables_ = 0;
+            depth_ = 2;
+            loops_ = false;
+            bool sets = false;
+            translatable_sequence(lambda, 2, sets);
+            copy_locals_ = sets;
+            body_.str("");
+            for (size_t p = 0; p < params->size(); ++p) {
+                params_.push_back(variable("v"));
+                locals_.emplace_back(symbol_id(params->get_value(p)), params_.back());
+            }
+            tail_sequence(lambda, 2);
+
+            auto signature = "ValuePtr function_" + std::to_string(i) + "(Library &lib, ValuePtr *args, size_t argc)";
+            definitions_ << "\n    // " << functions_[i].name << "\n    " << signature << " {\n"
+                         << "        native_check_arity(" << params_.size() << ", argc);\n";
+            for (size_t p = 0; p < params_.size(); ++p) {
+                definitions_ << "        ValuePtr " << params_[p] << " = args" << index(p) << ";\n";
+            }
+            if (loops_) {
+                definitions_ << "    start:\n";
+            }
+            definitions_ << body_.str() << "    }\n";
+        }
+
+    public:
+        std::string translate(const ValuePtr &ast) {
+            std::vector<ValuePtr> forms;
+            if (special_form(ast) == SpecialForm::Begin) {
+                auto list = std::static_pointer_cast<ListValue>(ast);
+                for (size_t i = 1; i < list->size(); ++i) {
+                    forms.push_back(list->get_value(i));
+                }
+            } else {
+                forms.push_back(ast);
+            }
+            // macros are expanded by the engine, so a function that uses one is left to it
+            std::vector<SymbolId> macros;
+            for (const auto &form: forms) {
+                if (special_form(form) == SpecialForm::DefineSyntax &&
+                    std::static_pointer_cast<ListValue>(form)->size() > 1 &&
+                    is_symbol(std::static_pointer_cast<ListValue>(form)->get_value(1))) {
+                    macros.push_back(symbol_id(std::static_pointer_cast<ListValue>(form)->get_value(1)));
+                }
+                if (!is_translatable_define(form) || mentions(form, macros)) {
+                    forms_.push_back("engine(" + construct(form) + ", env);");
+                    continue;
+                }
+                auto define = std::static_pointer_cast<ListValue>(form);
+                auto name = std::static_pointer_cast<SymbolValue>(define->get_value(1))->get_symbol_name();
+                functions_.push_back({name, std::static_pointer_cast<ListValue>(define->get_value(2))});
+                forms_.push_back("native_define(env, " + cpp_string(name) + ", lib->functions" +
+                                 index(functions_.size() - 1) + ");");
+            }
+            for (size_t i = 0; i < functions_.size(); ++i) {
+                translate_function(i);
+            }
+
+            std::ostringstream out;
+            out << "// generated by Scheme --compile, do not edit\n"
+                << "#include \"native.h\"\n"
+                << "#include <limits>\n\n"
+                << "namespace {\n"
+                << "    struct Library {\n"
+                << "        Environment *env = nullptr;\n"
+                << "        std::array<SymbolId, " << globals_.size() << "> names{};\n"
+                << "        std::array<GlobalCache, " << globals_.size() << "> caches{};\n"
+                << "        std::array<ValuePtr, " << constants_.size() << "> constants{};\n"
+                << "        std::array<ValuePtr, " << functions_.size() << "> functions{};\n"
+                << "    };\n\n";
+            for (size_t i = 0; i < functions_.size(); ++i) {
+                out << "    ValuePtr function_" << i << "(Library &lib, ValuePtr *args, size_t argc);\n";
+            }
+            out << definitions_.str() << "}\n\n"
+                << "extern \"C\" void scheme_load(const EnvironmentPtr &env, Engine engine) {\n"
+                << "    // the library stays loaded until the program exits\n"
+                << "    auto *lib = new Library;\n"
+                << "    lib->env = env.get();\n";
+            for (size_t i = 0; i < globals_.size(); ++i) {
+                out << "    lib->names" << index(i) << " = SymbolValue::intern("
+                    << cpp_string(SymbolValue::from_id(globals_[i])->get_symbol_name()) << ")->get_id();\n";
+            }
+            for (size_t i = 0; i < constants_.size(); ++i) {
+                out << "    lib->constants" << index(i) << " = " << constants_[i] << ";\n";
+            }
+            for (size_t i = 0; i < functions_.size(); ++i) {
+                out << "    lib->functions" << index(i)
+                    << " = std::make_shared<FunctionValue>([lib](size_t argc, std::vector<ValuePtr> &argv) {\n"
+                    << "        return function_" << i << "(*lib, argv.data(), argc);\n"
+                    << "    });\n";
+            }
+            for (const auto &form: forms_) {
+                out << "    " << form << "\n";
+            }
+            out << "}\n";
+            return out.str();
+        }
+    };
+}
+
+std::string translate_library(const ValuePtr &ast) {
+    return Translator().translate(ast);
+}
+
+std::string compile_library(const std::string &path) {
+    return compile_library(read_file(path), path);
+}
+
+std::string compile_library(const ValuePtr &ast, const std::string &path) {
+    auto source = path + ".cpp";
+    auto library = path + ".so";
+    {
+        std::ofstream out(source);
+        out << translate_library(ast);
+        if (!out) {
+            throw std::runtime_error("compile: cannot write " + source);
+        }
+    }
+    auto command = std::string(SCHEME_CXX) + " -std=c++20 -O2 -shared -fPIC -I" + shell_word(SCHEME_INCLUDE_DIR) +
+                   " -o " + shell_word(library) + " " + shell_word(source);
+    if (std::system(command.c_str()) != 0) {
+        throw std::runtime_error("compile: " + command + " failed");
+    }
+    return library;
+}
+
+void load_library(const std::string &path, const EnvironmentPtr &env, Engine engine) {
+    // a path without a slash would be searched in the library path
+    auto absolute = std::filesystem::absolute(path).string();
+    void *handle = dlopen(absolute.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        throw std::runtime_error(std::string("load: ") + dlerror());
+    }
+    auto load = reinterpret_cast<void (*)(const EnvironmentPtr &, Engine)>(dlsym(handle, "scheme_load"));
+    if (load == nullptr) {
+        throw std::runtime_error("load: " + path + " is not a compiled library");
+    }
+    load(env, engine);
+}
+
+ValuePtr native_call(const ValuePtr &fn, ValuePtr *args, size_t argc) {
+    if (fn->get_type() == ValueType::Function) {
+        const auto &function = static_cast<const FunctionValue &>(*fn);
+        auto primitive = function.get_primitive();
+        if (primitive != Primitive::None && primitive_arity(primitive) == argc) {
+            if (auto result = apply_primitive(primitive, args)) {
+                return result;
+            }
+        }
+        std::vector<ValuePtr> argv(args, args + argc);
+        return apply_fn(function, argv);
+    }
+    if (fn->get_type() == ValueType::Closure) {
+        std::vector<ValuePtr> argv(args, args + argc);
+        return std::static_pointer_cast<Closure>(fn)->call(argv);
+    }
+    throw std::runtime_error("eval error: " + fn->to_string() + " is not a function");
+}
+
+void native_check_arity(size_t expected, size_t actual) {
+    std::string name = "lambda";
+    check_arity(name, expected, actual);
+}
+
+ValuePtr native_list(std::vector<ValuePtr> values) {
+    return std::make_shared<ListValue>(std::move(values));
+}
+
+void native_define(const EnvironmentPtr &env, const std::string &name, const ValuePtr &function) {
+    auto symbol = SymbolValue::intern(name);
+    note_assigned(*env, symbol->get_id());
+    env->set(symbol->get_id(), function);
+}
@@ -0,0 +1,50 @@
+#ifndef SCHEME_NATIVE_H
+#define SCHEME_NATIVE_H
+
+#include "util.h"
+#include "primitives.h"
+#include <array>
+#include <string>
+#include <vector>
+
+// Ahead of time compilation of libraries to native code: Scheme --compile lib.scm translates the top level
+// definitions of lib.scm to C++ (lib.scm.cpp), which the system compiler builds into a shared object (lib.scm.so).
+// Scheme --load=lib.scm.so script.scm loads it with dlopen before the script runs.
+//
+// A (define name (lambda (params) body)) whose body only uses constants, parameters, let variables, globals, quote,
+// if, cond, let, begin, set! and calls becomes a C++ function: local variables live in C++ variables instead of
+// environment frames, calls of builtins take the primitive fast path and tail calls of the function itself are loops
+// (other calls, tail calls included, use the C++ stack).
+// Compiled functions are builtins (FunctionValues) for the rest of the interpreter, so scripts call them like any
+// other function. Globals are still looked up when they are used, redefining one (or the compiled function itself)
+// works as in the interpreter. Every other top level form, like a lambda that makes closures or uses a macro, is
+// evaluated by the engine when the library is loaded, in the order of the file.
+
+// engine that evaluates the forms of a library that were not compiled
+using Engine = ValuePtr (*)(const ValuePtr &, const EnvironmentPtr &);
+
+// translates the form read from a library file (a single form or a begin of top level forms) to C++
+std::string translate_library(const ValuePtr &ast);
+
+// translates the library at path and builds it, returns the path of the shared object
+std::string compile_library(const std::string &path);
+
+// builds the library form as path.so, with its C++ at path.cpp, returns the path of the shared object
+std::string compile_library(const ValuePtr &ast, const std::string &path);
+
+// loads a shared object made by compile_library into the environment
+void load_library(const std::string &path, const EnvironmentPtr &env, Engine engine);
+
+// runtime support of the generated code
+
+// calls fn with argc arguments starting at args
+ValuePtr native_call(const ValuePtr &fn, ValuePtr *args, size_t argc);
+
+void native_check_arity(size_t expected, size_t actual);
+
+ValuePtr native_list(std::vector<ValuePtr> values);
+
+// defines a compiled function, which the optimizer must not fold calls of anymore
+void native_define(const EnvironmentPtr &env, const std::string &name, const ValuePtr &function);
+
+#endif //SCHEME_NATIVE_H
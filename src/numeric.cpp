@@ -0,0 +1,652 @@
+#include "numeric.h"
+#include "analyzer.h"
+#include "primitives.h"
+#include "datatypes/closure.h"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <type_traits>
+
+namespace {
+    // an unboxed value, booleans are the integers 0 and 1
+    union Number {
+        std::int64_t integer;
+        double real;
+    };
+
+    template<typename T>
+    T value_of(const Number &number) {
+        if constexpr (std::is_same_v<T, double>) {
+            return number.real;
+        } else {
+            return number.integer;
+        }
+    }
+
+    template<typename T>
+    Number number_of(T value) {
+        Number number{};
+        if constexpr (std::is_same_v<T, double>) {
+            number.real = value;
+        } else {
+            number.integer = value;
+        }
+        return number;
+    }
+
+    // frames of the specialized code live on the C++ stack
+    constexpr size_t MAX_NUMERIC_SLOTS = 16;
+
+    constexpr size_t NUMERIC_DEPTH_LIMIT = 1000;
+
+    // thrown when the recursion got too deep, the call is then interpreted
+    struct TooDeep {
+    };
+
+    struct NumericFrame {
+        Number *slots;
+        const NumericCode *code;
+        size_t *depth;
+        // set by a tail call of the closure itself, the body is run again with the new arguments
+        bool again;
+    };
+
+    class Expression {
+    public:
+        virtual ~Expression() = default;
+
+        virtual Number evaluate(NumericFrame &frame) const = 0;
+    };
+
+    using ExpressionPtr = std::unique_ptr<const Expression>;
+}
+
+class NumericCode {
+public:
+    // global variable the code depends on and the value it had when the code was made
+    struct Guard {
+        const GlobalNode *node;
+        // nullptr for the closure itself, which cannot own itself
+        ValuePtr expected;
+    };
+
+    NumericCode(std::vector<ValueType> params, ValueType result, size_t frame_size, std::vector<Guard> guards,
+                ExpressionPtr body) : params_(std::move(params)), result_(result), frame_size_(frame_size),
+                                      guards_(std::move(guards)), body_(std::move(body)) {
+    }
+
+    [[nodiscard]] const std::vector<ValueType> &get_params() const {
+        return params_;
+    }
+
+    [[nodiscard]] ValueType get_result() const {
+        return result_;
+    }
+
+    [[nodiscard]] size_t get_frame_size() const {
+        return frame_size_;
+    }
+
+    [[nodiscard]] const std::vector<Guard> &get_guards() const {
+        return guards_;
+    }
+
+    Number run(Number *slots, size_t &depth) const {
+        if (++depth > NUMERIC_DEPTH_LIMIT) {
+            throw TooDeep{};
+        }
+        NumericFrame frame{slots, this, &depth, false};
+        Number result;
+        do {
+            frame.again = false;
+            result = body_->evaluate(frame);
+        } while (frame.again);
+        --depth;
+        return result;
+    }
+
+private:
+    std::vector<ValueType> params_;
+    ValueType result_;
+    size_t frame_size_;
+    std::vector<Guard> guards_;
+    ExpressionPtr body_;
+};
+
+namespace {
+    class Constant : public Expression {
+        Number value_;
+    public:
+        explicit Constant(Number value) : value_(value) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            return value_;
+        }
+    };
+
+    class Slot : public Expression {
+        size_t index_;
+    public:
+        explicit Slot(size_t index) : index_(index) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            return frame.slots[index_];
+        }
+    };
+
+    class SetSlot : public Expression {
+        size_t index_;
+        ExpressionPtr value_;
+    public:
+        SetSlot(size_t index, ExpressionPtr value) : index_(index), value_(std::move(value)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            return frame.slots[index_] = value_->evaluate(frame);
+        }
+    };
+
+    class ToFloat : public Expression {
+        ExpressionPtr value_;
+    public:
+        explicit ToFloat(ExpressionPtr value) : value_(std::move(value)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            return number_of(static_cast<double>(value_->evaluate(frame).integer));
+        }
+    };
+
+    // the same operations as the arithmetic primitives, on operands of one type
+    template<typename T, typename Operation>
+    class Arithmetic : public Expression {
+        ExpressionPtr a_;
+        ExpressionPtr b_;
+    public:
+        Arithmetic(ExpressionPtr a, ExpressionPtr b) : a_(std::move(a)), b_(std::move(b)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            auto a = value_of<T>(a_->evaluate(frame));
+            return number_of<T>(Operation{}(a, value_of<T>(b_->evaluate(frame))));
+        }
+    };
+
+    class IntegerDivide : public Expression {
+        ExpressionPtr a_;
+        ExpressionPtr b_;
+    public:
+        IntegerDivide(ExpressionPtr a, ExpressionPtr b) : a_(std::move(a)), b_(std::move(b)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            auto a = a_->evaluate(frame).integer;
+            auto b = b_->evaluate(frame).integer;
+            if (b == 0) {
+                throw std::runtime_error("Division by zero");
+            }
+            return number_of(a / b);
+        }
+    };
+
+    template<typename T, typename Comparator>
+    class Comparison : public Expression {
+        ExpressionPtr a_;
+        ExpressionPtr b_;
+    public:
+        Comparison(ExpressionPtr a, ExpressionPtr b) : a_(std::move(a)), b_(std::move(b)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            auto a = value_of<T>(a_->evaluate(frame));
+            return number_of<std::int64_t>(Comparator{}(a, value_of<T>(b_->evaluate(frame))));
+        }
+    };
+
+    template<typename T>
+    class IsZero : public Expression {
+        ExpressionPtr value_;
+    public:
+        explicit IsZero(ExpressionPtr value) : value_(std::move(value)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            return number_of<std::int64_t>(value_of<T>(value_->evaluate(frame)) == 0);
+        }
+    };
+
+    class Not : public Expression {
+        ExpressionPtr value_;
+    public:
+        explicit Not(ExpressionPtr value) : value_(std::move(value)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            return number_of<std::int64_t>(value_->evaluate(frame).integer == 0);
+        }
+    };
+
+    class If : public Expression {
+        ExpressionPtr test_;
+        ExpressionPtr consequent_;
+        ExpressionPtr alternate_;
+    public:
+        If(ExpressionPtr test, ExpressionPtr consequent, ExpressionPtr alternate)
+                : test_(std::move(test)), consequent_(std::move(consequent)), alternate_(std::move(alternate)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            return test_->evaluate(frame).integer != 0 ? consequent_->evaluate(frame) : alternate_->evaluate(frame);
+        }
+    };
+
+    class Sequence : public Expression {
+        std::vector<ExpressionPtr> body_;
+    public:
+        explicit Sequence(std::vector<ExpressionPtr> body) : body_(std::move(body)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            for (size_t i = 0; i + 1 < body_.size(); ++i) {
+                body_[i]->evaluate(frame);
+            }
+            return body_.back()->evaluate(frame);
+        }
+    };
+
+    // the arguments replace the parameters and the body runs again
+    class SelfTailCall : public Expression {
+        std::vector<ExpressionPtr> arguments_;
+    public:
+        explicit SelfTailCall(std::vector<ExpressionPtr> arguments) : arguments_(std::move(arguments)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            std::array<Number, MAX_NUMERIC_SLOTS> values{};
+            for (size_t i = 0; i < arguments_.size(); ++i) {
+                values[i] = arguments_[i]->evaluate(frame);
+            }
+            std::copy(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(arguments_.size()), frame.slots);
+            frame.again = true;
+            return {};
+        }
+    };
+
+    class SelfCall : public Expression {
+        std::vector<ExpressionPtr> arguments_;
+    public:
+        explicit SelfCall(std::vector<ExpressionPtr> arguments) : arguments_(std::move(arguments)) {
+        }
+
+        Number evaluate(NumericFrame &frame) const override {
+            std::array<Number, MAX_NUMERIC_SLOTS> slots{};
+            for (size_t i = 0; i < arguments_.size(); ++i) {
+                slots[i] = arguments_[i]->evaluate(frame);
+            }
+            return frame.code->run(slots.data(), *frame.depth);
+        }
+    };
+
+    bool is_number(ValueType type) {
+        return type == ValueType::Integer || type == ValueType::Float;
+    }
+
+    template<typename T>
+    ExpressionPtr make_arithmetic(Primitive primitive, ExpressionPtr a, ExpressionPtr b) {
+        switch (primitive) {
+            case Primitive::Add:
+                return std::make_unique<Arithmetic<T, std::plus<> > >(std::move(a), std::move(b));
+            case Primitive::Subtract:
+                return std::make_unique<Arithmetic<T, std::minus<> > >(std::move(a), std::move(b));
+            case Primitive::Multiply:
+                return std::make_unique<Arithmetic<T, std::multiplies<> > >(std::move(a), std::move(b));
+            case Primitive::Divide:
+                if constexpr (std::is_same_v<T, double>) {
+                    return std::make_unique<Arithmetic<T, std::divides<> > >(std::move(a), std::move(b));
+                } else {
+                    return std::make_unique<IntegerDivide>(std::move(a), std::move(b));
+                }
+            case Primitive::Equal:
+                return std::make_unique<Comparison<T, std::equal_to<> > >(std::move(a), std::move(b));
+            case Primitive::Less:
+                return std::make_unique<Comparison<T, std::less<> > >(std::move(a), std::move(b));
+            case Primitive::Greater:
+                return std::make_unique<Comparison<T, std::greater<> > >(std::move(a), std::move(b));
+            case Primitive::LessEqual:
+                return std::make_unique<Comparison<T, std::less_equal<> > >(std::move(a), std::move(b));
+            case Primitive::GreaterEqual:
+                return std::make_unique<Comparison<T, std::greater_equal<> > >(std::move(a), std::move(b));
+            default:
+                return nullptr;
+        }
+    }
+
+    // Type inference and specialization in one walk: build returns the typed expression of a node and sets its type,
+    // or returns nullptr if the type of the node cannot be proven. Expressions in tail position must have the type of
+    // the result of the closure.
+    class Specializer {
+        const Closure &closure_;
+        std::vector<ValueType> params_;
+        ValueType result_;
+        // type of each slot of the frame once it is bound
+        std::vector<std::optional<ValueType> > slots_;
+        std::vector<NumericCode::Guard> guards_;
+
+        // value of a global variable now, the code is guarded against its change
+        const Value *global_value(const Node *node) {
+            auto global = dynamic_cast<const GlobalNode *>(node);
+            if (global == nullptr) {
+                return nullptr;
+            }
+            auto cell = closure_.get_env()->find_cell(global->get_name());
+            if (cell == nullptr) {
+                return nullptr;
+            }
+            bool is_self = cell->get() == &closure_;
+            guards_.push_back({global, is_self ? nullptr : *cell});
+            return cell->get();
+        }
+
+        bool bind(size_t index, ValueType type) {
+            if (index >= slots_.size() || (slots_[index].has_value() && *slots_[index] != type)) {
+                return false;
+            }
+            slots_[index] = type;
+            return true;
+        }
+
+        ExpressionPtr constant(const Value &value, ValueType &type) {
+            type = value.get_type();
+            switch (type) {
+                case ValueType::Integer:
+                    return std::make_unique<Constant>(number_of(static_cast<const IntegerValue &>(value).get_value()));
+                case ValueType::Float:
+                    return std::make_unique<Constant>(number_of(value.to_double()));
+                case ValueType::Bool:
+                    return std::make_unique<Constant>(number_of<std::int64_t>(value.is_true()));
+                default:
+                    return nullptr;
+            }
+        }
+
+        // the last clause of a cond is taken whenever it is reached
+        bool is_true(const Node *node) {
+            if (auto constant = dynamic_cast<const ConstantNode *>(node)) {
+                return constant->get_value()->get_type() == ValueType::Bool && constant->get_value()->is_true();
+            }
+            auto value = global_value(node);
+            return value != nullptr && value->get_type() == ValueType::Bool && value->is_true();
+        }
+
+        ExpressionPtr build_cond(const std::vector<CondNode::Clause> &clauses, size_t i, bool tail, ValueType &type) {
+            const auto &clause = clauses[i];
+            bool last = i + 1 == clauses.size();
+            // a cond that falls through has no numeric value
+            if (last && !is_true(clause.test.get())) {
+                return nullptr;
+            }
+            ExpressionPtr body;
+            if (clause.body == nullptr) {
+                body = std::make_unique<Constant>(number_of<std::int64_t>(1));
+                type = ValueType::Bool;
+                if (tail && type != result_) {
+                    return nullptr;
+                }
+            } else {
+                body = build(clause.body.get(), tail, type);
+            }
+            if (last || body == nullptr) {
+                return body;
+            }
+            ValueType test_type;
+            auto test = build(clause.test.get(), false, test_type);
+            ValueType rest_type;
+            auto rest = build_cond(clauses, i + 1, tail, rest_type);
+            if (test == nullptr || test_type != ValueType::Bool || rest == nullptr || rest_type != type) {
+                return nullptr;
+            }
+            return std::make_unique<If>(std::move(test), std::move(body), std::move(rest));
+        }
+
+        ExpressionPtr build_call(const CallNode &call, bool tail, ValueType &type) {
+            auto value = global_value(call.get_operator().get());
+            if (value == nullptr) {
+                return nullptr;
+            }
+            std::vector<ExpressionPtr> operands;
+            std::vector<ValueType> types;
+            for (const auto &operand: call.get_operands()) {
+                ValueType operand_type;
+                operands.push_back(build(operand.get(), false, operand_type));
+                if (operands.back() == nullptr) {
+                    return nullptr;
+                }
+                types.push_back(operand_type);
+            }
+            if (value == &closure_) {
+                if (types != params_) {
+                    return nullptr;
+                }
+                type = result_;
+                if (tail) {
+                    return std::make_unique<SelfTailCall>(std::move(operands));
+                }
+                return std::make_unique<SelfCall>(std::move(operands));
+            }
+            if (value->get_type() != ValueType::Function) {
+                return nullptr;
+            }
+            auto primitive = static_cast<const FunctionValue *>(value)->get_primitive();
+            if (primitive == Primitive::None || primitive_arity(primitive) != operands.size()) {
+                return nullptr;
+            }
+            if (primitive == Primitive::Not) {
+                type = ValueType::Bool;
+                return types[0] == ValueType::Bool ? std::make_unique<Not>(std::move(operands[0])) : nullptr;
+            }
+            if (primitive == Primitive::IsZero) {
+                type = ValueType::Bool;
+                if (types[0] == ValueType::Integer) {
+                    return std::make_unique<IsZero<std::int64_t> >(std::move(operands[0]));
+                }
+                return types[0] == ValueType::Float ? std::make_unique<IsZero<double> >(std::move(operands[0]))
+                                                    : nullptr;
+            }
+            if (operands.size() != 2 || !is_number(types[0]) || !is_number(types[1])) {
+                return nullptr;
+            }
+            bool is_comparison = primitive == Primitive::Equal || primitive == Primitive::Less ||
+                                 primitive == Primitive::Greater || primitive == Primitive::LessEqual ||
+                                 primitive == Primitive::GreaterEqual;
+            // integers stay integers, a float operand makes the operation a float one
+            if (types[0] == ValueType::Integer && types[1] == ValueType::Integer) {
+                type = is_comparison ? ValueType::Bool : ValueType::Integer;
+                return make_arithmetic<std::int64_t>(primitive, std::move(operands[0]), std::move(operands[1]));
+            }
+            for (size_t i = 0; i < 2; ++i) {
+                if (types[i] == ValueType::Integer) {
+                    operands[i] = std::make_unique<ToFloat>(std::move(operands[i]));
+                }
+            }
+            type = is_comparison ? ValueType::Bool : ValueType::Float;
+            return make_arithmetic<double>(primitive, std::move(operands[0]), std::move(operands[1]));
+        }
+
+        ExpressionPtr build_node(const Node *node, bool tail, ValueType &type) {
+            if (auto constant_node = dynamic_cast<const ConstantNode *>(node)) {
+                return constant(*constant_node->get_value(), type);
+            }
+            if (auto local = dynamic_cast<const LocalNode *>(node)) {
+                const auto &address = local->get_address();
+                if (address.depth != 0 || address.index >= slots_.size() || !slots_[address.index].has_value()) {
+                    return nullptr;
+                }
+                type = *slots_[address.index];
+                return std::make_unique<Slot>(address.index);
+            }
+            if (dynamic_cast<const GlobalNode *>(node) != nullptr) {
+                auto value = global_value(node);
+                return value == nullptr ? nullptr : constant(*value, type);
+            }
+            if (auto set = dynamic_cast<const LocalSetNode *>(node)) {
+                auto value = build(set->get_value().get(), false, type);
+                if (value == nullptr || set->get_address().depth != 0 || !bind(set->get_address().index, type)) {
+                    return nullptr;
+                }
+                return std::make_unique<SetSlot>(set->get_address().index, std::move(value));
+            }
+            if (auto if_node = dynamic_cast<const IfNode *>(node)) {
+                ValueType test_type;
+                ValueType alternate_type;
+                auto test = build(if_node->get_test().get(), false, test_type);
+                auto consequent = build(if_node->get_consequent().get(), tail, type);
+                auto alternate = build(if_node->get_alternate().get(), tail, alternate_type);
+                if (test == nullptr || test_type != ValueType::Bool || consequent == nullptr || alternate == nullptr ||
+                    alternate_type != type) {
+                    return nullptr;
+                }
+                return std::make_unique<If>(std::move(test), std::move(consequent), std::move(alternate));
+            }
+            if (auto sequence = dynamic_cast<const SequenceNode *>(node)) {
+                const auto &body = sequence->get_body();
+                std::vector<ExpressionPtr> expressions;
+                for (size_t i = 0; i < body.size(); ++i) {
+                    expressions.push_back(build(body[i].get(), tail && i + 1 == body.size(), type));
+                    if (expressions.back() == nullptr) {
+                        return nullptr;
+                    }
+                }
+                return expressions.empty() ? nullptr : std::make_unique<Sequence>(std::move(expressions));
+            }
+            if (auto cond = dynamic_cast<const CondNode *>(node)) {
+                return cond->get_clauses().empty() ? nullptr : build_cond(cond->get_clauses(), 0, tail, type);
+            }
+            if (auto let = dynamic_cast<const LetNode *>(node)) {
+                if (let->get_frame_size() != 0) {
+                    return nullptr;
+                }
+                return bind_and_run(let->get_bindings(), let->get_body().get(), tail, type);
+            }
+            if (auto inlined = dynamic_cast<const InlineNode *>(node)) {
+                // the body is only run while the global variable holds the inlined closure
+                auto value = global_value(inlined->get_call()->get_operator().get());
+                if (value != inlined->get_closure().get()) {
+                    return nullptr;
+                }
+                return bind_and_run(inlined->get_arguments(), inlined->get_body().get(), tail, type);
+            }
+            if (auto call = dynamic_cast<const CallNode *>(node)) {
+                return build_call(*call, tail, type);
+            }
+            return nullptr;
+        }
+
+        // the slots are set in order, then the body runs (let and inlined calls)
+        ExpressionPtr bind_and_run(const std::vector<std::pair<size_t, NodePtr> > &bindings, const Node *body,
+                                   bool tail, ValueType &type) {
+            std::vector<ExpressionPtr> expressions;
+            for (const auto &[index, init]: bindings) {
+                ValueType init_type;
+                auto value = build(init.get(), false, init_type);
+                if (value == nullptr || !bind(index, init_type)) {
+                    return nullptr;
+                }
+                expressions.push_back(std::make_unique<SetSlot>(index, std::move(value)));
+            }
+            expressions.push_back(build(body, tail, type));
+            if (expressions.back() == nullptr) {
+                return nullptr;
+            }
+            return std::make_unique<Sequence>(std::move(expressions));
+        }
+
+    public:
+        Specializer(const Closure &closure, std::vector<ValueType> params, ValueType result)
+                : closure_(closure), params_(std::move(params)), result_(result), slots_(closure.get_frame_size()) {
+            for (size_t i = 0; i < params_.size(); ++i) {
+                slots_[i] = params_[i];
+            }
+        }
+
+        ExpressionPtr build(const Node *node, bool tail, ValueType &type) {
+            auto expression = build_node(node, tail, type);
+            if (expression != nullptr && tail && type != result_) {
+                return nullptr;
+            }
+            return expression;
+        }
+
+        NumericCodePtr specialize() {
+            ValueType type;
+            auto body = build(closure_.get_body().get(), true, type);
+            if (body == nullptr) {
+                return nullptr;
+            }
+            return std::make_shared<NumericCode>(params_, result_, closure_.get_frame_size(), std::move(guards_),
+                                                 std::move(body));
+        }
+    };
+}
+
+NumericCodePtr specialize_numeric(const Closure &closure, const std::vector<ValuePtr> &args) {
+    if (closure.get_body() == nullptr ||
+        closure.get_frame_size() > MAX_NUMERIC_SLOTS || args.size() != closure.get_formal_params()->size()) {
+        return nullptr;
+    }
+    std::vector<ValueType> params;
+    for (const auto &arg: args) {
+        if (!is_number(arg->get_type())) {
+            return nullptr;
+        }
+        params.push_back(arg->get_type());
+    }
+    // the result type is not known before the body is walked, each one is tried
+    for (auto result: {ValueType::Integer, ValueType::Float, ValueType::Bool}) {
+        if (auto code = Specializer(closure, params, result).specialize()) {
+            return code;
+        }
+    }
+    return nullptr;
+}
+
+ValuePtr run_numeric(const NumericCode &code, const Closure &closure, const std::vector<ValuePtr> &args,
+                     bool &too_deep) {
+    const auto &params = code.get_params();
+    if (args.size() != params.size()) {
+        return nullptr;
+    }
+    for (const auto &guard: code.get_guards()) {
+        const Value *expected = guard.expected == nullptr ? &closure : guard.expected.get();
+        if (guard.node->lookup(*closure.get_env()).get() != expected) {
+            return nullptr;
+        }
+    }
+    std::array<Number, MAX_NUMERIC_SLOTS> slots{};
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i]->get_type() != params[i]) {
+            return nullptr;
+        }
+        slots[i] = params[i] == ValueType::Integer
+                   ? number_of(static_cast<const IntegerValue &>(*args[i]).get_value())
+                   : number_of(args[i]->to_double());
+    }
+    size_t depth = 0;
+    Number result;
+    try {
+        result = code.run(slots.data(), depth);
+    } catch (TooDeep &) {
+        too_deep = true;
+        return nullptr;
+    }
+    switch (code.get_result()) {
+        case ValueType::Integer:
+            return std::make_shared<IntegerValue>(result.integer);
+        case ValueType::Float:
+            return std::make_shared<FloatValue>(result.real);
+        default:
+            return bool_value(result.integer != 0);
+    }
+}
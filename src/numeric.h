@@ -0,0 +1,33 @@
+#ifndef SCHEME_NUMERIC_H
+#define SCHEME_NUMERIC_H
+
+#include "util.h"
+#include <memory>
+#include <vector>
+
+// Specialization of hot closures of the tree walking engine to unboxed numbers.
+//
+// When a closure gets hot (see jit.h) with integer and float arguments, a type inference pass walks its body
+// assuming the parameters keep the types of these arguments. It succeeds if every expression is provably an integer,
+// a float or a boolean: constants, parameters, let variables and their set!, globals holding numbers, + - * /,
+// comparisons, zero? and not, if, cond, let, begin, inlined closures and calls of the closure itself that pass the
+// same types. The body is then rebuilt as a tree of typed expressions over unboxed slots: no value is allocated and no
+// operand type is checked while it runs, tail calls of the closure itself are a loop and only the result is boxed.
+// A call whose arguments have other types, or that finds a global the code depends on redefined, is interpreted.
+// Such a body has no side effects outside of its own frame, so a call that recurses too deep is interpreted as well.
+
+class Closure;
+
+class NumericCode;
+
+using NumericCodePtr = std::shared_ptr<const NumericCode>;
+
+// specializes the body of a closure made by eval for the types of args, nullptr if its types cannot be inferred
+NumericCodePtr specialize_numeric(const Closure &closure, const std::vector<ValuePtr> &args);
+
+// result of the specialized code, nullptr if the call has to be interpreted, too_deep is set if that is because the
+// recursion got too deep
+ValuePtr run_numeric(const NumericCode &code, const Closure &closure, const std::vector<ValuePtr> &args,
+                     bool &too_deep);
+
+#endif //SCHEME_NUMERIC_H
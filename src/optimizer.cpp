@@ -0,0 +1,499 @@
+#include "optimizer.h"
+#include "evaluator.h"
+#include "streams.h"
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+    // types of the arguments a builtin can be folded with, builtins do not check the types of all arguments
+    enum class Arguments {
+        Any, Numbers, Integers, Strings, Lists
+    };
+
+    struct PureBuiltin {
+        size_t arity;
+        Arguments arguments;
+    };
+
+    // builtins without side effects whose result does not share structure with their arguments
+    const std::unordered_map<SymbolId, PureBuiltin> &pure_builtins() {
+        static const std::unordered_map<SymbolId, PureBuiltin> builtins = [] {
+            std::unordered_map<SymbolId, PureBuiltin> result;
+            auto add = [&result](std::initializer_list<const char *> names, size_t arity, Arguments arguments) {
+                for (const auto *name: names) {
+                    result[SymbolValue::intern(name)->get_id()] = {arity, arguments};
+                }
+            };
+            add({"+", "-", "*", "/", "=", "<", ">", "<=", ">=", "max", "min"}, 2, Arguments::Numbers);
+            add({"abs", "zero?", "positive?", "negative?"}, 1, Arguments::Numbers);
+            add({"quotient", "remainder"}, 2, Arguments::Integers);
+            add({"odd?", "even?", "number?", "real?", "integer?", "rational?", "boolean?", "exact?", "inexact?",
+                 "not", "pair?", "list?", "null?", "empty?", "symbol?", "string?", "vector?", "procedure?"},
+                1, Arguments::Any);
+            add({"eq?", "eqv?", "equal?"}, 2, Arguments::Any);
+            add({"string-length", "string->symbol"}, 1, Arguments::Strings);
+            add({"string=?", "string<?", "string>?", "string<=?", "string>=?"}, 2, Arguments::Strings);
+            add({"length"}, 1, Arguments::Lists);
+            return result;
+        }();
+        return builtins;
+    }
+
+    // builtins that a chain of map and filter calls can be fused into, by the number of elements of their calls:
+    // map and filter are stages of a stream (and give a list), fold and for-each consume it
+    const std::unordered_map<SymbolId, std::pair<size_t, StreamOperation> > &combinators() {
+        static const std::unordered_map<SymbolId, std::pair<size_t, StreamOperation> > builtins = {
+                {SymbolValue::intern("map")->get_id(),      {3, StreamOperation::Map}},
+                {SymbolValue::intern("filter")->get_id(),   {3, StreamOperation::Filter}},
+                {SymbolValue::intern("fold")->get_id(),     {4, StreamOperation::Fold}},
+                {SymbolValue::intern("for-each")->get_id(), {3, StreamOperation::ForEach}},
+        };
+        return builtins;
+    }
+
+    // the assigned names of the global environment the environment is in, nullptr if it keeps none
+    std::unordered_set<SymbolId> *global_assigned(Environment &env) {
+        for (auto *frame = &env; frame != nullptr; frame = frame->get_outer().get()) {
+            if (auto *names = frame->assigned_names()) {
+                return names;
+            }
+        }
+        return nullptr;
+    }
+
+    bool is_form(const ListPtr &list, SpecialForm form) {
+        return list->size() > 0 && list->get_value(0)->get_type() == ValueType::Symbol &&
+               car<SymbolValue>(list)->get_id() == static_cast<SymbolId>(form);
+    }
+
+    bool has_type(const ValuePtr &value, Arguments arguments) {
+        switch (arguments) {
+            case Arguments::Any:
+                return true;
+            case Arguments::Numbers:
+                return value->get_type() == ValueType::Integer || value->get_type() == ValueType::Float;
+            case Arguments::Integers:
+                return value->get_type() == ValueType::Integer;
+            case Arguments::Strings:
+                return value->get_type() == ValueType::String;
+            case Arguments::Lists:
+                return value->get_type() == ValueType::List;
+        }
+        return false;
+    }
+
+    // results that can be put into the program, lists and vectors are mutable and must stay fresh
+    bool is_atom(const ValuePtr &value) {
+        switch (value->get_type()) {
+            case ValueType::Integer:
+            case ValueType::Float:
+            case ValueType::String:
+            case ValueType::Bool:
+            case ValueType::Nil:
+            case ValueType::Symbol:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    class Optimizer {
+        Environment &env_;
+        // names bound by lambdas and lets of the form, they are not the builtins
+        std::unordered_set<SymbolId> bound_;
+        // names that some form defined or set! in the global environment, their values are not known before the
+        // program runs; an environment that keeps none only knows those of this form
+        std::unordered_set<SymbolId> form_assigned_;
+        std::unordered_set<SymbolId> &assigned_;
+
+        void collect_bindings(const ValuePtr &ast) {
+            if (ast->get_type() != ValueType::List) {
+                return;
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            if (is_form(list, SpecialForm::Quote)) {
+                return;
+            }
+            if ((is_form(list, SpecialForm::Define) || is_form(list, SpecialForm::Set)) && list->size() > 1 &&
+                list->get_value(1)->get_type() == ValueType::Symbol) {
+                assigned_.insert(std::static_pointer_cast<SymbolValue>(list->get_value(1))->get_id());
+            }
+            if ((is_form(list, SpecialForm::Lambda) || is_form(list, SpecialForm::Receive)) && list->size() > 1 &&
+                list->get_value(1)->get_type() == ValueType::List) {
+                auto params = std::static_pointer_cast<ListValue>(list->get_value(1));
+                for (size_t i = 0; i < params->size(); ++i) {
+                    bind(params->get_value(i));
+                }
+            }
+            if (is_form(list, SpecialForm::Guard) && list->size() > 1 && list->get_value(1)->get_type() == ValueType::List &&
+                std::static_pointer_cast<ListValue>(list->get_value(1))->size() > 0) {
+                bind(car<Value>(list->get_value(1)));
+            }
+            if ((is_form(list, SpecialForm::Let) || is_form(list, SpecialForm::LetStar) ||
+                 is_form(list, SpecialForm::Letrec) || is_form(list, SpecialForm::Do)) && list->size() > 1) {
+                // a named let binds its name and has the bindings after it
+                size_t position = 1;
+                if (is_form(list, SpecialForm::Let) && list->get_value(1)->get_type() == ValueType::Symbol &&
+                    list->size() > 2) {
+                    bind(list->get_value(1));
+                    position = 2;
+                }
+                if (list->get_value(position)->get_type() == ValueType::List) {
+                    auto bindings = std::static_pointer_cast<ListValue>(list->get_value(position));
+                    for (size_t i = 0; i < bindings->size(); ++i) {
+                        if (bindings->get_value(i)->get_type() == ValueType::List &&
+                            std::static_pointer_cast<ListValue>(bindings->get_value(i))->size() > 0) {
+                            bind(car<Value>(bindings->get_value(i)));
+                        }
+                    }
+                }
+            }
+            for (size_t i = 0; i < list->size(); ++i) {
+                collect_bindings(list->get_value(i));
+            }
+        }
+
+        void bind(const ValuePtr &name) {
+            if (name->get_type() == ValueType::Symbol) {
+                bound_.insert(std::static_pointer_cast<SymbolValue>(name)->get_id());
+            }
+        }
+
+        // value of a global variable that the program never changes
+        ValuePtr known_global(const ValuePtr &name) {
+            auto id = std::static_pointer_cast<SymbolValue>(name)->get_id();
+            if (bound_.count(id) != 0 || assigned_.count(id) != 0) {
+                return nullptr;
+            }
+            auto cell = env_.find_cell(id);
+            return cell == nullptr ? nullptr : *cell;
+        }
+
+        // value of an expression that is known before it runs, nullptr otherwise
+        ValuePtr constant_value(const ValuePtr &ast) {
+            if (ast->get_type() == ValueType::Symbol) {
+                // true, false, nil and else
+                auto value = known_global(ast);
+                return value != nullptr && is_atom(value) && value->get_type() != ValueType::Symbol ? value : nullptr;
+            }
+            if (ast->get_type() != ValueType::List) {
+                return ast;
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            if (is_form(list, SpecialForm::Quote) && list->size() == 2) {
+                return list->get_value(1);
+            }
+            return nullptr;
+        }
+
+        // expression that evaluates to the value
+        static ValuePtr quote(const ValuePtr &value) {
+            if (value->get_type() != ValueType::Symbol && value->get_type() != ValueType::List) {
+                return value;
+            }
+            auto list = std::make_shared<ListValue>();
+            list->add_value(SymbolValue::from_id(static_cast<SymbolId>(SpecialForm::Quote)));
+            list->add_value(value);
+            return list;
+        }
+
+        // bindings of a let or a do, the names stay as they are
+        ListPtr optimize_bindings(const ValuePtr &bindings) {
+            auto list = std::static_pointer_cast<ListValue>(bindings);
+            auto result = std::make_shared<ListValue>();
+            for (size_t i = 0; i < list->size(); ++i) {
+                auto binding = list->get_value(i);
+                result->add_value(binding->get_type() == ValueType::List ? optimize_elements(
+                        std::static_pointer_cast<ListValue>(binding), 1) : binding);
+            }
+            return result;
+        }
+
+        ListPtr optimize_elements(const ListPtr &list, size_t start) {
+            auto result = std::make_shared<ListValue>();
+            for (size_t i = 0; i < list->size(); ++i) {
+                result->add_value(i < start ? list->get_value(i) : optimize(list->get_value(i)));
+            }
+            return result;
+        }
+
+        // the operation of a call of one of the combinator builtins
+        std::optional<StreamOperation> combinator(const ValuePtr &ast) {
+            if (ast->get_type() != ValueType::List) {
+                return std::nullopt;
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            if (list->size() == 0 || list->get_value(0)->get_type() != ValueType::Symbol) {
+                return std::nullopt;
+            }
+            auto builtin = combinators().find(car<SymbolValue>(list)->get_id());
+            if (builtin == combinators().end() || builtin->second.first != list->size()) {
+                return std::nullopt;
+            }
+            auto function = known_global(list->get_value(0));
+            if (function == nullptr || function->get_type() != ValueType::Function) {
+                return std::nullopt;
+            }
+            return builtin->second.second;
+        }
+
+        static ListPtr stream_call(StreamOperation operation, std::initializer_list<ValuePtr> args) {
+            auto call = std::make_shared<ListValue>();
+            call->add_value(stream_procedure(operation));
+            for (const auto &arg: args) {
+                call->add_value(arg);
+            }
+            return call;
+        }
+
+        // an expression of the stream of an (optimized) list expression that is made by map or filter,
+        // nullptr for other lists
+        ValuePtr stream_of(const ValuePtr &ast) {
+            if (ast->get_type() != ValueType::List) {
+                return nullptr;
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            // a chain that was fused already
+            if (list->size() == 2 && list->get_value(0) == stream_procedure(StreamOperation::ToList)) {
+                return list->get_value(1);
+            }
+            auto operation = combinator(list);
+            if (operation != StreamOperation::Map && operation != StreamOperation::Filter) {
+                return nullptr;
+            }
+            auto source = stream_of(list->get_value(2));
+            if (source == nullptr) {
+                source = stream_call(StreamOperation::FromList, {list->get_value(2)});
+            }
+            return stream_call(*operation, {list->get_value(1), source});
+        }
+
+        // a call of a combinator on the list that map or filter make runs as one stream, nullptr if there is no chain
+        ValuePtr fuse(const ListPtr &list) {
+            auto operation = combinator(list);
+            if (!operation) {
+                return nullptr;
+            }
+            auto stream = stream_of(list->get_value(list->size() - 1));
+            if (stream == nullptr) {
+                return nullptr;
+            }
+            switch (*operation) {
+                case StreamOperation::Map:
+                case StreamOperation::Filter:
+                    return stream_call(StreamOperation::ToList,
+                                       {stream_call(*operation, {list->get_value(1), stream})});
+                case StreamOperation::Fold:
+                    return stream_call(StreamOperation::Fold, {list->get_value(1), list->get_value(2), stream});
+                default:
+                    return stream_call(StreamOperation::ForEach, {list->get_value(1), stream});
+            }
+        }
+
+        ValuePtr optimize_call(const ListPtr &list_in) {
+            auto list = optimize_elements(list_in, 0);
+            auto op = list->get_value(0);
+            if (op->get_type() != ValueType::Symbol) {
+                return list;
+            }
+            if (auto fused = fuse(list)) {
+                return fused;
+            }
+            auto builtin = pure_builtins().find(std::static_pointer_cast<SymbolValue>(op)->get_id());
+            auto function = known_global(op);
+            if (builtin == pure_builtins().end() || function == nullptr ||
+                function->get_type() != ValueType::Function || list->size() - 1 != builtin->second.arity) {
+                return list;
+            }
+            std::vector<ValuePtr> args;
+            for (size_t i = 1; i < list->size(); ++i) {
+                auto arg = constant_value(list->get_value(i));
+                if (arg == nullptr || !has_type(arg, builtin->second.arguments)) {
+                    return list;
+                }
+                args.push_back(arg);
+            }
+            try {
+                auto result = apply_fn(static_cast<const FunctionValue &>(*function), args);
+                return is_atom(result) ? quote(result) : list;
+            } catch (std::exception &) {
+                // the error is reported if the call is ever evaluated
+                return list;
+            }
+        }
+
+        ValuePtr optimize_if(const ListPtr &list) {
+            if (list->size() < 3 || list->size() > 4) {
+                return list;
+            }
+            auto test = optimize(list->get_value(1));
+            auto value = constant_value(test);
+            if (value == nullptr) {
+                auto result = optimize_elements(list, 2);
+                result->set_value(1, test);
+                return result;
+            }
+            if (value->is_true()) {
+                return optimize(list->get_value(2));
+            }
+            return list->size() == 4 ? optimize(list->get_value(3)) : std::make_shared<NilValue>();
+        }
+
+        ValuePtr optimize_cond(const ListPtr &list) {
+            auto result = std::make_shared<ListValue>();
+            result->add_value(list->get_value(0));
+            for (size_t i = 1; i < list->size(); ++i) {
+                if (list->get_value(i)->get_type() != ValueType::List) {
+                    return list;
+                }
+                auto clause = optimize_elements(std::static_pointer_cast<ListValue>(list->get_value(i)), 0);
+                if (clause->size() == 0) {
+                    return list;
+                }
+                auto value = constant_value(clause->get_value(0));
+                if (value != nullptr && !value->is_true()) {
+                    continue;
+                }
+                result->add_value(clause);
+                // the following clauses are never reached
+                if (value != nullptr) {
+                    break;
+                }
+            }
+            if (result->size() == 1) {
+                return std::make_shared<NilValue>();
+            }
+            auto first = std::static_pointer_cast<ListValue>(result->get_value(1));
+            if (constant_value(first->get_value(0)) == nullptr) {
+                return result;
+            }
+            if (first->size() == 1) {
+                return std::make_shared<BoolValue>(true);
+            }
+            // the body of the first clause is evaluated like a begin
+            first->set_value(0, SymbolValue::from_id(static_cast<SymbolId>(SpecialForm::Begin)));
+            return first->size() == 2 ? first->get_value(1) : first;
+        }
+
+        ValuePtr optimize_begin(const ListPtr &list) {
+            auto result = std::make_shared<ListValue>();
+            result->add_value(list->get_value(0));
+            for (size_t i = 1; i < list->size(); ++i) {
+                auto expr = optimize(list->get_value(i));
+                // a constant has no effect unless it is the value of the begin
+                if (i + 1 < list->size() && constant_value(expr) != nullptr) {
+                    continue;
+                }
+                result->add_value(expr);
+            }
+            return result->size() == 2 ? result->get_value(1) : result;
+        }
+
+    public:
+        explicit Optimizer(Environment &env) : env_(env), assigned_(
+                global_assigned(env) != nullptr ? *global_assigned(env) : form_assigned_) {
+        }
+
+        ValuePtr run(const ValuePtr &ast) {
+            collect_bindings(ast);
+            return optimize(ast);
+        }
+
+        ValuePtr optimize(const ValuePtr &ast) {
+            if (ast->get_type() != ValueType::List) {
+                return ast;
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            if (list->size() == 0) {
+                return list;
+            }
+            if (list->get_value(0)->get_type() == ValueType::Symbol) {
+                switch (static_cast<SpecialForm>(car<SymbolValue>(list)->get_id())) {
+                    case SpecialForm::Quote:
+                        return list;
+                    case SpecialForm::Define:
+                    case SpecialForm::Set:
+                    case SpecialForm::Lambda:
+                    case SpecialForm::Receive:
+                        // the name or the variables stay as they are
+                        return optimize_elements(list, 2);
+                    case SpecialForm::LetStar:
+                    case SpecialForm::Letrec:
+                    case SpecialForm::Let: {
+                        // the bindings of a named let come after its name
+                        size_t position = list->size() > 2 && list->get_value(1)->get_type() == ValueType::Symbol ? 2 : 1;
+                        if (list->size() <= position || list->get_value(position)->get_type() != ValueType::List) {
+                            return list;
+                        }
+                        auto result = optimize_elements(list, position + 1);
+                        result->set_value(position, optimize_bindings(list->get_value(position)));
+                        return result;
+                    }
+                    case SpecialForm::Do: {
+                        if (list->size() < 3 || list->get_value(1)->get_type() != ValueType::List ||
+                            list->get_value(2)->get_type() != ValueType::List) {
+                            return list;
+                        }
+                        // the variables, their initial values and steps, the test and the result expressions
+                        auto result = optimize_elements(list, 3);
+                        result->set_value(1, optimize_bindings(list->get_value(1)));
+                        result->set_value(2, optimize_elements(std::static_pointer_cast<ListValue>(list->get_value(2)),
+                                                               0));
+                        return result;
+                    }
+                    case SpecialForm::Case: {
+                        // the datums of the clauses stay as they are
+                        auto result = optimize_elements(list, list->size());
+                        if (list->size() > 1) {
+                            result->set_value(1, optimize(list->get_value(1)));
+                        }
+                        for (size_t i = 2; i < list->size(); ++i) {
+                            if (list->get_value(i)->get_type() == ValueType::List) {
+                                result->set_value(i, optimize_elements(
+                                        std::static_pointer_cast<ListValue>(list->get_value(i)), 1));
+                            }
+                        }
+                        return result;
+                    }
+                    case SpecialForm::Guard: {
+                        if (list->size() < 2 || list->get_value(1)->get_type() != ValueType::List) {
+                            return list;
+                        }
+                        // the variable stays as it is, the clauses are those of cond
+                        auto result = optimize_elements(list, 2);
+                        auto clauses = std::static_pointer_cast<ListValue>(list->get_value(1));
+                        auto optimized = optimize_elements(clauses, clauses->size());
+                        for (size_t i = 1; i < clauses->size(); ++i) {
+                            if (clauses->get_value(i)->get_type() == ValueType::List) {
+                                optimized->set_value(i, optimize_elements(
+                                        std::static_pointer_cast<ListValue>(clauses->get_value(i)), 0));
+                            }
+                        }
+                        result->set_value(1, optimized);
+                        return result;
+                    }
+                    case SpecialForm::Begin:
+                        return optimize_begin(list);
+                    case SpecialForm::If:
+                        return optimize_if(list);
+                    case SpecialForm::Cond:
+                        return optimize_cond(list);
+                    default:
+                        break;
+                }
+            }
+            return optimize_call(list);
+        }
+    };
+}
+
+ValuePtr optimize(const ValuePtr &ast, const EnvironmentPtr &env) {
+    return Optimizer(*env).run(ast);
+}
+
+void note_assigned(Environment &env, SymbolId name) {
+    if (auto *names = global_assigned(env)) {
+        names->insert(name);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef SCHEME_OPTIMIZER_H
+#define SCHEME_OPTIMIZER_H
+
+#include "util.h"
+
+// Rewrites a form that was read before it is analyzed (or compiled):
+// - a call of a pure builtin with constant arguments is replaced by its result, e.g. (string-length "abc") by 3,
+// - if and cond with a constant test keep only the branch that is taken,
+// - constants in a begin that are not its value are dropped,
+// - a call of map, filter, fold or for-each on the result of map or filter is fused with it into one stream (see
+//   streams.h), e.g. (fold + 0 (map f (filter p xs))) makes no intermediate lists.
+// A builtin is folded or fused only if no form so far defined or set! its name in the same global environment and the
+// form does not bind the name itself. Forms that were already optimized keep the folded values even if the builtin is
+// redefined later.
+ValuePtr optimize(const ValuePtr &ast, const EnvironmentPtr &env);
+
+// records a name defined in env without a form (by a compiled library, a macro or the loader), calls of it are not
+// folded anymore in that global environment
+void note_assigned(Environment &env, SymbolId name);
+
+#endif //SCHEME_OPTIMIZER_H
@@ -0,0 +1,136 @@
+#include "primitives.h"
+#include "datatypes/types.h"
+#include <functional>
+
+const ValuePtr &bool_value(bool value) {
+    static const ValuePtr true_value = std::make_shared<BoolValue>(true);
+    static const ValuePtr false_value = std::make_shared<BoolValue>(false);
+    return value ? true_value : false_value;
+}
+
+size_t primitive_arity(Primitive primitive) {
+    switch (primitive) {
+        case Primitive::Car:
+        case Primitive::Cdr:
+        case Primitive::IsNull:
+        case Primitive::Not:
+        case Primitive::IsZero:
+        case Primitive::CallCC:
+        case Primitive::Continuation:
+        case Primitive::Spawn:
+        case Primitive::Join:
+        case Primitive::Receive:
+        case Primitive::Raise:
+        case Primitive::RaiseContinuable:
+            return 1;
+        case Primitive::None:
+        case Primitive::Yield:
+            return 0;
+        default:
+            return 2;
+    }
+}
+
+static bool is_number(const ValuePtr &value) {
+    return value->get_type() == ValueType::Integer || value->get_type() == ValueType::Float;
+}
+
+static std::int64_t integer_of(const ValuePtr &value) {
+    return static_cast<const IntegerValue &>(*value).get_value();
+}
+
+// same rules as the arithmetic builtins: integers stay integers, a float argument makes the result a float
+template<typename Operation>
+static ValuePtr arithmetic(const ValuePtr &a, const ValuePtr &b, Operation operation) {
+    if (a->get_type() == ValueType::Integer && b->get_type() == ValueType::Integer) {
+        return std::make_shared<IntegerValue>(operation(integer_of(a), integer_of(b)));
+    }
+    if (!is_number(a) || !is_number(b)) {
+        return nullptr;
+    }
+    return std::make_shared<FloatValue>(operation(a->to_double(), b->to_double()));
+}
+
+template<typename Comparator>
+static ValuePtr comparison(const ValuePtr &a, const ValuePtr &b, Comparator comparator) {
+    if (a->get_type() == ValueType::Integer && b->get_type() == ValueType::Integer) {
+        return bool_value(comparator(integer_of(a), integer_of(b)));
+    }
+    if (!is_number(a) || !is_number(b)) {
+        return nullptr;
+    }
+    return bool_value(comparator(a->to_double(), b->to_double()));
+}
+
+ValuePtr apply_primitive(Primitive primitive, const ValuePtr *args) {
+    switch (primitive) {
+        case Primitive::Add:
+            return arithmetic(args[0], args[1], std::plus<>{});
+        case Primitive::Subtract:
+            return arithmetic(args[0], args[1], std::minus<>{});
+        case Primitive::Multiply:
+            return arithmetic(args[0], args[1], std::multiplies<>{});
+        case Primitive::Divide:
+            // integer division by zero is left to the builtin
+            if (args[1]->get_type() == ValueType::Integer && integer_of(args[1]) == 0) {
+                return nullptr;
+            }
+            return arithmetic(args[0], args[1], std::divides<>{});
+        case Primitive::Equal:
+            return comparison(args[0], args[1], std::equal_to<>{});
+        case Primitive::Less:
+            return comparison(args[0], args[1], std::less<>{});
+        case Primitive::Greater:
+            return comparison(args[0], args[1], std::greater<>{});
+        case Primitive::LessEqual:
+            return comparison(args[0], args[1], std::less_equal<>{});
+        case Primitive::GreaterEqual:
+            return comparison(args[0], args[1], std::greater_equal<>{});
+        case Primitive::Car:
+            if (args[0]->get_type() != ValueType::List || static_cast<const ListValue &>(*args[0]).size() == 0) {
+                return nullptr;
+            }
+            return static_cast<const ListValue &>(*args[0]).get_value(0);
+        case Primitive::Cdr:
+            if (args[0]->get_type() != ValueType::List) {
+                return nullptr;
+            }
+            return cdr(args[0]);
+        case Primitive::Cons: {
+            // consing onto something else than a list makes a pair, that is left to the builtin
+            if (args[1]->get_type() != ValueType::List) {
+                return nullptr;
+            }
+            const auto &old_list = static_cast<const ListValue &>(*args[1]);
+            std::vector<ValuePtr> values;
+            values.reserve(old_list.size() + 1);
+            values.push_back(args[0]);
+            for (size_t i = 0; i < old_list.size(); ++i) {
+                values.push_back(old_list.get_value(i));
+            }
+            return std::make_shared<ListValue>(std::move(values));
+        }
+        case Primitive::IsNull:
+            return bool_value(args[0]->get_type() == ValueType::List &&
+                              static_cast<const ListValue &>(*args[0]).size() == 0);
+        case Primitive::Not:
+            return bool_value(args[0]->get_type() == ValueType::Bool && !args[0]->is_true());
+        case Primitive::IsZero:
+            if (!is_number(args[0])) {
+                return nullptr;
+            }
+            return bool_value(args[0]->to_double() == 0);
+        case Primitive::CallCC:
+        case Primitive::Continuation:
+        case Primitive::Spawn:
+        case Primitive::Yield:
+        case Primitive::Join:
+        case Primitive::Receive:
+        case Primitive::Raise:
+        case Primitive::RaiseContinuable:
+        case Primitive::Error:
+        case Primitive::None:
+            break;
+    }
+    return nullptr;
+}
@@ -0,0 +1,20 @@
+#ifndef SCHEME_PRIMITIVES_H
+#define SCHEME_PRIMITIVES_H
+
+#include "util.h"
+
+// Fast paths of the core builtins. A call of a FunctionValue tagged with a Primitive (see types.h) with the right
+// number of arguments is done here directly on the evaluated operands, without building an argument vector or going
+// through std::function. Anything unusual (other argument types, errors) is left to the builtin itself.
+
+// number of arguments the fast path of the primitive takes
+size_t primitive_arity(Primitive primitive);
+
+// result of the primitive applied to primitive_arity(primitive) arguments starting at args,
+// nullptr if the builtin has to be called instead
+ValuePtr apply_primitive(Primitive primitive, const ValuePtr *args);
+
+// shared #t and #f values, booleans are immutable so the results of predicates do not need to be allocated
+const ValuePtr &bool_value(bool value);
+
+#endif //SCHEME_PRIMITIVES_H
@@ -232,7 +232,7 @@ std::shared_ptr<ListValue> Reader::read_quoted_form(Tokenizer &tokenizer) {
     // create a List object
     std::shared_ptr<ListValue> list = std::make_shared<ListValue>();
     tokenizer.next_token();
-    list->add_value(std::make_shared<SymbolValue>("quote"));
+    list->add_value(SymbolValue::from_id(static_cast<SymbolId>(SpecialForm::Quote)));
     auto form = read_form(tokenizer);
     list->add_value(form);
     return list;
@@ -241,7 +241,7 @@ std::shared_ptr<ListValue> Reader::read_quoted_form(Tokenizer &tokenizer) {
 
 std::shared_ptr<Value> Reader::read_atom(Tokenizer &tokenizer) {
     if (tokenizer.peek_token().first == TOKEN_TYPE::INTEGER) {
-        auto value = std::make_shared<IntegerValue>(std::stoi(tokenizer.peek_token().second));
+        auto value = std::make_shared<IntegerValue>(std::stoll(tokenizer.peek_token().second));
         return value;
 
     } else if (tokenizer.peek_token().first == TOKEN_TYPE::FLOAT) {
@@ -252,7 +252,7 @@ std::shared_ptr<Value> Reader::read_atom(Tokenizer &tokenizer) {
             auto value = std::make_shared<NilValue>();
             return value;
         }
-        auto value = std::make_shared<SymbolValue>(tokenizer.peek_token().second);
+        auto value = SymbolValue::intern(tokenizer.peek_token().second);
         return value;
     } else if (tokenizer.peek_token().first == TOKEN_TYPE::STRING) {
         // create a StringValue object
@@ -282,6 +282,12 @@ std::shared_ptr<Value> read_file(const std::string &path) {
 
 }
 
+ValuePtr read_string(const std::string &source) {
+    Tokenizer tokenizer(source);
+    Reader reader;
+    return reader.read_form(tokenizer);
+}
+
 ValuePtr read_stdin() {
     // read_stdin source and return a list of tokens
     std::string line;
@@ -11,6 +11,8 @@
 
 std::shared_ptr<Value> read_file(const std::string &path);
 std::shared_ptr<Value> read_stdin();
+// the first form of the source
+std::shared_ptr<Value> read_string(const std::string &source);
 
 enum class TOKEN_TYPE {
     LPAREN,
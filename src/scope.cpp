@@ -0,0 +1,203 @@
+#include "scope.h"
+#include "syntax.h"
+#include "datatypes/types.h"
+
+#include <algorithm>
+#include <utility>
+
+Scope::Scope(ScopePtr parent, bool owns_frame, bool is_lambda, bool barrier) : parent_(std::move(parent)),
+                                                                               owns_frame_(owns_frame),
+                                                                               barrier_(barrier),
+                                                                               is_lambda_(is_lambda) {
+    frame_size_ = owns_frame || parent_ == nullptr ? std::make_shared<size_t>(0) : parent_->frame_size_;
+    function_level_ = (parent_ == nullptr ? 0 : parent_->function_level_) + (is_lambda ? 1 : 0);
+}
+
+size_t Scope::declare(SymbolId name, bool pending, bool boxed) {
+    for (auto &variable: variables_) {
+        if (variable.name == name) {
+            variable.pending = variable.pending && pending;
+            variable.boxed = variable.boxed || boxed;
+            return variable.index;
+        }
+    }
+    variables_.push_back({name, (*frame_size_)++, pending, boxed});
+    return variables_.back().index;
+}
+
+void Scope::bind(SymbolId name) {
+    for (auto &variable: variables_) {
+        if (variable.name == name) {
+            variable.pending = false;
+        }
+    }
+}
+
+std::optional<LexicalAddress> Scope::resolve(SymbolId name) {
+    return resolve(name, function_level_);
+}
+
+std::optional<LexicalAddress> Scope::resolve(SymbolId name, size_t function_level) {
+    size_t depth = 0;
+    for (Scope *scope = this; scope != nullptr; scope = scope->parent_.get()) {
+        for (const auto &variable: scope->variables_) {
+            if (variable.name != name) {
+                continue;
+            }
+            // before it is bound the name still refers to the outer variable, like with the old environments
+            if (!variable.pending || function_level > scope->function_level_) {
+                return LexicalAddress{depth, variable.index, variable.boxed};
+            }
+        }
+        if (scope->barrier_) {
+            break;
+        }
+        if (scope->is_lambda_) {
+            // a free variable of the lambda: the slot of its capture in the frame of the closure
+            auto &names = scope->capture_names_;
+            for (size_t i = 0; i < names.size(); ++i) {
+                if (names[i] == name) {
+                    return LexicalAddress{depth + 1, i, scope->captures_[i].boxed};
+                }
+            }
+            auto outer = scope->parent_ == nullptr ? std::nullopt : scope->parent_->resolve(name, function_level);
+            if (!outer.has_value()) {
+                return std::nullopt;
+            }
+            names.push_back(name);
+            scope->captures_.push_back(*outer);
+            return LexicalAddress{depth + 1, names.size() - 1, outer->boxed};
+        }
+        if (scope->owns_frame_) {
+            ++depth;
+        }
+    }
+    return std::nullopt;
+}
+
+bool Scope::is_boxed(SymbolId name) const {
+    for (const auto &variable: variables_) {
+        if (variable.name == name) {
+            return variable.boxed;
+        }
+    }
+    return false;
+}
+
+std::vector<size_t> Scope::boxed_slots(const std::vector<size_t> &except) const {
+    std::vector<size_t> slots;
+    for (const auto &variable: variables_) {
+        if (variable.boxed && std::find(except.begin(), except.end(), variable.index) == except.end()) {
+            slots.push_back(variable.index);
+        }
+    }
+    return slots;
+}
+
+size_t Scope::closure_depth() const {
+    size_t depth = 0;
+    for (const Scope *scope = this; scope != nullptr; scope = scope->parent_.get()) {
+        if (scope->owns_frame_) {
+            ++depth;
+        }
+        if (scope->is_lambda_) {
+            break;
+        }
+    }
+    return depth;
+}
+
+VariableUse::VariableUse(const ListPtr &forms, size_t start) {
+    for (size_t i = start; i < forms->size(); ++i) {
+        scan(forms->get_value(i), false);
+    }
+}
+
+void VariableUse::scan(const ValuePtr &ast, bool in_lambda) {
+    if (ast->get_type() == ValueType::Symbol) {
+        if (in_lambda) {
+            captured_.insert(std::static_pointer_cast<SymbolValue>(ast)->get_id());
+        }
+        return;
+    }
+    if (ast->get_type() != ValueType::List) {
+        return;
+    }
+    auto list = std::static_pointer_cast<ListValue>(ast);
+    if (list->size() == 0) {
+        return;
+    }
+    if (list->get_value(0)->get_type() == ValueType::Symbol) {
+        switch (static_cast<SpecialForm>(car<SymbolValue>(list)->get_id())) {
+            case SpecialForm::Quote:
+                return;
+            case SpecialForm::Lambda:
+                for (size_t i = 2; i < list->size(); ++i) {
+                    scan(list->get_value(i), true);
+                }
+                return;
+            case SpecialForm::Define:
+            case SpecialForm::Set:
+                if (list->size() == 3 && list->get_value(1)->get_type() == ValueType::Symbol) {
+                    assigned_.insert(std::static_pointer_cast<SymbolValue>(list->get_value(1))->get_id());
+                }
+                break;
+            case SpecialForm::Let:
+            case SpecialForm::LetStar:
+            case SpecialForm::Letrec:
+                // a named let that is not a loop makes a closure of its body
+                if (is_named_let(list) && !is_loop(list)) {
+                    scan(named_let_to_call(list), in_lambda);
+                    return;
+                }
+                break;
+            case SpecialForm::Do:
+                scan(do_to_named_let(list), in_lambda);
+                return;
+            default:
+                break;
+        }
+    }
+    for (size_t i = 0; i < list->size(); ++i) {
+        scan(list->get_value(i), in_lambda);
+    }
+}
+
+ScopePtr make_lambda_scope(const ScopePtr &parent) {
+    return std::make_shared<Scope>(parent, true, true);
+}
+
+ScopePtr make_let_scope(const ScopePtr &parent) {
+    return std::make_shared<Scope>(parent, parent == nullptr, false);
+}
+
+SymbolId variable_id(const ValuePtr &name, const std::string &form) {
+    if (name->get_type() != ValueType::Symbol) {
+        throw std::runtime_error(form + ": " + name->to_string() + " is not a variable name");
+    }
+    return std::static_pointer_cast<SymbolValue>(name)->get_id();
+}
+
+ScopePtr make_inline_scope(const ScopePtr &parent) {
+    return std::make_shared<Scope>(parent, false, false, true);
+}
+
+bool is_boxed_let_variable(SymbolId name, const VariableUse &use, const VariableUse &inits_use) {
+    return use.is_captured(name) && (use.is_assigned(name) || inits_use.is_captured(name));
+}
+
+void declare_internal_defines(const ScopePtr &scope, const ListPtr &exprs, size_t start, const VariableUse &use) {
+    for (size_t i = start; i < exprs->size(); ++i) {
+        auto expr = exprs->get_value(i);
+        if (expr->get_type() != ValueType::List) {
+            continue;
+        }
+        auto list = std::static_pointer_cast<ListValue>(expr);
+        if (list->size() == 3 && list->get_value(0)->get_type() == ValueType::Symbol &&
+            list->get_value(1)->get_type() == ValueType::Symbol &&
+            car<SymbolValue>(list)->get_id() == static_cast<SymbolId>(SpecialForm::Define)) {
+            auto name = std::static_pointer_cast<SymbolValue>(list->get_value(1))->get_id();
+            scope->declare(name, true, use.is_captured(name));
+        }
+    }
+}
@@ -0,0 +1,135 @@
+#ifndef SCHEME_SCOPE_H
+#define SCHEME_SCOPE_H
+
+#include "util.h"
+#include "datatypes/types.h"
+#include <memory>
+#include <optional>
+#include <unordered_set>
+#include <vector>
+
+// position of a local variable: number of frames to walk out and the slot in that frame
+struct LexicalAddress {
+    size_t depth;
+    size_t index;
+    // the slot holds a BoxValue with the value, shared with the closures that captured the variable
+    bool boxed = false;
+};
+
+class Scope;
+
+// nullptr is the top level scope, variables not found in any scope are globals
+using ScopePtr = std::shared_ptr<Scope>;
+
+// Compile time view of the local variables visible at a point of the program.
+// Every lambda body (and every let outside of all lambdas) gets a frame, a let inside of a lambda only opens a new
+// contour whose variables get slots in the frame of the lambda, so entering it costs no allocation.
+//
+// Closures are flat: the variables of enclosing lambdas and lets that a lambda refers to are its captures, which are
+// copied into a frame of the closure when it is made (one frame out of the frame of a call), so a closure keeps only
+// the values it uses alive and reads each of them in constant time. A variable that may change after a closure copied
+// it (it is assigned, or bound by letrec or an internal define after a lambda refers to it) lives in a box instead,
+// which the frame and the closures share. The frame of the closure leads to the global environment through the frames
+// of the enclosing closures.
+class Scope {
+    struct Variable {
+        SymbolId name;
+        size_t index;
+        // declared ahead of its binding (letrec, internal define): only visible from nested lambdas until bound
+        bool pending;
+        bool boxed;
+    };
+
+    ScopePtr parent_;
+    // shared by all contours of one frame
+    std::shared_ptr<size_t> frame_size_;
+    std::vector<Variable> variables_;
+    bool owns_frame_;
+    // number of lambdas around this contour
+    size_t function_level_;
+    // variables of the outer contours are not visible from this one (body of an inlined closure)
+    bool barrier_;
+    bool is_lambda_;
+    // free variables of the lambda that were referred to so far, the slots of the frame of its closures,
+    // and the address of each one where the closure is made
+    std::vector<SymbolId> capture_names_;
+    std::vector<LexicalAddress> captures_;
+
+    std::optional<LexicalAddress> resolve(SymbolId name, size_t function_level);
+
+public:
+    Scope(ScopePtr parent, bool owns_frame, bool is_lambda, bool barrier = false);
+
+    // makes the name a variable of this contour (a redeclaration reuses the slot) and returns its slot
+    size_t declare(SymbolId name, bool pending = false, bool boxed = false);
+
+    // makes a pending variable visible everywhere
+    void bind(SymbolId name);
+
+    // nullopt means a global variable, a variable of an enclosing lambda becomes a capture of this one
+    [[nodiscard]] std::optional<LexicalAddress> resolve(SymbolId name);
+
+    // whether the variable declared in this contour lives in a box
+    [[nodiscard]] bool is_boxed(SymbolId name) const;
+
+    // slots of the boxed variables of this contour, other than the given ones
+    [[nodiscard]] std::vector<size_t> boxed_slots(const std::vector<size_t> &except = {}) const;
+
+    [[nodiscard]] const std::vector<LexicalAddress> &captures() const {
+        return captures_;
+    }
+
+    // number of frames from the frame of this contour out to the environment of the closure of the enclosing lambda
+    // (the global environment outside of all lambdas), the outer environment of the closures made here
+    [[nodiscard]] size_t closure_depth() const;
+
+    [[nodiscard]] size_t frame_size() const {
+        return *frame_size_;
+    }
+};
+
+// Which names a lambda in some forms refers to and which names set! or define assign in them, found before the forms
+// are analyzed to decide which variables need boxes. Shadowing is ignored, so a variable may get a box it does not need.
+class VariableUse {
+    std::unordered_set<SymbolId> captured_;
+    std::unordered_set<SymbolId> assigned_;
+
+    void scan(const ValuePtr &ast, bool in_lambda);
+
+public:
+    VariableUse() = default;
+
+    // uses in the forms starting at element start of the list
+    VariableUse(const ListPtr &forms, size_t start);
+
+    [[nodiscard]] bool is_captured(SymbolId name) const {
+        return captured_.count(name) > 0;
+    }
+
+    [[nodiscard]] bool is_assigned(SymbolId name) const {
+        return assigned_.count(name) > 0;
+    }
+};
+
+ScopePtr make_lambda_scope(const ScopePtr &parent);
+
+// let at the top level needs its own frame, inside of a lambda it only opens a contour
+ScopePtr make_let_scope(const ScopePtr &parent);
+
+// id of the variable named by the form (define, set! or a parameter), throws if it is not a symbol
+SymbolId variable_id(const ValuePtr &name, const std::string &form);
+
+// contour for the parameters of an inlined closure, it uses slots of the frame of the caller,
+// but the body of the closure sees only its own variables and the globals
+ScopePtr make_inline_scope(const ScopePtr &parent);
+
+// a let variable needs a box if a lambda refers to it and it may change after the lambda copied it: it is assigned,
+// or a lambda in the initial values refers to it before it is bound (letrec)
+bool is_boxed_let_variable(SymbolId name, const VariableUse &use, const VariableUse &inits_use);
+
+// declares the names of the defines in a body as pending, so that lambdas in the body can refer to each other,
+// the names that lambdas in the body refer to are boxed
+void declare_internal_defines(const ScopePtr &scope, const ListPtr &exprs, size_t start,
+                              const VariableUse &use = VariableUse());
+
+#endif //SCHEME_SCOPE_H
@@ -0,0 +1,168 @@
+#include "streams.h"
+#include "evaluator.h"
+#include "primitives.h"
+#include <string>
+
+namespace {
+    ListPtr list_argument(const std::string &name, const ValuePtr &value) {
+        if (value->get_type() != ValueType::List) {
+            throw std::runtime_error(name + ": " + value->to_string() + " is not a list");
+        }
+        return std::static_pointer_cast<ListValue>(value);
+    }
+
+    const StreamValue &stream_argument(const std::string &name, const ValuePtr &value) {
+        if (value->get_type() != ValueType::Stream) {
+            throw std::runtime_error(name + ": " + value->to_string() + " is not a stream");
+        }
+        return static_cast<const StreamValue &>(*value);
+    }
+
+    // calls the procedure with one argument, args is reused by the calls of a pass
+    ValuePtr call(const ValuePtr &procedure, std::vector<ValuePtr> &args, const ValuePtr &value,
+                  const std::string &name) {
+        args.assign(1, value);
+        return call_procedure(procedure, args, name);
+    }
+
+    // passes the elements that come out of the stages of the stream to the sink, one element at a time
+    template<typename Sink>
+    void run_stream(const StreamValue &stream, const std::string &name, Sink sink) {
+        std::vector<ValuePtr> args;
+        for (size_t i = 0; i < stream.source->size(); ++i) {
+            auto value = stream.source->get_value(i);
+            bool passed = true;
+            for (const auto &stage: stream.stages) {
+                if (stage.operation == StreamOperation::Map) {
+                    value = call(stage.procedure, args, value, name);
+                } else if (!call(stage.procedure, args, value, name)->is_true()) {
+                    passed = false;
+                    break;
+                }
+            }
+            if (passed) {
+                sink(value);
+            }
+        }
+    }
+
+    ValuePtr add_stage(std::string name, size_t argc, std::vector<ValuePtr> &argv, StreamOperation operation) {
+        check_arity(name, 2, argc);
+        const auto &stream = stream_argument(name, argv[1]);
+        auto stages = stream.stages;
+        stages.push_back({operation, argv[0]});
+        return std::make_shared<StreamValue>(stream.source, std::move(stages));
+    }
+
+    ValuePtr list_to_stream_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (list->stream list)
+//    Returns a stream of the elements of list.
+        std::string name = "list->stream";
+        check_arity(name, 1, argc);
+        return std::make_shared<StreamValue>(list_argument(name, argv[0]), std::vector<StreamValue::Stage>());
+    }
+
+    ValuePtr stream_map_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (stream-map proc stream)
+//    Returns a stream of the results of proc applied to the elements of stream, proc is called when they are taken.
+        return add_stage("stream-map", argc, argv, StreamOperation::Map);
+    }
+
+    ValuePtr stream_filter_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (stream-filter pred stream)
+//    Returns a stream of the elements of stream that satisfy pred, pred is called when they are taken.
+        return add_stage("stream-filter", argc, argv, StreamOperation::Filter);
+    }
+
+    ValuePtr stream_to_list_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (stream->list stream)
+//    Returns a newly allocated list of the elements of stream.
+        std::string name = "stream->list";
+        check_arity(name, 1, argc);
+        std::vector<ValuePtr> values;
+        run_stream(stream_argument(name, argv[0]), name, [&values](const ValuePtr &value) {
+            values.push_back(value);
+        });
+        return std::make_shared<ListValue>(std::move(values));
+    }
+
+    ValuePtr stream_fold_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (stream-fold kons knil stream)
+//    Like fold on the elements of stream.
+        std::string name = "stream-fold";
+        check_arity(name, 3, argc);
+        auto accumulator = argv[1];
+        std::vector<ValuePtr> args;
+        run_stream(stream_argument(name, argv[2]), name, [&](const ValuePtr &value) {
+            args = {value, accumulator};
+            accumulator = call_procedure(argv[0], args, name);
+        });
+        return accumulator;
+    }
+
+    ValuePtr stream_for_each_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (stream-for-each proc stream)
+//    Calls proc on the elements of stream in order, for its side effects.
+        std::string name = "stream-for-each";
+        check_arity(name, 2, argc);
+        std::vector<ValuePtr> args;
+        run_stream(stream_argument(name, argv[1]), name, [&](const ValuePtr &value) {
+            call(argv[0], args, value, name);
+        });
+        return std::make_shared<NilValue>();
+    }
+}
+
+const ValuePtr &stream_procedure(StreamOperation operation) {
+    static const ValuePtr procedures[] = {
+            std::make_shared<FunctionValue>(list_to_stream_function),
+            std::make_shared<FunctionValue>(stream_map_function),
+            std::make_shared<FunctionValue>(stream_filter_function),
+            std::make_shared<FunctionValue>(stream_to_list_function),
+            std::make_shared<FunctionValue>(stream_fold_function),
+            std::make_shared<FunctionValue>(stream_for_each_function),
+    };
+    return procedures[static_cast<size_t>(operation)];
+}
+
+ValuePtr filter_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (filter pred list) SRFI 1
+//    Return all the elements of list that satisfy predicate pred. The list is not disordered -- elements that appear
+//    in the result list occur in the same order as they occur in the argument list.
+    std::string name = "filter";
+    check_arity(name, 2, argc);
+    auto list = list_argument(name, argv[1]);
+    std::vector<ValuePtr> values;
+    std::vector<ValuePtr> args;
+    for (size_t i = 0; i < list->size(); ++i) {
+        auto value = list->get_value(i);
+        if (call(argv[0], args, value, name)->is_true()) {
+            values.push_back(value);
+        }
+    }
+    return std::make_shared<ListValue>(std::move(values));
+}
+
+ValuePtr fold_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (fold kons knil list) SRFI 1
+//    The fundamental list iterator. First element of list is passed to kons together with knil, the result is passed
+//    to kons with the second element, and so on: (fold kons knil lis) = (fold kons (kons elt knil) rest).
+    std::string name = "fold";
+    check_arity(name, 3, argc);
+    auto list = list_argument(name, argv[2]);
+    auto accumulator = argv[1];
+    std::vector<ValuePtr> args;
+    for (size_t i = 0; i < list->size(); ++i) {
+        args = {list->get_value(i), accumulator};
+        accumulator = call_procedure(argv[0], args, name);
+    }
+    return accumulator;
+}
+
+ValuePtr stream_question_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (stream? obj)
+//    Returns #t if obj is a stream.
+    std::string name = "stream?";
+    check_arity(name, 1, argc);
+    return bool_value(argv[0]->get_type() == ValueType::Stream);
+}
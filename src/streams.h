@@ -0,0 +1,51 @@
+#ifndef SCHEME_STREAMS_H
+#define SCHEME_STREAMS_H
+
+#include "util.h"
+#include <vector>
+
+// List combinators and streams: (filter predicate list), (fold kons knil list), and the lazy pipelines
+// (list->stream list), (stream-map procedure stream), (stream-filter predicate stream), (stream->list stream),
+// (stream-fold kons knil stream), (stream-for-each procedure stream) and (stream? obj).
+//
+// A stream is a list and the stages that are still to be applied to its elements. stream-map and stream-filter only
+// add a stage, nothing runs until stream->list, stream-fold or stream-for-each take the elements one by one through
+// all stages, so a chain of stages makes no intermediate lists. The optimizer turns chains of the builtins into
+// streams (see optimizer.h): (fold + 0 (map f (filter p xs))) runs as
+// (stream-fold + 0 (stream-map f (stream-filter p (list->stream xs)))), which calls p and f on one element after the
+// other instead of calling p on all elements first. Like fold, stream-fold calls (kons element accumulator).
+
+enum class StreamOperation {
+    FromList, Map, Filter, ToList, Fold, ForEach
+};
+
+class StreamValue : public Value {
+public:
+    struct Stage {
+        // Map or Filter
+        StreamOperation operation;
+        ValuePtr procedure;
+    };
+
+    StreamValue(ListPtr source, std::vector<Stage> stages)
+            : Value(ValueType::Stream), source(std::move(source)), stages(std::move(stages)) {
+    }
+
+    [[nodiscard]] std::string to_string() const override {
+        return "#<stream>";
+    }
+
+    const ListPtr source;
+    const std::vector<Stage> stages;
+};
+
+// the builtin of the operation, the optimizer puts it into the chains it fuses
+const ValuePtr &stream_procedure(StreamOperation operation);
+
+ValuePtr filter_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr fold_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr stream_question_function(size_t argc, std::vector<ValuePtr> &argv);
+
+#endif //SCHEME_STREAMS_H
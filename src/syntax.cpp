@@ -0,0 +1,406 @@
+#include "syntax.h"
+#include "scope.h"
+#include "exceptions.h"
+#include <algorithm>
+#include <initializer_list>
+
+namespace {
+    ValuePtr keyword(SpecialForm form) {
+        return SymbolValue::from_id(static_cast<SymbolId>(form));
+    }
+
+    ListPtr make_list(std::initializer_list<ValuePtr> values) {
+        return std::make_shared<ListValue>(std::vector<ValuePtr>(values));
+    }
+
+    bool is_name(const ValuePtr &value, SymbolId name) {
+        return value->get_type() == ValueType::Symbol && std::static_pointer_cast<SymbolValue>(value)->get_id() == name;
+    }
+
+    // the special form the list starts with, SpecialForm::Count for a call
+    SpecialForm form_of(const ListPtr &list) {
+        if (list->get_value(0)->get_type() != ValueType::Symbol ||
+            car<SymbolValue>(list)->get_id() >= static_cast<SymbolId>(SpecialForm::Count)) {
+            return SpecialForm::Count;
+        }
+        return static_cast<SpecialForm>(car<SymbolValue>(list)->get_id());
+    }
+
+    // the list of bindings of a let, each a list of a variable and its initial value
+    bool is_binding_list(const ValuePtr &bindings) {
+        if (bindings->get_type() != ValueType::List) {
+            return false;
+        }
+        auto list = std::static_pointer_cast<ListValue>(bindings);
+        for (size_t i = 0; i < list->size(); ++i) {
+            auto binding = list->get_value(i);
+            if (binding->get_type() != ValueType::List || std::static_pointer_cast<ListValue>(binding)->size() != 2 ||
+                car<Value>(binding)->get_type() != ValueType::Symbol) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // whether the forms refer to the name of a loop only by calls in tail position and make no closures
+    class LoopCheck {
+        SymbolId name_;
+        size_t arity_;
+
+        bool sequence(const ListPtr &list, size_t start, bool tail) {
+            for (size_t i = start; i < list->size(); ++i) {
+                if (!check(list->get_value(i), tail && i + 1 == list->size())) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool inits(const ListPtr &bindings) {
+            for (size_t i = 0; i < bindings->size(); ++i) {
+                auto binding = std::static_pointer_cast<ListValue>(bindings->get_value(i));
+                if (is_name(binding->get_value(0), name_) || !check(binding->get_value(1), false)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    public:
+        LoopCheck(SymbolId name, size_t arity) : name_(name), arity_(arity) {
+        }
+
+        bool check(const ValuePtr &ast, bool tail) {
+            if (ast->get_type() == ValueType::Symbol) {
+                return !is_name(ast, name_);
+            }
+            if (ast->get_type() != ValueType::List || std::static_pointer_cast<ListValue>(ast)->size() == 0) {
+                return true;
+            }
+            auto list = std::static_pointer_cast<ListValue>(ast);
+            switch (form_of(list)) {
+                case SpecialForm::Quote:
+                    return true;
+                case SpecialForm::Lambda:
+                    return false;
+                case SpecialForm::If:
+                    return list->size() >= 3 && list->size() <= 4 && check(list->get_value(1), false) &&
+                           check(list->get_value(2), tail) && (list->size() == 3 || check(list->get_value(3), tail));
+                case SpecialForm::Cond:
+                    for (size_t i = 1; i < list->size(); ++i) {
+                        auto clause = list->get_value(i);
+                        if (clause->get_type() != ValueType::List ||
+                            std::static_pointer_cast<ListValue>(clause)->size() == 0 ||
+                            !check(car<Value>(clause), false) ||
+                            !sequence(std::static_pointer_cast<ListValue>(clause), 1, tail)) {
+                            return false;
+                        }
+                    }
+                    return true;
+                case SpecialForm::Let:
+                case SpecialForm::LetStar:
+                case SpecialForm::Letrec:
+                    if (is_named_let(list)) {
+                        // an inner loop of the same name hides this one, one that is not a loop makes a closure
+                        auto bindings = std::static_pointer_cast<ListValue>(list->get_value(2));
+                        if (!is_loop(list) || !inits(bindings)) {
+                            return false;
+                        }
+                        return is_name(list->get_value(1), name_) || sequence(list, 3, tail);
+                    }
+                    return list->size() >= 2 && is_binding_list(list->get_value(1)) &&
+                           inits(std::static_pointer_cast<ListValue>(list->get_value(1))) && sequence(list, 2, tail);
+                case SpecialForm::Do:
+                    return check(do_to_named_let(list), tail);
+                case SpecialForm::Case:
+                    if (list->size() < 2 || !check(list->get_value(1), false)) {
+                        return false;
+                    }
+                    for (size_t i = 2; i < list->size(); ++i) {
+                        auto clause = list->get_value(i);
+                        if (clause->get_type() != ValueType::List ||
+                            std::static_pointer_cast<ListValue>(clause)->size() == 0 ||
+                            !sequence(std::static_pointer_cast<ListValue>(clause), 1, tail)) {
+                            return false;
+                        }
+                    }
+                    return true;
+                case SpecialForm::Receive:
+                    if (list->size() < 3 || list->get_value(1)->get_type() != ValueType::List ||
+                        !check(list->get_value(2), false)) {
+                        return false;
+                    }
+                    for (size_t i = 0; i < std::static_pointer_cast<ListValue>(list->get_value(1))->size(); ++i) {
+                        if (is_name(std::static_pointer_cast<ListValue>(list->get_value(1))->get_value(i), name_)) {
+                            return false;
+                        }
+                    }
+                    return sequence(list, 3, tail);
+                case SpecialForm::Guard:
+                    // the body is not in tail position, the guard is left after it returns
+                    return sequence(list, 2, false) && check(guard_handler(list), tail);
+                case SpecialForm::Begin:
+                    return sequence(list, 1, tail);
+                case SpecialForm::Define:
+                case SpecialForm::Set:
+                    return list->size() == 3 && !is_name(list->get_value(1), name_) && check(list->get_value(2), false);
+                default:
+                    if (is_name(list->get_value(0), name_)) {
+                        return tail && list->size() - 1 == arity_ && sequence(list, 1, false);
+                    }
+                    return sequence(list, 0, false);
+            }
+        }
+
+        bool check_body(const ListPtr &named_let) {
+            return sequence(named_let, 3, true);
+        }
+    };
+}
+
+bool is_named_let(const ListPtr &list) {
+    if (list->size() < 3 || list->get_value(1)->get_type() != ValueType::Symbol ||
+        car<Value>(list)->get_type() != ValueType::Symbol ||
+        car<SymbolValue>(list)->get_id() != static_cast<SymbolId>(SpecialForm::Let)) {
+        return false;
+    }
+    if (!is_binding_list(list->get_value(2))) {
+        throw std::runtime_error("let: expected a list of bindings after the name");
+    }
+    return true;
+}
+
+bool is_loop(const ListPtr &named_let) {
+    auto name = variable_id(named_let->get_value(1), "let");
+    auto bindings = std::static_pointer_cast<ListValue>(named_let->get_value(2));
+    for (size_t i = 0; i < bindings->size(); ++i) {
+        if (is_name(car<Value>(bindings->get_value(i)), name)) {
+            return false;
+        }
+    }
+    return LoopCheck(name, bindings->size()).check_body(named_let);
+}
+
+std::vector<SymbolId> receive_variables(const ListPtr &receive) {
+//    (receive 〈formals〉 〈expression〉 〈body〉) syntax
+//    The 〈expression〉 is evaluated, and the values it returns are bound to the variables of 〈formals〉, which must
+//    be as many as there are values. The 〈body〉 is evaluated in the extended environment.
+    if (receive->size() < 3 || receive->get_value(1)->get_type() != ValueType::List) {
+        throw std::runtime_error("receive: expected a list of variables, an expression and a body");
+    }
+    auto formals = std::static_pointer_cast<ListValue>(receive->get_value(1));
+    std::vector<SymbolId> variables;
+    for (size_t i = 0; i < formals->size(); ++i) {
+        variables.push_back(variable_id(formals->get_value(i), "receive"));
+        // like lambda, receive takes no rest variable
+        if (variables.back() == SymbolValue::intern(".")->get_id()) {
+            throw std::runtime_error("receive: a rest variable is not supported in " + formals->to_string());
+        }
+    }
+    return variables;
+}
+
+ListPtr guard_handler(const ListPtr &guard) {
+//    (guard (〈variable〉 〈cond clause1〉 〈cond clause2〉 ...) 〈body〉) syntax
+//    The 〈body〉 is evaluated with an exception handler that binds the raised object to 〈variable〉 and, within the
+//    scope of that binding, evaluates the clauses as if they were the clauses of a cond expression. If every
+//    〈cond clause〉's 〈test〉 evaluates to #f and there is no else clause, then raise-continuable is invoked on the
+//    raised object within the dynamic environment of the original call to raise.
+    if (guard->size() < 3 || guard->get_value(1)->get_type() != ValueType::List ||
+        std::static_pointer_cast<ListValue>(guard->get_value(1))->size() == 0) {
+        throw std::runtime_error("guard: expected a variable with clauses and a body");
+    }
+    auto spec = std::static_pointer_cast<ListValue>(guard->get_value(1));
+    auto variable = spec->get_value(0);
+    variable_id(variable, "guard");
+    auto clauses = make_list({keyword(SpecialForm::Cond)});
+    for (size_t i = 1; i < spec->size(); ++i) {
+        auto clause = spec->get_value(i);
+        if (clause->get_type() != ValueType::List || std::static_pointer_cast<ListValue>(clause)->size() == 0) {
+            throw std::runtime_error("guard: expected a cond clause but got " + clause->to_string());
+        }
+        clauses->add_value(clause);
+    }
+    clauses->add_value(make_list({std::make_shared<BoolValue>(true), make_list({raise_procedure(), variable})}));
+    return make_list({keyword(SpecialForm::Receive), make_list({variable}), std::make_shared<BoolValue>(false),
+                      clauses});
+}
+
+ListPtr named_let_to_call(const ListPtr &named_let) {
+    auto name = named_let->get_value(1);
+    auto bindings = std::static_pointer_cast<ListValue>(named_let->get_value(2));
+    auto params = std::make_shared<ListValue>();
+    auto call = std::make_shared<ListValue>();
+    for (size_t i = 0; i < bindings->size(); ++i) {
+        params->add_value(car<Value>(bindings->get_value(i)));
+    }
+    auto lambda = make_list({keyword(SpecialForm::Lambda), params});
+    for (size_t i = 3; i < named_let->size(); ++i) {
+        lambda->add_value(named_let->get_value(i));
+    }
+    call->add_value(make_list({keyword(SpecialForm::Letrec), make_list({make_list({name, lambda})}), name}));
+    for (size_t i = 0; i < bindings->size(); ++i) {
+        call->add_value(std::static_pointer_cast<ListValue>(bindings->get_value(i))->get_value(1));
+    }
+    return call;
+}
+
+ListPtr do_to_named_let(const ListPtr &do_form) {
+//    (do ((〈variable1〉 〈init1〉 〈step1〉) ...) (〈test〉 〈expression〉 ...) 〈command〉 ...) syntax
+//    Do is an iteration construct. It specifies a set of variables to be bound, how they are to be initialized at
+//    the start, and how they are to be updated on each iteration. When a termination condition is met, the loop
+//    exits with a specified result value.
+    if (do_form->size() < 3 || do_form->get_value(1)->get_type() != ValueType::List ||
+        do_form->get_value(2)->get_type() != ValueType::List ||
+        std::static_pointer_cast<ListValue>(do_form->get_value(2))->size() == 0) {
+        throw std::runtime_error("do: expected a list of variables and a test clause");
+    }
+    auto specs = std::static_pointer_cast<ListValue>(do_form->get_value(1));
+    auto exit = std::static_pointer_cast<ListValue>(do_form->get_value(2));
+    auto loop = SymbolValue::intern("do loop");
+    auto bindings = std::make_shared<ListValue>();
+    auto next = make_list({loop});
+    for (size_t i = 0; i < specs->size(); ++i) {
+        auto spec = specs->get_value(i);
+        auto spec_list = std::static_pointer_cast<ListValue>(spec);
+        if (spec->get_type() != ValueType::List || spec_list->size() < 2 || spec_list->size() > 3) {
+            throw std::runtime_error("do: expected (variable init step) but got " + spec->to_string());
+        }
+        variable_id(spec_list->get_value(0), "do");
+        bindings->add_value(make_list({spec_list->get_value(0), spec_list->get_value(1)}));
+        next->add_value(spec_list->get_value(spec_list->size() == 3 ? 2 : 0));
+    }
+    auto result = make_list({keyword(SpecialForm::Begin)});
+    for (size_t i = 1; i < exit->size(); ++i) {
+        result->add_value(exit->get_value(i));
+    }
+    auto iteration = make_list({keyword(SpecialForm::Begin)});
+    for (size_t i = 3; i < do_form->size(); ++i) {
+        iteration->add_value(do_form->get_value(i));
+    }
+    iteration->add_value(next);
+    auto body = make_list({keyword(SpecialForm::If), exit->get_value(0), result, iteration});
+    return make_list({keyword(SpecialForm::Let), loop, bindings, body});
+}
+
+CaseTable::CaseTable(const ListPtr &case_form) {
+//    (case 〈key〉 〈clause1〉 〈clause2〉 ...) syntax
+//    Key may be any expression. Each clause should have the form ((〈datum1〉 ...) 〈expression1〉 〈expression2〉 ...),
+//    where each 〈datum〉 is an external representation of some object. All the 〈datum〉s must be distinct.
+//    The last clause may be an "else clause," which has the form (else 〈expression1〉 〈expression2〉 ...).
+    if (case_form->size() < 2) {
+        throw std::runtime_error("case: expected a key and clauses");
+    }
+    clauses_ = case_form->size() - 2;
+    default_ = clauses_;
+    auto else_id = SymbolValue::intern("else")->get_id();
+    std::vector<std::pair<std::int64_t, size_t> > integers;
+    for (size_t i = 0; i < clauses_; ++i) {
+        auto clause = case_form->get_value(i + 2);
+        if (clause->get_type() != ValueType::List || std::static_pointer_cast<ListValue>(clause)->size() == 0) {
+            throw std::runtime_error("case: expected a clause but got " + clause->to_string());
+        }
+        auto datums = car<Value>(clause);
+        if (is_name(datums, else_id)) {
+            if (i + 1 != clauses_) {
+                throw std::runtime_error("case: else has to be the last clause");
+            }
+            default_ = i;
+            continue;
+        }
+        if (datums->get_type() != ValueType::List) {
+            throw std::runtime_error("case: expected a list of datums but got " + datums->to_string());
+        }
+        auto datum_list = std::static_pointer_cast<ListValue>(datums);
+        // a datum that is repeated selects the first clause it is in
+        for (size_t j = 0; j < datum_list->size(); ++j) {
+            auto datum = datum_list->get_value(j);
+            switch (datum->get_type()) {
+                case ValueType::Integer:
+                    integers.emplace_back(std::static_pointer_cast<IntegerValue>(datum)->get_value(), i);
+                    break;
+                case ValueType::Symbol:
+                    symbols_.emplace(std::static_pointer_cast<SymbolValue>(datum)->get_id(), i);
+                    break;
+                case ValueType::Bool:
+                    (datum->is_true() ? true_ : false_) = std::min(datum->is_true() ? true_ : false_, i);
+                    break;
+                default:
+                    others_.emplace_back(datum, i);
+                    break;
+            }
+        }
+    }
+    if (integers.empty()) {
+        return;
+    }
+    auto [min, max] = std::minmax_element(integers.begin(), integers.end());
+    auto range = static_cast<std::uint64_t>(max->first) - static_cast<std::uint64_t>(min->first);
+    if (range < 2 * integers.size() + 16) {
+        min_integer_ = min->first;
+        dense_.assign(range + 1, NONE);
+        for (auto [integer, clause]: integers) {
+            auto &entry = dense_[static_cast<std::uint64_t>(integer) - static_cast<std::uint64_t>(min_integer_)];
+            entry = std::min(entry, clause);
+        }
+    } else {
+        for (auto [integer, clause]: integers) {
+            integers_.emplace(integer, clause);
+        }
+    }
+}
+
+size_t CaseTable::select(const Value &key) const {
+    size_t found = NONE;
+    switch (key.get_type()) {
+        case ValueType::Integer: {
+            auto integer = static_cast<const IntegerValue &>(key).get_value();
+            if (!dense_.empty()) {
+                auto offset = static_cast<std::uint64_t>(integer) - static_cast<std::uint64_t>(min_integer_);
+                if (offset < dense_.size()) {
+                    found = dense_[offset];
+                }
+            } else if (auto entry = integers_.find(integer); entry != integers_.end()) {
+                found = entry->second;
+            }
+            break;
+        }
+        case ValueType::Symbol:
+            if (auto entry = symbols_.find(static_cast<const SymbolValue &>(key).get_id()); entry != symbols_.end()) {
+                found = entry->second;
+            }
+            break;
+        case ValueType::Bool:
+            found = key.is_true() ? true_ : false_;
+            break;
+        default:
+            // the rest of eqv?: floats by value, strings by their characters, nil and the empty list
+            for (const auto &[datum, clause]: others_) {
+                if (datum->get_type() != key.get_type()) {
+                    continue;
+                }
+                bool equivalent = false;
+                switch (key.get_type()) {
+                    case ValueType::Float:
+                        equivalent = datum->to_double() == key.to_double();
+                        break;
+                    case ValueType::String:
+                    case ValueType::Nil:
+                        equivalent = datum->to_string() == key.to_string();
+                        break;
+                    case ValueType::List:
+                        equivalent = static_cast<const ListValue &>(key).size() == 0 &&
+                                     std::static_pointer_cast<ListValue>(datum)->size() == 0;
+                        break;
+                    default:
+                        break;
+                }
+                if (equivalent) {
+                    found = clause;
+                    break;
+                }
+            }
+            break;
+    }
+    return found == NONE ? default_ : found;
+}
@@ -0,0 +1,70 @@
+#ifndef SCHEME_SYNTAX_H
+#define SCHEME_SYNTAX_H
+
+#include "util.h"
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Derived forms, rewritten or checked the same way by the analyzer and the compiler.
+
+// (let name ((variable init) ...) body ...) binds name inside of the body to a procedure of the variables that runs
+// the body, the body is run with the initial values first.
+bool is_named_let(const ListPtr &list);
+
+// A named let is a loop if its body refers to the name only to call it in tail position with a value for every
+// variable, and makes no closures. Each call then stores the new values into the slots of the variables and jumps
+// back to the start of the body: the iterations reuse a single frame and allocate nothing. Otherwise a closure could
+// keep the variables of one iteration, so the named let is evaluated as the call it stands for.
+bool is_loop(const ListPtr &named_let);
+
+// ((letrec ((name (lambda (variable ...) body ...))) name) init ...)
+ListPtr named_let_to_call(const ListPtr &named_let);
+
+// (do ((variable init step) ...) (test expression ...) command ...) is the named let
+// (let <loop> ((variable init) ...) (if test (begin expression ...) (begin command ... (<loop> step ...))))
+// where <loop> is a name no program can refer to. A variable without a step keeps its value.
+ListPtr do_to_named_let(const ListPtr &do_form);
+
+// variables of (receive (variable ...) expression body ...), throws if the form is malformed (see values.h)
+std::vector<SymbolId> receive_variables(const ListPtr &receive);
+
+// the clauses of (guard (variable clause ...) body ...) as (receive (variable) #f (cond clause ... (#t (raise variable)))),
+// the guard binds the variable to the condition in place of the expression #f (see exceptions.h).
+// Throws if the form is malformed.
+ListPtr guard_handler(const ListPtr &guard);
+
+// Dispatch of (case key ((datum ...) expression ...) ... (else expression ...)): the clause with a datum equivalent
+// (in the sense of eqv?) to the value of key is evaluated. The clause of a value is found without comparing it to each
+// datum in turn: integers index a jump table if the integer datums are dense and a hash table otherwise, symbols and
+// booleans are looked up in hash tables, and only datums of other types (floats, strings, ...) are compared one by one.
+class CaseTable {
+public:
+    // checks the clauses of the case form, clause i is element i + 2 of the form
+    explicit CaseTable(const ListPtr &case_form);
+
+    // number of clauses, the else clause included
+    [[nodiscard]] size_t size() const {
+        return clauses_;
+    }
+
+    // index of the clause the value selects, the else clause (or size() if there is none) if no datum is equivalent
+    [[nodiscard]] size_t select(const Value &key) const;
+
+private:
+    static constexpr size_t NONE = SIZE_MAX;
+
+    size_t clauses_ = 0;
+    size_t default_ = 0;
+    // clause of integer min_integer_ + i, or a hash table of the integers if they are sparse
+    std::vector<size_t> dense_;
+    std::int64_t min_integer_ = 0;
+    std::unordered_map<std::int64_t, size_t> integers_;
+    std::unordered_map<SymbolId, size_t> symbols_;
+    size_t false_ = NONE;
+    size_t true_ = NONE;
+    std::vector<std::pair<ValuePtr, size_t> > others_;
+};
+
+#endif //SCHEME_SYNTAX_H
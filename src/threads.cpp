@@ -0,0 +1,117 @@
+#include "threads.h"
+#include "evaluator.h"
+#include "datatypes/closure.h"
+#include <algorithm>
+
+Scheduler &Scheduler::instance() {
+    thread_local Scheduler scheduler;
+    return scheduler;
+}
+
+GreenThreadPtr Scheduler::next(size_t activation) {
+    auto found = std::find_if(runnable.begin(), runnable.end(), [activation](const GreenThreadPtr &thread) {
+        return thread->pinned == 0 || thread->pinned == activation;
+    });
+    if (found == runnable.end()) {
+        return nullptr;
+    }
+    auto thread = std::move(*found);
+    runnable.erase(found);
+    return thread;
+}
+
+void Scheduler::wake(const GreenThreadPtr &thread, ValuePtr value) {
+    thread->resume_value = std::move(value);
+    thread->state = GreenThread::State::Runnable;
+    runnable.push_back(thread);
+}
+
+void Scheduler::finish(const GreenThreadPtr &thread, ValuePtr value) {
+    thread->state = GreenThread::State::Done;
+    thread->result = std::move(value);
+    thread->calls = CallStack();
+    for (const auto &joiner: thread->joiners) {
+        wake(joiner, thread->result);
+    }
+    thread->joiners.clear();
+}
+
+void Scheduler::drop_pinned(size_t activation) {
+    runnable.erase(std::remove_if(runnable.begin(), runnable.end(), [activation](const GreenThreadPtr &thread) {
+        return thread->pinned == activation;
+    }), runnable.end());
+}
+
+namespace {
+    template<typename T>
+    std::shared_ptr<T> argument(const std::string &name, ValueType type, const std::vector<ValuePtr> &argv) {
+        if (argv.size() != 1 || argv[0]->get_type() != type) {
+            throw std::runtime_error(name + ": expected a " + (type == ValueType::Thread ? "thread" : "channel"));
+        }
+        return std::static_pointer_cast<T>(argv[0]);
+    }
+}
+
+ValuePtr spawn_function(size_t argc, std::vector<ValuePtr> &argv) {
+    std::string name = "spawn";
+    check_arity(name, 1, argc);
+    auto thread = std::make_shared<GreenThread>(argv[0]);
+    std::vector<ValuePtr> args;
+    if (argv[0]->get_type() == ValueType::Function) {
+        thread->result = apply_fn(static_cast<const FunctionValue &>(*argv[0]), args);
+    } else if (argv[0]->get_type() == ValueType::Closure) {
+        thread->result = std::static_pointer_cast<Closure>(argv[0])->call(args);
+    } else {
+        throw std::runtime_error("spawn: " + argv[0]->to_string() + " is not a function");
+    }
+    thread->state = GreenThread::State::Done;
+    return thread;
+}
+
+ValuePtr yield_function(size_t argc, std::vector<ValuePtr> &argv) {
+    std::string name = "yield";
+    check_arity(name, 0, argc);
+    return std::make_shared<NilValue>();
+}
+
+ValuePtr join_function(size_t argc, std::vector<ValuePtr> &argv) {
+    auto thread = argument<GreenThread>("join", ValueType::Thread, argv);
+    if (thread->state != GreenThread::State::Done) {
+        throw std::runtime_error("join: the thread can only finish in the vm");
+    }
+    return thread->result;
+}
+
+ValuePtr make_channel_function(size_t argc, std::vector<ValuePtr> &argv) {
+    std::string name = "make-channel";
+    check_arity(name, 0, argc);
+    return std::make_shared<ChannelValue>();
+}
+
+ValuePtr channel_send_function(size_t argc, std::vector<ValuePtr> &argv) {
+    std::string name = "channel-send";
+    check_arity(name, 2, argc);
+    if (argv[0]->get_type() != ValueType::Channel) {
+        throw std::runtime_error("channel-send: expected a channel");
+    }
+    auto &channel = static_cast<ChannelValue &>(*argv[0]);
+    // the first waiting receiver gets the value right away
+    if (!channel.receivers.empty()) {
+        auto receiver = std::move(channel.receivers.front());
+        channel.receivers.pop_front();
+        Scheduler::instance().wake(receiver, argv[1]);
+    } else {
+        channel.values.push_back(argv[1]);
+    }
+    return argv[1];
+}
+
+ValuePtr channel_receive_function(size_t argc, std::vector<ValuePtr> &argv) {
+    auto channel = argument<ChannelValue>("channel-receive", ValueType::Channel, argv);
+    if (channel->values.empty()) {
+        throw std::runtime_error("channel-receive: the channel is empty and only the vm can wait for a value");
+    }
+    auto value = std::move(channel->values.front());
+    channel->values.pop_front();
+    return value;
+}
@@ -0,0 +1,102 @@
+#ifndef SCHEME_THREADS_H
+#define SCHEME_THREADS_H
+
+#include "util.h"
+#include "vm.h"
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Green threads: (spawn thunk), (yield), (join thread), (make-channel), (channel-send channel value) and
+// (channel-receive channel).
+//
+// In the vm threads are scheduled cooperatively, without OS threads: a thread runs until it yields, joins a thread
+// that did not finish, receives from an empty channel or finishes. Its calls are then moved out of the vm into a
+// CallStack (see vm.h) and the calls of the next runnable thread are moved in, so a suspended thread only takes the
+// memory of its own frames and stack slots. spawn does not switch, the new thread runs when the current one gives
+// way. Threads that did not finish when a top level form returns keep waiting and are run by the next form that
+// gives way, an error in any thread aborts the form.
+// A builtin that calls a closure (like map) enters a new activation of the vm, a thread that waits inside of it can
+// only be resumed there, and only threads that were suspended outside of any such call can run while it waits.
+//
+// eval has no scheduler: spawn runs the thunk to completion right away, yield does nothing and receiving from an
+// empty channel is an error.
+class GreenThread : public Value {
+public:
+    enum class State {
+        New, Runnable, Running, Blocked, Done
+    };
+
+    explicit GreenThread(ValuePtr thunk) : Value(ValueType::Thread), thunk(std::move(thunk)) {
+    }
+
+    [[nodiscard]] std::string to_string() const override {
+        return "#<thread>";
+    }
+
+    ValuePtr thunk;
+    State state = State::New;
+    // calls of a suspended thread
+    CallStack calls;
+    // vm activation the thread has to be resumed in, 0 if it can be resumed in any
+    size_t pinned = 0;
+    // result of the yield, join or channel-receive the thread waits in, it is pushed when it resumes
+    ValuePtr resume_value;
+    // value of the thunk once the thread is done
+    ValuePtr result;
+    std::vector<std::shared_ptr<GreenThread> > joiners;
+};
+
+using GreenThreadPtr = std::shared_ptr<GreenThread>;
+
+class ChannelValue : public Value {
+public:
+    ChannelValue() : Value(ValueType::Channel) {
+    }
+
+    [[nodiscard]] std::string to_string() const override {
+        return "#<channel>";
+    }
+
+    // values sent that nobody received yet
+    std::deque<ValuePtr> values;
+    // threads blocked in channel-receive, in the order they came
+    std::deque<GreenThreadPtr> receivers;
+};
+
+// threads of the vm of one OS thread
+class Scheduler {
+public:
+    static Scheduler &instance();
+
+    // thread that is running, the thread of the program itself until another one is resumed
+    GreenThreadPtr current = std::make_shared<GreenThread>(nullptr);
+    std::deque<GreenThreadPtr> runnable;
+
+    // removes and returns the first runnable thread the activation can resume, nullptr if there is none
+    GreenThreadPtr next(size_t activation);
+
+    // makes a blocked thread runnable, value is what its yield, join or channel-receive returns
+    void wake(const GreenThreadPtr &thread, ValuePtr value);
+
+    // the thread returned value, the threads joining it are woken
+    void finish(const GreenThreadPtr &thread, ValuePtr value);
+
+    // forgets the threads pinned to an activation that was left by an error
+    void drop_pinned(size_t activation);
+};
+
+// builtins, the vm handles spawn, yield, join and channel-receive itself (these are what eval does)
+ValuePtr spawn_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr yield_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr join_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr make_channel_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr channel_send_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr channel_receive_function(size_t argc, std::vector<ValuePtr> &argv);
+
+#endif //SCHEME_THREADS_H
@@ -10,6 +10,10 @@ using EnvironmentPtr = std::shared_ptr<Environment>;
 using ValuePtr = std::shared_ptr<Value>;
 using ListPtr = std::shared_ptr<ListValue>;
 
+class Node;
+
+using NodePtr = std::shared_ptr<const Node>;
+
 template<typename T>
 std::shared_ptr<T> car(const ValuePtr &list) {
     // cast to list
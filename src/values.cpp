@@ -0,0 +1,73 @@
+#include "values.h"
+#include "evaluator.h"
+#include <string>
+
+namespace {
+    class ValuesMarker : public Value {
+    public:
+        std::vector<ValuePtr> values;
+
+        ValuesMarker() : Value(ValueType::Values) {
+        }
+
+        [[nodiscard]] std::string to_string() const override {
+            return "#<values>";
+        }
+    };
+
+    // the marker of the last call of values, used again by the next one unless something else kept it
+    thread_local std::shared_ptr<ValuesMarker> spare_marker;
+
+    thread_local std::vector<ValuePtr> return_buffer;
+}
+
+std::vector<ValuePtr> &returned_values(const ValuePtr &result) {
+    if (result->get_type() != ValueType::Values) {
+        return_buffer.assign(1, result);
+        return return_buffer;
+    }
+    auto &marker = static_cast<ValuesMarker &>(*result);
+    // the receiver is the only one left with the marker: its values are moved, otherwise they are copied
+    auto owners = result.use_count() - (&marker == spare_marker.get() ? 1 : 0);
+    if (owners == 1) {
+        return_buffer.swap(marker.values);
+        marker.values.clear();
+    } else {
+        return_buffer = marker.values;
+    }
+    return return_buffer;
+}
+
+std::vector<ValuePtr> &received_values(const ValuePtr &result, size_t count) {
+    auto &values = returned_values(result);
+    if (values.size() != count) {
+        throw std::runtime_error("receive: expected " + std::to_string(count) + " values, got " +
+                                 std::to_string(values.size()));
+    }
+    return values;
+}
+
+ValuePtr values_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (values obj ...) procedure
+//    Delivers all of its arguments to its continuation.
+    if (argc == 1) {
+        return argv[0];
+    }
+    if (spare_marker == nullptr || spare_marker.use_count() != 1) {
+        spare_marker = std::make_shared<ValuesMarker>();
+    }
+    spare_marker->values.swap(argv);
+    return spare_marker;
+}
+
+ValuePtr call_with_values_function(size_t argc, std::vector<ValuePtr> &argv) {
+//    (call-with-values producer consumer) procedure
+//    Calls its producer argument with no values and a continuation that, when passed some values, calls the
+//    consumer procedure with those values as arguments.
+    std::string name = "call-with-values";
+    check_arity(name, 2, argc);
+    std::vector<ValuePtr> args;
+    auto result = call_procedure(argv[0], args, name);
+    args.swap(returned_values(result));
+    return call_procedure(argv[1], args, name);
+}
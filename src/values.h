@@ -0,0 +1,28 @@
+#ifndef SCHEME_VALUES_H
+#define SCHEME_VALUES_H
+
+#include "util.h"
+#include <vector>
+
+// Multiple return values: (values obj ...), (call-with-values producer consumer) and the special form
+// (receive (variable ...) expression body ...), which binds the variables to the values of the expression.
+//
+// (values obj) is obj itself. Any other number of values is moved into a values marker (the argument vector of the
+// call becomes its vector, nothing is copied), printed as #<values>. call-with-values and receive take the values
+// out of the marker as soon as it is returned to them, and the marker is used again by the next call of values, so
+// returning two or three values allocates no list and usually nothing at all. A continuation that keeps the marker
+// instead, like (define m (values 1 2)), keeps its values: the next call of values makes a new marker, and a receiver
+// that is given the kept marker later gets a copy of them.
+
+// the values returned to a receiver, in the return buffer of the thread: those of the marker if the result is one,
+// otherwise just the result. The values have to be moved out of it before anything else is evaluated.
+std::vector<ValuePtr> &returned_values(const ValuePtr &result);
+
+// the values returned to receive, which throws if there are not count of them
+std::vector<ValuePtr> &received_values(const ValuePtr &result, size_t count);
+
+ValuePtr values_function(size_t argc, std::vector<ValuePtr> &argv);
+
+ValuePtr call_with_values_function(size_t argc, std::vector<ValuePtr> &argv);
+
+#endif //SCHEME_VALUES_H
@@ -0,0 +1,593 @@
+#include "vm.h"
+#include "compiler.h"
+#include "evaluator.h"
+#include "primitives.h"
+#include "optimizer.h"
+#include "macros.h"
+#include "continuation.h"
+#include "threads.h"
+#include "values.h"
+#include "exceptions.h"
+#include "eval_cache.h"
+#include "datatypes/closure.h"
+#include <iterator>
+
+
+namespace {
+    // activations of execute so far, every activation has a different number
+    thread_local size_t activations = 0;
+}
+
+void VM::abandon_frames(size_t first) {
+    for (size_t i = first; i < frames_.size(); ++i) {
+        if (frames_[i].continuation != nullptr) {
+            frames_[i].continuation->live = false;
+        }
+    }
+    frames_.erase(frames_.begin() + static_cast<long>(first), frames_.end());
+}
+
+ValuePtr VM::execute(const PrototypePtr &prototype_in, EnvironmentPtr env) {
+    // replaced on tail calls, also keeps the executed code alive
+    auto prototype = prototype_in;
+    const Chunk *chunk = &prototype->chunk;
+    const std::uint8_t *ip = chunk->code.data();
+    // stack_[base] is the first slot of the current call
+    size_t base = stack_.size();
+    // calls and stack slots below these were made before execute was entered
+    const size_t first_frame = frames_.size();
+    const size_t first_base = base;
+    const size_t activation = ++activations;
+
+    auto read_u16 = [&ip]() {
+        std::uint16_t value = ip[0] | (ip[1] << 8);
+        ip += 2;
+        return value;
+    };
+    auto read_u32 = [&ip]() {
+        std::uint32_t value = ip[0] | (ip[1] << 8) | (ip[2] << 16) | (static_cast<std::uint32_t>(ip[3]) << 24);
+        ip += 4;
+        return value;
+    };
+    // pops the arguments and the function of a call, leaves the function in fn and arguments in args
+    auto pop_call = [this](std::uint16_t argc, ValuePtr &fn, std::vector<ValuePtr> &args) {
+        auto fn_index = stack_.size() - argc - 1;
+        fn = std::move(stack_[fn_index]);
+        args.assign(std::make_move_iterator(stack_.begin() + static_cast<long>(fn_index) + 1),
+                    std::make_move_iterator(stack_.end()));
+        stack_.resize(fn_index);
+    };
+
+    // applies a core builtin on the arguments on the stack, replacing the call with its result
+    auto try_primitive = [this](std::uint16_t argc) {
+        auto fn_index = stack_.size() - argc - 1;
+        const auto &fn = stack_[fn_index];
+        if (fn->get_type() != ValueType::Function) {
+            return false;
+        }
+        auto primitive = static_cast<const FunctionValue &>(*fn).get_primitive();
+        if (primitive == Primitive::None || primitive_arity(primitive) != argc) {
+            return false;
+        }
+        auto result = apply_primitive(primitive, &stack_[fn_index + 1]);
+        if (result == nullptr) {
+            return false;
+        }
+        stack_.resize(fn_index);
+        stack_.push_back(std::move(result));
+        return true;
+    };
+
+    // enters a closure made by the vm, the current call continues after the callee returns
+    auto push_call = [&](const Closure &closure, const std::vector<ValuePtr> &args) {
+        auto frame = closure.make_frame(args);
+        frames_.push_back({std::move(prototype), ip, std::move(env), base, nullptr});
+        env = std::move(frame);
+        prototype = closure.get_prototype();
+        chunk = &prototype->chunk;
+        ip = chunk->code.data();
+        base = stack_.size();
+    };
+    // guards of this activation, the innermost entries of the handler stack (see exceptions.h)
+    auto &handlers = handler_stack();
+    // drops the guards of the calls from index frame on
+    auto drop_guards = [&](size_t frame) {
+        while (!handlers.empty() && handlers.back().activation == activation && handlers.back().guard.frame >= frame) {
+            handlers.pop_back();
+        }
+    };
+    // the guards go with the calls of this activation when they are copied, or moved, out of it
+    auto save_guards = [&](CallStack &calls, bool move) {
+        auto first = handlers.size();
+        while (first > 0 && handlers[first - 1].activation == activation) {
+            --first;
+        }
+        for (size_t i = first; i < handlers.size(); ++i) {
+            auto guard = handlers[i].guard;
+            guard.frame -= first_frame;
+            guard.registers.base -= first_base;
+            guard.stack -= first_base;
+            calls.guards.push_back(std::move(guard));
+        }
+        if (move) {
+            handlers.resize(first);
+        }
+    };
+    // a guard of this activation catches the condition: the calls made since it was entered are dropped and its
+    // clauses continue with the condition pushed
+    auto catch_condition = [&](size_t index, ValuePtr condition) {
+        auto guard = std::move(handlers[index].guard);
+        handlers.resize(index);
+        abandon_frames(guard.frame);
+        stack_.resize(guard.stack);
+        prototype = std::move(guard.registers.prototype);
+        chunk = &prototype->chunk;
+        ip = guard.registers.ip;
+        env = std::move(guard.registers.env);
+        base = guard.registers.base;
+        stack_.push_back(std::move(condition));
+    };
+
+    // the call of call/cc that made the continuation returns, if the continuation is still referenced
+    // it may be re-entered later and the callers are copied
+    auto end_extent = [&](ContinuationState &state) {
+        state.live = false;
+        if (state.continuation.expired()) {
+            return;
+        }
+        auto snapshot = std::make_shared<CallStack>();
+        snapshot->frames.assign(frames_.begin() + static_cast<long>(first_frame), frames_.end());
+        for (auto &frame: snapshot->frames) {
+            frame.base -= first_base;
+        }
+        snapshot->stack.assign(stack_.begin() + static_cast<long>(first_base), stack_.end());
+        snapshot->top = {prototype, ip, env, base - first_base, nullptr};
+        save_guards(*snapshot, false);
+        state.snapshot = std::move(snapshot);
+    };
+    // replaces the calls of this activation with the calls of a continuation or a green thread,
+    // the innermost call continues with the value
+    auto install = [&](CallStack calls, ValuePtr value) {
+        drop_guards(first_frame);
+        abandon_frames(first_frame);
+        stack_.resize(first_base);
+        stack_.insert(stack_.end(), std::make_move_iterator(calls.stack.begin()),
+                      std::make_move_iterator(calls.stack.end()));
+        for (size_t i = 0; i < calls.frames.size(); ++i) {
+            auto &frame = calls.frames[i];
+            frame.base += first_base;
+            // continuations captured by the callers escape to the frames here now
+            if (frame.continuation != nullptr) {
+                auto &state = *frame.continuation;
+                state.live = true;
+                state.vm = this;
+                state.frame = frames_.size();
+                state.base = first_base + (i + 1 < calls.frames.size() ? calls.frames[i + 1].base : calls.top.base);
+            }
+            frames_.push_back(std::move(frame));
+        }
+        prototype = std::move(calls.top.prototype);
+        chunk = &prototype->chunk;
+        ip = calls.top.ip;
+        env = std::move(calls.top.env);
+        base = first_base + calls.top.base;
+        for (auto &guard: calls.guards) {
+            guard.frame += first_frame;
+            guard.registers.base += first_base;
+            guard.stack += first_base;
+            handlers.push_back({nullptr, activation, std::move(guard)});
+        }
+        stack_.push_back(std::move(value));
+    };
+
+    // green threads, see threads.h
+    auto &scheduler = Scheduler::instance();
+    // this activation returns when the thread it was entered by returns, threads can only leave an activation when
+    // all of their calls are in it, so that thread has to be resumed here
+    const auto own_thread = scheduler.current;
+    // moves the calls of the current thread out of the vm
+    auto suspend = [&](GreenThread &thread) {
+        auto &calls = thread.calls;
+        calls.frames.assign(std::make_move_iterator(frames_.begin() + static_cast<long>(first_frame)),
+                            std::make_move_iterator(frames_.end()));
+        frames_.erase(frames_.begin() + static_cast<long>(first_frame), frames_.end());
+        for (auto &frame: calls.frames) {
+            frame.base -= first_base;
+            // the frames are gone, a continuation of another thread cannot escape to them
+            if (frame.continuation != nullptr) {
+                frame.continuation->live = false;
+            }
+        }
+        calls.stack.assign(std::make_move_iterator(stack_.begin() + static_cast<long>(first_base)),
+                           std::make_move_iterator(stack_.end()));
+        stack_.resize(first_base);
+        calls.top = {std::move(prototype), ip, std::move(env), base - first_base, nullptr};
+        calls.guards.clear();
+        save_guards(calls, true);
+        thread.pinned = &thread == own_thread.get() ? activation : 0;
+    };
+    // continues the next thread that can run here, the current one was suspended or finished
+    auto resume_next = [&]() {
+        auto thread = scheduler.next(activation);
+        if (thread == nullptr) {
+            throw std::runtime_error(scheduler.runnable.empty()
+                                     ? "deadlock: all threads are waiting"
+                                     : "deadlock: the threads that could run wait outside of this call of a builtin");
+        }
+        scheduler.current = thread;
+        if (thread->state == GreenThread::State::New) {
+            const auto &closure = static_cast<const Closure &>(*thread->thunk);
+            env = closure.make_frame({});
+            prototype = closure.get_prototype();
+            chunk = &prototype->chunk;
+            ip = chunk->code.data();
+            base = first_base;
+        } else {
+            install(std::move(thread->calls), std::move(thread->resume_value));
+        }
+        thread->state = GreenThread::State::Running;
+    };
+    // the current thread waits until it is woken
+    auto block = [&]() {
+        scheduler.current->state = GreenThread::State::Blocked;
+        suspend(*scheduler.current);
+        resume_next();
+    };
+
+    // leaves the current call with the result, true if it is the call that execute started with,
+    // otherwise the caller (or the next thread if the thread finished) continues with the result pushed
+    auto return_from_call = [&](ValuePtr &result) {
+        stack_.resize(base);
+        if (frames_.size() == first_frame) {
+            if (scheduler.current == own_thread) {
+                return true;
+            }
+            scheduler.finish(scheduler.current, std::move(result));
+            resume_next();
+            return false;
+        }
+        auto &frame = frames_.back();
+        prototype = std::move(frame.prototype);
+        chunk = &prototype->chunk;
+        ip = frame.ip;
+        env = std::move(frame.env);
+        base = frame.base;
+        auto continuation = std::move(frame.continuation);
+        frames_.pop_back();
+        if (continuation != nullptr) {
+            end_extent(*continuation);
+        }
+        stack_.push_back(std::move(result));
+        return false;
+    };
+    // a live continuation of this activation returns the value from its call/cc: the calls made since are dropped
+    auto escape = [&](const ContinuationState &state, ValuePtr &value) {
+        drop_guards(state.frame + 1);
+        abandon_frames(state.frame + 1);
+        base = state.base;
+        return_from_call(value);
+    };
+
+    // call/cc, calls of continuations, the thread builtins and raise, which work on the call frames themselves
+    auto call_control = [&](std::uint16_t argc) {
+        const auto &callee = stack_[stack_.size() - argc - 1];
+        if (callee->get_type() != ValueType::Function) {
+            return false;
+        }
+        auto primitive = static_cast<const FunctionValue &>(*callee).get_primitive();
+        if (primitive < Primitive::CallCC) {
+            return false;
+        }
+        ValuePtr fn;
+        std::vector<ValuePtr> args;
+        pop_call(argc, fn, args);
+        auto is_vm_closure = [argc, &args]() {
+            return argc == 1 && args[0]->get_type() == ValueType::Closure &&
+                   static_cast<const Closure &>(*args[0]).get_prototype() != nullptr;
+        };
+        switch (primitive) {
+            case Primitive::CallCC:
+                if (is_vm_closure()) {
+                    auto state = std::make_shared<ContinuationState>();
+                    state->vm = this;
+                    state->frame = frames_.size();
+                    state->base = stack_.size();
+                    push_call(static_cast<const Closure &>(*args[0]), {make_continuation(state)});
+                    frames_.back().continuation = std::move(state);
+                    return true;
+                }
+                // other receivers get an escape only continuation from the builtin
+                break;
+            case Primitive::Continuation: {
+                auto state = static_cast<const ContinuationValue &>(*fn).get_state();
+                ValuePtr value = args.empty() ? std::make_shared<NilValue>() : args[0];
+                if (state->live && state->vm == this && state->frame >= first_frame) {
+                    escape(*state, value);
+                } else if (state->live) {
+                    throw ContinuationInvoked{state, value};
+                } else if (state->snapshot != nullptr) {
+                    install(*state->snapshot, value);
+                } else {
+                    throw std::runtime_error("continuation: it can no longer be re-entered");
+                }
+                return true;
+            }
+            case Primitive::Spawn:
+                if (is_vm_closure()) {
+                    auto thread = std::make_shared<GreenThread>(args[0]);
+                    scheduler.runnable.push_back(thread);
+                    stack_.push_back(thread);
+                    return true;
+                }
+                // other thunks are run right away by the builtin
+                break;
+            case Primitive::Yield: {
+                auto thread = scheduler.next(activation);
+                if (thread == nullptr) {
+                    stack_.push_back(std::make_shared<NilValue>());
+                    return true;
+                }
+                // the current thread goes after the ones that were waiting
+                scheduler.runnable.push_front(thread);
+                scheduler.wake(scheduler.current, std::make_shared<NilValue>());
+                suspend(*scheduler.current);
+                resume_next();
+                return true;
+            }
+            case Primitive::Join:
+                if (argc == 1 && args[0]->get_type() == ValueType::Thread &&
+                    static_cast<const GreenThread &>(*args[0]).state != GreenThread::State::Done) {
+                    std::static_pointer_cast<GreenThread>(args[0])->joiners.push_back(scheduler.current);
+                    block();
+                    return true;
+                }
+                break;
+            case Primitive::Receive:
+                if (argc == 1 && args[0]->get_type() == ValueType::Channel &&
+                    static_cast<const ChannelValue &>(*args[0]).values.empty()) {
+                    std::static_pointer_cast<ChannelValue>(args[0])->receivers.push_back(scheduler.current);
+                    block();
+                    return true;
+                }
+                break;
+            case Primitive::Raise:
+            case Primitive::RaiseContinuable:
+            case Primitive::Error:
+                // a guard of this activation is jumped to, handler procedures and other guards are left to the builtin
+                if (!handlers.empty() && handlers.back().activation == activation &&
+                    (primitive == Primitive::Error ? argc > 0 : argc == 1)) {
+                    catch_condition(handlers.size() - 1,
+                                    primitive == Primitive::Error ? make_error_object(argc, args) : args[0]);
+                    return true;
+                }
+                break;
+            default:
+                break;
+        }
+        stack_.push_back(apply_fn(static_cast<const FunctionValue &>(*fn), args));
+        return true;
+    };
+    // the activation is left by an error (or a continuation of an outer activation), the threads that were
+    // suspended in it cannot continue
+    auto leave = [&]() {
+        drop_guards(first_frame);
+        abandon_frames(first_frame);
+        scheduler.drop_pinned(activation);
+        scheduler.current = own_thread;
+    };
+
+    // a continuation called from a nested activation unwinds to here and the loop continues after its call/cc
+    while (true) {
+        try {
+            while (true) {
+                switch (static_cast<OpCode>(*ip++)) {
+                    case OpCode::Constant:
+                        stack_.push_back(chunk->constants[read_u16()]);
+                        break;
+                    case OpCode::GetGlobal: {
+                        auto index = read_u16();
+                        stack_.push_back(chunk->global_caches[index].lookup(*env, chunk->names[index]));
+                        break;
+                    }
+                    case OpCode::DefineGlobal:
+                        env->set(chunk->names[read_u16()], stack_.back());
+                        break;
+                    case OpCode::SetGlobal:
+                        env->update_existing(chunk->names[read_u16()], stack_.back());
+                        break;
+                    case OpCode::GetLocal: {
+                        auto depth = read_u16();
+                        auto index = read_u16();
+                        const auto &value = env->slot(depth, index);
+                        // internal define that was not executed yet
+                        if (value == nullptr) {
+                            throw std::runtime_error("local variable used before its define");
+                        }
+                        stack_.push_back(value);
+                        break;
+                    }
+                    case OpCode::SetLocal: {
+                        auto depth = read_u16();
+                        auto index = read_u16();
+                        env->slot(depth, index) = stack_.back();
+                        break;
+                    }
+                    case OpCode::GetBoxed: {
+                        auto depth = read_u16();
+                        auto index = read_u16();
+                        const auto &value = static_cast<BoxValue &>(*env->slot(depth, index)).value;
+                        if (value == nullptr) {
+                            throw std::runtime_error("local variable used before its define");
+                        }
+                        stack_.push_back(value);
+                        break;
+                    }
+                    case OpCode::SetBoxed: {
+                        auto depth = read_u16();
+                        auto index = read_u16();
+                        static_cast<BoxValue &>(*env->slot(depth, index)).value = stack_.back();
+                        break;
+                    }
+                    case OpCode::MakeBox: {
+                        auto &slot = env->slot(read_u16());
+                        slot = std::make_shared<BoxValue>(std::move(slot));
+                        break;
+                    }
+                    case OpCode::Pop:
+                        stack_.pop_back();
+                        break;
+                    case OpCode::Jump:
+                        ip = chunk->code.data() + read_u32();
+                        break;
+                    case OpCode::JumpIfFalse: {
+                        auto target = read_u32();
+                        bool test = stack_.back()->is_true();
+                        stack_.pop_back();
+                        if (!test) {
+                            ip = chunk->code.data() + target;
+                        }
+                        break;
+                    }
+                    case OpCode::Case: {
+                        const auto &dispatch = chunk->case_tables[read_u16()];
+                        auto clause = dispatch.table.select(*stack_.back());
+                        stack_.pop_back();
+                        ip = chunk->code.data() + dispatch.targets[clause];
+                        break;
+                    }
+                    case OpCode::Values: {
+                        auto count = read_u16();
+                        auto result = std::move(stack_.back());
+                        stack_.pop_back();
+                        for (auto &value: received_values(result, count)) {
+                            stack_.push_back(std::move(value));
+                        }
+                        break;
+                    }
+                    case OpCode::PushGuard: {
+                        auto target = chunk->code.data() + read_u32();
+                        handlers.push_back({nullptr, activation,
+                                            {frames_.size(), {prototype, target, env, base, nullptr}, stack_.size()}});
+                        break;
+                    }
+                    case OpCode::PopGuard:
+                        handlers.pop_back();
+                        break;
+                    case OpCode::MakeClosure: {
+                        const auto &prototype = chunk->prototypes[read_u16()];
+                        stack_.push_back(std::make_shared<Closure>(
+                                make_closure_env(env, prototype->closure_depth, prototype->captures), prototype));
+                        break;
+                    }
+                    case OpCode::Call: {
+                        auto argc = read_u16();
+                        if (try_primitive(argc) || call_control(argc)) {
+                            break;
+                        }
+                        ValuePtr fn;
+                        std::vector<ValuePtr> args;
+                        pop_call(argc, fn, args);
+                        if (fn->get_type() == ValueType::Function) {
+                            stack_.push_back(apply_fn(static_cast<const FunctionValue &>(*fn), args));
+                        } else if (fn->get_type() != ValueType::Closure) {
+                            throw std::runtime_error("eval error: " + fn->to_string() + " is not a function");
+                        } else if (auto closure = std::static_pointer_cast<Closure>(fn);
+                                closure->get_prototype() == nullptr) {
+                            stack_.push_back(closure->call(args));
+                        } else {
+                            push_call(*closure, args);
+                        }
+                        break;
+                    }
+                    case OpCode::TailCall: {
+                        auto argc = read_u16();
+                        // call/cc in tail position is done like any other call, Return follows the tail call
+                        if (call_control(argc)) {
+                            break;
+                        }
+                        ValuePtr result;
+                        if (try_primitive(argc)) {
+                            result = std::move(stack_.back());
+                        } else {
+                            ValuePtr fn;
+                            std::vector<ValuePtr> args;
+                            pop_call(argc, fn, args);
+                            if (fn->get_type() == ValueType::Function) {
+                                result = apply_fn(static_cast<const FunctionValue &>(*fn), args);
+                            } else if (fn->get_type() != ValueType::Closure) {
+                                throw std::runtime_error("eval error: " + fn->to_string() + " is not a function");
+                            } else if (auto closure = std::static_pointer_cast<Closure>(fn);
+                                    closure->get_prototype() == nullptr) {
+                                result = closure->call(args);
+                            } else {
+                                // reuse this frame for the callee
+                                stack_.resize(base);
+                                env = closure->make_frame(args);
+                                prototype = closure->get_prototype();
+                                chunk = &prototype->chunk;
+                                ip = chunk->code.data();
+                                break;
+                            }
+                        }
+                        if (return_from_call(result)) {
+                            return result;
+                        }
+                        break;
+                    }
+                    case OpCode::Return: {
+                        auto result = std::move(stack_.back());
+                        if (return_from_call(result)) {
+                            return result;
+                        }
+                        break;
+                    }
+                    case OpCode::EnterFrame:
+                        env = std::make_shared<Environment>(env, read_u16());
+                        break;
+                    case OpCode::LeaveFrame:
+                        env = env->get_outer();
+                        break;
+                }
+            }
+        } catch (ContinuationInvoked &jump) {
+            // a continuation of an outer activation, or of call/cc done by the builtin
+            if (!jump.state->live || jump.state->vm != this || jump.state->frame < first_frame) {
+                leave();
+                throw;
+            }
+            escape(*jump.state, jump.value);
+        } catch (ConditionRaised &raised) {
+            // a raise in a builtin or a nested activation to a guard of this activation
+            if (raised.guard >= handlers.size() || handlers[raised.guard].activation != activation) {
+                leave();
+                throw;
+            }
+            catch_condition(raised.guard, std::move(raised.condition));
+        } catch (std::runtime_error &error) {
+            // an error of the interpreter in the body of a guard of this activation
+            if (handlers.empty() || handlers.back().activation != activation) {
+                leave();
+                throw;
+            }
+            catch_condition(handlers.size() - 1, error_condition(error));
+        } catch (...) {
+            // the calls that were interrupted by the error are abandoned
+            leave();
+            throw;
+        }
+    }
+}
+
+ValuePtr VM::call(const Closure &closure, const std::vector<ValuePtr> &args) {
+    // closures made by eval are executed by eval
+    if (closure.get_prototype() == nullptr) {
+        return run(closure.get_body().get(), closure.make_frame(args));
+    }
+    return execute(closure.get_prototype(), closure.make_frame(args));
+}
+
+ValuePtr vm_eval(const ValuePtr &ast, const EnvironmentPtr &env) {
+    EvalContext context(env, true);
+    VM vm;
+    return vm.execute(compile(optimize(expand_macros(ast, env), env)), env);
+}
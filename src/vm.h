@@ -0,0 +1,62 @@
+#ifndef SCHEME_VM_H
+#define SCHEME_VM_H
+
+#include "bytecode.h"
+#include <vector>
+
+class Closure;
+
+struct ContinuationState;
+
+// what a call of the vm needs to continue after the call it made returns
+struct CallFrame {
+    PrototypePtr prototype;
+    const std::uint8_t *ip;
+    EnvironmentPtr env;
+    // first slot of the call on the value stack
+    size_t base;
+    // set if the callee is the receiver of call/cc, the continuation returns to this frame
+    std::shared_ptr<ContinuationState> continuation;
+};
+
+// a guard entered by the vm (see exceptions.h): the index of its call among the call frames, the registers its
+// clauses start with and the height of the value stack when it was entered
+struct GuardFrame {
+    size_t frame = 0;
+    CallFrame registers;
+    size_t stack = 0;
+};
+
+// calls of a vm activation copied or moved out of it (a continuation or a suspended green thread),
+// bases are relative to the bottom of the activation
+struct CallStack {
+    std::vector<CallFrame> frames;
+    std::vector<ValuePtr> stack;
+    // registers of the innermost call
+    CallFrame top;
+    // guards the calls are in, innermost last
+    std::vector<GuardFrame> guards;
+};
+
+// Stack based virtual machine executing compiled prototypes. Arguments and temporaries of all active
+// calls share one value stack, tail calls reuse the frame of the caller.
+// A call of a closure made by the vm does not recurse in C++: the state of the caller is pushed onto a stack of
+// call frames on the heap and restored when the callee returns, so non-tail recursion is only bounded by memory.
+class VM {
+    std::vector<ValuePtr> stack_;
+    std::vector<CallFrame> frames_;
+
+    // drops the call frames from index first on, continuations that return to them can no longer escape
+    void abandon_frames(size_t first);
+
+public:
+    ValuePtr execute(const PrototypePtr &prototype, EnvironmentPtr env);
+
+    // calls a closure made by the vm from outside of it (e.g. from map)
+    ValuePtr call(const Closure &closure, const std::vector<ValuePtr> &args);
+};
+
+// compiles the form and executes it in the vm, the counterpart of eval
+ValuePtr vm_eval(const ValuePtr &ast, const EnvironmentPtr &env);
+
+#endif //SCHEME_VM_H
@@ -0,0 +1,261 @@
+#include "watch.h"
+#include "eval_cache.h"
+#include "loader.h"
+#include "printer.h"
+#include "reader.h"
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+    // the symbols of the form outside of quotes and the names its set! forms change
+    void scan(const ValuePtr &ast, std::unordered_set<SymbolId> &uses, std::unordered_set<SymbolId> &assigns) {
+        if (ast->get_type() == ValueType::Symbol) {
+            uses.insert(std::static_pointer_cast<SymbolValue>(ast)->get_id());
+            return;
+        }
+        if (ast->get_type() != ValueType::List) {
+            return;
+        }
+        auto list = std::static_pointer_cast<ListValue>(ast);
+        if (is_form(list, SpecialForm::Quote)) {
+            return;
+        }
+        if (is_form(list, SpecialForm::Set) && list->size() > 1 && list->get_value(1)->get_type() == ValueType::Symbol) {
+            assigns.insert(std::static_pointer_cast<SymbolValue>(list->get_value(1))->get_id());
+        }
+        for (size_t i = 0; i < list->size(); ++i) {
+            scan(list->get_value(i), uses, assigns);
+        }
+    }
+}
+
+Watcher::Watcher(EnvironmentPtr env, Engine engine) : env_(std::move(env)), engine_(engine) {
+}
+
+Watcher::Form Watcher::read_form(const ValuePtr &form) {
+    Form result;
+    result.form = copy_form(form, QuotedLists::Equal);
+    result.hash = hash_form(*form, QuotedLists::Equal);
+    scan(form, result.uses, result.assigns);
+    for (const auto *name: MUTATING_BUILTINS) {
+        result.mutates = result.mutates || result.uses.count(SymbolValue::intern(name)->get_id()) != 0;
+    }
+    if (form->get_type() == ValueType::List) {
+        auto list = std::static_pointer_cast<ListValue>(form);
+        if ((is_form(list, SpecialForm::Define) || is_form(list, SpecialForm::DefineSyntax)) && list->size() > 1 &&
+            list->get_value(1)->get_type() == ValueType::Symbol) {
+            result.binds.push_back(std::static_pointer_cast<SymbolValue>(list->get_value(1))->get_id());
+        }
+    }
+    return result;
+}
+
+ValuePtr Watcher::update(const ValuePtr &program) {
+    std::vector<ValuePtr> sources;
+    if (program->get_type() == ValueType::List && is_form(std::static_pointer_cast<ListValue>(program),
+                                                          SpecialForm::Begin)) {
+        auto list = std::static_pointer_cast<ListValue>(program);
+        for (size_t i = 1; i < list->size(); ++i) {
+            sources.push_back(list->get_value(i));
+        }
+    } else {
+        sources.push_back(program);
+    }
+
+    // the forms of the previous run that are still there keep their state
+    std::unordered_multimap<size_t, size_t> previous;
+    for (size_t i = 0; i < forms_.size(); ++i) {
+        previous.emplace(forms_[i].hash, i);
+    }
+    std::vector<bool> kept(forms_.size());
+    std::vector<Form> forms;
+    for (const auto &source: sources) {
+        auto form = read_form(source);
+        auto range = previous.equal_range(form.hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (!kept[it->second] && same_form(forms_[it->second].form, source, QuotedLists::Equal)) {
+                kept[it->second] = true;
+                form.evaluated = forms_[it->second].evaluated;
+                form.value = std::move(forms_[it->second].value);
+                break;
+            }
+        }
+        forms.push_back(std::move(form));
+    }
+
+    // the forms that bind each name, the code of those that define a procedure or a macro runs where it is used
+    std::unordered_map<SymbolId, std::vector<size_t> > binders;
+    std::vector<bool> procedures(forms.size());
+    std::unordered_set<SymbolId> data_names;
+    for (size_t i = 0; i < forms.size(); ++i) {
+        for (auto name: forms[i].binds) {
+            binders[name].push_back(i);
+            auto list = std::static_pointer_cast<ListValue>(forms[i].form);
+            auto value = list->size() > 2 ? list->get_value(2) : nullptr;
+            procedures[i] = is_form(list, SpecialForm::DefineSyntax) ||
+                            (value != nullptr && value->get_type() == ValueType::List &&
+                             is_form(std::static_pointer_cast<ListValue>(value), SpecialForm::Lambda));
+            if (!procedures[i]) {
+                data_names.insert(name);
+            }
+        }
+    }
+    // the globals of the program a form changes by itself
+    auto changes = [&](const Form &form) {
+        std::unordered_set<SymbolId> names;
+        for (auto name: form.assigns) {
+            if (binders.count(name) != 0) {
+                names.insert(name);
+            }
+        }
+        if (form.mutates) {
+            for (auto name: form.uses) {
+                if (data_names.count(name) != 0) {
+                    names.insert(name);
+                }
+            }
+        }
+        return names;
+    };
+
+    // what the forms refer to and change, with the procedures and macros they use
+    std::vector<std::unordered_set<SymbolId> > own_effects;
+    for (const auto &form: forms) {
+        own_effects.push_back(changes(form));
+    }
+    std::unordered_map<SymbolId, std::vector<size_t> > users;
+    std::vector<std::unordered_set<SymbolId> > effects(forms.size());
+    for (size_t i = 0; i < forms.size(); ++i) {
+        std::vector<bool> reached(forms.size());
+        std::vector<size_t> stack{i};
+        reached[i] = true;
+        std::unordered_set<SymbolId> names;
+        while (!stack.empty()) {
+            auto reached_form = stack.back();
+            stack.pop_back();
+            effects[i].insert(own_effects[reached_form].begin(), own_effects[reached_form].end());
+            for (auto name: forms[reached_form].uses) {
+                names.insert(name);
+                auto found = binders.find(name);
+                if (found == binders.end()) {
+                    continue;
+                }
+                for (auto binder: found->second) {
+                    if (procedures[binder] && !reached[binder]) {
+                        reached[binder] = true;
+                        stack.push_back(binder);
+                    }
+                }
+            }
+        }
+        for (auto name: names) {
+            users[name].push_back(i);
+        }
+    }
+
+    std::vector<bool> evaluate(forms.size());
+    std::vector<size_t> form_work;
+    std::unordered_set<SymbolId> changed_names;
+    std::vector<SymbolId> name_work;
+    auto mark_form = [&](size_t i) {
+        if (!evaluate[i]) {
+            evaluate[i] = true;
+            form_work.push_back(i);
+        }
+    };
+    auto mark_name = [&](SymbolId name) {
+        if (changed_names.insert(name).second) {
+            name_work.push_back(name);
+        }
+    };
+    for (size_t i = 0; i < forms.size(); ++i) {
+        if (!forms[i].evaluated) {
+            mark_form(i);
+        }
+    }
+    if (!forms.empty() && forms.back().value == nullptr) {
+        mark_form(forms.size() - 1);
+    }
+    for (size_t i = 0; i < forms_.size(); ++i) {
+        if (!kept[i]) {
+            for (auto name: forms_[i].binds) {
+                mark_name(name);
+            }
+            for (auto name: forms_[i].assigns) {
+                mark_name(name);
+            }
+            for (auto name: changes(forms_[i])) {
+                mark_name(name);
+            }
+        }
+    }
+    // a form evaluated again binds its names again and starts the globals it changes over
+    while (!form_work.empty() || !name_work.empty()) {
+        if (!form_work.empty()) {
+            auto i = form_work.back();
+            form_work.pop_back();
+            for (auto name: forms[i].binds) {
+                mark_name(name);
+            }
+            for (auto name: effects[i]) {
+                mark_name(name);
+            }
+            continue;
+        }
+        auto name = name_work.back();
+        name_work.pop_back();
+        auto found = users.find(name);
+        if (found != users.end()) {
+            for (auto user: found->second) {
+                mark_form(user);
+            }
+        }
+    }
+
+    auto begin = std::make_shared<ListValue>();
+    begin->add_value(SymbolValue::from_id(static_cast<SymbolId>(SpecialForm::Begin)));
+    for (size_t i = 0; i < forms.size(); ++i) {
+        if (evaluate[i]) {
+            begin->add_value(sources[i]);
+            forms[i].evaluated = false;
+            forms[i].value = nullptr;
+        }
+    }
+    forms_ = std::move(forms);
+    evaluated_ = begin->size() - 1;
+    if (evaluated_ > 0) {
+        // if it raises an error, the forms are evaluated again by the next update
+        auto value = load_program(begin, env_, engine_);
+        for (auto &form: forms_) {
+            form.evaluated = true;
+        }
+        if (evaluate.back()) {
+            forms_.back().value = value;
+        }
+    }
+    if (forms_.empty()) {
+        return std::make_shared<NilValue>();
+    }
+    return forms_.back().value;
+}
+
+void watch_file(const std::string &path, const EnvironmentPtr &env, Engine engine) {
+    Watcher watcher(env, engine);
+    std::filesystem::file_time_type seen;
+    while (true) {
+        std::error_code error;
+        auto time = std::filesystem::last_write_time(path, error);
+        if (!error && time != seen) {
+            seen = time;
+            try {
+                print(*watcher.update(read_file(path)));
+            } catch (std::exception &e) {
+                std::cout << e.what() << std::endl;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_INTERVAL_MS));
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef SCHEME_WATCH_H
+#define SCHEME_WATCH_H
+
+#include "util.h"
+#include "native.h"
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Watch mode (--watch): the program file is evaluated again whenever it changes, in the same environment, and only
+// the top level forms whose result may differ from the previous run are evaluated.
+//
+// The forms of the new version are matched with those of the previous one by their structure (see hash_form in
+// eval_cache.h), wherever they moved to. A form is evaluated again if it is new or changed, or its last evaluation
+// raised an error, or it refers to a name that a form evaluated again binds or changes. What a form refers to and
+// changes is found in its text and in the text of the procedures and macros it uses by name: calling a procedure
+// whose body does (set! counter ...) changes counter, and so does every form that calls a procedure that calls it.
+// A form that changes a global (with set!, or set-car!, set-cdr! and vector-set! on a list or vector it refers to)
+// cannot simply run again, it would change the value the previous run left: the forms that bind the names it changes
+// are evaluated again too, and with them the forms that refer to those names. The names bound by removed forms count
+// as changed. Forms that are not evaluated again do not print again.
+//
+// The forms to evaluate are evaluated in the order of the file, as one program of the loader (see loader.h). Like the
+// optimizer, the watcher only sees the text of the program: code made at run time for eval is not followed, and the
+// bindings of removed definitions stay in the environment.
+class Watcher {
+    struct Form {
+        ValuePtr form;
+        size_t hash;
+        // the name of a define or define-syntax
+        std::vector<SymbolId> binds;
+        // the symbols of the form outside of quotes
+        std::unordered_set<SymbolId> uses;
+        // the names of its set! forms
+        std::unordered_set<SymbolId> assigns;
+        // it calls set-car!, set-cdr! or vector-set!
+        bool mutates = false;
+        bool evaluated = false;
+        // the value of the form if it was the last form of the program when it was evaluated
+        ValuePtr value;
+    };
+
+    EnvironmentPtr env_;
+    Engine engine_;
+    std::vector<Form> forms_;
+    size_t evaluated_ = 0;
+
+    static Form read_form(const ValuePtr &form);
+
+public:
+    Watcher(EnvironmentPtr env, Engine engine);
+
+    // evaluates the forms of the new version of the program that need it and returns the value of its last form
+    ValuePtr update(const ValuePtr &program);
+
+    // number of forms the last update evaluated
+    [[nodiscard]] size_t evaluated_forms() const {
+        return evaluated_;
+    }
+};
+
+// how often the file is checked for changes
+constexpr size_t WATCH_INTERVAL_MS = 200;
+
+// evaluates the file and then again whenever it changes, printing the value of the program or the error it raised
+[[noreturn]] void watch_file(const std::string &path, const EnvironmentPtr &env, Engine engine);
+
+#endif //SCHEME_WATCH_H
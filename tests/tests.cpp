@@ -1,5 +1,16 @@
 #include "../src/reader.h"
 #include "../src/evaluator.h"
+#include "../src/vm.h"
+#include "../src/optimizer.h"
+#include "../src/datatypes/closure.h"
+#include "../src/native.h"
+#include "../src/eval_cache.h"
+#include "../src/loader.h"
+#include "../src/watch.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <limits>
 
 
 void test_tokenizer() {
@@ -70,11 +81,12 @@ void test_car_cdr_internal() {
 }
 
 // end-to-end tests
-bool eval_from_string_test(const std::string &source, const std::string &expected_output, const EnvironmentPtr &env) {
+bool eval_from_string_test(const std::string &source, const std::string &expected_output, const EnvironmentPtr &env,
+                           bool use_vm = false) {
     Tokenizer tokenizer(source);
     Reader reader;
     auto ast = reader.read_form(tokenizer);
-    auto result = eval(ast, env);
+    auto result = use_vm ? vm_eval(ast, env) : eval(ast, env);
     if (result->to_string() != expected_output) {
         // compare char by char
         int differs_at = -1;
@@ -204,6 +216,10 @@ void test_case_insensitive() {
     auto input_output_pairs = {
             std::make_pair("(define mynum 111)", "111"),
             std::make_pair("MyNuM", "111"),
+            std::make_pair("(eq? 'abc 'ABC)", "#t"),
+            std::make_pair("(eq? (string->symbol \"MyNum\") 'mynum)", "#t"),
+            std::make_pair("(DEFINE other 5)", "5"),
+            std::make_pair("(eqv? 'mynum 'other)", "#f"),
     };
     for (auto [input, output]: input_output_pairs) {
         eval_from_string_test(input, output, env);
@@ -253,6 +269,8 @@ void test_if() {
             std::make_pair("(if 0 7 8)", "8"),
             std::make_pair("(if (list) 7 8)", "8"),
             std::make_pair("(if (list 1 2 3) 7 8)", "8"),
+            std::make_pair("(if false 7)", "nil"),
+            std::make_pair("(begin)", "nil"),
     };
     for (auto [input, output]: input_output_pairs) {
         eval_from_string_test(input, output, env);
@@ -880,6 +898,840 @@ void test_ass() {
 
 }
 
+void test_lexical_scope() {
+    auto input_output_pairs = {
+            std::make_pair("(define x 10)", "10"),
+            std::make_pair("(let ((x (+ x 1))) x)", "11"),
+            std::make_pair("((lambda (x) (let ((x (+ x 1)) (y x)) (list x y))) 1)", "(2 2)"),
+            std::make_pair("((lambda (n) (define sq (* n n)) (define n 3) (+ sq n)) 5)", "28"),
+            std::make_pair("((lambda () (define ev? (lambda (n) (if (= n 0) #t (od? (- n 1))))) "
+                           "(define od? (lambda (n) (if (= n 0) #f (ev? (- n 1))))) (ev? 10)))", "#t"),
+            std::make_pair("(define make-counter (lambda () (let ((count 0)) (lambda () (set! count (+ count 1)) count))))",
+                           "#<Closure>"),
+            std::make_pair("(define c1 (make-counter))", "#<Closure>"),
+            std::make_pair("(define c2 (make-counter))", "#<Closure>"),
+            std::make_pair("(begin (c1) (c1) (c2) (list (c1) (c2)))", "(3 2)"),
+            std::make_pair("(let ((a 1)) (let ((b 2)) (let ((c 3)) (lambda () (+ a b c)))))", "#<Closure>"),
+            std::make_pair("((let ((a 1)) (let ((b 2)) (let ((c 3)) (lambda () (list a b c))))))", "(1 2 3)"),
+            std::make_pair("((lambda (a b c d e f) (list f e d c b a)) 1 2 3 4 5 6)", "(6 5 4 3 2 1)"),
+            std::make_pair("(let ((x 1)) (define y 2) (+ x y))", "3"),
+            std::make_pair("x", "10"),
+    };
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_global_cache() {
+    auto input_output_pairs = {
+            std::make_pair("(define g 1)", "1"),
+            std::make_pair("(define get-g (lambda () g))", "#<Closure>"),
+            std::make_pair("(get-g)", "1"),
+            std::make_pair("(set! g 2)", "2"),
+            std::make_pair("(get-g)", "2"),
+            std::make_pair("(define g 3)", "3"),
+            std::make_pair("(get-g)", "3"),
+            std::make_pair("(define first (lambda (l) (car l)))", "#<Closure>"),
+            std::make_pair("(first '(1 2))", "1"),
+            std::make_pair("(define car cdr)", "#<function>"),
+            std::make_pair("(first '(1 2))", "(2)"),
+            std::make_pair("(define call-later (lambda () (later)))", "#<Closure>"),
+            std::make_pair("(define later (lambda () 'defined))", "#<Closure>"),
+            std::make_pair("(call-later)", "defined"),
+    };
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_primitives() {
+    auto input_output_pairs = {
+            std::make_pair("(+ 1 2)", "3"),
+            std::make_pair("(- 1 2.5)", "-1.500000"),
+            std::make_pair("(* 3000000000 2)", "6000000000"),
+            std::make_pair("(/ 7 2)", "3"),
+            std::make_pair("(< 1 2)", "#t"),
+            std::make_pair("(>= 1.5 2)", "#f"),
+            std::make_pair("(= 2 2.0)", "#t"),
+            std::make_pair("(car '(1 2))", "1"),
+            std::make_pair("(cdr '(1 2))", "(2)"),
+            std::make_pair("(cons 1 '(2))", "(1 2)"),
+            std::make_pair("(null? '())", "#t"),
+            std::make_pair("(null? 0)", "#f"),
+            std::make_pair("(not #f)", "#t"),
+            std::make_pair("(not 0)", "#f"),
+            std::make_pair("(zero? 0.0)", "#t"),
+            std::make_pair("(define plus +)", "#<function>"),
+            std::make_pair("(plus 1 2)", "3"),
+            std::make_pair("((lambda (+) (+ 2 3)) -)", "-1"),
+            std::make_pair("(define add-one (lambda (n) (+ n 1)))", "#<Closure>"),
+            std::make_pair("(add-one 1)", "2"),
+            std::make_pair("(define + *)", "#<function>"),
+            std::make_pair("(add-one 5)", "5"),
+    };
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_jit() {
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    auto input_output_pairs = {
+            std::make_pair("(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))", "#<Closure>"),
+            std::make_pair("(fib 20)", "6765"),
+            std::make_pair("(fib 20.0)", "6765.000000"),
+            std::make_pair("(define sumdown (lambda (n acc) (if (zero? n) acc (sumdown (- n 1) (+ acc n)))))",
+                           "#<Closure>"),
+            std::make_pair("(sumdown 200 0)", "20100"),
+            std::make_pair("(sumdown 1000000 0)", "500000500000"),
+            // too deep for the native code, it bails out and the call is interpreted
+            std::make_pair("(define sum (lambda (n) (if (= n 0) 0 (+ n (sum (- n 1))))))", "#<Closure>"),
+            std::make_pair("(sum 200)", "20100"),
+            std::make_pair("(sum 12000)", "72006000"),
+            // the compiled code is not used once a global it depends on changes
+            std::make_pair("(define + -)", "#<function>"),
+            std::make_pair("(sumdown 200 0)", "-20100"),
+            std::make_pair("(fib 10)", "-1"),
+    };
+    for (auto [input, output]: input_output_pairs) {
+        eval_from_string_test(input, output, env);
+    }
+    // the calls nested in the interpreted call do not go as deep again in native code, each of them would bail out
+    // after NATIVE_DEPTH_LIMIT frames (this took seconds)
+    EnvironmentPtr deep = std::make_shared<BaseEnvironment>();
+    eval_from_string_test("(define sum (lambda (n) (if (= n 0) 0 (+ n (sum (- n 1))))))", "#<Closure>", deep);
+    eval_from_string_test("(sum 200)", "20100", deep);
+    auto start = std::chrono::steady_clock::now();
+    eval_from_string_test("(list (sum 12000) (sum 11000))", "(72006000 60505500)", deep);
+    if (std::chrono::steady_clock::now() - start > std::chrono::seconds(2)) {
+        std::cout << "Error: deep recursion past the native depth limit is not linear" << std::endl;
+    }
+}
+
+void test_numeric_specialization() {
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    auto input_output_pairs = {
+            std::make_pair("(define dt 0.5)", "0.500000"),
+            std::make_pair("(define step (lambda (n x v) (if (= n 0) x (let ((a (- 0.0 x))) "
+                           "(step (- n 1) (+ x (* v dt)) (+ v (* a dt)))))))", "#<Closure>"),
+            std::make_pair("(define repeat (lambda (m) (if (= m 1) (step 4 1.0 0.0) (begin (step 4 1.0 0.0) "
+                           "(repeat (- m 1))))))", "#<Closure>"),
+            std::make_pair("(repeat 300)", "-0.437500"),
+            // integer arguments do not match the specialization, the call is interpreted
+            std::make_pair("(step 2 1 0)", "0.750000"),
+            // a global the code depends on changed
+            std::make_pair("(define dt 1)", "1"),
+            std::make_pair("(step 4 1.0 0.0)", "-4.000000"),
+            std::make_pair("(define classify (lambda (x) (cond ((< x 0.0) (- 0 1)) ((zero? x) 0) (else 1))))",
+                           "#<Closure>"),
+            std::make_pair("(define count (lambda (n acc) (if (= n 0) acc "
+                           "(count (- n 1) (+ acc (classify (- (* n 1.5) 150.0)))))))", "#<Closure>"),
+            std::make_pair("(count 300 0)", "101"),
+            std::make_pair("(define mean-positive? (lambda (a b) (let ((m (/ (+ a b) 2))) (set! m (* m 2)) "
+                           "(not (< m 0)))))", "#<Closure>"),
+            std::make_pair("(define check (lambda (n ok) (if (= n 0) ok (check (- n 1) (mean-positive? n -3)))))",
+                           "#<Closure>"),
+            std::make_pair("(check 300 #f)", "#f"),
+            std::make_pair("(check 300 #t)", "#f"),
+            std::make_pair("(mean-positive? 4 -3)", "#t"),
+    };
+    for (auto [input, output]: input_output_pairs) {
+        eval_from_string_test(input, output, env);
+    }
+}
+
+void test_optimizer() {
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    auto input_output_pairs = {
+            std::make_pair("(lambda (n) (+ n (* 60 60)))", "(lambda (n) (+ n 3600))"),
+            std::make_pair("(string-length \"abc\")", "3"),
+            std::make_pair("(if (< 1 2) 'yes 'no)", "(quote yes)"),
+            std::make_pair("(if (> 1 2) 'yes)", "nil"),
+            std::make_pair("(cond ((= 1 2) 1) ((f) 2) (else 3) ((g) 4))", "(cond ((f) 2) (else 3))"),
+            std::make_pair("(cond (#f 1) (else (display 3) 3))", "(begin (display 3) 3)"),
+            std::make_pair("(begin 1 \"two\" (display 3) 'four)", "(begin (display 3) (quote four))"),
+            std::make_pair("(lambda (abs) (abs -1))", "(lambda (abs) (abs -1))"),
+            std::make_pair("(let ((max 1)) (max 2 3))", "(let ((max 1)) (max 2 3))"),
+            std::make_pair("(if (f) (quotient 1 0) (car '(1)))", "(if (f) (quotient 1 0) (car (quote (1))))"),
+            std::make_pair("(begin (define max 7) (max 1 2))", "(begin (define max 7) (max 1 2))"),
+    };
+    auto check = [](const std::string &input, const std::string &output, const EnvironmentPtr &env) {
+        auto result = optimize(read_string(input), env)->to_string();
+        if (result != output) {
+            std::cout << "Error: " << input << " was optimized to " << result << " instead of " << output << std::endl;
+        }
+    };
+    for (auto [input, output]: input_output_pairs) {
+        check(input, output, env);
+    }
+    // a name defined by an earlier form is not folded in its environment, other environments still fold it
+    EnvironmentPtr defining = std::make_shared<BaseEnvironment>();
+    check("(min 1 2)", "1", defining);
+    check("(define min 7)", "(define min 7)", defining);
+    check("(min 1 2)", "(min 1 2)", defining);
+    check("(min 1 2)", "1", std::make_shared<BaseEnvironment>());
+}
+
+void test_inlining() {
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    auto input_output_pairs = {
+            std::make_pair("(define inc5 (lambda (a) (+ 5 a)))", "#<Closure>"),
+            std::make_pair("(define f (lambda (x) (inc5 x)))", "#<Closure>"),
+            std::make_pair("(f 1)", "6"),
+            std::make_pair("(define inc5 (lambda (a) (- a 5)))", "#<Closure>"),
+            std::make_pair("(f 1)", "-4"),
+            std::make_pair("(define y 100)", "100"),
+            std::make_pair("(define add-y (lambda (x) (+ x y)))", "#<Closure>"),
+            std::make_pair("(define g (lambda (y) (add-y y)))", "#<Closure>"),
+            std::make_pair("(g 1)", "101"),
+            std::make_pair("(define twice (lambda (x) (* 2 x)))", "#<Closure>"),
+            std::make_pair("(define quad (lambda (x) (twice (twice x))))", "#<Closure>"),
+            std::make_pair("(define h (lambda (x) (+ (quad x) x)))", "#<Closure>"),
+            std::make_pair("(h 3)", "15"),
+            std::make_pair("(define bump (lambda (x) (set! x (+ x 1)) x))", "#<Closure>"),
+            std::make_pair("(define k (lambda (x) (list (bump x) x)))", "#<Closure>"),
+            std::make_pair("(k 1)", "(2 1)"),
+            std::make_pair("(define count-down (lambda (n) (if (= n 0) 'done (count-down (- n 1)))))", "#<Closure>"),
+            std::make_pair("(define start (lambda () (count-down 10000)))", "#<Closure>"),
+            std::make_pair("(start)", "done"),
+    };
+    for (auto [input, output]: input_output_pairs) {
+        eval_from_string_test(input, output, env);
+    }
+}
+
+void test_local_frames() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(define square (lambda (x) (* x x)))", "#<Closure>"),
+                std::make_pair("(define adder (lambda (n) (lambda (x) (+ x n))))", "#<Closure>"),
+                std::make_pair("(define nested (lambda (n) (let ((f (lambda () n))) (f))))", "#<Closure>"),
+                std::make_pair("(define sum-squares (lambda (n acc) (if (= n 0) acc (sum-squares (- n 1) "
+                               "(+ acc (square n))))))", "#<Closure>"),
+                std::make_pair("(sum-squares 100 0)", "338350"),
+                std::make_pair("(map (adder 10) (list (square 2) (square 3)))", "(14 19)"),
+                std::make_pair("(nested 5)", "5"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_loops() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(let loop ((i 0) (acc 0)) (if (= i 10) acc (loop (+ i 1) (+ acc i))))", "45"),
+                std::make_pair("(do ((i 0 (+ i 1)) (acc '() (cons i acc))) ((= i 4) acc))", "(3 2 1 0)"),
+                std::make_pair("(define pairs (lambda (n) (do ((i 0 (+ i 1)) (s 0)) ((= i n) s) "
+                               "(do ((j 0 (+ j 1))) ((= j i)) (set! s (+ s 1))))))", "#<Closure>"),
+                std::make_pair("(pairs 5)", "10"),
+                std::make_pair("(define count (lambda (n) (let loop ((i 0)) (if (< i n) (loop (+ i 1)) i))))",
+                               "#<Closure>"),
+                std::make_pair("(count 1000000)", "1000000"),
+                // the variables are assigned after all the arguments are evaluated
+                std::make_pair("(let loop ((a 1) (b 2) (n 3)) (if (= n 0) (list a b) (loop b a (- n 1))))", "(2 1)"),
+                // a loop variable named like a builtin
+                std::make_pair("(let loop ((list 0)) (if (< list 3) (loop (+ list 1)) list))", "3"),
+                // not a loop: the name is called outside of a tail position, or closures capture the variables
+                std::make_pair("(let loop ((i 3)) (if (= i 0) 0 (+ 1 (loop (- i 1)))))", "3"),
+                std::make_pair("(map (lambda (f) (f)) (let loop ((i 0) (acc '())) "
+                               "(if (= i 3) acc (loop (+ i 1) (cons (lambda () i) acc)))))", "(2 1 0)"),
+                std::make_pair("(let loop ((f car)) (if (eq? f car) (loop cdr) (f '(1 2))))", "(2)"),
+                std::make_pair("(do ((vec (make-vector 5)) (i 0 (+ i 1))) ((= i 5) vec) (vector-set! vec i i))",
+                               "(0 1 2 3 4)"),
+                // a named let in an argument of a call of the enclosing loop
+                std::make_pair("(let outer ((i 0) (acc '())) (if (= i 3) acc (outer (+ i 1) "
+                               "(let inner ((j 0)) (if (= j i) (cons j acc) (inner (+ j 1)))))))", "(2 1 0)"),
+                std::make_pair("(define nested (lambda (n) (let outer ((i 0) (s 0)) (if (= i n) s (outer (+ i 1) "
+                               "(let inner ((j 0) (s s)) (if (= j i) s (inner (+ j 1) (+ s 1)))))))))", "#<Closure>"),
+                std::make_pair("(nested 4)", "6"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_macros() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(define-syntax swap! (syntax-rules () ((_ a b) (let ((tmp a)) (set! a b) "
+                               "(set! b tmp)))))", "swap!"),
+                // the tmp of the template does not capture the tmp of the use
+                std::make_pair("(define tmp 1)", "1"),
+                std::make_pair("(define y 2)", "2"),
+                std::make_pair("(begin (swap! tmp y) (list tmp y))", "(2 1)"),
+                std::make_pair("(define-syntax my-or (syntax-rules () ((_) #f) ((_ e) e) "
+                               "((_ e r ...) (let ((t e)) (if t t (my-or r ...))))))", "my-or"),
+                std::make_pair("(define t 5)", "5"),
+                std::make_pair("(list (my-or) (my-or #f t) (my-or #t not-defined))", "(#f 5 #t)"),
+                std::make_pair("(define-syntax for (syntax-rules (in) ((_ x in items body ...) "
+                               "(map (lambda (x) body ...) items))))", "for"),
+                std::make_pair("(for x in '(1 2 3) (* x x))", "(1 4 9)"),
+                std::make_pair("(define-syntax pairs (syntax-rules () ((_ (a b) ... last) (list (list b a) ... last))))",
+                               "pairs"),
+                std::make_pair("(pairs (1 2) (3 4) 5)", "((2 1) (4 3) 5)"),
+                // a macro defined earlier in the same form, used by a closure
+                std::make_pair("(begin (define-syntax twice (syntax-rules () ((_ e) (* 2 e)))) "
+                               "(define double (lambda (x) (twice x))) (double 21))", "42"),
+                // the body of double was expanded when it was defined, not when it is called
+                std::make_pair("(define-syntax twice (syntax-rules () ((_ e) (* 3 e))))", "twice"),
+                std::make_pair("(list (double 5) (twice 5))", "(10 15)"),
+                // a variable with the name of a macro
+                std::make_pair("((lambda (twice) (twice 1)) (lambda (x) (+ x 1)))", "2"),
+                std::make_pair("'(twice 1)", "(twice 1)"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_case() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(case (* 2 3) ((2 3 5 7) 'prime) ((1 4 6 8 9) 'composite))", "composite"),
+                std::make_pair("(case (car '(c d)) ((a e i o u) 'vowel) ((w y) 'semivowel) (else 'consonant))",
+                               "consonant"),
+                std::make_pair("(case 99 ((1) 'one))", "nil"),
+                // dense integers use a jump table, sparse ones a hash table
+                std::make_pair("(define dense (lambda (x) (case x ((1 2 3) 'low) ((10 20) 'high) (else 'none))))",
+                               "#<Closure>"),
+                std::make_pair("(map dense '(1 3 10 20 4 -1))", "(low low high high none none)"),
+                std::make_pair("(define sparse (lambda (x) (case x ((-1000000) 'low) ((0 1000000) 'high) "
+                               "((1000000000000) 'huge))))", "#<Closure>"),
+                std::make_pair("(map sparse '(-1000000 0 1000000 1000000000000 5))", "(low high high huge nil)"),
+                std::make_pair("(define kind (lambda (x) (case x ((#t) 'true) ((#f) 'false) ((2.5) 'float) "
+                               "((\"s\") 'string) ((()) 'empty) ((1 1) 'first) ((1) 'second))))", "#<Closure>"),
+                std::make_pair("(map kind (list #t #f 2.5 '() 1 2))", "(true false float empty first nil)"),
+                std::make_pair("(define count (lambda (n acc) (case n ((0) acc) (else (count (- n 1) (+ acc 1))))))",
+                               "#<Closure>"),
+                std::make_pair("(count 100000 0)", "100000"),
+                std::make_pair("(let loop ((i 0)) (case i ((5) i) (else (loop (+ i 1)))))", "5"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_flat_closures() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(define adder (lambda (n) (lambda (x) (+ x n))))", "#<Closure>"),
+                std::make_pair("(define add10 (adder 10))", "#<Closure>"),
+                std::make_pair("(add10 5)", "15"),
+                // closures that share a variable they assign share its box
+                std::make_pair("(define make-counter (lambda () (let ((n 0)) "
+                               "(list (lambda () (set! n (+ n 1)) n) (lambda () n)))))", "#<Closure>"),
+                std::make_pair("(define counter (make-counter))", "(#<Closure> #<Closure>)"),
+                std::make_pair("(begin ((car counter)) ((car counter)) ((car (cdr counter))))", "2"),
+                std::make_pair("(define bump (lambda (x) (let ((get (lambda () x))) (set! x (+ x 1)) (get))))",
+                               "#<Closure>"),
+                std::make_pair("(bump 1)", "2"),
+                // mutual recursion through letrec and internal defines
+                std::make_pair("(letrec ((even? (lambda (n) (if (= n 0) #t (odd? (- n 1))))) "
+                               "(odd? (lambda (n) (if (= n 0) #f (even? (- n 1)))))) (even? 100))", "#t"),
+                std::make_pair("(define parity (lambda (n) (define ev? (lambda (n) (if (= n 0) #t (od? (- n 1))))) "
+                               "(define od? (lambda (n) (if (= n 0) #f (ev? (- n 1))))) (od? n)))", "#<Closure>"),
+                std::make_pair("(parity 7)", "#t"),
+                // a variable of a lambda two levels out, and one of a let at the top level
+                std::make_pair("(define curry3 (lambda (a) (lambda (b) (lambda (c) (list a b c)))))", "#<Closure>"),
+                std::make_pair("(((curry3 1) 2) 3)", "(1 2 3)"),
+                std::make_pair("(define scale (let ((factor 3) (unused (make-vector 1000))) (lambda (x) (* x factor))))",
+                               "#<Closure>"),
+                std::make_pair("(scale 5)", "15"),
+                // a named let that makes closures is a call, every iteration has its own variables
+                std::make_pair("(map (lambda (f) (f)) (let loop ((i 0) (acc '())) "
+                               "(if (= i 3) acc (loop (+ i 1) (cons (lambda () i) acc)))))", "(2 1 0)"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+        // the closure keeps only the value of n, not the frame of the call of adder
+        auto add10 = std::static_pointer_cast<Closure>(env->get("add10"));
+        if (add10->get_env()->slot(0)->to_string() != "10" || add10->get_env()->get_outer() != env) {
+            std::cout << "Error: closure of adder expected to capture only n" << std::endl;
+        }
+        auto scale = std::static_pointer_cast<Closure>(env->get("scale"));
+        if (scale->get_env()->get_outer() != env) {
+            std::cout << "Error: closure of scale expected to lead to the global environment" << std::endl;
+        }
+    }
+}
+
+void test_multiple_values() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(call-with-values (lambda () (values 1 2)) +)", "3"),
+                std::make_pair("(call-with-values (lambda () (values)) list)", "()"),
+                std::make_pair("(call-with-values (lambda () 5) (lambda (x) (* x x)))", "25"),
+                std::make_pair("(values 7)", "7"),
+                std::make_pair("(define divmod (lambda (a b) (values (quotient a b) (remainder a b))))", "#<Closure>"),
+                std::make_pair("(receive (q r) (divmod 17 5) (list q r))", "(3 2)"),
+                std::make_pair("(receive () (values) 'none)", "none"),
+                std::make_pair("(receive (x) 4 (+ x 1))", "5"),
+                // values of a call in tail position, and receive inside of a lambda and a loop
+                std::make_pair("(define split (lambda (n) (if (< n 0) (values '- (- 0 n)) (divmod n 10))))",
+                               "#<Closure>"),
+                std::make_pair("(receive (a b) (split -4) (list a b))", "(- 4)"),
+                std::make_pair("(define digits (lambda (n) (let loop ((n n) (acc '())) "
+                               "(if (= n 0) acc (receive (q r) (divmod n 10) (loop q (cons r acc)))))))",
+                               "#<Closure>"),
+                std::make_pair("(digits 9075)", "(9 0 7 5)"),
+                std::make_pair("(define counter (lambda () (receive (n step) (values 0 2) "
+                               "(lambda () (set! n (+ n step)) n))))", "#<Closure>"),
+                std::make_pair("(define next (counter))", "#<Closure>"),
+                std::make_pair("(begin (next) (next))", "4"),
+                std::make_pair("(define-syntax swap-values (syntax-rules () ((_ e) (receive (a b) e (values b a)))))",
+                               "swap-values"),
+                std::make_pair("(call-with-values (lambda () (swap-values (values 1 2))) list)", "(2 1)"),
+                // dotted formals are an error instead of binding . as a variable
+                std::make_pair("(guard (e ((error-object? e) 'rejected)) "
+                               "(eval '(receive (a b . rest) (values 1 2 3 4) (list a b rest))))", "rejected"),
+                // values kept by a variable or a list are not those of later calls of values
+                std::make_pair("(begin (define m (values 1 2)) (call-with-values (lambda () (values 3 4)) "
+                               "(lambda (a b) 0)) (call-with-values (lambda () m) list))", "(1 2)"),
+                std::make_pair("(receive (a b) m (list a b (call-with-values (lambda () m) +)))", "(1 2 3)"),
+                std::make_pair("(define kept (list (values 5 6) (values 7 8)))", "(#<values> #<values>)"),
+                std::make_pair("(receive (a b) (car (cdr kept)) (receive (c d) (car kept) (list a b c d)))", "(7 8 5 6)"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_exceptions() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(guard (e (#t (list 'caught e))) (+ 1 (raise 'oops)))", "(caught oops)"),
+                std::make_pair("(guard (e ((symbol? e) 'symbol) ((string? e) 'string)) (raise \"x\"))", "string"),
+                std::make_pair("(guard (e ((error-object? e) (error-object-irritants e))) (error \"bad\" 1 2))",
+                               "(1 2)"),
+                std::make_pair("(guard (e (else (error-object-message e))) (error \"bad\" 1 2))", "\"bad\""),
+                // errors of the interpreter become error objects
+                std::make_pair("(guard (e ((error-object? e) 'unbound)) no-such-variable)", "unbound"),
+                std::make_pair("(with-exception-handler (lambda (c) (* c 10)) (lambda () (+ 1 (raise-continuable 4))))",
+                               "41"),
+                // a handler that returns from raise raises a secondary error to the outer handlers
+                std::make_pair("(guard (e ((error-object? e) (error-object-irritants e))) "
+                               "(with-exception-handler (lambda (c) 0) (lambda () (raise 'first))))", "(first)"),
+                // the clauses of an inner guard that do not apply raise the condition again
+                std::make_pair("(guard (e ((eq? e 'outer) 'outer)) (guard (e ((eq? e 'inner) 'inner)) (raise 'outer)))",
+                               "outer"),
+                // unwinding drops the calls made since the guard was entered
+                std::make_pair("(define deep (lambda (n) (if (= n 0) (raise 'bottom) (+ 1 (deep (- n 1))))))",
+                               "#<Closure>"),
+                std::make_pair("(guard (e (#t e)) (deep 1000))", "bottom"),
+                std::make_pair("(guard (e (#t e)) (map (lambda (x) (if (= x 2) (raise 'two) x)) '(1 2 3)))", "two"),
+                std::make_pair("(map (lambda (x) (guard (e (#t 0)) (if (= x 2) (raise 'two) x))) '(1 2 3))",
+                               "(1 0 3)"),
+                std::make_pair("(define count (lambda (i acc) (if (= i 0) acc "
+                               "(count (- i 1) (+ acc (guard (e (#t 1)) (raise i)))))))", "#<Closure>"),
+                std::make_pair("(count 1000 0)", "1000"),
+                std::make_pair("(call/cc (lambda (k) (guard (e (#t 'handled)) (k 'escaped))))", "escaped"),
+                std::make_pair("(guard (e (#t e)) (call/cc (lambda (k) (guard (e (#t 'inner)) (k 1)))) (raise 'after))",
+                               "after"),
+                std::make_pair("(let ((x 5)) (guard (e (#t (set! x (+ x e)) x)) (raise 1)))", "6"),
+                // a suspended green thread keeps its guards
+                std::make_pair("(define worker (lambda (name) (spawn (lambda () "
+                               "(guard (e (#t (list name e))) (yield) (raise 'stop))))))", "#<Closure>"),
+                std::make_pair("(let ((a (worker 'a)) (b (worker 'b))) (list (join a) (join b)))",
+                               "((a stop) (b stop))"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+}
+
+void test_eval() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(eval '(+ 1 2))", "3"),
+                std::make_pair("(eval (list '* 6 7) (interaction-environment))", "42"),
+                std::make_pair("(eval '(define square (lambda (x) (* x x))))", "#<Closure>"),
+                std::make_pair("(square 9)", "81"),
+                std::make_pair("(read \"(a (b c) 2)\")", "(a (b c) 2)"),
+                std::make_pair("(eval (read \"(let ((x 4)) (+ x 1))\"))", "5"),
+                std::make_pair("(define limit 10)", "10"),
+                std::make_pair("(define rule (lambda (k) (list 'if (list '> 'limit k) (list '+ 'limit k) ''small)))",
+                               "#<Closure>"),
+                std::make_pair("(define apply-rules (lambda (i acc) (if (= i 0) acc "
+                               "(apply-rules (- i 1) (cons (eval (rule (remainder i 3))) acc)))))", "#<Closure>"),
+                std::make_pair("(apply-rules 6 '())", "(11 12 10 11 12 10)"),
+                // a cached form sees the current values of the globals
+                std::make_pair("(set! limit 1)", "1"),
+                std::make_pair("(apply-rules 3 '())", "(small small 1)"),
+                std::make_pair("(guard (e ((error-object? e) 'error)) (eval '(no-such-function 1)))", "error"),
+                // a quoted list is returned itself, an equal list is another form
+                std::make_pair("(define quoted-a (list 1 2))", "(1 2)"),
+                std::make_pair("(eval (list 'quote quoted-a))", "(1 2)"),
+                std::make_pair("(begin (set-car! quoted-a 9) quoted-a)", "(9 2)"),
+                std::make_pair("(define quoted-b (list 1 2))", "(1 2)"),
+                std::make_pair("(eval (list 'quote quoted-b))", "(1 2)"),
+                std::make_pair("(eq? (eval (list 'quote quoted-b)) quoted-b)", "#t"),
+                // floats are the same constant only if their bits are
+                std::make_pair("(eval '(/ 1 0.0))", "inf"),
+                std::make_pair("(eval '(/ 1 -0.0))", "-inf"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+    // equal forms share one cache entry, the copy in the cache does not change with the list evaluated
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    eval_from_string_test("(define form (list '+ 1 2))", "(+ 1 2)", env);
+    auto before = eval_cache_size();
+    eval_from_string_test("(eval form)", "3", env);
+    eval_from_string_test("(eval (list '+ 1 2))", "3", env);
+    if (eval_cache_size() != before + 1) {
+        std::cout << "Error: equal forms are cached " << eval_cache_size() - before << " times" << std::endl;
+    }
+    eval_from_string_test("(begin (set-car! form '-) (eval form))", "-1", env);
+    eval_from_string_test("(eval (list '+ 1 2))", "3", env);
+    // a NaN constant is the same form as itself
+    eval_from_string_test("(begin (define nan-form (list '+ (- (/ 1 0.0) (/ 1 0.0)) 1)) 'nan-form)", "nan-form", env);
+    before = eval_cache_size();
+    eval_from_string_test("(= (eval nan-form) (eval nan-form))", "#f", env);
+    if (eval_cache_size() != before + 1) {
+        std::cout << "Error: a NaN form is cached " << eval_cache_size() - before << " times" << std::endl;
+    }
+}
+
+void test_streams() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(filter odd? '(1 2 3 4 5))", "(1 3 5)"),
+                std::make_pair("(fold cons '() '(1 2 3))", "(3 2 1)"),
+                std::make_pair("(fold + 0 (map (lambda (x) (* x x)) (filter odd? '(1 2 3 4 5))))", "35"),
+                std::make_pair("(map (lambda (x) (+ x 1)) (map (lambda (x) (* x 2)) '(1 2 3)))", "(3 5 7)"),
+                std::make_pair("(filter even? (map (lambda (x) (+ x 1)) '()))", "()"),
+                std::make_pair("(define s (stream-filter even? (list->stream '(1 2 3 4))))", "#<stream>"),
+                std::make_pair("(stream->list (stream-map (lambda (x) (* x 10)) s))", "(20 40)"),
+                std::make_pair("(stream-fold + 0 s)", "6"),
+                std::make_pair("(stream? s)", "#t"),
+                // a fused chain calls the stages on one element after the other
+                std::make_pair("(define log '())", "()"),
+                std::make_pair("(define note (lambda (tag x) (begin (set! log (cons (list tag x) log)) x)))",
+                               "#<Closure>"),
+                std::make_pair("(for-each (lambda (x) (note 'each x)) "
+                               "(map (lambda (x) (note 'map x)) (filter (lambda (x) (odd? (note 'filter x))) '(1 2 3))))",
+                               "nil"),
+                std::make_pair("log", "((each 3) (map 3) (filter 3) (filter 2) (each 1) (map 1) (filter 1))"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+    // chains of a redefined builtin are not fused
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    eval_from_string_test("(define filter (lambda (p l) (list 'mine)))", "#<Closure>", env);
+    eval_from_string_test("(map (lambda (x) x) (filter odd? '(1 2 3)))", "(mine)", env);
+}
+
+void test_parallel_load() {
+    set_load_threads(4, 0);
+    for (bool use_vm: {false, true}) {
+        Engine engine = use_vm ? vm_eval : eval;
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto before = parallel_definitions();
+        auto result = load_program(read_string(
+                "(begin (define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))"
+                " (define range (lambda (i n acc) (if (= i n) acc (range (+ i 1) n (cons i acc)))))"
+                " (define x-value 1)"
+                // independent tables, the closures get hot on all threads at once
+                " (define a (fib 20)) (define b (fib 19)) (define squares (map (lambda (x) (* x x)) (range 0 4 '())))"
+                " (define old x-value)"
+                // waits for a and b
+                " (define c (+ a b))"
+                // a definition that a definition of the batch uses is bound after it
+                " (define x-value 2)"
+                // a set! of a global is evaluated in order
+                " (define counter 0) (define bump (lambda () (set! counter (+ counter 1))))"
+                " (define bumped (begin (bump) counter))"
+                " (list a b c squares bumped old x-value))"), env, engine);
+        if (result->to_string() != "(6765 4181 10946 (9 4 1 0) 1 1 2)") {
+            std::cout << "Error: the parallel load evaluated to " << result->to_string() << std::endl;
+        }
+        if (parallel_definitions() - before != 4) {
+            std::cout << "Error: " << parallel_definitions() - before << " definitions were evaluated in parallel"
+                      << std::endl;
+        }
+        eval_from_string_test("c", "10946", env, use_vm);
+        // the error of the first definition in the file is raised, the definitions before it are defined
+        try {
+            load_program(read_string("(begin (define d 1) (define e (+ d 1)) (define f (error \"first\"))"
+                                     " (define g (error \"second\")) (define h 3))"), env, engine);
+            std::cout << "Error: the error of a parallel definition was not raised" << std::endl;
+        } catch (std::runtime_error &error) {
+            if (std::string(error.what()) != "error: first") {
+                std::cout << "Error: the parallel load raised " << error.what() << std::endl;
+            }
+        }
+        eval_from_string_test("e", "2", env, use_vm);
+    }
+    set_load_threads(0);
+}
+
+void test_watch() {
+    auto program = [](const std::string &square, const std::string &other, const std::string &bumped,
+                      const std::string &extra) {
+        return read_string("(begin (define counter 0) (define bump (lambda () (set! counter (+ counter 1)) counter))"
+                           " (define square " + square + ") (define table (map square '(1 2 3)))"
+                           " (define other " + other + ") (define bumped " + bumped + ")"
+                           " (define v (list 0 0)) (set-car! v (car other)) " + extra +
+                           " (list table other bumped v))");
+    };
+    auto check = [](Watcher &watcher, const ValuePtr &program, const std::string &expected, size_t evaluated) {
+        auto result = watcher.update(program)->to_string();
+        if (result != expected || watcher.evaluated_forms() != evaluated) {
+            std::cout << "Error: watch mode evaluated " << watcher.evaluated_forms() << " forms to " << result
+                      << ", expected " << evaluated << " forms and " << expected << std::endl;
+        }
+    };
+    for (bool use_vm: {false, true}) {
+        Engine engine = use_vm ? vm_eval : eval;
+        Watcher watcher(std::make_shared<BaseEnvironment>(), engine);
+        std::string square = "(lambda (x) (* x x))";
+        check(watcher, program(square, "(list 1 2)", "(bump)", ""), "((1 4 9) (1 2) 1 (1 0))", 9);
+        check(watcher, program(square, "(list 1 2)", "(bump)", ""), "((1 4 9) (1 2) 1 (1 0))", 0);
+        // square, the table made with it and the list of the results
+        square = "(lambda (x) (+ x x))";
+        check(watcher, program(square, "(list 1 2)", "(bump)", ""), "((2 4 6) (1 2) 1 (1 0))", 3);
+        // the set-car! of v uses other, so v is made again before it runs
+        check(watcher, program(square, "(list 5 2)", "(bump)", ""), "((2 4 6) (5 2) 1 (5 0))", 4);
+        // bump changes counter, which starts over from 0
+        check(watcher, program(square, "(list 5 2)", "(+ (bump) 10)", ""), "((2 4 6) (5 2) 11 (5 0))", 4);
+        try {
+            watcher.update(program(square, "(list 5 2)", "(+ (bump) 10)", "(define broken (error \"broken\"))"));
+            std::cout << "Error: watch mode did not raise the error of a form" << std::endl;
+        } catch (std::runtime_error &error) {
+            if (std::string(error.what()) != "error: broken") {
+                std::cout << "Error: watch mode raised " << error.what() << std::endl;
+            }
+        }
+        check(watcher, program(square, "(list 5 2)", "(+ (bump) 10)", ""), "((2 4 6) (5 2) 11 (5 0))", 0);
+    }
+}
+
+void test_deep_recursion() {
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    auto input_output_pairs = {
+            std::make_pair("(define sum (lambda (n) (if (= n 0) 0 (+ n (sum (- n 1))))))", "#<Closure>"),
+            std::make_pair("(sum 100000)", "5000050000"),
+            std::make_pair("(define nest (lambda (n) (if (= n 0) '() (list (nest (- n 1))))))", "#<Closure>"),
+            std::make_pair("(nest 3)", "(((())))"),
+            std::make_pair("(length (nest 100000))", "1"),
+    };
+    for (auto [input, output]: input_output_pairs) {
+        eval_from_string_test(input, output, env, true);
+    }
+    // printing and destroying a deeply nested list does not recurse
+    auto list = std::make_shared<ListValue>();
+    for (int i = 0; i < 100000; ++i) {
+        auto outer = std::make_shared<ListValue>();
+        outer->add_value(list);
+        list = outer;
+    }
+    if (list->to_string().size() != 200002) {
+        std::cout << "Error: nested list printed as " << list->to_string().substr(0, 20) << "..." << std::endl;
+    }
+}
+
+void test_call_cc() {
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        auto input_output_pairs = {
+                std::make_pair("(call/cc (lambda (k) (+ 1 (k 42))))", "42"),
+                std::make_pair("(+ 1 (call-with-current-continuation (lambda (k) 1)))", "2"),
+                std::make_pair("(procedure? (call/cc (lambda (k) k)))", "#t"),
+                std::make_pair("(define find-first (lambda (pred lst) (call/cc (lambda (return) "
+                               "(for-each (lambda (x) (if (pred x) (return x))) lst) #f))))", "#<Closure>"),
+                std::make_pair("(find-first even? '(1 3 4 5 6))", "4"),
+                std::make_pair("(find-first even? '(1 3 5))", "#f"),
+                std::make_pair("(define search (lambda (n k) (if (= n 0) (k 'found) (+ 1 (search (- n 1) k)))))",
+                               "#<Closure>"),
+                std::make_pair("(call/cc (lambda (k) (search 1000 k)))", "found"),
+                std::make_pair("(call/cc (lambda (outer) (+ 1 (call/cc (lambda (inner) (outer 5))))))", "5"),
+                std::make_pair("(call/cc (lambda (outer) (+ 1 (call/cc (lambda (inner) (inner 5))))))", "6"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+    // continuations that outlive their call/cc can be re-entered in the vm
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    auto input_output_pairs = {
+            std::make_pair("(define r #f)", "#f"),
+            std::make_pair("(+ 1 (call/cc (lambda (k) (set! r k) 1)))", "2"),
+            std::make_pair("(r 10)", "11"),
+            std::make_pair("(r 20)", "21"),
+            std::make_pair("(define count 0)", "0"),
+            std::make_pair("(begin (define v (call/cc (lambda (c) (set! r c) 0))) (set! count (+ count 1)) "
+                           "(if (< v 3) (r (+ v 1)) count))", "4"),
+    };
+    for (auto [input, output]: input_output_pairs) {
+        eval_from_string_test(input, output, env, true);
+    }
+}
+
+void test_green_threads() {
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    auto input_output_pairs = {
+            std::make_pair("(define t (spawn (lambda () (+ 1 2))))", "#<thread>"),
+            std::make_pair("(join t)", "3"),
+            std::make_pair("(define ch (make-channel))", "#<channel>"),
+            std::make_pair("(define producer (spawn (lambda () (channel-send ch 1) (yield) (channel-send ch 2) "
+                           "(channel-send ch 3) 'done)))", "#<thread>"),
+            std::make_pair("(+ (channel-receive ch) (+ (channel-receive ch) (channel-receive ch)))", "6"),
+            std::make_pair("(join producer)", "done"),
+            std::make_pair("(define trace '())", "()"),
+            std::make_pair("(define work (lambda (name n) (if (= n 0) name "
+                           "(begin (set! trace (cons name trace)) (yield) (work name (- n 1))))))", "#<Closure>"),
+            std::make_pair("(define a (spawn (lambda () (work 'a 3))))", "#<thread>"),
+            std::make_pair("(define b (spawn (lambda () (work 'b 3))))", "#<thread>"),
+            std::make_pair("(join a)", "a"),
+            std::make_pair("(join b)", "b"),
+            std::make_pair("trace", "(b a b a b a)"),
+            // threads blocked inside of calls of builtins
+            std::make_pair("(define results (make-channel))", "#<channel>"),
+            std::make_pair("(define waiter (spawn (lambda () (map (lambda (x) (+ x (channel-receive ch))) '(1 2)))))",
+                           "#<thread>"),
+            std::make_pair("(define sender (spawn (lambda () (channel-send ch 10) (channel-send ch 20))))",
+                           "#<thread>"),
+            std::make_pair("(join waiter)", "(11 22)"),
+            std::make_pair("(define spawn-all (lambda (i) (if (= i 0) 0 "
+                           "(begin (spawn (lambda () (channel-send results i))) (spawn-all (- i 1))))))",
+                           "#<Closure>"),
+            std::make_pair("(define sum-all (lambda (i acc) (if (= i 0) acc "
+                           "(sum-all (- i 1) (+ acc (channel-receive results))))))", "#<Closure>"),
+            std::make_pair("(spawn-all 1000)", "0"),
+            std::make_pair("(sum-all 1000 0)", "500500"),
+    };
+    for (auto [input, output]: input_output_pairs) {
+        eval_from_string_test(input, output, env, true);
+    }
+    // eval runs a thread to completion when it is spawned
+    env = std::make_shared<BaseEnvironment>();
+    auto eval_pairs = {
+            std::make_pair("(define ch (make-channel))", "#<channel>"),
+            std::make_pair("(define t (spawn (lambda () (channel-send ch 1) (yield) 'done)))", "#<thread>"),
+            std::make_pair("(list (join t) (channel-receive ch))", "(done 1)"),
+    };
+    for (auto [input, output]: eval_pairs) {
+        eval_from_string_test(input, output, env);
+    }
+}
+
+void test_native_library() {
+    // the name is quoted for the shell that runs the compiler
+    auto path = (std::filesystem::temp_directory_path() / "scheme native's test.scm").string();
+    std::ofstream(path) << "(begin (define square (lambda (x) (* x x)))"
+                           " (define fact (lambda (n acc) (if (= n 0) acc (fact (- n 1) (* acc n)))))"
+                           " (define count-down (lambda (n) (if (= n 0) 'done (count-down (- n 1)))))"
+                           " (define classify (lambda (n) (cond ((< n 0) 'negative) ((= n 0) 'zero)"
+                           "   (else (let ((half (quotient n 2))) (if (= (* half 2) n) 'even 'odd))))))"
+                           " (define counter 10)"
+                           " (define bump (lambda (k) (set! counter (+ counter k)) counter))"
+                           " (define swap (lambda (a b) (let ((t a)) (set! a b) (set! b t) (list a b))))"
+                           " (define make-adder (lambda (n) (lambda (x) (+ x n))))"
+                           " (define greet (lambda (name) (list \"hello\" name '(1 2.5 #t)))))";
+    auto library = compile_library(path);
+    for (bool use_vm: {false, true}) {
+        EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+        load_library(library, env, use_vm ? vm_eval : eval);
+        auto input_output_pairs = {
+                std::make_pair("(square 12)", "144"),
+                std::make_pair("(fact 20 1)", "2432902008176640000"),
+                std::make_pair("(count-down 1000000)", "done"),
+                std::make_pair("(list (classify -3) (classify 0) (classify 7) (classify 8))", "(negative zero odd even)"),
+                std::make_pair("(bump 5)", "15"),
+                std::make_pair("counter", "15"),
+                std::make_pair("(swap 1 2)", "(2 1)"),
+                std::make_pair("((make-adder 1) 2)", "3"),
+                std::make_pair("(greet 'bob)", "(\"hello\" bob (1 2.500000 #t))"),
+                std::make_pair("(map square '(1 2 3))", "(1 4 9)"),
+                // compiled functions look up globals when they run
+                std::make_pair("(define * +)", "#<function>"),
+                std::make_pair("(square 12)", "24"),
+        };
+        for (auto [input, output]: input_output_pairs) {
+            eval_from_string_test(input, output, env, use_vm);
+        }
+    }
+
+    // the reader makes no infinite or NaN constants, a library given as a form can have them
+    auto infinity = std::numeric_limits<double>::infinity();
+    auto nan = std::make_shared<FloatValue>(std::numeric_limits<double>::quiet_NaN());
+    auto body = std::make_shared<ListValue>(std::vector<ValuePtr>{
+            SymbolValue::intern("list"), std::make_shared<FloatValue>(infinity), std::make_shared<FloatValue>(-infinity),
+            std::make_shared<ListValue>(std::vector<ValuePtr>{SymbolValue::intern("="), nan, nan})});
+    auto lambda = std::make_shared<ListValue>(std::vector<ValuePtr>{
+            SymbolValue::intern("lambda"), std::make_shared<ListValue>(), body});
+    auto form = std::make_shared<ListValue>(std::vector<ValuePtr>{
+            SymbolValue::intern("define"), SymbolValue::intern("limits"), lambda});
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+    load_library(compile_library(form, (std::filesystem::temp_directory_path() / "scheme_limits_test").string()),
+                 env, eval);
+    eval_from_string_test("(limits)", "(inf -inf #f)", env);
+}
+
+void test_vm_engine() {
+    EnvironmentPtr env = std::make_shared<BaseEnvironment>();
+
+    auto input_output_pairs = {
+            std::make_pair("(+ 5 (* 2 3))", "11"),
+            std::make_pair("'(1 2 (3 4))", "(1 2 (3 4))"),
+            std::make_pair("()", "()"),
+            std::make_pair("(if false 7 8)", "8"),
+            std::make_pair("(if false 7)", "nil"),
+            std::make_pair("(begin)", "nil"),
+            std::make_pair("( (lambda (f x) (f x)) (lambda (a) (+ 1 a)) 7)", "8"),
+            std::make_pair("( ( (lambda (a) (lambda (b) (+ a b))) 5) 7)", "12"),
+            std::make_pair("(define fib (lambda (N) (if (= N 0) 1 (if (= N 1) 1 (+ (fib (- N 1)) (fib (- N 2)))))))",
+                           "#<Closure>"),
+            std::make_pair("(fib 4)", "5"),
+            std::make_pair("(define sum2 (lambda (n acc) (if (= n 0) acc (sum2 (- n 1) (+ n acc)))))", "#<Closure>"),
+            std::make_pair("(sum2 10000 0)", "50005000"),
+            std::make_pair("(define foo (lambda (n) (if (= n 0) 0 (bar (- n 1)))))", "#<Closure>"),
+            std::make_pair("(define bar (lambda (n) (if (= n 0) 0 (foo (- n 1)))))", "#<Closure>"),
+            std::make_pair("(foo 10000)", "0"),
+            std::make_pair("(let ((x 2) (y 3)) (let* ((x 7) (z (+ x y))) (* z x)))", "70"),
+            std::make_pair("(let ((x 2) (y 3)) (letrec ((foo (lambda (z) (+ x (+ y z))))) (foo 4)))", "9"),
+            std::make_pair("(+ (let ((x 1)) x) (let ((y 2)) y))", "3"),
+            std::make_pair("(cond ((> 3 3) 'greater) ((< 3 3) 'less) (else 'equal))", "equal"),
+            std::make_pair("(cond ((> 3 3) 'greater))", "nil"),
+            std::make_pair("(cond ((> 3 2)))", "#t"),
+            std::make_pair("(define x 3)", "3"),
+            std::make_pair("(set! x (+ x 1))", "4"),
+            std::make_pair("(map (lambda (a) (* 2 a)) (list 1 2 3))", "(2 4 6)"),
+    };
+    for (auto [input, output]: input_output_pairs) {
+        eval_from_string_test(input, output, env, true);
+    }
+}
+
 void run_tests() {
     test_tokenizer();
     test_car_cdr_internal();
@@ -913,6 +1765,29 @@ void run_tests() {
     test_vector_functions();
     test_mem();
     test_ass();
+    test_vm_engine();
+    test_lexical_scope();
+    test_global_cache();
+    test_primitives();
+    test_jit();
+    test_numeric_specialization();
+    test_optimizer();
+    test_inlining();
+    test_local_frames();
+    test_loops();
+    test_macros();
+    test_case();
+    test_flat_closures();
+    test_multiple_values();
+    test_exceptions();
+    test_eval();
+    test_streams();
+    test_parallel_load();
+    test_watch();
+    test_deep_recursion();
+    test_call_cc();
+    test_green_threads();
+    test_native_library();
 // display write newline, for-each tested by running external file
 
 }